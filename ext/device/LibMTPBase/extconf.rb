@@ -15,6 +15,57 @@ if(have_header("libmtp.h"))
 
     if(have_library("mtp", "LIBMTP_Get_First_Device"))
 
+      # native transfer threads
+
+      have_library("pthread", "pthread_create")
+
+      have_header("ruby/thread.h")
+
+      have_header("ruby/fiber/scheduler.h")
+
+
+      # optional: inotify for Device#watch
+
+      have_header("sys/inotify.h")
+
+
+      # optional: partial object reads so bulk downloads can be preempted
+
+      have_func("LIBMTP_GetPartialObject", "libmtp.h")
+
+
+      # optional: on-device move and copy, capability probing (libmtp 1.1)
+
+      have_func("LIBMTP_Move_Object", "libmtp.h")
+
+
+      # optional: device events for Device#events (asynchronous reads, libmtp 1.1.9)
+
+      have_func("LIBMTP_Read_Event_Async", "libmtp.h")
+
+
+      # optional: xxh3 transfer digests
+
+      if(have_header("xxhash.h") && have_library("xxhash", "XXH3_createState"))
+
+        have_func("XXH3_createState", "xxhash.h")
+
+      end
+
+      # optional: IO::Buffer chunks for streamed downloads
+
+      have_header("ruby/io/buffer.h")
+
+
+      # optional: io_uring writer for batch downloads
+
+      if(have_header("liburing.h") && have_library("uring", "io_uring_queue_init"))
+
+        have_func("io_uring_prep_openat_direct", "liburing.h")
+
+      end
+
+
       puts "Creating makefile\n\n"
 
       create_makefile("device/LibMTPBase")
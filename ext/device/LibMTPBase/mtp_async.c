@@ -0,0 +1,1663 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include <stddef.h>
+
+#include <errno.h>
+
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/time.h>
+
+#include "mtp_proto.h"
+
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+#include "ruby/io.h"
+
+#include "ruby/fiber/scheduler.h"
+#endif
+
+
+static VALUE cMTPFuture;
+
+static VALUE cMTPAsync;
+
+
+#define ASYNC_QUEUED    0
+
+#define ASYNC_RUNNING   1
+
+#define ASYNC_DONE      2
+
+#define ASYNC_CANCELLED 3
+
+
+#define ASYNC_ALBUM_GET       0
+
+#define ASYNC_ALBUM_LIST      1
+
+#define ASYNC_FILE_INFO_GET   2
+
+#define ASYNC_FILE_INFO_LIST  3
+
+#define ASYNC_FILE_GET        4
+
+#define ASYNC_FILE_SEND       5
+
+#define ASYNC_FOLDER_LIST     6
+
+#define ASYNC_PLAYLIST_GET    7
+
+#define ASYNC_PLAYLIST_LIST   8
+
+#define ASYNC_TRACK_GET       9
+
+#define ASYNC_TRACK_LIST      10
+
+#define ASYNC_TRACK_GET_FILE  11
+
+#define ASYNC_TRACK_SEND_FILE 12
+
+#define ASYNC_DELETE_OBJECT   13
+
+
+/* seconds a waiting thread sleeps before it checks for interrupts */
+#define ASYNC_WAIT_SLICE 0.1
+
+
+/*
+ * One queued device operation.  It is shared by the worker and the future
+ * and freed by whichever lets go of it last.
+ */
+
+typedef struct mtp_call_s
+{
+  struct mtp_call_s *next;
+
+  int refs;
+
+  int op;
+
+  int state;
+
+  int cancel;
+
+  int priority;
+
+  uint32_t id;
+
+  char *path;
+
+  void *object;               /* copy of the file or track metadata of a send */
+
+  void *result;               /* libmtp result, until converted by the future */
+
+  int status;
+
+  int notify;                 /* pipe written when the call finishes, or -1 */
+} mtp_call_t;
+
+
+/*
+ * The native thread that runs the queued operations of one device.
+ */
+
+struct mtp_worker_s
+{
+  mtp_device_t *device;
+
+  pthread_t thread;
+
+  pthread_mutex_t lock;
+
+  pthread_cond_t ready;
+
+  pthread_cond_t done;
+
+  mtp_call_t *head;
+
+  mtp_call_t *tail;
+
+  int stop;
+};
+
+
+typedef struct mtp_future_s
+{
+  mtp_call_t *call;
+
+  mtp_worker_t *worker;
+
+  VALUE device;
+
+  VALUE object;
+
+  VALUE parent;               /* for futures created by Future#then */
+
+  VALUE block;
+
+  VALUE value;
+
+  VALUE error;
+
+  int resolved;
+} mtp_future_t;
+
+
+static void call_release(mtp_call_t *call)
+{
+  void *next;
+
+
+  if(__sync_sub_and_fetch(&call->refs, 1) > 0)
+  {
+    return;
+  }
+
+  /* a result nobody asked for */
+  while(call->result != NULL)
+  {
+    switch(call->op)
+    {
+      case ASYNC_ALBUM_GET:
+      case ASYNC_ALBUM_LIST:
+        next = ((LIBMTP_album_t *)call->result)->next;
+
+        LIBMTP_destroy_album_t((LIBMTP_album_t *)call->result);
+        break;
+
+      case ASYNC_FILE_INFO_GET:
+      case ASYNC_FILE_INFO_LIST:
+        next = ((LIBMTP_file_t *)call->result)->next;
+
+        LIBMTP_destroy_file_t((LIBMTP_file_t *)call->result);
+        break;
+
+      case ASYNC_PLAYLIST_GET:
+      case ASYNC_PLAYLIST_LIST:
+        next = ((LIBMTP_playlist_t *)call->result)->next;
+
+        LIBMTP_destroy_playlist_t((LIBMTP_playlist_t *)call->result);
+        break;
+
+      case ASYNC_TRACK_GET:
+      case ASYNC_TRACK_LIST:
+        next = ((LIBMTP_track_t *)call->result)->next;
+
+        LIBMTP_destroy_track_t((LIBMTP_track_t *)call->result);
+        break;
+
+      default:
+        /* folders are destroyed as a tree */
+        LIBMTP_destroy_folder_t((LIBMTP_folder_t *)call->result);
+
+        next = NULL;
+        break;
+    }
+
+    call->result = next;
+  }
+
+  if(call->object != NULL)
+  {
+    if(call->op == ASYNC_TRACK_SEND_FILE)
+    {
+      LIBMTP_destroy_track_t((LIBMTP_track_t *)call->object);
+    }
+    else
+    {
+      LIBMTP_destroy_file_t((LIBMTP_file_t *)call->object);
+    }
+  }
+
+  free(call->path);
+
+  free(call);
+
+
+  return;
+}
+
+
+static char *async_strdup(const char *string)
+{
+  return ((string != NULL) ? strdup(string) : NULL);
+}
+
+
+/*
+ * The worker sends from copies of the metadata, so that the Ruby object
+ * may change or be collected while the send is queued.
+ */
+
+static LIBMTP_file_t *async_copy_file(LIBMTP_file_t *file)
+{
+  LIBMTP_file_t *copy = LIBMTP_new_file_t();
+
+
+  memcpy(copy, file, sizeof(LIBMTP_file_t));
+
+  copy->filename = async_strdup(file->filename);
+
+  copy->next = NULL;
+
+
+  return copy;
+}
+
+
+static LIBMTP_track_t *async_copy_track(LIBMTP_track_t *track)
+{
+  LIBMTP_track_t *copy = LIBMTP_new_track_t();
+
+
+  memcpy(copy, track, sizeof(LIBMTP_track_t));
+
+  copy->title = async_strdup(track->title);
+
+  copy->artist = async_strdup(track->artist);
+
+  copy->composer = async_strdup(track->composer);
+
+  copy->genre = async_strdup(track->genre);
+
+  copy->album = async_strdup(track->album);
+
+  copy->date = async_strdup(track->date);
+
+  copy->filename = async_strdup(track->filename);
+
+  copy->next = NULL;
+
+
+  return copy;
+}
+
+
+/*
+ * libmtp progress callback: a non-zero return cancels the transfer.
+ */
+
+static int call_progress(uint64_t const sent, uint64_t const total, void const *const data)
+{
+  return ((const mtp_call_t *)data)->cancel;
+}
+
+
+static void call_execute(mtp_device_t *device, mtp_call_t *call)
+{
+  LIBMTP_mtpdevice_t *device_ptr = device->device;
+
+
+  call->status = 0;
+
+  switch(call->op)
+  {
+    case ASYNC_ALBUM_GET:
+      call->result = LIBMTP_Get_Album(device_ptr, call->id);
+      break;
+
+    case ASYNC_ALBUM_LIST:
+      call->result = LIBMTP_Get_Album_List(device_ptr);
+      break;
+
+    case ASYNC_FILE_INFO_GET:
+      call->result = LIBMTP_Get_Filemetadata(device_ptr, call->id);
+      break;
+
+    case ASYNC_FILE_INFO_LIST:
+      call->result = LIBMTP_Get_Filelisting_With_Callback(device_ptr, NULL, NULL);
+      break;
+
+    case ASYNC_FOLDER_LIST:
+      call->result = LIBMTP_Get_Folder_List(device_ptr);
+      break;
+
+    case ASYNC_PLAYLIST_GET:
+      call->result = LIBMTP_Get_Playlist(device_ptr, call->id);
+      break;
+
+    case ASYNC_PLAYLIST_LIST:
+      call->result = LIBMTP_Get_Playlist_List(device_ptr);
+      break;
+
+    case ASYNC_TRACK_GET:
+      call->result = LIBMTP_Get_Trackmetadata(device_ptr, call->id);
+      break;
+
+    case ASYNC_TRACK_LIST:
+      call->result = LIBMTP_Get_Tracklisting_With_Callback(device_ptr, NULL, NULL);
+      break;
+
+    case ASYNC_FILE_GET:
+      call->status = LIBMTP_Get_File_To_File(device_ptr, call->id, call->path, call_progress, call);
+      break;
+
+    case ASYNC_TRACK_GET_FILE:
+      call->status = LIBMTP_Get_Track_To_File(device_ptr, call->id, call->path, call_progress, call);
+      break;
+
+    case ASYNC_FILE_SEND:
+      call->status = LIBMTP_Send_File_From_File(device_ptr, call->path, (LIBMTP_file_t *)call->object, call_progress, call);
+      break;
+
+    case ASYNC_TRACK_SEND_FILE:
+      call->status = LIBMTP_Send_Track_From_File(device_ptr, call->path, (LIBMTP_track_t *)call->object, call_progress, call);
+      break;
+
+    case ASYNC_DELETE_OBJECT:
+      call->status = LIBMTP_Delete_Object(device_ptr, call->id);
+      break;
+  }
+
+
+  return;
+}
+
+
+/*
+ * Marks a call finished and wakes whoever waits for it.  Called with the
+ * worker lock held.
+ */
+
+static void call_finish(mtp_worker_t *worker, mtp_call_t *call, int state)
+{
+  call->state = state;
+
+  pthread_cond_broadcast(&worker->done);
+
+  if(call->notify >= 0)
+  {
+    if(write(call->notify, "", 1) < 0)
+    {
+      /* the reader checks the state again anyway */
+    }
+  }
+
+
+  return;
+}
+
+
+static void *worker_run(void *ptr)
+{
+  mtp_worker_t *worker = (mtp_worker_t *)ptr;
+
+  mtp_call_t *call;
+
+
+  pthread_mutex_lock(&worker->lock);
+
+  while(1)
+  {
+    while((worker->head == NULL) && !worker->stop)
+    {
+      pthread_cond_wait(&worker->ready, &worker->lock);
+    }
+
+    call = worker->head;
+
+    if(call == NULL) break;
+
+    worker->head = call->next;
+
+    if(worker->head == NULL) worker->tail = NULL;
+
+    if(worker->stop)
+    {
+      call_finish(worker, call, ASYNC_CANCELLED);
+
+      call_release(call);
+
+      continue;
+    }
+
+    call->state = ASYNC_RUNNING;
+
+    pthread_mutex_unlock(&worker->lock);
+
+
+    mtp_device_wait(worker->device, call->priority);
+
+    call_execute(worker->device, call);
+
+    mtp_device_unlock(worker->device);
+
+
+    pthread_mutex_lock(&worker->lock);
+
+    call_finish(worker, call, ASYNC_DONE);
+
+    call_release(call);
+  }
+
+  pthread_mutex_unlock(&worker->lock);
+
+
+  return NULL;
+}
+
+
+static mtp_worker_t *worker_get(mtp_device_t *device)
+{
+  mtp_worker_t *worker = device->worker;
+
+
+  if(worker != NULL)
+  {
+    return worker;
+  }
+
+  worker = (mtp_worker_t *)calloc(1, sizeof(mtp_worker_t));
+
+  if(worker == NULL)
+  {
+    rb_raise(rb_eNoMemError, "Unable to allocate device worker");
+  }
+
+  worker->device = device;
+
+  pthread_mutex_init(&worker->lock, NULL);
+
+  pthread_cond_init(&worker->ready, NULL);
+
+  pthread_cond_init(&worker->done, NULL);
+
+  if(pthread_create(&worker->thread, NULL, worker_run, worker) != 0)
+  {
+    pthread_cond_destroy(&worker->done);
+
+    pthread_cond_destroy(&worker->ready);
+
+    pthread_mutex_destroy(&worker->lock);
+
+    free(worker);
+
+    rb_raise(rb_eIOError, "Unable to start device worker");
+  }
+
+  device->worker = worker;
+
+
+  return worker;
+}
+
+
+/*
+ * Stops the worker of a device that is being freed.  The operation in
+ * progress completes; queued ones are dropped.
+ */
+
+void mtp_async_stop(mtp_device_t *device)
+{
+  mtp_worker_t *worker = device->worker;
+
+
+  if(worker == NULL) return;
+
+  pthread_mutex_lock(&worker->lock);
+
+  worker->stop = 1;
+
+  pthread_cond_signal(&worker->ready);
+
+  pthread_mutex_unlock(&worker->lock);
+
+  pthread_join(worker->thread, NULL);
+
+  pthread_cond_destroy(&worker->done);
+
+  pthread_cond_destroy(&worker->ready);
+
+  pthread_mutex_destroy(&worker->lock);
+
+  free(worker);
+
+  device->worker = NULL;
+
+
+  return;
+}
+
+
+static void future_mark(void *ptr)
+{
+  mtp_future_t *future = (mtp_future_t *)ptr;
+
+
+  rb_gc_mark(future->device);
+
+  rb_gc_mark(future->object);
+
+  rb_gc_mark(future->parent);
+
+  rb_gc_mark(future->block);
+
+  rb_gc_mark(future->value);
+
+  rb_gc_mark(future->error);
+
+
+  return;
+}
+
+
+static void future_free(void *ptr)
+{
+  mtp_future_t *future = (mtp_future_t *)ptr;
+
+
+  if(future->call != NULL)
+  {
+    call_release(future->call);
+  }
+
+  xfree(future);
+
+
+  return;
+}
+
+
+static VALUE future_new(mtp_future_t **ptr)
+{
+  mtp_future_t *future;
+
+  VALUE obj;
+
+
+  obj = Data_Make_Struct(cMTPFuture, mtp_future_t, future_mark, future_free, future);
+
+  future->device = future->object = future->parent = Qnil;
+
+  future->block = future->value = future->error = Qnil;
+
+  *ptr = future;
+
+
+  return obj;
+}
+
+
+/*
+ * Queues an operation on the worker of <i>device</i> and returns its future.
+ * Arguments are converted by the caller, so nothing here runs Ruby code
+ * once the call is queued.
+ */
+
+static VALUE async_submit(VALUE device, int op, uint32_t id, VALUE path, VALUE object, void *object_ptr)
+{
+  mtp_device_t *device_ptr = Get_MTP_Device(device);
+
+  mtp_worker_t *worker;
+
+  mtp_future_t *future;
+
+  mtp_call_t *call;
+
+  VALUE obj;
+
+
+  worker = worker_get(device_ptr);
+
+  call = (mtp_call_t *)calloc(1, sizeof(mtp_call_t));
+
+  if(call == NULL)
+  {
+    rb_raise(rb_eNoMemError, "Unable to allocate device call");
+  }
+
+  call->op = op;
+
+  call->id = id;
+
+  call->object = object_ptr;
+
+  call->priority = mtp_priority(MTP_PRIORITY_NORMAL);
+
+  call->refs = 2;
+
+  call->notify = -1;
+
+  if(!NIL_P(path))
+  {
+    call->path = strdup(StringValueCStr(path));
+  }
+
+  obj = future_new(&future);
+
+  future->call = call;
+
+  future->worker = worker;
+
+  future->device = device;
+
+  future->object = object;
+
+
+  pthread_mutex_lock(&worker->lock);
+
+  if(worker->tail != NULL)
+  {
+    worker->tail->next = call;
+  }
+  else
+  {
+    worker->head = call;
+  }
+
+  worker->tail = call;
+
+  pthread_cond_signal(&worker->ready);
+
+  pthread_mutex_unlock(&worker->lock);
+
+
+  return obj;
+}
+
+
+typedef struct mtp_future_wait_s
+{
+  mtp_future_t *future;
+
+  struct timespec until;
+} mtp_future_wait_t;
+
+
+static void *future_wait_blocking(void *ptr)
+{
+  mtp_future_wait_t *wait = (mtp_future_wait_t *)ptr;
+
+  mtp_worker_t *worker = wait->future->worker;
+
+  mtp_call_t *call = wait->future->call;
+
+
+  pthread_mutex_lock(&worker->lock);
+
+  while(call->state < ASYNC_DONE)
+  {
+    if(pthread_cond_timedwait(&worker->done, &worker->lock, &wait->until) == ETIMEDOUT) break;
+  }
+
+  pthread_mutex_unlock(&worker->lock);
+
+
+  return NULL;
+}
+
+
+static int future_done(mtp_future_t *future)
+{
+  int state;
+
+
+  pthread_mutex_lock(&future->worker->lock);
+
+  state = future->call->state;
+
+  pthread_mutex_unlock(&future->worker->lock);
+
+
+  return (state >= ASYNC_DONE);
+}
+
+
+static double future_now(void)
+{
+  struct timeval tv;
+
+
+  gettimeofday(&tv, NULL);
+
+
+  return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+
+typedef struct mtp_fiber_wait_s
+{
+  mtp_future_t *future;
+
+  VALUE scheduler;
+
+  VALUE pipe;
+
+  double timeout;
+} mtp_fiber_wait_t;
+
+
+static VALUE fiber_wait_io(VALUE ptr)
+{
+  mtp_fiber_wait_t *wait = (mtp_fiber_wait_t *)ptr;
+
+  double deadline = future_now() + wait->timeout;
+
+  VALUE timeout = Qnil;
+
+
+  while(!future_done(wait->future))
+  {
+    if(wait->timeout >= 0)
+    {
+      if(future_now() >= deadline) break;
+
+      timeout = DBL2NUM(deadline - future_now());
+    }
+
+    rb_fiber_scheduler_io_wait(wait->scheduler, rb_ary_entry(wait->pipe, 0), INT2NUM(RUBY_IO_READABLE), timeout);
+  }
+
+
+  return Qnil;
+}
+
+
+static VALUE fiber_wait_done(VALUE ptr)
+{
+  mtp_fiber_wait_t *wait = (mtp_fiber_wait_t *)ptr;
+
+
+  pthread_mutex_lock(&wait->future->worker->lock);
+
+  wait->future->call->notify = -1;
+
+  pthread_mutex_unlock(&wait->future->worker->lock);
+
+  rb_funcall(rb_ary_entry(wait->pipe, 0), rb_intern("close"), 0);
+
+  rb_funcall(rb_ary_entry(wait->pipe, 1), rb_intern("close"), 0);
+
+
+  return Qnil;
+}
+
+
+/*
+ * Waits in a non-blocking fiber: the worker writes to a pipe when the call
+ * finishes and the fiber scheduler waits for the pipe, so other fibers keep
+ * running on this thread meanwhile.
+ */
+
+static int future_wait_fiber(mtp_future_t *future, VALUE scheduler, double timeout)
+{
+  mtp_fiber_wait_t wait;
+
+  int pending;
+
+  int notify;
+
+
+  wait.future = future;
+
+  wait.scheduler = scheduler;
+
+  wait.timeout = timeout;
+
+  wait.pipe = rb_funcall(rb_cIO, rb_intern("pipe"), 0);
+
+  /* these call into Ruby and may raise, so not under the worker lock */
+  notify = NUM2INT(rb_funcall(rb_ary_entry(wait.pipe, 1), rb_intern("fileno"), 0));
+
+
+  pthread_mutex_lock(&future->worker->lock);
+
+  pending = (future->call->state < ASYNC_DONE);
+
+  if(pending)
+  {
+    future->call->notify = notify;
+  }
+
+  pthread_mutex_unlock(&future->worker->lock);
+
+  if(pending)
+  {
+    rb_ensure(fiber_wait_io, (VALUE)&wait, fiber_wait_done, (VALUE)&wait);
+  }
+  else
+  {
+    fiber_wait_done((VALUE)&wait);
+  }
+
+
+  return future_done(future);
+}
+
+#endif
+
+
+/*
+ * True when the current fiber is non-blocking under a fiber scheduler, in
+ * which case blocking device calls go through the worker instead.
+ */
+
+int mtp_async_nonblocking(void)
+{
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+  return !NIL_P(rb_fiber_scheduler_current());
+#else
+  return 0;
+#endif
+}
+
+
+/*
+ * Runs a Device method through the worker of <i>device</i> and waits for
+ * its value; see mtp_async_nonblocking.
+ */
+
+VALUE mtp_async_call(VALUE device, const char *name, int argc, VALUE *argv)
+{
+  VALUE future = rb_funcall2(mtp_async_create(device), rb_intern(name), argc, argv);
+
+
+  return rb_funcall(future, rb_intern("value"), 0);
+}
+
+
+/*
+ * Waits up to <i>timeout</i> seconds (forever when negative) for the device
+ * operation behind a future, in short slices so that the waiting thread can
+ * still be interrupted.  Returns true once the operation has finished.
+ */
+
+static int future_wait_call(mtp_future_t *future, double timeout)
+{
+  mtp_future_wait_t wait;
+
+  double deadline = future_now() + timeout;
+
+  double until;
+
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+  VALUE scheduler = rb_fiber_scheduler_current();
+
+
+  if(!NIL_P(scheduler))
+  {
+    return future_wait_fiber(future, scheduler, timeout);
+  }
+#endif
+
+
+  wait.future = future;
+
+  while(!future_done(future))
+  {
+    until = future_now() + ASYNC_WAIT_SLICE;
+
+    if(timeout >= 0)
+    {
+      if(future_now() >= deadline) return 0;
+
+      if(until > deadline) until = deadline;
+    }
+
+    wait.until.tv_sec = (time_t)until;
+
+    wait.until.tv_nsec = (long)((until - (time_t)until) * 1e9);
+
+    mtp_without_gvl(future_wait_blocking, &wait);
+
+    rb_thread_check_ints();
+  }
+
+
+  return 1;
+}
+
+
+static int future_wait(mtp_future_t *future, double timeout)
+{
+  mtp_future_t *parent;
+
+
+  while(!NIL_P(future->parent))
+  {
+    Data_Get_Struct(future->parent, mtp_future_t, parent);
+
+    future = parent;
+  }
+
+  if(future->resolved || (future->call == NULL))
+  {
+    return 1;
+  }
+
+
+  return future_wait_call(future, timeout);
+}
+
+
+static VALUE future_list(mtp_call_t *call, VALUE (*wrap)(void *), size_t next_offset, const char *message)
+{
+  VALUE array = rb_ary_new();
+
+  void *current = call->result;
+
+  void *next;
+
+
+  if(current == NULL)
+  {
+    rb_raise(rb_eIOError, "%s", message);
+  }
+
+  call->result = NULL;
+
+  while(current != NULL)
+  {
+    next = *(void **)((char *)current + next_offset);
+
+    rb_ary_push(array, wrap(current));
+
+    current = next;
+  }
+
+
+  return array;
+}
+
+
+static VALUE future_item(mtp_call_t *call, VALUE (*wrap)(void *), const char *message)
+{
+  void *item = call->result;
+
+
+  if(item == NULL)
+  {
+    rb_raise(rb_eIOError, "%s", message);
+  }
+
+  call->result = NULL;
+
+
+  return wrap(item);
+}
+
+
+/*
+ * Turns the native result of a finished call into the value the
+ * synchronous Device method would have returned.  Runs with the GVL.
+ */
+
+static VALUE future_convert(VALUE ptr)
+{
+  mtp_future_t *future = (mtp_future_t *)ptr;
+
+  mtp_call_t *call = future->call;
+
+  LIBMTP_file_t *file_ptr;
+
+  LIBMTP_track_t *track_ptr;
+
+
+  if(call->state == ASYNC_CANCELLED)
+  {
+    rb_raise(rb_eIOError, "Operation was cancelled");
+  }
+
+  switch(call->op)
+  {
+    case ASYNC_ALBUM_GET:
+      return future_item(call, (VALUE (*)(void *))Wrap_LibMTP_Album, "Unable to get album");
+
+    case ASYNC_ALBUM_LIST:
+      return future_list(call, (VALUE (*)(void *))Wrap_LibMTP_Album, offsetof(LIBMTP_album_t, next), "Unable to get album list");
+
+    case ASYNC_FILE_INFO_GET:
+      return future_item(call, (VALUE (*)(void *))Wrap_LibMTP_File, "Unable to get file metadata");
+
+    case ASYNC_FILE_INFO_LIST:
+      return future_list(call, (VALUE (*)(void *))Wrap_LibMTP_File, offsetof(LIBMTP_file_t, next), "Unable to get file metadata listing");
+
+    case ASYNC_FOLDER_LIST:
+      return future_list(call, (VALUE (*)(void *))Wrap_LibMTP_Folder, offsetof(LIBMTP_folder_t, sibling), "Unable to get folder listing");
+
+    case ASYNC_PLAYLIST_GET:
+      return future_item(call, (VALUE (*)(void *))Wrap_LibMTP_Playlist, "Unable to get playlist");
+
+    case ASYNC_PLAYLIST_LIST:
+      return future_list(call, (VALUE (*)(void *))Wrap_LibMTP_Playlist, offsetof(LIBMTP_playlist_t, next), "Unable to get playlist list");
+
+    case ASYNC_TRACK_GET:
+      return future_item(call, (VALUE (*)(void *))Wrap_LibMTP_Track, "Unable to get track metadata");
+
+    case ASYNC_TRACK_LIST:
+      return future_list(call, (VALUE (*)(void *))Wrap_LibMTP_Track, offsetof(LIBMTP_track_t, next), "Unable to get track metadata listing");
+
+    case ASYNC_FILE_GET:
+    case ASYNC_TRACK_GET_FILE:
+      if(call->status != 0) rb_raise(rb_eIOError, "Unable to retrieve file");
+      break;
+
+    case ASYNC_FILE_SEND:
+      if(call->status != 0) rb_raise(rb_eIOError, "Unable to send file");
+
+      Data_Get_Struct(future->object, LIBMTP_file_t, file_ptr);
+
+      file_ptr->item_id = ((LIBMTP_file_t *)call->object)->item_id;
+
+      return UINT2NUM(file_ptr->item_id);
+
+    case ASYNC_TRACK_SEND_FILE:
+      if(call->status != 0) rb_raise(rb_eIOError, "Unable to send track");
+
+      Data_Get_Struct(future->object, LIBMTP_track_t, track_ptr);
+
+      track_ptr->item_id = ((LIBMTP_track_t *)call->object)->item_id;
+
+      return UINT2NUM(track_ptr->item_id);
+
+    case ASYNC_DELETE_OBJECT:
+      if(call->status != 0) rb_raise(rb_eIOError, "Unable to delete object");
+      break;
+  }
+
+
+  return future->device;
+}
+
+
+static VALUE future_chain(VALUE ptr)
+{
+  mtp_future_t *future = (mtp_future_t *)ptr;
+
+
+  return rb_funcall(future->block, rb_intern("call"), 1, rb_funcall(future->parent, rb_intern("value"), 0));
+}
+
+
+/*
+ *  call-seq:
+ *     future.value() -> result of the operation
+ *
+ *  Waits for the operation and returns what the synchronous LibMTP::Device method returns, or raises
+ *  the error it raises.  A cancelled operation raises an IOError.  The result is computed once;
+ *  later calls return the same object or raise the same error.
+ *
+ */
+
+static VALUE future_value(VALUE self)
+{
+  mtp_future_t *future;
+
+  int state = 0;
+
+
+  Data_Get_Struct(self, mtp_future_t, future);
+
+  if(!future->resolved)
+  {
+    if(NIL_P(future->parent))
+    {
+      future_wait(future, -1);
+
+      future->value = rb_protect(future_convert, (VALUE)future, &state);
+    }
+    else
+    {
+      future->value = rb_protect(future_chain, (VALUE)future, &state);
+    }
+
+    if(state != 0)
+    {
+      future->error = rb_errinfo();
+
+      rb_set_errinfo(Qnil);
+    }
+
+    future->resolved = 1;
+  }
+
+  if(!NIL_P(future->error))
+  {
+    rb_exc_raise(future->error);
+  }
+
+
+  return future->value;
+}
+
+
+/*
+ *  call-seq:
+ *     future.wait() -> future
+ *     future.wait(timeout) -> future or nil
+ *
+ *  Waits until the operation has finished, or at most <i>timeout</i> seconds.  Returns nil when the
+ *  timeout expires first.
+ *
+ */
+
+static VALUE future_wait_for(int argc, VALUE *argv, VALUE self)
+{
+  mtp_future_t *future;
+
+  VALUE timeout;
+
+
+  rb_scan_args(argc, argv, "01", &timeout);
+
+  Data_Get_Struct(self, mtp_future_t, future);
+
+
+  return (future_wait(future, NIL_P(timeout) ? -1 : NUM2DBL(timeout)) ? self : Qnil);
+}
+
+
+/*
+ *  call-seq:
+ *     future.done?() -> true or false
+ *
+ *  Returns true once the operation has finished and its value can be taken without waiting.
+ *
+ */
+
+static VALUE future_is_done(VALUE self)
+{
+  mtp_future_t *future;
+
+
+  Data_Get_Struct(self, mtp_future_t, future);
+
+  while(!NIL_P(future->parent))
+  {
+    Data_Get_Struct(future->parent, mtp_future_t, future);
+  }
+
+
+  return ((future->resolved || (future->call == NULL) || future_done(future)) ? Qtrue : Qfalse);
+}
+
+
+/*
+ *  call-seq:
+ *     future.then { |value| ... } -> LibMTP::Future
+ *
+ *  Returns a future for the result of the block applied to the value of this future.  The block runs in
+ *  the thread that first asks for the new future's value; if this future fails, so does the new one.
+ *
+ */
+
+static VALUE future_then(VALUE self)
+{
+  mtp_future_t *future;
+
+  VALUE obj;
+
+
+  rb_need_block();
+
+  obj = future_new(&future);
+
+  future->parent = self;
+
+  future->block = rb_block_proc();
+
+
+  return obj;
+}
+
+
+/*
+ *  call-seq:
+ *     future.cancel() -> true or false
+ *
+ *  Cancels the operation.  An operation that is still queued is dropped, and a file transfer in progress
+ *  is aborted at its next chunk.  Returns false when the operation had already finished or cannot be
+ *  interrupted, such as a listing in progress.
+ *
+ */
+
+static VALUE future_cancel(VALUE self)
+{
+  mtp_future_t *future;
+
+  mtp_worker_t *worker;
+
+  mtp_call_t *call, **link;
+
+  VALUE result = Qfalse;
+
+
+  Data_Get_Struct(self, mtp_future_t, future);
+
+  while(!NIL_P(future->parent))
+  {
+    Data_Get_Struct(future->parent, mtp_future_t, future);
+  }
+
+  call = future->call;
+
+  if((call == NULL) || future->resolved)
+  {
+    return Qfalse;
+  }
+
+  worker = future->worker;
+
+
+  pthread_mutex_lock(&worker->lock);
+
+  if(call->state == ASYNC_QUEUED)
+  {
+    for(link = &worker->head; *link != NULL; link = &(*link)->next)
+    {
+      if(*link == call)
+      {
+        *link = call->next;
+
+        break;
+      }
+    }
+
+    worker->tail = NULL;
+
+    for(call = worker->head; call != NULL; call = call->next)
+    {
+      worker->tail = call;
+    }
+
+    call = future->call;
+
+    call_finish(worker, call, ASYNC_CANCELLED);
+
+    /* the worker's reference went with the queue entry */
+    __sync_sub_and_fetch(&call->refs, 1);
+
+    result = Qtrue;
+  }
+  else if(call->state == ASYNC_RUNNING)
+  {
+    switch(call->op)
+    {
+      case ASYNC_FILE_GET:
+      case ASYNC_FILE_SEND:
+      case ASYNC_TRACK_GET_FILE:
+      case ASYNC_TRACK_SEND_FILE:
+        call->cancel = 1;
+
+        result = Qtrue;
+        break;
+    }
+  }
+
+  pthread_mutex_unlock(&worker->lock);
+
+
+  return result;
+}
+
+
+/*
+ *  call-seq:
+ *     future.inspect() -> string
+ *
+ */
+
+static VALUE future_inspect(VALUE self)
+{
+  return rb_str_new2(RTEST(future_is_done(self)) ? "#<LibMTP::Future done>" : "#<LibMTP::Future pending>");
+}
+
+
+static void async_mark(void *ptr)
+{
+  rb_gc_mark(*(VALUE *)ptr);
+
+
+  return;
+}
+
+
+/*
+ * Returns the LibMTP::Device::Async proxy of a device (see Device#async).
+ */
+
+VALUE mtp_async_create(VALUE device)
+{
+  VALUE *ptr;
+
+  VALUE obj;
+
+
+  obj = Data_Make_Struct(cMTPAsync, VALUE, async_mark, -1, ptr);
+
+  *ptr = device;
+
+
+  return obj;
+}
+
+
+static VALUE async_device(VALUE self)
+{
+  VALUE *ptr;
+
+
+  Data_Get_Struct(self, VALUE, ptr);
+
+
+  return *ptr;
+}
+
+
+static VALUE async_path(VALUE pathname)
+{
+  VALUE path = StringValue(pathname);
+
+
+  if(RSTRING_LEN(path) == 0)
+  {
+    rb_raise(rb_eArgError, "Empty pathname");
+  }
+
+  StringValueCStr(path);
+
+
+  return path;
+}
+
+
+static VALUE async_album_get(VALUE self, VALUE id)
+{
+  return async_submit(async_device(self), ASYNC_ALBUM_GET, NUM2UINT(id), Qnil, Qnil, NULL);
+}
+
+
+static VALUE async_album_list(VALUE self)
+{
+  return async_submit(async_device(self), ASYNC_ALBUM_LIST, 0, Qnil, Qnil, NULL);
+}
+
+
+static VALUE async_file_info_get(VALUE self, VALUE id)
+{
+  return async_submit(async_device(self), ASYNC_FILE_INFO_GET, NUM2UINT(id), Qnil, Qnil, NULL);
+}
+
+
+static VALUE async_file_info_list(VALUE self)
+{
+  return async_submit(async_device(self), ASYNC_FILE_INFO_LIST, 0, Qnil, Qnil, NULL);
+}
+
+
+static VALUE async_file_get(VALUE self, VALUE id, VALUE pathname)
+{
+  uint32_t object_id = NUM2UINT(id);
+
+
+  return async_submit(async_device(self), ASYNC_FILE_GET, object_id, async_path(pathname), Qnil, NULL);
+}
+
+
+static VALUE async_file_send(VALUE self, VALUE parent, VALUE pathname, VALUE file)
+{
+  LIBMTP_file_t *file_ptr;
+
+  uint32_t parent_id = NUM2UINT(parent);
+
+  VALUE path = async_path(pathname);
+
+
+  file = Get_LibMTP_File(file);
+
+  Data_Get_Struct(file, LIBMTP_file_t, file_ptr);
+
+  file_ptr->parent_id = parent_id;
+
+
+  return async_submit(async_device(self), ASYNC_FILE_SEND, 0, path, file, async_copy_file(file_ptr));
+}
+
+
+static VALUE async_folder_list(VALUE self)
+{
+  return async_submit(async_device(self), ASYNC_FOLDER_LIST, 0, Qnil, Qnil, NULL);
+}
+
+
+static VALUE async_playlist_get(VALUE self, VALUE id)
+{
+  return async_submit(async_device(self), ASYNC_PLAYLIST_GET, NUM2UINT(id), Qnil, Qnil, NULL);
+}
+
+
+static VALUE async_playlist_list(VALUE self)
+{
+  return async_submit(async_device(self), ASYNC_PLAYLIST_LIST, 0, Qnil, Qnil, NULL);
+}
+
+
+static VALUE async_track_get(VALUE self, VALUE id)
+{
+  return async_submit(async_device(self), ASYNC_TRACK_GET, NUM2UINT(id), Qnil, Qnil, NULL);
+}
+
+
+static VALUE async_track_list(VALUE self)
+{
+  return async_submit(async_device(self), ASYNC_TRACK_LIST, 0, Qnil, Qnil, NULL);
+}
+
+
+static VALUE async_track_get_file(VALUE self, VALUE id, VALUE pathname)
+{
+  uint32_t object_id = NUM2UINT(id);
+
+
+  return async_submit(async_device(self), ASYNC_TRACK_GET_FILE, object_id, async_path(pathname), Qnil, NULL);
+}
+
+
+static VALUE async_track_send_file(VALUE self, VALUE parent, VALUE pathname, VALUE track)
+{
+  LIBMTP_track_t *track_ptr;
+
+  uint32_t parent_id = NUM2UINT(parent);
+
+  VALUE path = async_path(pathname);
+
+
+  track = Get_LibMTP_Track(track);
+
+  Data_Get_Struct(track, LIBMTP_track_t, track_ptr);
+
+  track_ptr->parent_id = parent_id;
+
+
+  return async_submit(async_device(self), ASYNC_TRACK_SEND_FILE, 0, path, track, async_copy_track(track_ptr));
+}
+
+
+static VALUE async_delete_object(VALUE self, VALUE id)
+{
+  return async_submit(async_device(self), ASYNC_DELETE_OBJECT, NUM2UINT(id), Qnil, Qnil, NULL);
+}
+
+
+static VALUE async_send(VALUE args)
+{
+  return rb_funcall2(RARRAY_PTR(args)[0], SYM2ID(RARRAY_PTR(args)[1]), RARRAY_LEN(args) - 2, RARRAY_PTR(args) + 2);
+}
+
+
+/*
+ * Any other Device method runs at once on the calling thread and returns a
+ * future that is already resolved, so that callers can treat every method
+ * alike.
+ */
+
+static VALUE async_method_missing(int argc, VALUE *argv, VALUE self)
+{
+  mtp_future_t *future;
+
+  VALUE device = async_device(self);
+
+  VALUE args, obj;
+
+  int state = 0;
+
+
+  if((argc < 1) || !rb_respond_to(device, SYM2ID(argv[0])))
+  {
+    return rb_call_super(argc, argv);
+  }
+
+  args = rb_ary_new4(argc, argv);
+
+  rb_ary_unshift(args, device);
+
+  obj = future_new(&future);
+
+  future->device = device;
+
+  future->value = rb_protect(async_send, args, &state);
+
+  if(state != 0)
+  {
+    future->value = Qnil;
+
+    future->error = rb_errinfo();
+
+    rb_set_errinfo(Qnil);
+  }
+
+  future->resolved = 1;
+
+
+  return obj;
+}
+
+
+static VALUE async_respond_to_missing(VALUE self, VALUE name, VALUE include_private)
+{
+  return (rb_respond_to(async_device(self), rb_to_id(name)) ? Qtrue : Qfalse);
+}
+
+
+/*
+ * Document-class: LibMTP::Future
+ *
+ * The pending result of a device operation started through LibMTP::Device#async.
+ *
+ *  futures = devices.map { |device| device.async.track_list }
+ *
+ *  futures.each { |future| puts future.value.length }
+ *
+ */
+
+/*
+ * Document-class: LibMTP::Device::Async
+ *
+ * Proxy returned by LibMTP::Device#async.  It takes the same methods as LibMTP::Device and returns a
+ * LibMTP::Future for each call instead of waiting for the result.
+ *
+ * The listing, metadata, transfer and delete methods (album_get, album_list, file_info_get,
+ * file_info_list, file_get, file_send, folder_list, playlist_get, playlist_list, track_get, track_list,
+ * track_get_file, track_send_file and delete_object) are queued on a native worker thread of the
+ * device and run without the GVL, in the order they were called and at the priority of the calling
+ * thread (see LibMTP::with_priority), so a single Ruby thread can keep many devices busy.  Transfers
+ * take no options here and file_send and track_send_file yield the new object ID.  Every other method
+ * runs at once and returns a future that is already resolved.
+ *
+ */
+
+void Init_LibMTP_Async(void)
+{
+  cMTPFuture = rb_define_class_under(mLibMTP, "Future", rb_cObject);
+
+  rb_undef_alloc_func(cMTPFuture);
+
+
+  rb_define_method(cMTPFuture, "value", future_value, 0);
+
+  rb_define_method(cMTPFuture, "wait", future_wait_for, -1);
+
+  rb_define_method(cMTPFuture, "done?", future_is_done, 0);
+
+  rb_define_method(cMTPFuture, "then", future_then, 0);
+
+  rb_define_method(cMTPFuture, "cancel", future_cancel, 0);
+
+  rb_define_method(cMTPFuture, "inspect", future_inspect, 0);
+
+
+  cMTPAsync = rb_define_class_under(rb_const_get(mLibMTP, rb_intern("Device")), "Async", rb_cObject);
+
+  rb_undef_alloc_func(cMTPAsync);
+
+
+  rb_define_method(cMTPAsync, "album_get", async_album_get, 1);
+
+  rb_define_method(cMTPAsync, "album_list", async_album_list, 0);
+
+  rb_define_method(cMTPAsync, "file_info_get", async_file_info_get, 1);
+
+  rb_define_method(cMTPAsync, "file_info_list", async_file_info_list, 0);
+
+  rb_define_method(cMTPAsync, "file_get", async_file_get, 2);
+
+  rb_define_method(cMTPAsync, "file_send", async_file_send, 3);
+
+  rb_define_method(cMTPAsync, "folder_list", async_folder_list, 0);
+
+  rb_define_method(cMTPAsync, "playlist_get", async_playlist_get, 1);
+
+  rb_define_method(cMTPAsync, "playlist_list", async_playlist_list, 0);
+
+  rb_define_method(cMTPAsync, "track_get", async_track_get, 1);
+
+  rb_define_method(cMTPAsync, "track_list", async_track_list, 0);
+
+  rb_define_method(cMTPAsync, "track_get_file", async_track_get_file, 2);
+
+  rb_define_method(cMTPAsync, "track_send_file", async_track_send_file, 3);
+
+  rb_define_method(cMTPAsync, "delete_object", async_delete_object, 1);
+
+  rb_define_method(cMTPAsync, "method_missing", async_method_missing, -1);
+
+  rb_define_method(cMTPAsync, "respond_to_missing?", async_respond_to_missing, 2);
+
+
+  return;
+}
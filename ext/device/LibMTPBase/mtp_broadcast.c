@@ -0,0 +1,633 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "mtp_proto.h"
+
+
+#define BROADCAST_CHUNK_SIZE (1024 * 1024)
+
+#define BROADCAST_WINDOW     (16 * 1024 * 1024)
+
+
+/*
+ * The source is read once into a list of chunks.  Every chunk carries a
+ * reference for each receiver that has not yet sent it and is freed by the
+ * last one to move past it, so memory is bounded by how far the fastest
+ * receiver is ahead of the slowest.
+ */
+
+typedef struct mtp_chunk_s
+{
+  struct mtp_chunk_s *next;
+
+  unsigned char *data;
+
+  size_t len;
+
+  int refs;
+} mtp_chunk_t;
+
+
+typedef struct mtp_broadcast_s
+{
+  pthread_mutex_t lock;
+
+  pthread_cond_t ready;
+
+  pthread_cond_t room;
+
+  mtp_chunk_t *head;
+
+  mtp_chunk_t *tail;
+
+  size_t buffered;
+
+  size_t window;
+
+  int live;
+
+  int eof;
+
+  int failed;
+} mtp_broadcast_t;
+
+
+typedef struct mtp_receiver_s
+{
+  mtp_broadcast_t *broadcast;
+
+  mtp_device_t *device;
+
+  LIBMTP_file_t *file;
+
+  mtp_chunk_t *chunk;
+
+  size_t offset;
+
+  int started;
+
+  int done;
+
+  int status;
+
+  pthread_t thread;
+} mtp_receiver_t;
+
+
+/*
+ * Frees chunks from the head of the list once no receiver needs them.
+ * Called with the broadcast lock held.
+ */
+
+static void broadcast_trim(mtp_broadcast_t *broadcast)
+{
+  mtp_chunk_t *chunk;
+
+
+  while((broadcast->head != NULL) && (broadcast->head->refs == 0))
+  {
+    chunk = broadcast->head;
+
+    broadcast->head = chunk->next;
+
+    if(broadcast->head == NULL) broadcast->tail = NULL;
+
+    broadcast->buffered -= chunk->len;
+
+    free(chunk->data);
+
+    free(chunk);
+  }
+
+  pthread_cond_broadcast(&broadcast->room);
+
+
+  return;
+}
+
+
+/*
+ * Data handler for each destination device.
+ */
+
+static uint16_t broadcast_get(void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen)
+{
+  mtp_receiver_t *receiver = (mtp_receiver_t *)priv;
+
+  mtp_broadcast_t *broadcast = receiver->broadcast;
+
+  mtp_chunk_t *chunk;
+
+  size_t done = 0;
+
+  size_t n;
+
+
+  pthread_mutex_lock(&broadcast->lock);
+
+  while(done < wantlen)
+  {
+    chunk = receiver->chunk;
+
+    if((chunk != NULL) && (receiver->offset == chunk->len) && (chunk->next != NULL))
+    {
+      receiver->chunk = chunk->next;
+
+      receiver->offset = 0;
+
+      chunk->refs--;
+
+      broadcast_trim(broadcast);
+
+      continue;
+    }
+
+    if((chunk == NULL) || (receiver->offset == chunk->len))
+    {
+      /* hand over what we have rather than wait for the reader */
+      if((done > 0) || broadcast->eof) break;
+
+      pthread_cond_wait(&broadcast->ready, &broadcast->lock);
+
+      continue;
+    }
+
+    n = chunk->len - receiver->offset;
+
+    if(n > wantlen - done) n = wantlen - done;
+
+    memcpy(data + done, chunk->data + receiver->offset, n);
+
+    receiver->offset += n;
+
+    done += n;
+  }
+
+  pthread_mutex_unlock(&broadcast->lock);
+
+  *gotlen = done;
+
+
+  /* the source failed or ended before the device received filesize bytes */
+  return ((done > 0) ? LIBMTP_HANDLER_RETURN_OK : LIBMTP_HANDLER_RETURN_ERROR);
+}
+
+
+static void *broadcast_send(void *ptr)
+{
+  mtp_receiver_t *receiver = (mtp_receiver_t *)ptr;
+
+  mtp_broadcast_t *broadcast = receiver->broadcast;
+
+  mtp_chunk_t *chunk;
+
+
+  receiver->status = LIBMTP_Send_File_From_Handler(receiver->device->device, broadcast_get, receiver, receiver->file, NULL, NULL);
+
+
+  /* drop the references this receiver still holds, whether it finished or failed */
+  pthread_mutex_lock(&broadcast->lock);
+
+  for(chunk = receiver->chunk; chunk != NULL; chunk = chunk->next)
+  {
+    chunk->refs--;
+  }
+
+  receiver->chunk = NULL;
+
+  receiver->done = 1;
+
+  broadcast->live--;
+
+  broadcast_trim(broadcast);
+
+  pthread_mutex_unlock(&broadcast->lock);
+
+
+  return NULL;
+}
+
+
+typedef struct mtp_broadcast_run_s
+{
+  mtp_broadcast_t *broadcast;
+
+  mtp_receiver_t *receivers;
+
+  long count;
+
+  int fd;
+} mtp_broadcast_run_t;
+
+
+/*
+ * Runs without the GVL: reads the source on the calling thread and appends
+ * it chunk by chunk, staying at most one window ahead of the slowest receiver.
+ */
+
+static void *broadcast_run(void *ptr)
+{
+  mtp_broadcast_run_t *run = (mtp_broadcast_run_t *)ptr;
+
+  mtp_broadcast_t *broadcast = run->broadcast;
+
+  mtp_chunk_t *chunk;
+
+  ssize_t n;
+
+  long i;
+
+
+  for(i=0; i < run->count; i++)
+  {
+    run->receivers[i].started = (pthread_create(&run->receivers[i].thread, NULL, broadcast_send, &run->receivers[i]) == 0);
+
+    if(!run->receivers[i].started)
+    {
+      run->receivers[i].status = -1;
+
+      pthread_mutex_lock(&broadcast->lock);
+
+      run->receivers[i].done = 1;
+
+      broadcast->live--;
+
+      pthread_mutex_unlock(&broadcast->lock);
+    }
+  }
+
+  while(1)
+  {
+    pthread_mutex_lock(&broadcast->lock);
+
+    while((broadcast->buffered >= broadcast->window) && (broadcast->live > 0))
+    {
+      pthread_cond_wait(&broadcast->room, &broadcast->lock);
+    }
+
+    if(broadcast->live == 0)
+    {
+      pthread_mutex_unlock(&broadcast->lock);
+
+      break;
+    }
+
+    pthread_mutex_unlock(&broadcast->lock);
+
+
+    chunk = (mtp_chunk_t *)malloc(sizeof(mtp_chunk_t));
+
+    if(chunk != NULL)
+    {
+      chunk->data = (unsigned char *)malloc(BROADCAST_CHUNK_SIZE);
+
+      if(chunk->data == NULL)
+      {
+        free(chunk);
+
+        chunk = NULL;
+      }
+    }
+
+    if(chunk == NULL)
+    {
+      n = -1;
+    }
+    else
+    {
+      do
+      {
+        n = read(run->fd, chunk->data, BROADCAST_CHUNK_SIZE);
+      } while((n < 0) && (errno == EINTR));
+    }
+
+    if(n <= 0)
+    {
+      if(chunk != NULL)
+      {
+        free(chunk->data);
+
+        free(chunk);
+      }
+
+      pthread_mutex_lock(&broadcast->lock);
+
+      broadcast->eof = 1;
+
+      broadcast->failed = (n < 0);
+
+      pthread_cond_broadcast(&broadcast->ready);
+
+      pthread_mutex_unlock(&broadcast->lock);
+
+      break;
+    }
+
+
+    chunk->next = NULL;
+
+    chunk->len = n;
+
+    pthread_mutex_lock(&broadcast->lock);
+
+    chunk->refs = broadcast->live;
+
+    for(i=0; i < run->count; i++)
+    {
+      if(!run->receivers[i].done && (run->receivers[i].chunk == NULL))
+      {
+        run->receivers[i].chunk = chunk;
+
+        run->receivers[i].offset = 0;
+      }
+    }
+
+    if(broadcast->tail != NULL)
+    {
+      broadcast->tail->next = chunk;
+    }
+    else
+    {
+      broadcast->head = chunk;
+    }
+
+    broadcast->tail = chunk;
+
+    broadcast->buffered += n;
+
+    pthread_cond_broadcast(&broadcast->ready);
+
+    pthread_mutex_unlock(&broadcast->lock);
+  }
+
+
+  for(i=0; i < run->count; i++)
+  {
+    if(run->receivers[i].started)
+    {
+      pthread_join(run->receivers[i].thread, NULL);
+    }
+  }
+
+
+  return NULL;
+}
+
+
+static int broadcast_device_cmp(const void *a, const void *b)
+{
+  const mtp_device_t *da = *(mtp_device_t * const *)a;
+
+  const mtp_device_t *db = *(mtp_device_t * const *)b;
+
+
+  if(da < db) return -1;
+
+  if(da > db) return 1;
+
+
+  return 0;
+}
+
+
+/*
+ *  call-seq:
+ *     LibMTP::broadcast(devices, pathname, file) -> Array of object IDs
+ *     LibMTP::broadcast(devices, pathname, file, window: 16777216) -> Array of object IDs
+ *
+ *  Sends the file specified by <i>pathname</i> to every device in the array <i>devices</i> with the metadata
+ *  specified by the LibMTP::File object <i>file</i>.  The file is read once and sent to all devices at the
+ *  same time, each device on its own native thread.
+ *
+ *  Data that has been read is kept until every device has sent it.  A device may run ahead of the slowest
+ *  device by at most <i>window</i> bytes before it waits; a device that fails is dropped and does not hold
+ *  up the others.
+ *
+ *  If <i>file</i> contains a hash, a LibMTP::File object will be created from the hash data.
+ *
+ *  Returns an array with the ID of the new object on each device, in the order of <i>devices</i>, or nil
+ *  for every device the file could not be sent to.
+ *
+ *  Wraps: <i>LIBMTP_Send_File_From_Handler</i>
+ *
+ */
+
+static VALUE mtp_broadcast(int argc, VALUE *argv, VALUE self)
+{
+  mtp_broadcast_t broadcast;
+
+  mtp_broadcast_run_t run;
+
+  mtp_receiver_t *receivers;
+
+  mtp_device_t **sorted;
+
+  LIBMTP_file_t *file_ptr;
+
+  struct stat st;
+
+  char *path_ptr;
+
+  VALUE devices, pathname, file, opts, window, path;
+
+  VALUE array, receivers_store, sorted_store;
+
+  long i, count;
+
+
+  rb_scan_args(argc, argv, "31", &devices, &pathname, &file, &opts);
+
+  Check_Type(devices, T_ARRAY);
+
+  path = StringValue(pathname);
+
+  /* a hash becomes a new LibMTP::File, which must outlive file_ptr */
+  file = Get_LibMTP_File(file);
+
+  Data_Get_Struct(file, LIBMTP_file_t, file_ptr);
+
+  memset(&broadcast, 0, sizeof(broadcast));
+
+  broadcast.window = BROADCAST_WINDOW;
+
+  window = mtp_option(opts, "window");
+
+  if(!NIL_P(window))
+  {
+    broadcast.window = NUM2SIZET(window);
+  }
+
+  /* the reader always needs room for one chunk */
+  if(broadcast.window < BROADCAST_CHUNK_SIZE)
+  {
+    broadcast.window = BROADCAST_CHUNK_SIZE;
+  }
+
+  count = RARRAY_LEN(devices);
+
+  /* freed by the GC should a conversion or a wait for a device raise */
+  receivers = ALLOCV_N(mtp_receiver_t, receivers_store, count + 1);
+
+  sorted = ALLOCV_N(mtp_device_t *, sorted_store, count + 1);
+
+  memset(receivers, 0, sizeof(mtp_receiver_t) * count);
+
+  for(i=0; i < count; i++)
+  {
+    receivers[i].broadcast = &broadcast;
+
+    receivers[i].device = sorted[i] = Get_MTP_Device(rb_ary_entry(devices, i));
+  }
+
+  qsort(sorted, count, sizeof(mtp_device_t *), broadcast_device_cmp);
+
+  for(i=1; i < count; i++)
+  {
+    if(sorted[i] == sorted[i - 1])
+    {
+      rb_raise(rb_eArgError, "Each device may only appear once");
+    }
+  }
+
+  path_ptr = StringValueCStr(path);
+
+
+  /* lock in a fixed order so that overlapping broadcasts and copies cannot deadlock */
+  mtp_device_lock_all(sorted, count);
+
+  run.fd = open(path_ptr, O_RDONLY);
+
+  if((run.fd < 0) || (fstat(run.fd, &st) != 0))
+  {
+    if(run.fd >= 0) close(run.fd);
+
+    for(i=count - 1; i >= 0; i--)
+    {
+      mtp_device_unlock(sorted[i]);
+    }
+
+    rb_raise(rb_eIOError, "Unable to open file");
+  }
+
+  for(i=0; i < count; i++)
+  {
+    receivers[i].file = LIBMTP_new_file_t();
+
+    if(file_ptr->filename != NULL)
+    {
+      receivers[i].file->filename = strdup(file_ptr->filename);
+    }
+
+    receivers[i].file->filesize = st.st_size;
+
+    receivers[i].file->filetype = file_ptr->filetype;
+
+    receivers[i].file->parent_id = file_ptr->parent_id;
+
+    receivers[i].file->storage_id = file_ptr->storage_id;
+  }
+
+  RB_GC_GUARD(file);
+
+  pthread_mutex_init(&broadcast.lock, NULL);
+
+  pthread_cond_init(&broadcast.ready, NULL);
+
+  pthread_cond_init(&broadcast.room, NULL);
+
+  broadcast.live = count;
+
+  run.broadcast = &broadcast;
+
+  run.receivers = receivers;
+
+  run.count = count;
+
+
+  mtp_without_gvl(broadcast_run, &run);
+
+  for(i=count - 1; i >= 0; i--)
+  {
+    mtp_device_unlock(sorted[i]);
+  }
+
+
+  close(run.fd);
+
+  pthread_cond_destroy(&broadcast.room);
+
+  pthread_cond_destroy(&broadcast.ready);
+
+  pthread_mutex_destroy(&broadcast.lock);
+
+
+  array = rb_ary_new2(count);
+
+  for(i=0; i < count; i++)
+  {
+    if((receivers[i].status == 0) && !broadcast.failed)
+    {
+      rb_ary_push(array, UINT2NUM(receivers[i].file->item_id));
+    }
+    else
+    {
+      rb_ary_push(array, Qnil);
+    }
+
+    LIBMTP_destroy_file_t(receivers[i].file);
+  }
+
+  ALLOCV_END(sorted_store);
+
+  ALLOCV_END(receivers_store);
+
+
+  return array;
+}
+
+
+void Init_LibMTP_Broadcast(void)
+{
+  rb_define_module_function(mLibMTP, "broadcast", mtp_broadcast, -1);
+
+
+  return;
+}
@@ -0,0 +1,458 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include "mtp_proto.h"
+
+
+#define COPY_RING_SIZE (4 * 1024 * 1024)
+
+
+/*
+ * A bounded ring between the thread reading from the source device and the
+ * thread sending to the destination.  Whichever side is faster blocks on the
+ * ring, so both USB links run at the speed of the slower one.
+ */
+
+typedef struct mtp_ring_s
+{
+  unsigned char *data;
+
+  size_t size;
+
+  size_t head;
+
+  size_t count;
+
+  int eof;
+
+  int failed;
+
+  int aborted;
+
+  pthread_mutex_t lock;
+
+  pthread_cond_t readable;
+
+  pthread_cond_t writable;
+} mtp_ring_t;
+
+
+typedef struct mtp_copy_s
+{
+  mtp_device_t *src;
+
+  mtp_device_t *dst;
+
+  uint32_t id;
+
+  LIBMTP_file_t *file;
+
+  mtp_ring_t ring;
+
+  int get_status;
+
+  int send_status;
+} mtp_copy_t;
+
+
+static int ring_init(mtp_ring_t *ring, size_t size)
+{
+  memset(ring, 0, sizeof(mtp_ring_t));
+
+  ring->data = (unsigned char *)malloc(size);
+
+  if(ring->data == NULL)
+  {
+    return -1;
+  }
+
+  ring->size = size;
+
+  pthread_mutex_init(&ring->lock, NULL);
+
+  pthread_cond_init(&ring->readable, NULL);
+
+  pthread_cond_init(&ring->writable, NULL);
+
+
+  return 0;
+}
+
+
+static void ring_destroy(mtp_ring_t *ring)
+{
+  pthread_cond_destroy(&ring->writable);
+
+  pthread_cond_destroy(&ring->readable);
+
+  pthread_mutex_destroy(&ring->lock);
+
+  free(ring->data);
+
+
+  return;
+}
+
+
+/*
+ * Marks the producer side finished; <i>failed</i> tells the consumer that no
+ * more data will come even though the object was not fully read.
+ */
+
+static void ring_close(mtp_ring_t *ring, int failed)
+{
+  pthread_mutex_lock(&ring->lock);
+
+  ring->eof = 1;
+
+  ring->failed = failed;
+
+  pthread_cond_broadcast(&ring->readable);
+
+  pthread_mutex_unlock(&ring->lock);
+
+
+  return;
+}
+
+
+static void ring_abort(mtp_ring_t *ring)
+{
+  pthread_mutex_lock(&ring->lock);
+
+  ring->aborted = 1;
+
+  pthread_cond_broadcast(&ring->writable);
+
+  pthread_mutex_unlock(&ring->lock);
+
+
+  return;
+}
+
+
+/*
+ * Data handler for the source device: blocks while the ring is full.
+ */
+
+static uint16_t copy_put(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen)
+{
+  mtp_ring_t *ring = (mtp_ring_t *)priv;
+
+  size_t done = 0;
+
+  size_t tail, n;
+
+
+  pthread_mutex_lock(&ring->lock);
+
+  while(done < sendlen)
+  {
+    while((ring->count == ring->size) && !ring->aborted)
+    {
+      pthread_cond_wait(&ring->writable, &ring->lock);
+    }
+
+    if(ring->aborted)
+    {
+      pthread_mutex_unlock(&ring->lock);
+
+      return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+
+    tail = (ring->head + ring->count) % ring->size;
+
+    n = ring->size - ring->count;
+
+    if(n > ring->size - tail) n = ring->size - tail;
+
+    if(n > sendlen - done) n = sendlen - done;
+
+    memcpy(ring->data + tail, data + done, n);
+
+    ring->count += n;
+
+    done += n;
+
+    pthread_cond_signal(&ring->readable);
+  }
+
+  pthread_mutex_unlock(&ring->lock);
+
+  *putlen = sendlen;
+
+
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+
+/*
+ * Data handler for the destination device: blocks until the ring holds data.
+ * libmtp accepts short reads, so whatever is buffered is handed over at once.
+ */
+
+static uint16_t copy_get(void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen)
+{
+  mtp_ring_t *ring = (mtp_ring_t *)priv;
+
+  size_t done = 0;
+
+  size_t n;
+
+
+  pthread_mutex_lock(&ring->lock);
+
+  while((ring->count == 0) && !ring->eof)
+  {
+    pthread_cond_wait(&ring->readable, &ring->lock);
+  }
+
+  if(ring->count == 0)
+  {
+    /* the source ended early or failed */
+    pthread_mutex_unlock(&ring->lock);
+
+    return LIBMTP_HANDLER_RETURN_ERROR;
+  }
+
+  while((done < wantlen) && (ring->count > 0))
+  {
+    n = ring->size - ring->head;
+
+    if(n > ring->count) n = ring->count;
+
+    if(n > wantlen - done) n = wantlen - done;
+
+    memcpy(data + done, ring->data + ring->head, n);
+
+    ring->head = (ring->head + n) % ring->size;
+
+    ring->count -= n;
+
+    done += n;
+  }
+
+  pthread_cond_signal(&ring->writable);
+
+  pthread_mutex_unlock(&ring->lock);
+
+  *gotlen = done;
+
+
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+
+static void *copy_reader(void *ptr)
+{
+  mtp_copy_t *copy = (mtp_copy_t *)ptr;
+
+
+  copy->get_status = LIBMTP_Get_File_To_Handler(copy->src->device, copy->id, copy_put, &copy->ring, NULL, NULL);
+
+  ring_close(&copy->ring, copy->get_status != 0);
+
+
+  return NULL;
+}
+
+
+/*
+ * Runs without the GVL: sends on the calling thread while a second native
+ * thread reads, then waits for the reader.
+ */
+
+static void *copy_run(void *ptr)
+{
+  mtp_copy_t *copy = (mtp_copy_t *)ptr;
+
+  pthread_t reader;
+
+
+  if(pthread_create(&reader, NULL, copy_reader, copy) != 0)
+  {
+    copy->get_status = copy->send_status = -1;
+
+    return NULL;
+  }
+
+  copy->send_status = LIBMTP_Send_File_From_Handler(copy->dst->device, copy_get, &copy->ring, copy->file, NULL, NULL);
+
+  /* the send takes no more than the file size, so a source that delivers
+     more would block forever on a full ring; release it either way */
+  ring_abort(&copy->ring);
+
+  pthread_join(reader, NULL);
+
+
+  return NULL;
+}
+
+
+/*
+ *  call-seq:
+ *     LibMTP::copy(src_device, id, dst_device, parent) -> object ID
+ *     LibMTP::copy(src_device, id, dst_device, parent, buffer_size: 4194304) -> object ID
+ *
+ *  Copies the file with the specified ID from <i>src_device</i> to <i>dst_device</i> as a child of
+ *  the object with the ID <i>parent</i>, without a temporary file.  The file is read from the source
+ *  and sent to the destination at the same time, through a buffer of <i>buffer_size</i> bytes, so
+ *  both devices transfer at the speed of the slower one.  Other Ruby threads keep running meanwhile.
+ *
+ *  The file name and type are taken from the source.  Returns the ID of the new object.
+ *
+ *  Wraps: <i>LIBMTP_Get_File_To_Handler</i>, <i>LIBMTP_Send_File_From_Handler</i>
+ *
+ */
+
+static VALUE mtp_copy_file(int argc, VALUE *argv, VALUE self)
+{
+  mtp_copy_t copy;
+
+  mtp_device_t *first, *second;
+
+  mtp_device_t *devices[2];
+
+  LIBMTP_file_t *src_file;
+
+  VALUE src, id, dst, parent, opts, buffer_size;
+
+  size_t size = COPY_RING_SIZE;
+
+  uint32_t parent_id;
+
+
+  rb_scan_args(argc, argv, "41", &src, &id, &dst, &parent, &opts);
+
+  memset(&copy, 0, sizeof(copy));
+
+  copy.src = Get_MTP_Device(src);
+
+  copy.dst = Get_MTP_Device(dst);
+
+  copy.id = NUM2UINT(id);
+
+  parent_id = NUM2UINT(parent);
+
+  if(copy.src == copy.dst)
+  {
+    rb_raise(rb_eArgError, "Source and destination must be different devices");
+  }
+
+  buffer_size = mtp_option(opts, "buffer_size");
+
+  if(!NIL_P(buffer_size))
+  {
+    size = NUM2SIZET(buffer_size);
+
+    if(size == 0)
+    {
+      rb_raise(rb_eArgError, "buffer_size must be positive");
+    }
+  }
+
+
+  /* lock in a fixed order so that copies in opposite directions cannot deadlock */
+  first = (copy.src < copy.dst) ? copy.src : copy.dst;
+
+  second = (copy.src < copy.dst) ? copy.dst : copy.src;
+
+  devices[0] = first;
+
+  devices[1] = second;
+
+  mtp_device_lock_all(devices, 2);
+
+
+  src_file = LIBMTP_Get_Filemetadata(copy.src->device, copy.id);
+
+  if((src_file == NULL) || (ring_init(&copy.ring, size) != 0))
+  {
+    mtp_device_unlock(second);
+
+    mtp_device_unlock(first);
+
+    if(src_file == NULL)
+    {
+      rb_raise(rb_eIOError, "Unable to get file metadata");
+    }
+
+    LIBMTP_destroy_file_t(src_file);
+
+    rb_raise(rb_eNoMemError, "Unable to allocate copy buffer");
+  }
+
+  copy.file = LIBMTP_new_file_t();
+
+  copy.file->filename = (src_file->filename != NULL) ? strdup(src_file->filename) : NULL;
+
+  copy.file->filesize = src_file->filesize;
+
+  copy.file->filetype = src_file->filetype;
+
+  copy.file->parent_id = parent_id;
+
+  LIBMTP_destroy_file_t(src_file);
+
+
+  mtp_without_gvl(copy_run, &copy);
+
+
+  mtp_device_unlock(second);
+
+  mtp_device_unlock(first);
+
+  ring_destroy(&copy.ring);
+
+  id = UINT2NUM(copy.file->item_id);
+
+  LIBMTP_destroy_file_t(copy.file);
+
+
+  if((copy.get_status != 0) || (copy.send_status != 0))
+  {
+    rb_raise(rb_eIOError, "Unable to copy file");
+  }
+
+
+  return id;
+}
+
+
+void Init_LibMTP_Copy(void)
+{
+  rb_define_module_function(mLibMTP, "copy", mtp_copy_file, -1);
+
+
+  return;
+}
@@ -37,15 +37,40 @@
 static VALUE cMTPDevice;
 
 
-static void device_free(void *device)
+static void device_free(void *ptr)
 {
-  LIBMTP_Release_Device((LIBMTP_mtpdevice_t *)device);
+  mtp_device_t *device = (mtp_device_t *)ptr;
+
+
+  mtp_async_stop(device);
+
+  mtp_events_stop(device);
+
+  LIBMTP_Release_Device(device->device);
+
+  mtp_device_destroy(device);
+
+  xfree(device);
 
 
   return;
 }
 
 
+static VALUE device_wrap(VALUE klass, LIBMTP_mtpdevice_t *device_ptr)
+{
+  mtp_device_t *device;
+
+
+  device = ALLOC(mtp_device_t);
+
+  mtp_device_init(device, device_ptr);
+
+
+  return Data_Wrap_Struct(klass, 0, device_free, device);
+}
+
+
 static VALUE device_alloc(VALUE klass)
 {
   LIBMTP_mtpdevice_t *device;
@@ -57,7 +82,7 @@ static VALUE device_alloc(VALUE klass)
 
   if(device != NULL)
   {
-    obj = Data_Wrap_Struct(klass, 0, device_free, device);
+    obj = device_wrap(klass, device);
   }
   else
   {
@@ -69,6 +94,60 @@ static VALUE device_alloc(VALUE klass)
 }
 
 
+/*
+ * Returns the wrapper of a LibMTP::Device object, raising TypeError for anything else.
+ */
+
+mtp_device_t *Get_MTP_Device(VALUE obj)
+{
+  mtp_device_t *device;
+
+
+  if(!RTEST(rb_obj_is_kind_of(obj, cMTPDevice)))
+  {
+    rb_raise(rb_eTypeError, "Expected a LibMTP::Device");
+  }
+
+  Data_Get_Struct(obj, mtp_device_t, device);
+
+
+  return device;
+}
+
+
+/*
+ * Locks the device of a LibMTP::Device object around a libmtp call.  Nothing
+ * that can raise may run between device_acquire() and device_release().
+ */
+
+static LIBMTP_mtpdevice_t *device_acquire(VALUE self)
+{
+  mtp_device_t *device;
+
+
+  Data_Get_Struct(self, mtp_device_t, device);
+
+  mtp_device_lock(device);
+
+
+  return device->device;
+}
+
+
+static void device_release(VALUE self)
+{
+  mtp_device_t *device;
+
+
+  Data_Get_Struct(self, mtp_device_t, device);
+
+  mtp_device_unlock(device);
+
+
+  return;
+}
+
+
 static VALUE device_init(VALUE self)
 {
   return self;
@@ -90,10 +169,12 @@ static VALUE device_dump(VALUE self)
   LIBMTP_mtpdevice_t *device;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   LIBMTP_Dump_Device_Info(device);
 
+  device_release(self);
+
 
   return self;
 }
@@ -114,10 +195,12 @@ static VALUE device_dump_errors(VALUE self)
   LIBMTP_mtpdevice_t *device;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   LIBMTP_Dump_Errorstack(device);
 
+  device_release(self);
+
 
   return self;
 }
@@ -138,10 +221,12 @@ static VALUE device_reset_errors(VALUE self)
   LIBMTP_mtpdevice_t *device;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   LIBMTP_Clear_Errorstack(device);
 
+  device_release(self);
+
 
   return self;
 }
@@ -164,10 +249,12 @@ static VALUE device_reset(VALUE self)
   int status;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   status = LIBMTP_Reset_Device(device);
 
+  device_release(self);
+
   if(status != 0)
   {
     rb_raise(rb_eIOError, "Unable to reset device");
@@ -197,10 +284,12 @@ static VALUE device_model_name(VALUE self)
   char *name_ptr;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   name_ptr = LIBMTP_Get_Modelname(device);
 
+  device_release(self);
+
   if(name_ptr != NULL)
   {
     name = rb_str_new2(name_ptr);
@@ -232,10 +321,12 @@ static VALUE device_serial_number(VALUE self)
   char *serial_number_ptr;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   serial_number_ptr = LIBMTP_Get_Serialnumber(device);
 
+  device_release(self);
+
   if(serial_number_ptr != NULL)
   {
     serial_number = rb_str_new2(serial_number_ptr);
@@ -267,10 +358,12 @@ static VALUE device_version(VALUE self)
   char *version_ptr;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   version_ptr = LIBMTP_Get_Deviceversion(device);
 
+  device_release(self);
+
   if(version_ptr != NULL)
   {
     version = rb_str_new2(version_ptr);
@@ -303,10 +396,12 @@ static VALUE device_friendly_name(VALUE self)
   char *name_ptr;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   name_ptr = LIBMTP_Get_Friendlyname(device);
 
+  device_release(self);
+
   if(name_ptr != NULL)
   {
     name = rb_str_new2(name_ptr);
@@ -346,11 +441,13 @@ static VALUE device_set_friendly_name(VALUE self, VALUE orig_name)
 
   if((name_ptr != NULL) && (RSTRING(name)->as.heap.len > 0))
   {
-    Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+    device = device_acquire(self);
 
 
     status = LIBMTP_Set_Friendlyname(device, name_ptr);
 
+    device_release(self);
+
     if(status != 0)
     {
       rb_raise(rb_eIOError, "Unable to set friendly name");
@@ -381,10 +478,12 @@ static VALUE device_sync_partner(VALUE self)
   char *sync_partner_ptr;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   sync_partner_ptr = LIBMTP_Get_Syncpartner(device);
 
+  device_release(self);
+
   if(sync_partner_ptr != NULL)
   {
     sync_partner = rb_str_new2(sync_partner_ptr);
@@ -424,11 +523,13 @@ static VALUE device_set_sync_partner(VALUE self, VALUE orig_sync_partner)
 
   if((sync_partner_ptr != NULL) && (RSTRING(sync_partner)->as.heap.len > 0))
   {
-    Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+    device = device_acquire(self);
 
 
     status = LIBMTP_Set_Syncpartner(device, sync_partner_ptr);
 
+    device_release(self);
+
     if(status != 0)
     {
       rb_raise(rb_eIOError, "Unable to set sync partner");
@@ -461,10 +562,12 @@ static VALUE device_battery_level(VALUE self)
   int status;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   status = LIBMTP_Get_Batterylevel(device, &max, &current);
 
+  device_release(self);
+
   if(status == 0)
   {
     hash = rb_hash_new();
@@ -504,10 +607,12 @@ static VALUE device_secure_time(VALUE self)
   int status;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   status = LIBMTP_Get_Secure_Time(device, &time_ptr);
 
+  device_release(self);
+
   if((status == 0) && (time_ptr != NULL))
   {
     time = rb_str_new2(time_ptr);
@@ -546,10 +651,12 @@ static VALUE device_certificate(VALUE self)
   int status;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   status = LIBMTP_Get_Device_Certificate(device, &certificate_ptr);
 
+  device_release(self);
+
   if((status == 0) && (certificate_ptr != NULL))
   {
     certificate = rb_str_new2(certificate_ptr);
@@ -593,10 +700,12 @@ static VALUE device_supported_filetypes(VALUE self)
   int i;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
   status = LIBMTP_Get_Supported_Filetypes(device, &filetypes_ptr, &filetypes_length);
 
+  device_release(self);
+
   if((status == 0) && (filetypes_ptr != NULL) && (filetypes_length > 0))
   {
     filetypes = rb_ary_new();
@@ -642,12 +751,14 @@ static VALUE device_storage(VALUE self, VALUE sort_by)
 
   VALUE array = rb_ary_new();
 
+  int sort = FIX2INT(sort_by);
+
   int status;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  device = device_acquire(self);
 
-  status = LIBMTP_Get_Storage(device, FIX2INT(sort_by));
+  status = LIBMTP_Get_Storage(device, sort);
 
   if(status == 0)
   {
@@ -659,9 +770,14 @@ static VALUE device_storage(VALUE self, VALUE sort_by)
 
       current = current->next;
     }
+
+    device_release(self);
   }
   else
   {
+    device_release(self);
+
+
     rb_raise(rb_eIOError, "Unable to get storage list");
   }
 
@@ -687,10 +803,19 @@ static VALUE device_delete_object(VALUE self, VALUE id)
 
   int status;
 
+  uint32_t object_id = NUM2UINT(id);
+
+
+  if(mtp_async_nonblocking())
+  {
+    return mtp_async_call(self, "delete_object", 1, &id);
+  }
+
+  device = device_acquire(self);
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device);
+  status = LIBMTP_Delete_Object(device, object_id);
 
-  status = LIBMTP_Delete_Object(device, NUM2UINT(id));
+  device_release(self);
 
   if(status != 0)
   {
@@ -720,10 +845,19 @@ static VALUE device_album_get(VALUE self, VALUE id)
 
   VALUE obj = Qnil;
 
+  uint32_t object_id = NUM2UINT(id);
+
+
+  if(mtp_async_nonblocking())
+  {
+    return mtp_async_call(self, "album_get", 1, &id);
+  }
+
+  device_ptr = device_acquire(self);
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  album_ptr = LIBMTP_Get_Album(device_ptr, object_id);
 
-  album_ptr = LIBMTP_Get_Album(device_ptr, NUM2UINT(id));
+  device_release(self);
 
   if(album_ptr != NULL)
   {
@@ -760,10 +894,17 @@ static VALUE device_album_list(VALUE self)
   VALUE array = rb_ary_new();
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  if(mtp_async_nonblocking())
+  {
+    return mtp_async_call(self, "album_list", 0, NULL);
+  }
+
+  device_ptr = device_acquire(self);
 
   album_ptr = LIBMTP_Get_Album_List(device_ptr);
 
+  device_release(self);
+
   if(album_ptr != NULL)
   {
     current = album_ptr;
@@ -804,12 +945,14 @@ static VALUE device_album_create(VALUE self, VALUE parent, VALUE album)
   int status;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
-
   Data_Get_Struct(album, LIBMTP_album_t, album_ptr);
 
+  device_ptr = device_acquire(self);
+
   status = LIBMTP_Create_New_Album(device_ptr, album_ptr);
 
+  device_release(self);
+
   if(status != 0)
   {
     rb_raise(rb_eIOError, "Unable to create album");
@@ -839,12 +982,14 @@ static VALUE device_album_update(VALUE self, VALUE album)
   int status;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
-
   Data_Get_Struct(album, LIBMTP_album_t, album_ptr);
 
+  device_ptr = device_acquire(self);
+
   status = LIBMTP_Update_Album(device_ptr, album_ptr);
 
+  device_release(self);
+
   if(status != 0)
   {
     rb_raise(rb_eIOError, "Unable to send album");
@@ -873,10 +1018,19 @@ static VALUE device_file_info_get(VALUE self, VALUE id)
 
   VALUE obj = Qnil;
 
+  uint32_t object_id = NUM2UINT(id);
+
+
+  if(mtp_async_nonblocking())
+  {
+    return mtp_async_call(self, "file_info_get", 1, &id);
+  }
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  device_ptr = device_acquire(self);
 
-  file_ptr = LIBMTP_Get_Filemetadata(device_ptr, NUM2UINT(id));
+  file_ptr = LIBMTP_Get_Filemetadata(device_ptr, object_id);
+
+  device_release(self);
 
   if(file_ptr != NULL)
   {
@@ -913,10 +1067,17 @@ static VALUE device_file_info_list(VALUE self)
   VALUE array = rb_ary_new();
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  if(mtp_async_nonblocking())
+  {
+    return mtp_async_call(self, "file_info_list", 0, NULL);
+  }
+
+  device_ptr = device_acquire(self);
 
   file_ptr = LIBMTP_Get_Filelisting_With_Callback(device_ptr, NULL, NULL);
 
+  device_release(self);
+
   if(file_ptr != NULL)
   {
     current = file_ptr;
@@ -941,83 +1102,363 @@ static VALUE device_file_info_list(VALUE self)
 /*
  *  call-seq:
  *     device.file_get(id, pathname) -> device
+ *     device.file_get(id, pathname, digest: :sha256) -> digest string
+ *     device.file_get(id, pathname, preallocate: true, direct: true, dontneed: true) -> device
  *
  *  Retrieves the file with the specified file ID and writes it to the specified path.
  *
- *  Wraps: <i>LIBMTP_Get_File_To_File</i>
+ *  When a <i>digest</i> of :sha256, :crc32c or :xxh3 is given, the digest is computed
+ *  from the data as it is received and returned as a hex string.
+ *
+ *  For large downloads the local file can be written without thrashing the page cache:
+ *
+ *  preallocate     =>    true to reserve the object's size up front, or a size in bytes
+ *
+ *  direct          =>    write with O_DIRECT where the filesystem supports it
+ *
+ *  dontneed        =>    drop written data from the page cache as the download proceeds
+ *
+ *  Wraps: <i>LIBMTP_Get_File_To_File</i>, <i>LIBMTP_Get_File_To_Handler</i>
  *
  */
 
-static VALUE device_file_get(VALUE self, VALUE id, VALUE pathname)
+static VALUE device_file_get(int argc, VALUE *argv, VALUE self)
 {
   LIBMTP_mtpdevice_t *device_ptr;
 
+  VALUE id, pathname, opts;
+
+  VALUE result = self;
+
   VALUE path;
 
+  uint32_t object_id;
+
+  char *path_ptr;
+
   int status;
 
 
+  rb_scan_args(argc, argv, "21", &id, &pathname, &opts);
+
   path = StringValue(pathname);
 
-  if((RSTRING(path)->as.heap.ptr != NULL) && (RSTRING(path)->as.heap.len > 0))
+  if((RSTRING_PTR(path) != NULL) && (RSTRING_LEN(path) > 0))
   {
-    Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+    object_id = NUM2UINT(id);
 
-    status = LIBMTP_Get_File_To_File(device_ptr, NUM2UINT(id), RSTRING(path)->as.heap.ptr, NULL, NULL);
+    path_ptr = StringValueCStr(path);
 
-    if(status != 0)
+    /* bulk downloads go through the handler so that they can be preempted */
+    if(NIL_P(opts) && (mtp_priority(MTP_PRIORITY_NORMAL) != MTP_PRIORITY_BULK))
     {
-      rb_raise(rb_eIOError, "Unable to retrieve file");
+      if(mtp_async_nonblocking())
+      {
+        return mtp_async_call(self, "file_get", 2, argv);
+      }
+
+      device_ptr = device_acquire(self);
+
+      status = LIBMTP_Get_File_To_File(device_ptr, object_id, path_ptr, NULL, NULL);
+
+      device_release(self);
+
+      if(status != 0)
+      {
+        rb_raise(rb_eIOError, "Unable to retrieve file");
+      }
+    }
+    else
+    {
+      result = mtp_transfer_to_file(Get_MTP_Device(self), object_id, path_ptr, opts, MTP_TRANSFER_FILE);
+
+      if(NIL_P(result)) result = self;
     }
   }
 
 
-  return self;
+  return result;
 }
 
 
 /*
  *  call-seq:
- *     device.file_send(parent, pathname, file) -> device
+ *     device.file_send(parent, pathname, file) -> object ID
+ *     device.file_send(parent, pathname, file, digest: :sha256) -> digest string
+ *     device.file_send(0, pathname, file, placement: :most_free) -> object ID
  *
  *  Sends the file specified by <i>pathname</i> to an MTP device with the metadata specified by the LibMTP::File
- *  object <i>file</i>.  The file will be a child of the object with the given ID specifed by <i>parent</i>.
+ *  object <i>file</i>.  The file will be a child of the object with the given ID specifed by <i>parent</i>, 0
+ *  for the root, on the storage given by the storage_id of <i>file</i> (0 for the default storage).
+ *  Returns the ID of the new object, which is also set as the file_id of <i>file</i>.
+ *
+ *  With a <i>placement</i> the storage is chosen per file among those that are writable and have room:
+ *  :most_free picks the one with the most free space, :round_robin the next one after the storage used last,
+ *  and :fill_first the first one in the device's order.  The choice uses the free space cached with the
+ *  storage list and deducts each upload from it, so a batch of uploads does not query the storages again;
+ *  Device#storage refreshes it.  The chosen storage is set as the storage_id of <i>file</i>.  As a folder
+ *  belongs to one storage, <i>parent</i> must be 0 with a placement; raises ArgumentError otherwise.  Raises
+ *  IOError when no storage has room.
  *
  *  If <i>file</i> contains a hash, a LibMTP::File object will be created from the hash data.
  *
- *  Wraps: <i>LIBMTP_Send_File_From_File</i>
+ *  When a <i>digest</i> of :sha256, :crc32c or :xxh3 is given, the digest is computed
+ *  from the data as it is sent and returned as a hex string.
+ *
+ *  Wraps: <i>LIBMTP_Send_File_From_File</i>, <i>LIBMTP_Send_File_From_Handler</i>
  *
  */
 
-static VALUE device_file_send(VALUE self, VALUE parent, VALUE pathname, VALUE file)
+static VALUE device_file_send(int argc, VALUE *argv, VALUE self)
 {
   LIBMTP_mtpdevice_t *device_ptr;
 
   LIBMTP_file_t *file_ptr;
 
+  VALUE parent, pathname, file, opts;
+
+  VALUE result = self;
+
   VALUE path;
 
+  char *path_ptr;
+
   int status;
 
 
+  rb_scan_args(argc, argv, "31", &parent, &pathname, &file, &opts);
+
   path = StringValue(pathname);
 
-  if((RSTRING(path)->as.heap.ptr != NULL) && (RSTRING(path)->as.heap.len > 0))
+  if((RSTRING_PTR(path) != NULL) && (RSTRING_LEN(path) > 0))
   {
-    Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
-
     Data_Get_Struct(Get_LibMTP_File(file), LIBMTP_file_t, file_ptr);
 
-    status = LIBMTP_Send_File_From_File(device_ptr, RSTRING(path)->as.heap.ptr, file_ptr, NULL, NULL);
+    path_ptr = StringValueCStr(path);
 
-    if(status != 0)
+    file_ptr->parent_id = NUM2UINT(parent);
+
+    if(NIL_P(opts))
     {
-      rb_raise(rb_eIOError, "Unable to send file");
+      if(mtp_async_nonblocking())
+      {
+        return mtp_async_call(self, "file_send", 3, argv);
+      }
+
+      device_ptr = device_acquire(self);
+
+      status = LIBMTP_Send_File_From_File(device_ptr, path_ptr, file_ptr, NULL, NULL);
+
+      device_release(self);
+
+      if(status != 0)
+      {
+        rb_raise(rb_eIOError, "Unable to send file");
+      }
+
+      result = UINT2NUM(file_ptr->item_id);
+    }
+    else
+    {
+      result = mtp_transfer_from_file(Get_MTP_Device(self), path_ptr, file_ptr, opts, MTP_TRANSFER_FILE);
+
+      if(NIL_P(result)) result = UINT2NUM(file_ptr->item_id);
     }
   }
 
 
-  return self;
+  return result;
+}
+
+
+/*
+ *  call-seq:
+ *     device.file_stream(id) { |chunk| ... } -> device
+ *     device.file_stream(id, buffer: true, chunk_size: 1048576) { |chunk| ... } -> device
+ *
+ *  Retrieves the file with the specified file ID and yields its data in chunks of
+ *  <i>chunk_size</i> bytes instead of writing it to a local file.  Chunks are yielded as strings.
+ *
+ *  With <i>buffer</i> set, each chunk is a read-only IO::Buffer over a native buffer that is reused
+ *  for every chunk, so no object is allocated per chunk.  A chunk is only valid inside the block: its
+ *  contents change with the next chunk and it is freed when the download ends.
+ *
+ *  A <i>digest</i> option returns the digest of the data instead of the device (see Device#file_get).
+ *
+ *  The block runs while the device is in the middle of the transfer, so it may not use the device;
+ *  doing so raises RuntimeError.
+ *
+ *  Wraps: <i>LIBMTP_Get_File_To_Handler</i>
+ *
+ */
+
+static VALUE device_file_stream(int argc, VALUE *argv, VALUE self)
+{
+  VALUE id, opts;
+
+  VALUE result;
+
+
+  rb_scan_args(argc, argv, "11", &id, &opts);
+
+  rb_need_block();
+
+  result = mtp_transfer_stream(Get_MTP_Device(self), NUM2UINT(id), opts);
+
+
+  return (NIL_P(result) ? self : result);
+}
+
+
+/*
+ *  call-seq:
+ *     device.file_get_batch(list) -> Array of true or false
+ *     device.file_get_batch(list, backend: :io_uring) -> Array of true or false
+ *
+ *  Retrieves many files in one call.  <i>list</i> is an array of [id, pathname] pairs or a hash of
+ *  id => pathname.  Each file is read into memory and written out while the next file is retrieved.
+ *  The returned array holds true for every file that was written and false for every file that
+ *  could not be retrieved or written, in the order of <i>list</i>.
+ *
+ *  The <i>backend</i> option selects how the local files are written.  With :io_uring the open, write
+ *  and close of each file are submitted asynchronously; with :threads they are handed to a pool of
+ *  writer threads; with :pwrite each file is written before the next one is retrieved.  By default
+ *  io_uring is used when it is available, and the thread pool otherwise.
+ *
+ *  Wraps: <i>LIBMTP_Get_File_To_Handler</i>
+ *
+ */
+
+typedef struct mtp_get_batch_s
+{
+  mtp_device_t *device;
+
+  mtp_writer_t *writer;
+
+  uint32_t *ids;
+
+  VALUE paths;
+
+  int *status;
+
+  long count;
+} mtp_get_batch_t;
+
+
+static VALUE file_get_batch_body(VALUE ptr)
+{
+  mtp_get_batch_t *batch = (mtp_get_batch_t *)ptr;
+
+  VALUE array;
+
+  long i;
+
+  int state;
+
+
+  for(i=0; i < batch->count; i++)
+  {
+    state = mtp_writer_get_file(batch->writer, batch->device, batch->ids[i], RSTRING_PTR(RARRAY_PTR(batch->paths)[i]), &batch->status[i]);
+
+    /* the ensure waits for the writes in flight */
+    if(state != 0) rb_jump_tag(state);
+  }
+
+  mtp_writer_finish(batch->writer);
+
+
+  array = rb_ary_new2(batch->count);
+
+  for(i=0; i < batch->count; i++)
+  {
+    rb_ary_push(array, (batch->status[i] == 0) ? Qtrue : Qfalse);
+  }
+
+
+  return array;
+}
+
+
+static VALUE file_get_batch_ensure(VALUE ptr)
+{
+  mtp_get_batch_t *batch = (mtp_get_batch_t *)ptr;
+
+
+  mtp_writer_free(batch->writer);
+
+
+  return Qnil;
+}
+
+
+static VALUE device_file_get_batch(int argc, VALUE *argv, VALUE self)
+{
+  mtp_get_batch_t batch;
+
+  VALUE list, opts, entry, path, result, ids_store, status_store;
+
+  int kind;
+
+  long i;
+
+
+  rb_scan_args(argc, argv, "11", &list, &opts);
+
+  if(TYPE(list) == T_HASH)
+  {
+    list = rb_funcall(list, rb_intern("to_a"), 0);
+  }
+
+  Check_Type(list, T_ARRAY);
+
+
+  kind = mtp_writer_option(opts);
+
+
+  batch.device = Get_MTP_Device(self);
+
+  batch.count = RARRAY_LEN(list);
+
+  batch.paths = rb_ary_new2(batch.count);
+
+  /* freed by the GC should an entry fail to convert */
+  batch.ids = ALLOCV_N(uint32_t, ids_store, batch.count + 1);
+
+  batch.status = ALLOCV_N(int, status_store, batch.count + 1);
+
+  for(i=0; i < batch.count; i++)
+  {
+    entry = rb_check_array_type(rb_ary_entry(list, i));
+
+    if(NIL_P(entry) || (RARRAY_LEN(entry) != 2))
+    {
+      rb_raise(rb_eTypeError, "file_get_batch expects [id, pathname] pairs");
+    }
+
+    batch.ids[i] = NUM2UINT(RARRAY_PTR(entry)[0]);
+
+    path = RARRAY_PTR(entry)[1];
+
+    StringValueCStr(path);
+
+    rb_ary_push(batch.paths, rb_str_new_frozen(path));
+  }
+
+  batch.writer = mtp_writer_new(kind);
+
+  if(batch.writer == NULL)
+  {
+    rb_raise(rb_eNoMemError, "Unable to allocate batch writer");
+  }
+
+  result = rb_ensure(file_get_batch_body, (VALUE)&batch, file_get_batch_ensure, (VALUE)&batch);
+
+  ALLOCV_END(status_store);
+
+  ALLOCV_END(ids_store);
+
+
+  return result;
 }
 
 
@@ -1042,10 +1483,17 @@ static VALUE device_folder_list(VALUE self)
   VALUE array = rb_ary_new();
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  if(mtp_async_nonblocking())
+  {
+    return mtp_async_call(self, "folder_list", 0, NULL);
+  }
+
+  device_ptr = device_acquire(self);
 
   folder_ptr = LIBMTP_Get_Folder_List(device_ptr);
 
+  device_release(self);
+
   if(folder_ptr != NULL)
   {
     current = folder_ptr;
@@ -1070,8 +1518,10 @@ static VALUE device_folder_list(VALUE self)
 /*
  *  call-seq:
  *     device.folder_create(parent, name) -> folder ID
+ *     device.folder_create(parent, name, storage_id) -> folder ID
  *
- *  Creates a folder with the specified name and parent ID on an MTP device.
+ *  Creates a folder with the specified name in the folder <i>parent</i> (0 for the root) of the storage
+ *  <i>storage_id</i> (0 for the default storage) on an MTP device.  Device#upload_tree creates a whole tree.
  *
  *  Returns the folder ID of the created folder.
  *
@@ -1079,24 +1529,32 @@ static VALUE device_folder_list(VALUE self)
  *
  */
 
-static VALUE device_folder_create(VALUE self, VALUE parent, VALUE name)
+static VALUE device_folder_create(int argc, VALUE *argv, VALUE self)
 {
   LIBMTP_mtpdevice_t *device_ptr;
 
   VALUE folder = Qnil;
 
-  VALUE string;
+  VALUE parent, name, storage, string;
+
+  uint32_t id, parent_id, storage_id;
+
 
-  uint32_t id;
+  rb_scan_args(argc, argv, "21", &parent, &name, &storage);
 
+  parent_id = NUM2UINT(parent);
+
+  storage_id = NIL_P(storage) ? 0 : NUM2UINT(storage);
 
   string = StringValue(name);
 
   if((RSTRING(string)->as.heap.ptr != NULL) && (RSTRING(string)->as.heap.len > 0))
   {
-    Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+    device_ptr = device_acquire(self);
+
+    id = LIBMTP_Create_Folder(device_ptr, RSTRING(string)->as.heap.ptr, parent_id, storage_id);
 
-    id = LIBMTP_Create_Folder(device_ptr, RSTRING(string)->as.heap.ptr,0,0);
+    device_release(self);
 
 
     if(id != 0)
@@ -1132,10 +1590,19 @@ static VALUE device_playlist_get(VALUE self, VALUE id)
 
   VALUE obj = Qnil;
 
+  uint32_t object_id = NUM2UINT(id);
+
+
+  if(mtp_async_nonblocking())
+  {
+    return mtp_async_call(self, "playlist_get", 1, &id);
+  }
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  device_ptr = device_acquire(self);
 
-  playlist_ptr = LIBMTP_Get_Playlist(device_ptr, NUM2UINT(id));
+  playlist_ptr = LIBMTP_Get_Playlist(device_ptr, object_id);
+
+  device_release(self);
 
   if(playlist_ptr != NULL)
   {
@@ -1172,10 +1639,17 @@ static VALUE device_playlist_list(VALUE self)
   VALUE array = rb_ary_new();
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  if(mtp_async_nonblocking())
+  {
+    return mtp_async_call(self, "playlist_list", 0, NULL);
+  }
+
+  device_ptr = device_acquire(self);
 
   playlist_ptr = LIBMTP_Get_Playlist_List(device_ptr);
 
+  device_release(self);
+
   if(playlist_ptr != NULL)
   {
     current = playlist_ptr;
@@ -1216,12 +1690,14 @@ static VALUE device_playlist_create(VALUE self, VALUE parent, VALUE playlist)
   int status;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
-
   Data_Get_Struct(playlist, LIBMTP_playlist_t, playlist_ptr);
 
+  device_ptr = device_acquire(self);
+
   status = LIBMTP_Create_New_Playlist(device_ptr, playlist_ptr);
 
+  device_release(self);
+
   if(status != 0)
   {
     rb_raise(rb_eIOError, "Unable to create playlist");
@@ -1251,12 +1727,14 @@ static VALUE device_playlist_update(VALUE self, VALUE playlist)
   int status;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
-
   Data_Get_Struct(playlist, LIBMTP_playlist_t, playlist_ptr);
 
+  device_ptr = device_acquire(self);
+
   status = LIBMTP_Update_Playlist(device_ptr, playlist_ptr);
 
+  device_release(self);
+
   if(status != 0)
   {
     rb_raise(rb_eIOError, "Unable to send playlist");
@@ -1285,10 +1763,19 @@ static VALUE device_track_get(VALUE self, VALUE id)
 
   VALUE obj = Qnil;
 
+  uint32_t object_id = NUM2UINT(id);
+
+
+  if(mtp_async_nonblocking())
+  {
+    return mtp_async_call(self, "track_get", 1, &id);
+  }
+
+  device_ptr = device_acquire(self);
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  track_ptr = LIBMTP_Get_Trackmetadata(device_ptr, object_id);
 
-  track_ptr = LIBMTP_Get_Trackmetadata(device_ptr, NUM2UINT(id));
+  device_release(self);
 
   if(track_ptr != NULL)
   {
@@ -1325,10 +1812,17 @@ static VALUE device_track_list(VALUE self)
   VALUE array = rb_ary_new();
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  if(mtp_async_nonblocking())
+  {
+    return mtp_async_call(self, "track_list", 0, NULL);
+  }
+
+  device_ptr = device_acquire(self);
 
   track_ptr = LIBMTP_Get_Tracklisting_With_Callback(device_ptr, NULL, NULL);
 
+  device_release(self);
+
   if(track_ptr != NULL)
   {
     current = track_ptr;
@@ -1358,6 +1852,8 @@ static VALUE device_track_list(VALUE self)
  *
  *  If <i>track</i> contains a hash, a LibMTP::Track object will be created from the hash data.
  *
+ *  Every property is written; Device#track_update_batch writes only those changed.
+ *
  *  Wraps: <i>LIBMTP_Update_Track_Metadata</i>
  *
  */
@@ -1371,17 +1867,23 @@ static VALUE device_track_update(VALUE self, VALUE track)
   int status;
 
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  track = Get_LibMTP_Track(track);
 
-  Data_Get_Struct(Get_LibMTP_Track(track), LIBMTP_track_t, track_ptr);
+  Data_Get_Struct(track, LIBMTP_track_t, track_ptr);
+
+  device_ptr = device_acquire(self);
 
   status = LIBMTP_Update_Track_Metadata(device_ptr, track_ptr);
 
+  device_release(self);
+
   if(status != 0)
   {
     rb_raise(rb_eIOError, "Unable to send track");
   }
 
+  mtp_track_clean(track, ~0U);
+
 
   return self;
 }
@@ -1403,10 +1905,14 @@ static VALUE device_track_exists(VALUE self, VALUE id)
 
   int status;
 
+  uint32_t object_id = NUM2UINT(id);
+
+
+  device_ptr = device_acquire(self);
 
-  Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+  status = LIBMTP_Track_Exists(device_ptr, object_id);
 
-  status = LIBMTP_Track_Exists(device_ptr, NUM2UINT(id));
+  device_release(self);
 
 
   return ((status) ? Qtrue : Qfalse);
@@ -1416,81 +1922,167 @@ static VALUE device_track_exists(VALUE self, VALUE id)
 /*
  *  call-seq:
  *     device.track_get_file(id, pathname) -> device
+ *     device.track_get_file(id, pathname, digest: :sha256) -> digest string
  *
  *  Retrieves the file with the specified track ID and writes it to the specified path.
  *
- *  Wraps: <i>LIBMTP_Get_Track_To_File</i>
+ *  See Device#file_get for the <i>digest</i> and local file options.
+ *
+ *  Wraps: <i>LIBMTP_Get_Track_To_File</i>, <i>LIBMTP_Get_Track_To_Handler</i>
  *
  */
 
-static VALUE device_track_get_file(VALUE self, VALUE id, VALUE pathname)
+static VALUE device_track_get_file(int argc, VALUE *argv, VALUE self)
 {
   LIBMTP_mtpdevice_t *device_ptr;
 
+  VALUE id, pathname, opts;
+
+  VALUE result = self;
+
   VALUE path;
 
+  uint32_t object_id;
+
+  char *path_ptr;
+
   int status;
 
 
+  rb_scan_args(argc, argv, "21", &id, &pathname, &opts);
+
   path = StringValue(pathname);
 
-  if((RSTRING(path)->as.heap.ptr != NULL) && (RSTRING(path)->as.heap.len > 0))
+  if((RSTRING_PTR(path) != NULL) && (RSTRING_LEN(path) > 0))
   {
-    Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
+    object_id = NUM2UINT(id);
 
-    status = LIBMTP_Get_Track_To_File(device_ptr, NUM2UINT(id), RSTRING(path)->as.heap.ptr, NULL, NULL);
+    path_ptr = StringValueCStr(path);
 
-    if(status != 0)
+    if(NIL_P(opts))
     {
-      rb_raise(rb_eIOError, "Unable to retrieve file");
+      if(mtp_async_nonblocking())
+      {
+        return mtp_async_call(self, "track_get_file", 2, argv);
+      }
+
+      device_ptr = device_acquire(self);
+
+      status = LIBMTP_Get_Track_To_File(device_ptr, object_id, path_ptr, NULL, NULL);
+
+      device_release(self);
+
+      if(status != 0)
+      {
+        rb_raise(rb_eIOError, "Unable to retrieve file");
+      }
+    }
+    else
+    {
+      result = mtp_transfer_to_file(Get_MTP_Device(self), object_id, path_ptr, opts, MTP_TRANSFER_TRACK);
+
+      if(NIL_P(result)) result = self;
     }
   }
 
 
-  return self;
+  return result;
 }
 
 
 /*
  *  call-seq:
- *     device.track_send_file(parent, pathname, track) -> device
+ *     device.track_send_file(parent, pathname, track) -> object ID
+ *     device.track_send_file(parent, pathname, track, digest: :sha256) -> digest string
  *
- *  Sends the file specified by <i>path</i> with the track metadata specified by <i>track</i>.
+ *  Sends the file specified by <i>path</i> with the track metadata specified by <i>track</i> into the folder
+ *  <i>parent</i>, 0 for the root.  Returns the ID of the new object, which is also set as the track_id of
+ *  <i>track</i>.
  *
  *  If <i>track</i> contains a hash, a LibMTP::Track object will be created from the hash data.
  *
- *  Wraps: <i>LIBMTP_Send_Track_From_File</i>
+ *  See Device#file_send for the <i>digest</i> and <i>placement</i> options.
+ *
+ *  Wraps: <i>LIBMTP_Send_Track_From_File</i>, <i>LIBMTP_Send_Track_From_Handler</i>
  *
  */
 
-static VALUE device_track_send_file(VALUE self, VALUE parent, VALUE pathname, VALUE track)
+static VALUE device_track_send_file(int argc, VALUE *argv, VALUE self)
 {
   LIBMTP_mtpdevice_t *device_ptr;
 
   LIBMTP_track_t *track_ptr;
 
+  VALUE parent, pathname, track, opts;
+
+  VALUE result = self;
+
   VALUE path;
 
+  char *path_ptr;
+
   int status;
 
 
+  rb_scan_args(argc, argv, "31", &parent, &pathname, &track, &opts);
+
   path = StringValue(pathname);
 
-  if((RSTRING(path)->as.heap.ptr != NULL) && (RSTRING(path)->as.heap.len > 0))
+  if((RSTRING_PTR(path) != NULL) && (RSTRING_LEN(path) > 0))
   {
-    Data_Get_Struct(self, LIBMTP_mtpdevice_t, device_ptr);
-
     Data_Get_Struct(Get_LibMTP_Track(track), LIBMTP_track_t, track_ptr);
 
-    status = LIBMTP_Send_Track_From_File(device_ptr, RSTRING(path)->as.heap.ptr, track_ptr, NULL, NULL);
-    if(status != 0)
+    path_ptr = StringValueCStr(path);
+
+    track_ptr->parent_id = NUM2UINT(parent);
+
+    if(NIL_P(opts))
     {
-      rb_raise(rb_eIOError, "Unable to send track");
+      if(mtp_async_nonblocking())
+      {
+        return mtp_async_call(self, "track_send_file", 3, argv);
+      }
+
+      device_ptr = device_acquire(self);
+
+      status = LIBMTP_Send_Track_From_File(device_ptr, path_ptr, track_ptr, NULL, NULL);
+
+      device_release(self);
+
+      if(status != 0)
+      {
+        rb_raise(rb_eIOError, "Unable to send track");
+      }
+
+      result = UINT2NUM(track_ptr->item_id);
+    }
+    else
+    {
+      result = mtp_transfer_from_file(Get_MTP_Device(self), path_ptr, track_ptr, opts, MTP_TRANSFER_TRACK);
+
+      if(NIL_P(result)) result = UINT2NUM(track_ptr->item_id);
     }
   }
 
 
-  return self;
+  return result;
+}
+
+
+/*
+ *  call-seq:
+ *     device.async() -> LibMTP::Device::Async
+ *
+ *  Returns a proxy whose methods start the operation of the same name on this device and return a
+ *  LibMTP::Future instead of waiting for it.
+ *
+ *  array = devices.map { |device| device.async.track_list }.map(&:value)
+ *
+ */
+
+static VALUE device_async(VALUE self)
+{
+  return mtp_async_create(self);
 }
 
 
@@ -1521,7 +2113,7 @@ static VALUE device_list(VALUE klass)
 
       current->next = NULL;
 
-      rb_ary_push(array, Data_Wrap_Struct(cMTPDevice, 0, device_free, current));
+      rb_ary_push(array, device_wrap(cMTPDevice, current));
     }
   }
   else if(status == LIBMTP_ERROR_NO_DEVICE_ATTACHED)
@@ -1570,6 +2162,10 @@ static VALUE device_list(VALUE klass)
  *
  *  The MTP device will be released at the end of the connect block.
  *
+ *  Inside a non-blocking fiber under a <code>Fiber.scheduler</code> (such as the one of the async gem), the
+ *  listing, metadata, delete and plain transfer methods run on the device's worker thread (see Device#async)
+ *  and the fiber waits through the scheduler, so other fibers keep running while the device is busy.
+ *
  *  For more information, see the documentation that is provided with <i>libmtp</i>.
  *
  *  Or, see the libmtp homepage at http://libmtp.sourceforge.net/
@@ -1634,14 +2230,18 @@ void Init_LibMTP_Device(void)
 
   rb_define_method(cMTPDevice, "file_info_list", device_file_info_list,  0);
 
-  rb_define_method(cMTPDevice, "file_get", device_file_get,  2);
+  rb_define_method(cMTPDevice, "file_get", device_file_get,  -1);
+
+  rb_define_method(cMTPDevice, "file_send", device_file_send,  -1);
+
+  rb_define_method(cMTPDevice, "file_get_batch", device_file_get_batch,  -1);
 
-  rb_define_method(cMTPDevice, "file_send", device_file_send,  3);
+  rb_define_method(cMTPDevice, "file_stream", device_file_stream,  -1);
 
 
   rb_define_method(cMTPDevice, "folder_list", device_folder_list, 0);
 
-  rb_define_method(cMTPDevice, "folder_create", device_folder_create, 1);
+  rb_define_method(cMTPDevice, "folder_create", device_folder_create, -1);
 
 
   rb_define_method(cMTPDevice, "playlist_get", device_playlist_get, 1);
@@ -1661,9 +2261,12 @@ void Init_LibMTP_Device(void)
 
   rb_define_method(cMTPDevice, "track_exists?", device_track_exists, 1);
 
-  rb_define_method(cMTPDevice, "track_get_file", device_track_get_file, 2);
+  rb_define_method(cMTPDevice, "track_get_file", device_track_get_file, -1);
+
+  rb_define_method(cMTPDevice, "track_send_file", device_track_send_file, -1);
+
 
-  rb_define_method(cMTPDevice, "track_send_file", device_track_send_file, 3);
+  rb_define_method(cMTPDevice, "async", device_async, 0);
 
 
   rb_define_module_function(cMTPDevice, "list", device_list, 0);
@@ -0,0 +1,663 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include "mtp_proto.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+
+#include <immintrin.h>
+#define MTP_DIGEST_X86 1
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#ifdef HAVE_XXH3_CREATESTATE
+#include <xxhash.h>
+#endif
+
+
+#define DIGEST_SHA256 1
+
+#define DIGEST_CRC32C 2
+
+#define DIGEST_XXH3   3
+
+
+struct mtp_digest_s
+{
+  int type;
+
+  uint32_t crc;
+
+  uint32_t state[8];
+
+  uint64_t length;
+
+  unsigned char block[64];
+
+  size_t used;
+
+#ifdef HAVE_XXH3_CREATESTATE
+  XXH3_state_t *xxh3;
+#endif
+};
+
+
+static const uint32_t sha256_k[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+static uint32_t crc32c_table[8][256];
+
+
+static void (*sha256_blocks)(uint32_t *, const unsigned char *, size_t);
+
+static uint32_t (*crc32c_update)(uint32_t, const unsigned char *, size_t);
+
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+static void sha256_blocks_generic(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+  uint32_t a, b, c, d, e, f, g, h, t1, t2;
+
+  uint32_t w[64];
+
+  int i;
+
+
+  while(blocks-- > 0)
+  {
+    for(i=0; i < 16; i++)
+    {
+      w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) |
+             ((uint32_t)data[i * 4 + 2] << 8) | (uint32_t)data[i * 4 + 3];
+    }
+
+    for(i=16; i < 64; i++)
+    {
+      w[i] = (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10)) + w[i - 7] +
+             (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 16];
+    }
+
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for(i=0; i < 64; i++)
+    {
+      t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+
+      t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+      h = g; g = f; f = e; e = d + t1;
+
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+
+
+    data += 64;
+  }
+
+
+  return;
+}
+
+
+static uint32_t crc32c_update_generic(uint32_t crc, const unsigned char *data, size_t len)
+{
+  uint64_t word;
+
+
+  while((len > 0) && (((uintptr_t)data & 7) != 0))
+  {
+    crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    len--;
+  }
+
+  /* slicing-by-8: fold eight input bytes per table round */
+  while(len >= 8)
+  {
+    memcpy(&word, data, 8);
+
+    word ^= crc;
+
+    crc = crc32c_table[7][word & 0xff] ^
+          crc32c_table[6][(word >> 8) & 0xff] ^
+          crc32c_table[5][(word >> 16) & 0xff] ^
+          crc32c_table[4][(word >> 24) & 0xff] ^
+          crc32c_table[3][(word >> 32) & 0xff] ^
+          crc32c_table[2][(word >> 40) & 0xff] ^
+          crc32c_table[1][(word >> 48) & 0xff] ^
+          crc32c_table[0][word >> 56];
+
+    data += 8;
+
+    len -= 8;
+  }
+
+  while(len-- > 0)
+  {
+    crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  }
+
+
+  return crc;
+}
+
+
+#ifdef MTP_DIGEST_X86
+
+/* SHA-NI rounds, two per sha256rnds2, message schedule via sha256msg1/msg2 */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  __m128i state0, state1, abef, cdgh, msg, tmp;
+
+  __m128i m[4];
+
+  int i;
+
+
+  tmp    = _mm_loadu_si128((const __m128i *)&state[0]);
+
+  state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+
+  tmp    = _mm_shuffle_epi32(tmp, 0xb1);
+
+  state1 = _mm_shuffle_epi32(state1, 0x1b);
+
+  state0 = _mm_alignr_epi8(tmp, state1, 8);
+
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+
+  while(blocks-- > 0)
+  {
+    abef = state0;
+
+    cdgh = state1;
+
+    for(i=0; i < 16; i++)
+    {
+      if(i < 4)
+      {
+        m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), mask);
+      }
+      else
+      {
+        m[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+                                                      _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4)),
+                                        m[(i + 3) & 3]);
+      }
+
+      msg    = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+      msg    = _mm_shuffle_epi32(msg, 0x0e);
+
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+
+    state1 = _mm_add_epi32(state1, cdgh);
+
+
+    data += 64;
+  }
+
+
+  tmp    = _mm_shuffle_epi32(state0, 0x1b);
+
+  state1 = _mm_shuffle_epi32(state1, 0xb1);
+
+  state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+  _mm_storeu_si128((__m128i *)&state[0], state0);
+
+  _mm_storeu_si128((__m128i *)&state[4], state1);
+
+
+  return;
+}
+
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_sse42(uint32_t crc, const unsigned char *data, size_t len)
+{
+  uint64_t word;
+
+  uint64_t crc64;
+
+
+  while((len > 0) && (((uintptr_t)data & 7) != 0))
+  {
+    crc = _mm_crc32_u8(crc, *data++);
+
+    len--;
+  }
+
+  crc64 = crc;
+
+  while(len >= 8)
+  {
+    memcpy(&word, data, 8);
+
+    crc64 = _mm_crc32_u64(crc64, word);
+
+    data += 8;
+
+    len -= 8;
+  }
+
+  crc = (uint32_t)crc64;
+
+  while(len-- > 0)
+  {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+
+
+  return crc;
+}
+
+#endif
+
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+static uint32_t crc32c_update_armv8(uint32_t crc, const unsigned char *data, size_t len)
+{
+  uint64_t word;
+
+
+  while(len >= 8)
+  {
+    memcpy(&word, data, 8);
+
+    crc = __crc32cd(crc, word);
+
+    data += 8;
+
+    len -= 8;
+  }
+
+  while(len-- > 0)
+  {
+    crc = __crc32cb(crc, *data++);
+  }
+
+
+  return crc;
+}
+
+#endif
+
+
+static int digest_type(VALUE type)
+{
+  ID id;
+
+
+  if(!SYMBOL_P(type))
+  {
+    type = rb_str_intern(StringValue(type));
+  }
+
+  id = SYM2ID(type);
+
+  if(id == rb_intern("sha256"))
+  {
+    return DIGEST_SHA256;
+  }
+  else if(id == rb_intern("crc32c"))
+  {
+    return DIGEST_CRC32C;
+  }
+  else if(id == rb_intern("xxh3"))
+  {
+#ifdef HAVE_XXH3_CREATESTATE
+    return DIGEST_XXH3;
+#else
+    rb_raise(rb_eNotImpError, "xxh3 digest requires libxxhash");
+#endif
+  }
+
+
+  rb_raise(rb_eArgError, "Unknown digest type");
+
+
+  return 0;
+}
+
+
+mtp_digest_t *mtp_digest_new(VALUE type)
+{
+  static const uint32_t sha256_init[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  mtp_digest_t *digest;
+
+  int kind;
+
+
+  kind = digest_type(type);
+
+  digest = (mtp_digest_t *)calloc(1, sizeof(mtp_digest_t));
+
+  if(digest == NULL)
+  {
+    rb_raise(rb_eNoMemError, "Unable to allocate digest");
+  }
+
+  digest->type = kind;
+
+  digest->crc = 0xffffffff;
+
+  memcpy(digest->state, sha256_init, sizeof(sha256_init));
+
+#ifdef HAVE_XXH3_CREATESTATE
+  if(kind == DIGEST_XXH3)
+  {
+    digest->xxh3 = XXH3_createState();
+
+    if(digest->xxh3 == NULL)
+    {
+      free(digest);
+
+      rb_raise(rb_eNoMemError, "Unable to allocate digest");
+    }
+
+    XXH3_64bits_reset(digest->xxh3);
+  }
+#endif
+
+
+  return digest;
+}
+
+
+/*
+ * Safe to call without the GVL; the transfer handlers feed every chunk through here.
+ */
+
+void mtp_digest_update(mtp_digest_t *digest, const unsigned char *data, size_t len)
+{
+  size_t take;
+
+
+  if(digest->type == DIGEST_CRC32C)
+  {
+    digest->crc = crc32c_update(digest->crc, data, len);
+  }
+#ifdef HAVE_XXH3_CREATESTATE
+  else if(digest->type == DIGEST_XXH3)
+  {
+    XXH3_64bits_update(digest->xxh3, data, len);
+  }
+#endif
+  else if(digest->type == DIGEST_SHA256)
+  {
+    digest->length += len;
+
+    if(digest->used > 0)
+    {
+      take = 64 - digest->used;
+
+      if(take > len) take = len;
+
+      memcpy(digest->block + digest->used, data, take);
+
+      digest->used += take;
+
+      data += take;
+
+      len -= take;
+
+      if(digest->used == 64)
+      {
+        sha256_blocks(digest->state, digest->block, 1);
+
+        digest->used = 0;
+      }
+    }
+
+    if(len >= 64)
+    {
+      sha256_blocks(digest->state, data, len / 64);
+
+      data += len & ~(size_t)63;
+
+      len &= 63;
+    }
+
+    if(len > 0)
+    {
+      memcpy(digest->block, data, len);
+
+      digest->used = len;
+    }
+  }
+
+
+  return;
+}
+
+
+void mtp_digest_free(mtp_digest_t *digest)
+{
+  if(digest != NULL)
+  {
+#ifdef HAVE_XXH3_CREATESTATE
+    if(digest->xxh3 != NULL)
+    {
+      XXH3_freeState(digest->xxh3);
+    }
+#endif
+
+    free(digest);
+  }
+
+
+  return;
+}
+
+
+/*
+ * Returns the digest as a lowercase hex string and releases the context.
+ */
+
+VALUE mtp_digest_finish(mtp_digest_t *digest)
+{
+  unsigned char out[32];
+
+  char hex[65];
+
+  uint64_t bits;
+
+  size_t len = 0;
+
+  size_t i;
+
+
+  if(digest->type == DIGEST_CRC32C)
+  {
+    digest->crc ^= 0xffffffff;
+
+    for(i=0; i < 4; i++)
+    {
+      out[i] = (unsigned char)(digest->crc >> (24 - i * 8));
+    }
+
+    len = 4;
+  }
+#ifdef HAVE_XXH3_CREATESTATE
+  else if(digest->type == DIGEST_XXH3)
+  {
+    XXH64_canonicalFromHash((XXH64_canonical_t *)out, XXH3_64bits_digest(digest->xxh3));
+
+    len = 8;
+  }
+#endif
+  else if(digest->type == DIGEST_SHA256)
+  {
+    bits = digest->length * 8;
+
+    digest->block[digest->used++] = 0x80;
+
+    if(digest->used > 56)
+    {
+      memset(digest->block + digest->used, 0, 64 - digest->used);
+
+      sha256_blocks(digest->state, digest->block, 1);
+
+      digest->used = 0;
+    }
+
+    memset(digest->block + digest->used, 0, 56 - digest->used);
+
+    for(i=0; i < 8; i++)
+    {
+      digest->block[56 + i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+
+    sha256_blocks(digest->state, digest->block, 1);
+
+    for(i=0; i < 32; i++)
+    {
+      out[i] = (unsigned char)(digest->state[i / 4] >> (24 - (i % 4) * 8));
+    }
+
+    len = 32;
+  }
+
+  mtp_digest_free(digest);
+
+
+  for(i=0; i < len; i++)
+  {
+    hex[i * 2]     = "0123456789abcdef"[out[i] >> 4];
+
+    hex[i * 2 + 1] = "0123456789abcdef"[out[i] & 0x0f];
+  }
+
+
+  return rb_str_new(hex, len * 2);
+}
+
+
+void Init_LibMTP_Digest(void)
+{
+  uint32_t crc;
+
+  int i, j;
+
+#ifdef MTP_DIGEST_X86
+  unsigned int eax, ebx, ecx, edx;
+#endif
+
+
+  for(i=0; i < 256; i++)
+  {
+    crc = i;
+
+    for(j=0; j < 8; j++)
+    {
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : (crc >> 1);
+    }
+
+    crc32c_table[0][i] = crc;
+  }
+
+  for(i=0; i < 256; i++)
+  {
+    for(j=1; j < 8; j++)
+    {
+      crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+    }
+  }
+
+
+  sha256_blocks = sha256_blocks_generic;
+
+  crc32c_update = crc32c_update_generic;
+
+#ifdef MTP_DIGEST_X86
+  if(__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+  {
+    if(ecx & bit_SSE4_2)
+    {
+      crc32c_update = crc32c_update_sse42;
+    }
+
+    if((ecx & bit_SSE4_1) && (ecx & bit_SSSE3) && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA))
+    {
+      sha256_blocks = sha256_blocks_shani;
+    }
+  }
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  crc32c_update = crc32c_update_armv8;
+#endif
+
+
+  return;
+}
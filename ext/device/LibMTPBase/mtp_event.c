@@ -0,0 +1,952 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include <errno.h>
+
+#include <time.h>
+
+#include <sys/time.h>
+
+#include "mtp_proto.h"
+
+
+static VALUE cMTPEvents;
+
+
+#define EVENT_OVERFLOW    -1
+
+#define EVENT_QUEUE_LIMIT 4096
+
+#define EVENT_WAIT_SLICE  0.1
+
+#define EVENT_POLL_SLICE  200000 /* microseconds between stop checks */
+
+
+#define EVENTS_RUNNING 0
+
+#define EVENTS_STOPPED 1
+
+#define EVENTS_FAILED  2
+
+
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+
+typedef struct mtp_event_item_s
+{
+  struct mtp_event_item_s *next;
+
+  int type;
+
+  uint32_t param;
+} mtp_event_item_t;
+
+
+struct mtp_events_s
+{
+  mtp_device_t *device;       /* NULL once the device was freed */
+
+  VALUE owner;                /* the Device, kept alive while the reader runs */
+
+  VALUE map;                  /* object map to invalidate, or nil */
+
+  pthread_t thread;
+
+  pthread_mutex_t lock;
+
+  pthread_cond_t ready;
+
+  mtp_event_item_t *head;
+
+  mtp_event_item_t *tail;
+
+  long count;
+
+  int overflow;               /* events were dropped since the last pop */
+
+  int stop;
+
+  int state;
+
+  int started;
+
+  mtp_events_t *next;         /* the next reader of the device */
+};
+
+
+
+/*
+ * Queues an event for the Ruby side.  The queue is bounded: when Ruby does
+ * not keep up the oldest events are dropped and the next pop reports
+ * :overflow, so that caches keyed on the events know to rescan.
+ */
+
+static void events_push(mtp_events_t *events, int type, uint32_t param)
+{
+  mtp_event_item_t *item = (mtp_event_item_t *)malloc(sizeof(mtp_event_item_t)), *head;
+
+
+  if(item == NULL) return;
+
+  item->next = NULL;
+
+  item->type = type;
+
+  item->param = param;
+
+
+  pthread_mutex_lock(&events->lock);
+
+  if(events->count >= EVENT_QUEUE_LIMIT)
+  {
+    head = events->head;
+
+    events->head = head->next;
+
+    events->count--;
+
+    events->overflow = 1;
+
+    free(head);
+  }
+
+  if(events->tail != NULL)
+  {
+    events->tail->next = item;
+  }
+  else
+  {
+    events->head = item;
+  }
+
+  events->tail = item;
+
+  events->count++;
+
+  pthread_cond_broadcast(&events->ready);
+
+  pthread_mutex_unlock(&events->lock);
+
+
+  return;
+}
+
+
+static int events_stopping(mtp_events_t *events)
+{
+  int stop;
+
+
+  pthread_mutex_lock(&events->lock);
+
+  stop = events->stop;
+
+  pthread_mutex_unlock(&events->lock);
+
+
+  return stop;
+}
+
+
+/*
+ * An asynchronous event read.  libmtp cannot cancel a submitted read, so a
+ * reader that stops with a read pending abandons it here and the callback
+ * frees it whenever libusb completes it.
+ */
+
+typedef struct mtp_event_read_s
+{
+  int completed;
+
+  int abandoned;
+
+  int status;
+
+  LIBMTP_event_t event;
+
+  uint32_t param;
+} mtp_event_read_t;
+
+
+static pthread_mutex_t event_read_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void event_read_done(int status, LIBMTP_event_t event, uint32_t param, void *ptr)
+{
+  mtp_event_read_t *read = (mtp_event_read_t *)ptr;
+
+
+  pthread_mutex_lock(&event_read_lock);
+
+  if(read->abandoned)
+  {
+    pthread_mutex_unlock(&event_read_lock);
+
+    free(read);
+
+    return;
+  }
+
+  read->status = status;
+
+  read->event = event;
+
+  read->param = param;
+
+  read->completed = 1;
+
+  pthread_mutex_unlock(&event_read_lock);
+
+
+  return;
+}
+
+
+/*
+ * Reads one event, handling libusb events in short slices so that a stop
+ * request is seen promptly.  Returns 0 with an event, 1 when stopped and -1
+ * on error.  <i>event</i> and <i>param</i> are set on every return, to
+ * LIBMTP_EVENT_NONE and 0 when no event was read.
+ */
+
+static int events_read(mtp_events_t *events, LIBMTP_event_t *event, uint32_t *param)
+{
+  mtp_event_read_t *read = (mtp_event_read_t *)calloc(1, sizeof(mtp_event_read_t));
+
+  struct timeval slice;
+
+  int status = 0;
+
+
+  *event = LIBMTP_EVENT_NONE;
+
+  *param = 0;
+
+  if(read == NULL) return -1;
+
+  if(LIBMTP_Read_Event_Async(events->device->device, event_read_done, read) != 0)
+  {
+    free(read);
+
+    return -1;
+  }
+
+  while(!read->completed && (status == 0))
+  {
+    if(events_stopping(events))
+    {
+      status = 1;
+
+      break;
+    }
+
+    slice.tv_sec = 0;
+
+    slice.tv_usec = EVENT_POLL_SLICE;
+
+    if(LIBMTP_Handle_Events_Timeout_Completed(&slice, &read->completed) != 0) status = -1;
+  }
+
+  pthread_mutex_lock(&event_read_lock);
+
+  if(!read->completed)
+  {
+    read->abandoned = 1;
+
+    read = NULL;
+  }
+
+  pthread_mutex_unlock(&event_read_lock);
+
+  if(read == NULL) return status;
+
+  if(read->status < 0) status = -1;
+
+  *event = read->event;
+
+  *param = read->param;
+
+  free(read);
+
+
+  return status;
+}
+
+
+/*
+ * The reader thread.  Events arrive on the interrupt endpoint, apart from
+ * the bulk pipe that other calls use, so the reader does not take the
+ * device and never holds up a transfer.
+ */
+
+static void *events_run(void *ptr)
+{
+  mtp_events_t *events = (mtp_events_t *)ptr;
+
+  LIBMTP_event_t event;
+
+  uint32_t param;
+
+  int status;
+
+
+  while((status = events_read(events, &event, &param)) == 0)
+  {
+    if(event != LIBMTP_EVENT_NONE) events_push(events, (int)event, param);
+  }
+
+  pthread_mutex_lock(&events->lock);
+
+  events->state = ((status > 0) ? EVENTS_STOPPED : EVENTS_FAILED);
+
+  pthread_cond_broadcast(&events->ready);
+
+  pthread_mutex_unlock(&events->lock);
+
+
+  return NULL;
+}
+
+
+/*
+ * Stops the reader and waits for it.  Called with or without the GVL; the
+ * reader itself never calls into Ruby.
+ */
+
+static void *events_stop(void *ptr)
+{
+  mtp_events_t *events = (mtp_events_t *)ptr;
+
+
+  if(!events->started) return NULL;
+
+  pthread_mutex_lock(&events->lock);
+
+  events->stop = 1;
+
+  pthread_mutex_unlock(&events->lock);
+
+  pthread_join(events->thread, NULL);
+
+  events->started = 0;
+
+
+  return NULL;
+}
+
+
+/*
+ * Links a started reader into its device, or unlinks it, so that the device
+ * can stop its readers before it is released.  The device list is guarded
+ * by the device's queue lock.
+ */
+
+static void events_register(mtp_events_t *events)
+{
+  mtp_device_t *device = events->device;
+
+
+  pthread_mutex_lock(&device->lock);
+
+  events->next = device->events;
+
+  device->events = events;
+
+  pthread_mutex_unlock(&device->lock);
+
+
+  return;
+}
+
+
+static void events_unregister(mtp_events_t *events)
+{
+  mtp_device_t *device = events->device;
+
+  mtp_events_t **link;
+
+
+  if(device == NULL) return;
+
+  pthread_mutex_lock(&device->lock);
+
+  for(link = &device->events; *link != NULL; link = &(*link)->next)
+  {
+    if(*link == events)
+    {
+      *link = events->next;
+
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&device->lock);
+
+
+  return;
+}
+
+
+static void events_mark(void *ptr)
+{
+  mtp_events_t *events = (mtp_events_t *)ptr;
+
+
+  rb_gc_mark(events->owner);
+
+  rb_gc_mark(events->map);
+
+
+  return;
+}
+
+
+static void events_free(void *ptr)
+{
+  mtp_events_t *events = (mtp_events_t *)ptr;
+
+  mtp_event_item_t *item;
+
+
+  events_stop(events);
+
+  events_unregister(events);
+
+  while((item = events->head) != NULL)
+  {
+    events->head = item->next;
+
+    free(item);
+  }
+
+  pthread_cond_destroy(&events->ready);
+
+  pthread_mutex_destroy(&events->lock);
+
+  xfree(events);
+
+
+  return;
+}
+
+
+static mtp_events_t *Get_MTP_Events(VALUE self)
+{
+  mtp_events_t *events;
+
+
+  Data_Get_Struct(self, mtp_events_t, events);
+
+
+  return events;
+}
+
+
+typedef struct mtp_events_wait_s
+{
+  mtp_events_t *events;
+
+  struct timespec until;
+} mtp_events_wait_t;
+
+
+static void *events_wait_blocking(void *ptr)
+{
+  mtp_events_wait_t *wait = (mtp_events_wait_t *)ptr;
+
+  mtp_events_t *events = wait->events;
+
+
+  pthread_mutex_lock(&events->lock);
+
+  while((events->head == NULL) && !events->overflow && (events->state == EVENTS_RUNNING) && !events->stop)
+  {
+    if(pthread_cond_timedwait(&events->ready, &events->lock, &wait->until) == ETIMEDOUT) break;
+  }
+
+  pthread_mutex_unlock(&events->lock);
+
+
+  return NULL;
+}
+
+
+static double events_now(void)
+{
+  struct timeval tv;
+
+
+  gettimeofday(&tv, NULL);
+
+
+  return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+
+/*
+ * Takes the next event off the queue, waiting up to <i>timeout</i> seconds
+ * (forever when negative) in slices so that Ruby interrupts are handled.
+ * Returns 1 with an event, 0 when none came and -1 when the reader failed.
+ */
+
+static int events_take(mtp_events_t *events, double timeout, int *type, uint32_t *param)
+{
+  mtp_events_wait_t wait;
+
+  mtp_event_item_t *item = NULL;
+
+  double deadline = events_now() + timeout;
+
+  double until;
+
+  int state;
+
+
+  wait.events = events;
+
+  while(1)
+  {
+    pthread_mutex_lock(&events->lock);
+
+    if(events->overflow)
+    {
+      events->overflow = 0;
+
+      *type = EVENT_OVERFLOW;
+
+      *param = 0;
+
+      pthread_mutex_unlock(&events->lock);
+
+      return 1;
+    }
+
+    if((item = events->head) != NULL)
+    {
+      events->head = item->next;
+
+      if(events->head == NULL) events->tail = NULL;
+
+      events->count--;
+    }
+
+    state = events->state;
+
+    if(events->stop && (state == EVENTS_RUNNING)) state = EVENTS_STOPPED;
+
+    pthread_mutex_unlock(&events->lock);
+
+    if(item != NULL) break;
+
+    if(state != EVENTS_RUNNING) return ((state == EVENTS_FAILED) ? -1 : 0);
+
+    until = events_now() + EVENT_WAIT_SLICE;
+
+    if(timeout >= 0)
+    {
+      if(events_now() >= deadline) return 0;
+
+      if(until > deadline) until = deadline;
+    }
+
+    wait.until.tv_sec = (time_t)until;
+
+    wait.until.tv_nsec = (long)((until - (time_t)until) * 1e9);
+
+    mtp_without_gvl(events_wait_blocking, &wait);
+
+    rb_thread_check_ints();
+  }
+
+  *type = item->type;
+
+  *param = item->param;
+
+  free(item);
+
+
+  return 1;
+}
+
+
+static void events_removed_path(const char *path, uint32_t id, uint64_t size, time_t mtime, int folder, void *arg)
+{
+  if(id == *(uint32_t *)((VALUE *)arg)[0])
+  {
+    rb_ary_push(((VALUE *)arg)[1], rb_str_new2(path));
+  }
+
+
+  return;
+}
+
+
+/*
+ * Applies an event to the caches the extension keeps: a removed object is
+ * dropped from the object map, and the storage list of the device is
+ * reread when a storage comes or goes so that placement sees it.
+ */
+
+static void events_apply(mtp_events_t *events, int type, uint32_t param)
+{
+  mtp_objmap_t *map;
+
+  VALUE arg[2];
+
+  long i;
+
+
+  if((type == LIBMTP_EVENT_OBJECT_REMOVED) && !NIL_P(events->map))
+  {
+    map = Get_MTP_ObjectMap(events->map);
+
+    arg[0] = (VALUE)&param;
+
+    arg[1] = rb_ary_new();
+
+    mtp_objmap_each(map, events_removed_path, arg);
+
+    for(i=0; i < RARRAY_LEN(arg[1]); i++)
+    {
+      mtp_objmap_remove(map, StringValueCStr(RARRAY_PTR(arg[1])[i]));
+    }
+  }
+  else if((type == LIBMTP_EVENT_STORE_ADDED) || (type == LIBMTP_EVENT_STORE_REMOVED))
+  {
+    mtp_device_lock(events->device);
+
+    LIBMTP_Get_Storage(events->device->device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+
+    mtp_device_unlock(events->device);
+  }
+
+
+  return;
+}
+
+
+static VALUE events_type(int type)
+{
+  switch(type)
+  {
+    case EVENT_OVERFLOW:
+      return ID2SYM(rb_intern("overflow"));
+
+    case LIBMTP_EVENT_STORE_ADDED:
+      return ID2SYM(rb_intern("store_added"));
+
+    case LIBMTP_EVENT_STORE_REMOVED:
+      return ID2SYM(rb_intern("store_removed"));
+
+    case LIBMTP_EVENT_OBJECT_ADDED:
+      return ID2SYM(rb_intern("object_added"));
+
+    case LIBMTP_EVENT_OBJECT_REMOVED:
+      return ID2SYM(rb_intern("object_removed"));
+
+    case LIBMTP_EVENT_DEVICE_PROPERTY_CHANGED:
+      return ID2SYM(rb_intern("device_property_changed"));
+  }
+
+
+  return ID2SYM(rb_intern("unknown"));
+}
+
+
+/*
+ *  call-seq:
+ *     events.pop -> [type, param] or nil
+ *     events.pop(timeout) -> [type, param] or nil
+ *
+ *  Returns the next event, waiting up to <i>timeout</i> seconds, or forever when no timeout is given.
+ *  Returns nil when the timeout passes or once the reader is closed and every queued event was returned.
+ *
+ *  <i>type</i> is :object_added, :object_removed, :store_added, :store_removed or :device_property_changed
+ *  and <i>param</i> the object, storage or property the event is about.  The queue holds the latest 4096
+ *  events; when older ones were dropped the next pop returns [:overflow, 0] and a cache kept up to date
+ *  from the events must be rebuilt.
+ *
+ *  Before returning, :object_removed drops the object from the object map given to Device#events and
+ *  :store_added and :store_removed reread the storage list of the device.
+ *
+ *  Raises IOError when reading events failed, for instance because the device was disconnected.
+ *
+ */
+
+static VALUE events_pop(int argc, VALUE *argv, VALUE self)
+{
+  mtp_events_t *events = Get_MTP_Events(self);
+
+  VALUE timeout;
+
+  uint32_t param;
+
+  int type, status;
+
+
+  rb_scan_args(argc, argv, "01", &timeout);
+
+  status = events_take(events, NIL_P(timeout) ? -1 : NUM2DBL(timeout), &type, &param);
+
+  if(status < 0)
+  {
+    rb_raise(rb_eIOError, "Unable to read device events");
+  }
+
+  if(status == 0)
+  {
+    return Qnil;
+  }
+
+  events_apply(events, type, param);
+
+
+  return rb_assoc_new(events_type(type), UINT2NUM(param));
+}
+
+
+/*
+ *  call-seq:
+ *     events.each { |type, param| ... } -> events
+ *
+ *  Yields every event as it arrives (see Events#pop) until the reader is closed, for instance by the
+ *  block calling Events#close.
+ *
+ */
+
+static VALUE events_each(VALUE self)
+{
+  VALUE event;
+
+
+  rb_need_block();
+
+  while(!NIL_P(event = events_pop(0, NULL, self)))
+  {
+    rb_yield_values(2, RARRAY_PTR(event)[0], RARRAY_PTR(event)[1]);
+  }
+
+
+  return self;
+}
+
+
+/*
+ *  call-seq:
+ *     events.close -> nil
+ *
+ *  Stops the reader.  Events already queued can still be popped.
+ *
+ */
+
+static VALUE events_close(VALUE self)
+{
+  mtp_events_t *events = Get_MTP_Events(self);
+
+
+  mtp_without_gvl(events_stop, events);
+
+
+  return Qnil;
+}
+
+
+/*
+ *  call-seq:
+ *     events.closed? -> true or false
+ *
+ *  Returns whether the reader has stopped, because it was closed or because reading events failed.
+ *
+ */
+
+static VALUE events_is_closed(VALUE self)
+{
+  mtp_events_t *events = Get_MTP_Events(self);
+
+  int state;
+
+
+  pthread_mutex_lock(&events->lock);
+
+  state = events->state;
+
+  if(events->stop) state = EVENTS_STOPPED;
+
+  pthread_mutex_unlock(&events->lock);
+
+
+  return ((state == EVENTS_RUNNING) ? Qfalse : Qtrue);
+}
+
+
+#endif
+
+
+/*
+ *  call-seq:
+ *     device.events -> LibMTP::Device::Events
+ *     device.events(map: object_map) -> LibMTP::Device::Events
+ *     device.events { |type, param| ... } -> nil
+ *
+ *  Starts a native thread that reads the events the device sends and queues them for Events#pop, so
+ *  caches and indexes can follow changes made on the device itself instead of rescanning it.  The reader
+ *  does not take the device, so it never delays other calls.  With <i>map</i>, objects the device reports
+ *  as removed are dropped from that LibMTP::ObjectMap as their events are popped.
+ *
+ *  With a block, yields every event until the block breaks or closes the reader, and closes the reader
+ *  when the block returns.
+ *
+ *  Raises NotImplementedError when libmtp cannot read events asynchronously (libmtp older than 1.1.9):
+ *  a blocking reader could not be stopped until the device sent another event.
+ *
+ *  Wraps: <i>LIBMTP_Read_Event_Async</i>
+ *
+ */
+
+static VALUE device_events(int argc, VALUE *argv, VALUE self)
+{
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+  mtp_events_t *events;
+
+  VALUE obj;
+#endif
+
+  VALUE opts, map;
+
+
+  rb_scan_args(argc, argv, "01", &opts);
+
+  map = mtp_option(opts, "map");
+
+  if(!NIL_P(map)) Get_MTP_ObjectMap(map);
+
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+  obj = Data_Make_Struct(cMTPEvents, mtp_events_t, events_mark, events_free, events);
+
+  events->device = Get_MTP_Device(self);
+
+  events->owner = self;
+
+  events->map = map;
+
+  pthread_mutex_init(&events->lock, NULL);
+
+  pthread_cond_init(&events->ready, NULL);
+
+  if(pthread_create(&events->thread, NULL, events_run, events) != 0)
+  {
+    rb_raise(rb_eIOError, "Unable to start event reader");
+  }
+
+  events->started = 1;
+
+  events_register(events);
+
+  if(rb_block_given_p())
+  {
+    rb_ensure(events_each, obj, events_close, obj);
+
+    return Qnil;
+  }
+
+
+  return obj;
+#else
+  rb_raise(rb_eNotImpError, "Device events require libmtp 1.1.9 or later");
+
+
+  return Qnil;
+#endif
+}
+
+
+/*
+ * Stops every reader of a device that is being freed.  A reader keeps its
+ * Device alive, so this only finds readers that die in the same collection,
+ * which may be finalized after the device; they must not touch it then.
+ */
+
+void mtp_events_stop(mtp_device_t *device)
+{
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+  mtp_events_t *events;
+
+
+  while((events = device->events) != NULL)
+  {
+    device->events = events->next;
+
+    events_stop(events);
+
+    events->device = NULL;
+  }
+#endif
+
+
+  return;
+}
+
+
+/*
+ * Document-class: LibMTP::Device::Events
+ *
+ * The event reader of a device (see Device#events).  A native thread reads the events the device sends
+ * and queues them; Events#pop and Events#each return them on the Ruby side.
+ *
+ */
+
+void Init_LibMTP_Events(void)
+{
+  VALUE cMTPDevice = rb_const_get(mLibMTP, rb_intern("Device"));
+
+
+  cMTPEvents = rb_define_class_under(cMTPDevice, "Events", rb_cObject);
+
+  rb_undef_alloc_func(cMTPEvents);
+
+
+#ifdef HAVE_LIBMTP_READ_EVENT_ASYNC
+  rb_define_method(cMTPEvents, "pop", events_pop, -1);
+
+  rb_define_method(cMTPEvents, "each", events_each, 0);
+
+  rb_define_method(cMTPEvents, "close", events_close, 0);
+
+  rb_define_method(cMTPEvents, "closed?", events_is_closed, 0);
+#endif
+
+
+  rb_define_method(cMTPDevice, "events", device_events, -1);
+
+
+  return;
+}
@@ -90,6 +90,8 @@ static VALUE file_to_hash(VALUE self)
 
   rb_hash_aset(hash, rb_str_new2("parent_id"),    INT2NUM(file->parent_id));
 
+  rb_hash_aset(hash, rb_str_new2("storage_id"),   UINT2NUM(file->storage_id));
+
   if(file->filename != NULL)
   {
     rb_hash_aset(hash, rb_str_new2("file_name"),  rb_str_new2(file->filename));
@@ -99,7 +101,7 @@ static VALUE file_to_hash(VALUE self)
     rb_hash_aset(hash, rb_str_new2("file_name"),  Qnil);
   }
 
-  rb_hash_aset(hash, rb_str_new2("file_size"),    INT2NUM(file->filesize));
+  rb_hash_aset(hash, rb_str_new2("file_size"),    ULL2NUM(file->filesize));
 
   rb_hash_aset(hash, rb_str_new2("file_type"),    INT2NUM(file->filetype));
 
@@ -163,6 +165,10 @@ static VALUE file_aset(VALUE self, VALUE name, VALUE value)
   {
     file->parent_id = NUM2UINT(value);
   }
+  else if(strcmp("storage_id", ptr) == 0)
+  {
+    file->storage_id = NUM2UINT(value);
+  }
   else if(strcmp("file_name", ptr) == 0)
   {
     if(file->filename != NULL)
@@ -185,7 +191,7 @@ static VALUE file_aset(VALUE self, VALUE name, VALUE value)
   }
   else if(strcmp("file_size", ptr) == 0)
   {
-    file->filesize = NUM2UINT(value);
+    file->filesize = NUM2ULL(value);
   }
   else if(strcmp("file_type", ptr) == 0)
   {
@@ -312,6 +318,8 @@ static VALUE file_cmp_by_id(VALUE self, VALUE other)
  *
  *  parent_id       =>    Integer parent ID
  *
+ *  storage_id      =>    Integer storage ID
+ *
  *  file_name       =>    Filename string
  *
  *  file_size       =>    Integer file size
@@ -350,9 +358,9 @@ VALUE Get_LibMTP_File(VALUE value)
   VALUE hash;
 
 
-  if(rb_obj_is_instance_of(cMTPFile, rb_obj_class(value)))
+  if(rb_obj_is_instance_of(value, cMTPFile))
   {
-    file = cMTPFile;
+    file = value;
   }
   else
   {
@@ -378,6 +386,27 @@ VALUE Get_LibMTP_File(VALUE value)
 }
 
 
+/*
+ * Stores the size of a LibMTP::File in <i>size</i>.  Returns 0 when
+ * <i>value</i> is not one.
+ */
+
+int mtp_file_size(VALUE value, uint64_t *size)
+{
+  LIBMTP_file_t *file;
+
+
+  if(!RTEST(rb_obj_is_kind_of(value, cMTPFile))) return 0;
+
+  Data_Get_Struct(value, LIBMTP_file_t, file);
+
+  *size = file->filesize;
+
+
+  return 1;
+}
+
+
 VALUE Wrap_LibMTP_File(LIBMTP_file_t *file)
 {
   return Data_Wrap_Struct(cMTPFile, 0, file_free, file);
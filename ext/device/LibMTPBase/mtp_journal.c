@@ -0,0 +1,1426 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <sys/file.h>
+
+#include <sys/stat.h>
+
+#include "mtp_proto.h"
+
+
+#define RECORD_INTENT 1
+
+#define RECORD_DONE   2
+
+#define RECORD_EXISTING 3
+
+#define KEY_SEPARATOR "\037"
+
+
+static VALUE cMTPJournal;
+
+
+/*
+ * The journal file is a sequence of records, each a header followed by the
+ * key of a step.  An intent record is written before a step touches the
+ * device and a done record, with the ID the step produced, after it
+ * succeeded; both are flushed to disk before going on.  A step that makes a
+ * named object writes, together with its intent, an existing record for
+ * each object of that name already in the folder, so that recovery touches
+ * only objects the step made.  A torn record at the end, left by a crash
+ * while writing it, is cut off when the journal is opened.
+ */
+
+typedef struct mtp_journal_record_s
+{
+  uint32_t length;            /* of the key that follows */
+
+  uint32_t type;
+
+  uint32_t id;
+
+  uint32_t check;
+} mtp_journal_record_t;
+
+
+typedef struct mtp_journal_step_s
+{
+  int done;
+
+  uint32_t id;
+
+  uint32_t *existing;         /* objects of the step's name that were there before it */
+
+  long nexisting;
+} mtp_journal_step_t;
+
+
+typedef struct mtp_journal_s
+{
+  int fd;
+
+  st_table *steps;            /* key -> mtp_journal_step_t */
+
+  st_table *seen;             /* key -> times the batch has run the step */
+
+  long completed;
+
+  VALUE device;               /* while a batch runs */
+
+  int listed;
+
+  mtp_listing_t listing;      /* the device when the batch first looked, while it runs */
+
+  mtp_listing_t made;         /* objects the batch made since */
+} mtp_journal_t;
+
+
+static uint32_t journal_check(mtp_journal_record_t *record, const char *key)
+{
+  uint32_t hash = 2166136261U;
+
+  uint32_t i;
+
+
+  hash = (hash ^ record->type) * 16777619U;
+
+  hash = (hash ^ record->id) * 16777619U;
+
+  for(i=0; i < record->length; i++)
+  {
+    hash = (hash ^ (unsigned char)key[i]) * 16777619U;
+  }
+
+
+  return hash;
+}
+
+
+static int journal_free_step_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  free((char *)key);
+
+  xfree(((mtp_journal_step_t *)value)->existing);
+
+  xfree((void *)value);
+
+
+  return ST_DELETE;
+}
+
+
+static int journal_free_key_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  free((char *)key);
+
+
+  return ST_DELETE;
+}
+
+
+static void journal_remember(mtp_journal_t *journal, const char *key, int type, uint32_t id)
+{
+  mtp_journal_step_t *step;
+
+  st_data_t value;
+
+
+  if(st_lookup(journal->steps, (st_data_t)key, &value))
+  {
+    step = (mtp_journal_step_t *)value;
+  }
+  else
+  {
+    step = ALLOC(mtp_journal_step_t);
+
+    step->done = 0;
+
+    step->existing = NULL;
+
+    step->nexisting = 0;
+
+    st_insert(journal->steps, (st_data_t)strdup(key), (st_data_t)step);
+  }
+
+  if(type == RECORD_DONE)
+  {
+    if(!step->done) journal->completed++;
+
+    step->done = 1;
+
+    step->id = id;
+  }
+  else if(type == RECORD_EXISTING)
+  {
+    REALLOC_N(step->existing, uint32_t, step->nexisting + 1);
+
+    step->existing[step->nexisting++] = id;
+  }
+
+
+  return;
+}
+
+
+/*
+ * Reads the records of the journal file, and cuts off a torn one at the end.
+ */
+
+static void journal_load(mtp_journal_t *journal)
+{
+  mtp_journal_record_t record;
+
+  struct stat st;
+
+  char *data, *key;
+
+  off_t offset = 0;
+
+  ssize_t got;
+
+
+  if((fstat(journal->fd, &st) != 0) || (st.st_size == 0)) return;
+
+  data = ALLOC_N(char, st.st_size);
+
+  got = pread(journal->fd, data, st.st_size, 0);
+
+  while((got > 0) && (offset + (off_t)sizeof(record) <= got))
+  {
+    memcpy(&record, data + offset, sizeof(record));
+
+    if(offset + (off_t)sizeof(record) + record.length > got) break;
+
+    key = data + offset + sizeof(record);
+
+    if((journal_check(&record, key) != record.check) || ((record.type != RECORD_INTENT) && (record.type != RECORD_DONE) && (record.type != RECORD_EXISTING)))
+    {
+      break;
+    }
+
+    key = strndup(key, record.length);
+
+    journal_remember(journal, key, record.type, record.id);
+
+    free(key);
+
+    offset += sizeof(record) + record.length;
+  }
+
+  xfree(data);
+
+  if(offset < st.st_size)
+  {
+    if(ftruncate(journal->fd, offset) != 0)
+    {
+      rb_raise(rb_eIOError, "Unable to repair journal");
+    }
+  }
+
+  lseek(journal->fd, offset, SEEK_SET);
+
+
+  return;
+}
+
+
+/*
+ * Appends a record of <i>type</i> for <i>key</i> to the journal file, after
+ * an existing record for each of the <i>nexisting</i> objects given, and
+ * flushes it.  Returns -1 on failure rather than raising, so that it may be
+ * called with the device held.
+ */
+
+static int journal_append(mtp_journal_t *journal, const char *key, int type, uint32_t id, uint32_t *existing, long nexisting)
+{
+  mtp_journal_record_t record;
+
+  size_t length = strlen(key), size = (sizeof(record) + length) * (nexisting + 1);
+
+  char *buffer, *next;
+
+  long i;
+
+  int status;
+
+
+  if((buffer = (char *)malloc(size)) == NULL) return -1;
+
+  record.length = length;
+
+  for(i=0, next = buffer; i <= nexisting; i++, next += sizeof(record) + length)
+  {
+    record.type = (i < nexisting) ? RECORD_EXISTING : type;
+
+    record.id = (i < nexisting) ? existing[i] : id;
+
+    record.check = journal_check(&record, key);
+
+    memcpy(next, &record, sizeof(record));
+
+    memcpy(next + sizeof(record), key, length);
+  }
+
+  status = (write(journal->fd, buffer, size) == (ssize_t)size) && (fdatasync(journal->fd) == 0);
+
+  free(buffer);
+
+  if(!status) return -1;
+
+  for(i=0; i < nexisting; i++)
+  {
+    journal_remember(journal, key, RECORD_EXISTING, existing[i]);
+  }
+
+  journal_remember(journal, key, type, id);
+
+
+  return 0;
+}
+
+
+static void journal_write(mtp_journal_t *journal, const char *key, int type, uint32_t id)
+{
+  if(journal_append(journal, key, type, id, NULL, 0) != 0)
+  {
+    rb_raise(rb_eIOError, "Unable to write journal");
+  }
+
+
+  return;
+}
+
+
+static void journal_reset(mtp_journal_t *journal)
+{
+  st_foreach(journal->steps, journal_free_step_i, 0);
+
+  journal->completed = 0;
+
+  if((ftruncate(journal->fd, 0) != 0) || (lseek(journal->fd, 0, SEEK_SET) != 0) || (fdatasync(journal->fd) != 0))
+  {
+    rb_raise(rb_eIOError, "Unable to write journal");
+  }
+
+
+  return;
+}
+
+
+static mtp_journal_t *journal_get(VALUE self)
+{
+  mtp_journal_t *journal;
+
+
+  Data_Get_Struct(self, mtp_journal_t, journal);
+
+  if(journal->fd < 0)
+  {
+    rb_raise(rb_eIOError, "Journal is closed");
+  }
+
+
+  return journal;
+}
+
+
+static mtp_journal_t *journal_running(VALUE self)
+{
+  mtp_journal_t *journal = journal_get(self);
+
+
+  if(NIL_P(journal->device))
+  {
+    rb_raise(rb_eRuntimeError, "Journal steps must be run inside LibMTP::Journal#run");
+  }
+
+
+  return journal;
+}
+
+
+/*
+ * Turns the description of a step into its key.  A batch may run the same
+ * step more than once, so the key counts the runs.
+ */
+
+static char *journal_key(mtp_journal_t *journal, VALUE description)
+{
+  st_data_t count = 0;
+
+  char *base = StringValueCStr(description);
+
+  char *key;
+
+
+  st_lookup(journal->seen, (st_data_t)base, &count);
+
+  if(count == 0)
+  {
+    st_insert(journal->seen, (st_data_t)strdup(base), 1);
+  }
+  else
+  {
+    st_insert(journal->seen, (st_data_t)base, count + 1);
+  }
+
+  key = (char *)malloc(strlen(base) + 16);
+
+  sprintf(key, "%s" KEY_SEPARATOR "%lu", base, (unsigned long)count);
+
+
+  return key;
+}
+
+
+/*
+ * Takes the device of the journal for a step.  An interrupted wait frees
+ * <i>key</i> before it is raised.
+ */
+
+static mtp_device_t *journal_lock(mtp_journal_t *journal, char *key)
+{
+  mtp_device_t *device = Get_MTP_Device(journal->device);
+
+  int state;
+
+
+  state = mtp_device_lock_protect(device, mtp_priority(MTP_PRIORITY_NORMAL));
+
+  if(state != 0)
+  {
+    free(key);
+
+    rb_jump_tag(state);
+  }
+
+
+  return device;
+}
+
+
+#define STEP_NEW       0
+
+#define STEP_DONE      1
+
+#define STEP_RECOVER   2
+
+/*
+ * Looks a step up before running it.  A done step has its ID set.
+ * STEP_RECOVER means its intent was logged by an earlier run, so the step
+ * may have been cut short by a crash and partly happened.
+ */
+
+static int journal_lookup(mtp_journal_t *journal, const char *key, uint32_t *id)
+{
+  mtp_journal_step_t *step;
+
+  st_data_t value;
+
+
+  if(!st_lookup(journal->steps, (st_data_t)key, &value))
+  {
+    return STEP_NEW;
+  }
+
+  step = (mtp_journal_step_t *)value;
+
+  if(step->done)
+  {
+    *id = step->id;
+
+    return STEP_DONE;
+  }
+
+
+  return STEP_RECOVER;
+}
+
+
+/*
+ * Looks a step up and logs the intent of a new one.
+ */
+
+static int journal_begin(mtp_journal_t *journal, const char *key, uint32_t *id)
+{
+  int state = journal_lookup(journal, key, id);
+
+
+  if(state == STEP_NEW) journal_write(journal, key, RECORD_INTENT, 0);
+
+
+  return state;
+}
+
+
+static int journal_match(mtp_listing_entry_t *object, uint32_t storage, uint32_t parent, const char *name, int folder)
+{
+  return ((object->parent_id == parent) && ((storage == 0) || (object->storage_id == storage)) &&
+          ((object->folder != 0) == (folder != 0)) && (strcmp(object->name, name) == 0));
+}
+
+
+/*
+ * Collects the objects named <i>name</i> in folder <i>parent</i>: those on
+ * the device when the batch first looked and those it made since.  Returns
+ * their number, or -1 when the device cannot be listed.  Called with the
+ * device held.
+ */
+
+static long journal_matches(mtp_journal_t *journal, mtp_device_t *device, uint32_t storage, uint32_t parent, const char *name,
+                            int folder, mtp_listing_entry_t ***found)
+{
+  mtp_listing_entry_t **matches;
+
+  long i, first, count, n = 0;
+
+
+  if(!journal->listed)
+  {
+    if(mtp_listing_read(device, 0, &journal->listing) != 0) return -1;
+
+    journal->listed = 1;
+  }
+
+  count = mtp_listing_children(&journal->listing, parent, &first);
+
+  if((matches = (mtp_listing_entry_t **)malloc(sizeof(mtp_listing_entry_t *) * (count + journal->made.count + 1))) == NULL)
+  {
+    return -1;
+  }
+
+  for(i=first; i < first + count; i++)
+  {
+    if(journal_match(&journal->listing.entries[i], storage, parent, name, folder)) matches[n++] = &journal->listing.entries[i];
+  }
+
+  for(i=0; i < journal->made.count; i++)
+  {
+    if(journal_match(&journal->made.entries[i], storage, parent, name, folder)) matches[n++] = &journal->made.entries[i];
+  }
+
+  *found = matches;
+
+
+  return n;
+}
+
+
+/*
+ * Finds the object a step cut short by a crash made.  Only objects absent
+ * from the existing records of its intent can be the step's; of those, a
+ * file of the wrong size is a partial upload and is deleted.
+ */
+
+static uint32_t journal_adopt(mtp_journal_t *journal, mtp_device_t *device, const char *key, mtp_listing_entry_t **found, long nfound,
+                              int folder, uint64_t size)
+{
+  mtp_journal_step_t *step;
+
+  st_data_t value;
+
+  uint32_t id = 0;
+
+  long i, k;
+
+
+  if(!st_lookup(journal->steps, (st_data_t)key, &value)) return 0;
+
+  step = (mtp_journal_step_t *)value;
+
+  for(i=0; i < nfound; i++)
+  {
+    for(k=0; (k < step->nexisting) && (step->existing[k] != found[i]->id); k++);
+
+    if(k < step->nexisting) continue;
+
+    if(folder || (found[i]->size == size))
+    {
+      if(id == 0) id = found[i]->id;
+    }
+    else
+    {
+      LIBMTP_Delete_Object(device->device, found[i]->id);
+    }
+  }
+
+
+  return id;
+}
+
+
+/*
+ * Readies a step that makes the object <i>name</i> in folder <i>parent</i>:
+ * a new step has its intent logged along with the objects of that name
+ * already there, and a step cut short has the object it made, if any, set
+ * in <i>id</i>.  Returns an error message, or NULL.  Called with the device
+ * held, so nothing here raises.
+ */
+
+static const char *journal_prepare(mtp_journal_t *journal, mtp_device_t *device, const char *key, int state, uint32_t storage,
+                                   uint32_t parent, const char *name, int folder, uint64_t size, uint32_t *id)
+{
+  mtp_listing_entry_t **found;
+
+  uint32_t *existing;
+
+  long i, nfound;
+
+  int status;
+
+
+  if((nfound = journal_matches(journal, device, storage, parent, name, folder, &found)) < 0)
+  {
+    return "Unable to list device";
+  }
+
+  if(state == STEP_RECOVER)
+  {
+    *id = journal_adopt(journal, device, key, found, nfound, folder, size);
+
+    free(found);
+
+    return NULL;
+  }
+
+  if((existing = (uint32_t *)malloc(sizeof(uint32_t) * (nfound + 1))) == NULL)
+  {
+    free(found);
+
+    return "Unable to write journal";
+  }
+
+  for(i=0; i < nfound; i++)
+  {
+    existing[i] = found[i]->id;
+  }
+
+  status = journal_append(journal, key, RECORD_INTENT, 0, existing, nfound);
+
+  free(existing);
+
+  free(found);
+
+
+  return ((status == 0) ? NULL : "Unable to write journal");
+}
+
+
+/*
+ * Notes an object a step made, for the steps that follow.
+ */
+
+static void journal_made(mtp_journal_t *journal, uint32_t id, uint32_t storage, uint32_t parent, const char *name, uint64_t size, int folder)
+{
+  if(journal->listed) mtp_listing_add(&journal->made, id, parent, storage, name, size, 0, folder);
+
+
+  return;
+}
+
+
+/*
+ *  call-seq:
+ *     journal.folder_create(parent, name) -> folder ID
+ *     journal.folder_create(parent, name, storage_id) -> folder ID
+ *
+ *  Creates the folder <i>name</i> in the folder <i>parent</i> (0 for the root) as a step of the batch.
+ *
+ *  Wraps: <i>LIBMTP_Create_Folder</i>
+ *
+ */
+
+static VALUE journal_folder_create(int argc, VALUE *argv, VALUE self)
+{
+  mtp_journal_t *journal = journal_running(self);
+
+  VALUE parent, name, storage;
+
+  mtp_device_t *device;
+
+  uint32_t parent_id, storage_id = 0, id = 0;
+
+  const char *error;
+
+  char *key, *name_ptr;
+
+  int state;
+
+
+  rb_scan_args(argc, argv, "21", &parent, &name, &storage);
+
+  parent_id = NUM2UINT(parent);
+
+  if(!NIL_P(storage)) storage_id = NUM2UINT(storage);
+
+  name_ptr = StringValueCStr(name);
+
+  key = journal_key(journal, rb_str_concat(rb_str_new2("folder_create" KEY_SEPARATOR),
+                    rb_funcall(rb_ary_new3(3, parent, name, UINT2NUM(storage_id)), rb_intern("join"), 1, rb_str_new2(KEY_SEPARATOR))));
+
+  state = journal_lookup(journal, key, &id);
+
+  if(state != STEP_DONE)
+  {
+    device = journal_lock(journal, key);
+
+    error = journal_prepare(journal, device, key, state, storage_id, parent_id, name_ptr, 1, 0, &id);
+
+    if((error == NULL) && (id == 0))
+    {
+      id = LIBMTP_Create_Folder(device->device, name_ptr, parent_id, storage_id);
+
+      if(id != 0) journal_made(journal, id, storage_id, parent_id, name_ptr, 0, 1);
+    }
+
+    mtp_device_unlock(device);
+
+    if((error != NULL) || (id == 0))
+    {
+      free(key);
+
+      rb_raise(rb_eIOError, (error != NULL) ? error : "Unable to create folder");
+    }
+
+    journal_write(journal, key, RECORD_DONE, id);
+  }
+
+  free(key);
+
+
+  return UINT2NUM(id);
+}
+
+
+typedef struct mtp_journal_send_s
+{
+  mtp_device_t *device;
+
+  const char *path;
+
+  void *object;
+
+  int track;
+
+  int status;
+} mtp_journal_send_t;
+
+
+static void *journal_send_blocking(void *ptr)
+{
+  mtp_journal_send_t *send = (mtp_journal_send_t *)ptr;
+
+
+  if(send->track)
+  {
+    send->status = LIBMTP_Send_Track_From_File(send->device->device, send->path, (LIBMTP_track_t *)send->object, NULL, NULL);
+  }
+  else
+  {
+    send->status = LIBMTP_Send_File_From_File(send->device->device, send->path, (LIBMTP_file_t *)send->object, NULL, NULL);
+  }
+
+
+  return NULL;
+}
+
+
+static VALUE journal_send(VALUE self, VALUE parent, VALUE pathname, VALUE object, int track)
+{
+  mtp_journal_t *journal = journal_running(self);
+
+  mtp_journal_send_t send;
+
+  LIBMTP_track_t *track_ptr = NULL;
+
+  LIBMTP_file_t *file_ptr = NULL;
+
+  uint32_t id = 0, storage_id, parent_id = NUM2UINT(parent);
+
+  const char *filename, *error;
+
+  char *key;
+
+  struct stat st;
+
+  int state;
+
+
+  memset(&send, 0, sizeof(send));
+
+  send.path = StringValueCStr(pathname);
+
+  send.track = track;
+
+  /* a hash becomes a new wrapper, which must outlive track_ptr or file_ptr */
+  if(track)
+  {
+    object = Get_LibMTP_Track(object);
+
+    Data_Get_Struct(object, LIBMTP_track_t, track_ptr);
+
+    track_ptr->parent_id = parent_id;
+
+    filename = track_ptr->filename;
+
+    storage_id = track_ptr->storage_id;
+
+    send.object = track_ptr;
+  }
+  else
+  {
+    object = Get_LibMTP_File(object);
+
+    Data_Get_Struct(object, LIBMTP_file_t, file_ptr);
+
+    file_ptr->parent_id = parent_id;
+
+    filename = file_ptr->filename;
+
+    storage_id = file_ptr->storage_id;
+
+    send.object = file_ptr;
+  }
+
+  if((filename == NULL) || (stat(send.path, &st) != 0))
+  {
+    rb_raise(rb_eIOError, "Unable to send file");
+  }
+
+  key = journal_key(journal, rb_str_concat(rb_str_new2(track ? "track_send_file" KEY_SEPARATOR : "file_send" KEY_SEPARATOR),
+                    rb_funcall(rb_ary_new3(3, parent, rb_str_new2(filename), pathname), rb_intern("join"), 1, rb_str_new2(KEY_SEPARATOR))));
+
+  state = journal_lookup(journal, key, &id);
+
+  if(state != STEP_DONE)
+  {
+    send.device = journal_lock(journal, key);
+
+    error = journal_prepare(journal, send.device, key, state, storage_id, parent_id, filename, 0, st.st_size, &id);
+
+    if((error == NULL) && (id == 0))
+    {
+      mtp_without_gvl(journal_send_blocking, &send);
+
+      if(send.status == 0)
+      {
+        id = track ? track_ptr->item_id : file_ptr->item_id;
+
+        journal_made(journal, id, storage_id, parent_id, filename, st.st_size, 0);
+      }
+    }
+
+    mtp_device_unlock(send.device);
+
+    if((error != NULL) || (id == 0))
+    {
+      free(key);
+
+      rb_raise(rb_eIOError, (error != NULL) ? error : (track ? "Unable to send track" : "Unable to send file"));
+    }
+
+    journal_write(journal, key, RECORD_DONE, id);
+  }
+
+  free(key);
+
+  if(track) track_ptr->item_id = id; else file_ptr->item_id = id;
+
+  RB_GC_GUARD(object);
+
+
+  return UINT2NUM(id);
+}
+
+
+/*
+ *  call-seq:
+ *     journal.file_send(parent, pathname, file) -> object ID
+ *
+ *  Sends a file into the folder <i>parent</i> as a step of the batch (see Device#file_send).
+ *
+ *  Wraps: <i>LIBMTP_Send_File_From_File</i>
+ *
+ */
+
+static VALUE journal_file_send(VALUE self, VALUE parent, VALUE pathname, VALUE file)
+{
+  return journal_send(self, parent, pathname, file, 0);
+}
+
+
+/*
+ *  call-seq:
+ *     journal.track_send_file(parent, pathname, track) -> object ID
+ *
+ *  Sends a track into the folder <i>parent</i> as a step of the batch (see Device#track_send_file).
+ *
+ *  Wraps: <i>LIBMTP_Send_Track_From_File</i>
+ *
+ */
+
+static VALUE journal_track_send_file(VALUE self, VALUE parent, VALUE pathname, VALUE track)
+{
+  return journal_send(self, parent, pathname, track, 1);
+}
+
+
+/*
+ *  call-seq:
+ *     journal.playlist_create(playlist) -> playlist ID
+ *
+ *  Creates the LibMTP::Playlist <i>playlist</i> as a step of the batch.  A playlist of the same name found after
+ *  a crash during the step is updated instead.
+ *
+ *  Wraps: <i>LIBMTP_Create_New_Playlist</i>
+ *
+ */
+
+static VALUE journal_playlist_create(VALUE self, VALUE playlist)
+{
+  mtp_journal_t *journal = journal_running(self);
+
+  LIBMTP_playlist_t *playlist_ptr, *list, *item, *next;
+
+  mtp_device_t *device;
+
+  uint32_t id = 0;
+
+  char *key;
+
+  int state, status = 0;
+
+
+  Data_Get_Struct(playlist, LIBMTP_playlist_t, playlist_ptr);
+
+  if(playlist_ptr->name == NULL)
+  {
+    rb_raise(rb_eIOError, "Unable to create playlist");
+  }
+
+  key = journal_key(journal, rb_str_concat(rb_str_new2("playlist_create" KEY_SEPARATOR),
+                    rb_funcall(rb_ary_new3(2, UINT2NUM(playlist_ptr->parent_id), rb_str_new2(playlist_ptr->name)),
+                               rb_intern("join"), 1, rb_str_new2(KEY_SEPARATOR))));
+
+  state = journal_begin(journal, key, &id);
+
+  if(state != STEP_DONE)
+  {
+    device = journal_lock(journal, key);
+
+    if(state == STEP_RECOVER)
+    {
+      list = LIBMTP_Get_Playlist_List(device->device);
+
+      for(item = list; item != NULL; item = next)
+      {
+        next = item->next;
+
+        /* the newest of several playlists of that name is the one the step made */
+        if((item->name != NULL) && (strcmp(item->name, playlist_ptr->name) == 0) && (item->playlist_id > id))
+        {
+          id = item->playlist_id;
+        }
+
+        LIBMTP_destroy_playlist_t(item);
+      }
+
+      if(id != 0)
+      {
+        playlist_ptr->playlist_id = id;
+
+        status = LIBMTP_Update_Playlist(device->device, playlist_ptr);
+      }
+    }
+
+    if(id == 0)
+    {
+      status = LIBMTP_Create_New_Playlist(device->device, playlist_ptr);
+
+      id = playlist_ptr->playlist_id;
+    }
+
+    mtp_device_unlock(device);
+
+    if((status != 0) || (id == 0))
+    {
+      free(key);
+
+      rb_raise(rb_eIOError, "Unable to create playlist");
+    }
+
+    journal_write(journal, key, RECORD_DONE, id);
+  }
+
+  free(key);
+
+  playlist_ptr->playlist_id = id;
+
+
+  return UINT2NUM(id);
+}
+
+
+/*
+ *  call-seq:
+ *     journal.playlist_update(playlist) -> playlist
+ *
+ *  Updates the LibMTP::Playlist <i>playlist</i> on the device as a step of the batch.
+ *
+ *  Wraps: <i>LIBMTP_Update_Playlist</i>
+ *
+ */
+
+static VALUE journal_playlist_update(VALUE self, VALUE playlist)
+{
+  mtp_journal_t *journal = journal_running(self);
+
+  LIBMTP_playlist_t *playlist_ptr;
+
+  mtp_device_t *device;
+
+  uint32_t id = 0;
+
+  char *key;
+
+  int status;
+
+
+  Data_Get_Struct(playlist, LIBMTP_playlist_t, playlist_ptr);
+
+  key = journal_key(journal, rb_str_concat(rb_str_new2("playlist_update" KEY_SEPARATOR), rb_obj_as_string(UINT2NUM(playlist_ptr->playlist_id))));
+
+  /* updating twice does no harm, so a step cut short is simply run again */
+  if(journal_begin(journal, key, &id) != STEP_DONE)
+  {
+    device = journal_lock(journal, key);
+
+    status = LIBMTP_Update_Playlist(device->device, playlist_ptr);
+
+    mtp_device_unlock(device);
+
+    if(status != 0)
+    {
+      free(key);
+
+      rb_raise(rb_eIOError, "Unable to send playlist");
+    }
+
+    journal_write(journal, key, RECORD_DONE, playlist_ptr->playlist_id);
+  }
+
+  free(key);
+
+
+  return playlist;
+}
+
+
+/*
+ *  call-seq:
+ *     journal.delete_object(id) -> true
+ *
+ *  Deletes the object <i>id</i> as a step of the batch.  When the step is run again after a crash, an object that
+ *  is already gone counts as deleted.
+ *
+ *  Wraps: <i>LIBMTP_Delete_Object</i>
+ *
+ */
+
+static VALUE journal_delete_object(VALUE self, VALUE id)
+{
+  mtp_journal_t *journal = journal_running(self);
+
+  mtp_device_t *device;
+
+  uint32_t done_id, object_id = NUM2UINT(id);
+
+  char *key;
+
+  int state, status;
+
+
+  key = journal_key(journal, rb_str_concat(rb_str_new2("delete_object" KEY_SEPARATOR), rb_obj_as_string(id)));
+
+  state = journal_begin(journal, key, &done_id);
+
+  if(state != STEP_DONE)
+  {
+    device = journal_lock(journal, key);
+
+    status = LIBMTP_Delete_Object(device->device, object_id);
+
+    mtp_device_unlock(device);
+
+    if((status != 0) && (state != STEP_RECOVER))
+    {
+      free(key);
+
+      rb_raise(rb_eIOError, "Unable to delete object");
+    }
+
+    journal_write(journal, key, RECORD_DONE, object_id);
+  }
+
+  free(key);
+
+
+  return Qtrue;
+}
+
+
+static void journal_close(mtp_journal_t *journal)
+{
+  if(journal->fd >= 0)
+  {
+    close(journal->fd);
+
+    journal->fd = -1;
+  }
+
+  st_foreach(journal->steps, journal_free_step_i, 0);
+
+  journal->completed = 0;
+
+
+  return;
+}
+
+
+static void journal_mark(void *ptr)
+{
+  rb_gc_mark(((mtp_journal_t *)ptr)->device);
+
+
+  return;
+}
+
+
+static void journal_free(void *ptr)
+{
+  mtp_journal_t *journal = (mtp_journal_t *)ptr;
+
+
+  journal_close(journal);
+
+  st_foreach(journal->seen, journal_free_key_i, 0);
+
+  st_free_table(journal->steps);
+
+  st_free_table(journal->seen);
+
+  xfree(journal);
+
+
+  return;
+}
+
+
+static VALUE journal_alloc(VALUE klass)
+{
+  mtp_journal_t *journal;
+
+
+  journal = ALLOC(mtp_journal_t);
+
+  memset(journal, 0, sizeof(mtp_journal_t));
+
+  journal->fd = -1;
+
+  journal->steps = st_init_strtable();
+
+  journal->seen = st_init_strtable();
+
+  journal->device = Qnil;
+
+
+  return Data_Wrap_Struct(klass, journal_mark, journal_free, journal);
+}
+
+
+/*
+ *  call-seq:
+ *     LibMTP::Journal.new(path) -> New LibMTP::Journal object.
+ *
+ *  Opens the journal file <i>path</i>, creating it if needed.  Only one LibMTP::Journal may have a file open at a
+ *  time.
+ *
+ */
+
+static VALUE journal_init(VALUE self, VALUE path)
+{
+  mtp_journal_t *journal;
+
+
+  Data_Get_Struct(self, mtp_journal_t, journal);
+
+  journal_close(journal);
+
+  journal->fd = open(StringValueCStr(path), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+  if(journal->fd < 0)
+  {
+    rb_raise(rb_eIOError, "Unable to open journal");
+  }
+
+  if(flock(journal->fd, LOCK_EX | LOCK_NB) != 0)
+  {
+    journal_close(journal);
+
+    rb_raise(rb_eIOError, "Journal is in use");
+  }
+
+  journal_load(journal);
+
+
+  return self;
+}
+
+
+static VALUE journal_run_body(VALUE self)
+{
+  VALUE result = rb_yield(self);
+
+
+  journal_reset(journal_get(self));
+
+
+  return result;
+}
+
+
+static VALUE journal_run_ensure(VALUE self)
+{
+  mtp_journal_t *journal;
+
+
+  Data_Get_Struct(self, mtp_journal_t, journal);
+
+  journal->device = Qnil;
+
+  st_foreach(journal->seen, journal_free_key_i, 0);
+
+  if(journal->listed)
+  {
+    mtp_listing_free(&journal->listing);
+
+    mtp_listing_free(&journal->made);
+
+    journal->listed = 0;
+  }
+
+
+  return Qnil;
+}
+
+
+/*
+ *  call-seq:
+ *     journal.run(device) { |journal| ... } -> result of the block
+ *
+ *  Runs the batch in the block against <i>device</i>.  Each step the block runs through the journal is logged
+ *  before and after it touches the device.
+ *
+ *  When the block finishes the batch is complete and the journal is emptied.  When it raises, or the process
+ *  dies, the journal keeps the completed steps: running the same batch again skips them, returning the IDs they
+ *  produced, and finishes the rest.  A step that was cut short is checked on the device first, so that a folder
+ *  or file it already made is reused rather than made twice (a partly sent file is deleted and sent again).
+ *  Objects of the same name that were there before the step are never reused or deleted: a step that creates
+ *  or sends an object logs them with its intent.  The device is listed once per run for this.
+ *
+ *  Steps are matched by what they do, such as the parent, name and local path of a send, so the batch may
+ *  compute its steps afresh when it is run again.
+ *
+ */
+
+static VALUE journal_run(VALUE self, VALUE device)
+{
+  mtp_journal_t *journal = journal_get(self);
+
+
+  rb_need_block();
+
+  Get_MTP_Device(device);
+
+  if(!NIL_P(journal->device))
+  {
+    rb_raise(rb_eRuntimeError, "Journal is running");
+  }
+
+  journal->device = device;
+
+
+  return rb_ensure(journal_run_body, self, journal_run_ensure, self);
+}
+
+
+/*
+ *  call-seq:
+ *     journal.pending?() -> true or false
+ *
+ *  Returns true when the journal holds an unfinished batch.
+ *
+ */
+
+static VALUE journal_pending(VALUE self)
+{
+  return ((journal_get(self)->steps->num_entries > 0) ? Qtrue : Qfalse);
+}
+
+
+/*
+ *  call-seq:
+ *     journal.completed() -> number of steps
+ *
+ *  Returns the number of steps of the unfinished batch that have completed.
+ *
+ */
+
+static VALUE journal_completed(VALUE self)
+{
+  return LONG2NUM(journal_get(self)->completed);
+}
+
+
+/*
+ *  call-seq:
+ *     journal.discard() -> journal
+ *
+ *  Forgets an unfinished batch, so that running it again starts from the first step.
+ *
+ */
+
+static VALUE journal_discard(VALUE self)
+{
+  mtp_journal_t *journal = journal_get(self);
+
+
+  if(!NIL_P(journal->device))
+  {
+    rb_raise(rb_eRuntimeError, "Journal is running");
+  }
+
+  journal_reset(journal);
+
+
+  return self;
+}
+
+
+/*
+ *  call-seq:
+ *     journal.close() -> nil
+ *
+ */
+
+static VALUE journal_close_m(VALUE self)
+{
+  mtp_journal_t *journal;
+
+
+  Data_Get_Struct(self, mtp_journal_t, journal);
+
+  if(!NIL_P(journal->device))
+  {
+    rb_raise(rb_eRuntimeError, "Journal is running");
+  }
+
+  journal_close(journal);
+
+
+  return Qnil;
+}
+
+
+/*
+ *  Document-class: LibMTP::Journal
+ *
+ *  A LibMTP::Journal makes a batch of device operations resumable.  The batch is a block whose steps go
+ *  through the journal, which logs them to an append-only file:
+ *
+ *  <code>journal = LibMTP::Journal.new('/var/lib/kiosk/upload.journal')</code>
+ *
+ *  <code>journal.run(device) do |j|</code>
+ *
+ *  <code>  folder = j.folder_create(0, 'Music')</code>
+ *
+ *  <code>  paths.each_with_index { |path, i| playlist[i] = j.track_send_file(folder, path, tags(path)) }</code>
+ *
+ *  <code>  j.playlist_create(playlist)</code>
+ *
+ *  <code>end</code>
+ *
+ *  If the process dies half way, running the same code again picks up after the last completed step instead of
+ *  creating the folder and sending the tracks a second time.
+ *
+ */
+
+void Init_LibMTP_Journal(void)
+{
+  cMTPJournal = rb_define_class_under(mLibMTP, "Journal", rb_cObject);
+
+  rb_define_alloc_func(cMTPJournal, journal_alloc);
+
+
+  rb_define_method(cMTPJournal, "initialize", journal_init, 1);
+
+  rb_define_method(cMTPJournal, "run", journal_run, 1);
+
+  rb_define_method(cMTPJournal, "pending?", journal_pending, 0);
+
+  rb_define_method(cMTPJournal, "completed", journal_completed, 0);
+
+  rb_define_method(cMTPJournal, "discard", journal_discard, 0);
+
+  rb_define_method(cMTPJournal, "close", journal_close_m, 0);
+
+
+  rb_define_method(cMTPJournal, "folder_create", journal_folder_create, -1);
+
+  rb_define_method(cMTPJournal, "file_send", journal_file_send, 3);
+
+  rb_define_method(cMTPJournal, "track_send_file", journal_track_send_file, 3);
+
+  rb_define_method(cMTPJournal, "playlist_create", journal_playlist_create, 1);
+
+  rb_define_method(cMTPJournal, "playlist_update", journal_playlist_update, 1);
+
+  rb_define_method(cMTPJournal, "delete_object", journal_delete_object, 1);
+
+
+  return;
+}
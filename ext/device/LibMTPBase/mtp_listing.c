@@ -0,0 +1,232 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include "mtp_proto.h"
+
+
+/*
+ * A snapshot of the objects on a device, for code that walks folders.
+ * Devices are opened with libmtp's object cache, which makes libmtp refuse
+ * LIBMTP_Get_Files_And_Folders, so the snapshot is built from the file and
+ * folder listings of the whole device instead and children are found by
+ * sorting on the parent.  Nothing here calls into Ruby, so a listing may be
+ * read and used without the GVL.
+ */
+
+static int listing_cmp(const void *a, const void *b)
+{
+  const mtp_listing_entry_t *x = (const mtp_listing_entry_t *)a, *y = (const mtp_listing_entry_t *)b;
+
+
+  if(x->parent_id != y->parent_id) return ((x->parent_id < y->parent_id) ? -1 : 1);
+
+
+  return ((x->id < y->id) ? -1 : (x->id > y->id));
+}
+
+
+/*
+ * Adds an object to a listing.  Returns -1 when out of memory.
+ */
+
+int mtp_listing_add(mtp_listing_t *listing, uint32_t id, uint32_t parent_id, uint32_t storage_id, const char *name,
+                    uint64_t size, time_t mtime, int folder)
+{
+  mtp_listing_entry_t *entries, *entry;
+
+  long capa;
+
+
+  if(listing->count == listing->capa)
+  {
+    capa = (listing->capa > 0) ? listing->capa * 2 : 256;
+
+    entries = (mtp_listing_entry_t *)realloc(listing->entries, sizeof(mtp_listing_entry_t) * capa);
+
+    if(entries == NULL) return -1;
+
+    listing->entries = entries;
+
+    listing->capa = capa;
+  }
+
+  entry = &listing->entries[listing->count];
+
+  if((entry->name = strdup(name)) == NULL) return -1;
+
+  /* some devices give objects in the root the parent 0xffffffff */
+  entry->parent_id = (parent_id == 0xffffffff) ? 0 : parent_id;
+
+  entry->id = id;
+
+  entry->storage_id = storage_id;
+
+  entry->size = size;
+
+  entry->mtime = mtime;
+
+  entry->folder = folder;
+
+  listing->count++;
+
+  listing->sorted = 0;
+
+
+  return 0;
+}
+
+
+static int listing_add_folders(mtp_listing_t *listing, LIBMTP_folder_t *folder, uint32_t storage_id)
+{
+  for(; folder != NULL; folder = folder->sibling)
+  {
+    if((storage_id != 0) && (folder->storage_id != storage_id)) continue;
+
+    if(folder->name != NULL)
+    {
+      if(mtp_listing_add(listing, folder->folder_id, folder->parent_id, folder->storage_id, folder->name, 0, 0, 1) != 0)
+      {
+        return -1;
+      }
+    }
+
+    if(listing_add_folders(listing, folder->child, storage_id) != 0) return -1;
+  }
+
+
+  return 0;
+}
+
+
+/*
+ * Reads every file and folder on the storage <i>storage_id</i>, or on all
+ * storages when it is 0.  Returns -1 when the device could not be listed,
+ * which is not the same as an empty storage.  Called with the device held.
+ */
+
+int mtp_listing_read(mtp_device_t *device, uint32_t storage_id, mtp_listing_t *listing)
+{
+  LIBMTP_file_t *files, *file, *next;
+
+  LIBMTP_folder_t *folders;
+
+  int status = 0;
+
+
+  memset(listing, 0, sizeof(mtp_listing_t));
+
+  /* both calls return NULL for an empty device too; only the error stack tells a failure apart */
+  LIBMTP_Clear_Errorstack(device->device);
+
+  folders = LIBMTP_Get_Folder_List(device->device);
+
+  if((folders == NULL) && (LIBMTP_Get_Errorstack(device->device) != NULL)) return -1;
+
+  status = listing_add_folders(listing, folders, storage_id);
+
+  if(folders != NULL) LIBMTP_destroy_folder_t(folders);
+
+  files = LIBMTP_Get_Filelisting_With_Callback(device->device, NULL, NULL);
+
+  if((files == NULL) && (LIBMTP_Get_Errorstack(device->device) != NULL)) status = -1;
+
+  for(file = files; file != NULL; file = next)
+  {
+    next = file->next;
+
+    /* folders come from the folder list */
+    if((status == 0) && (file->filename != NULL) && (file->filetype != LIBMTP_FILETYPE_FOLDER) &&
+       ((storage_id == 0) || (file->storage_id == storage_id)))
+    {
+      status = mtp_listing_add(listing, file->item_id, file->parent_id, file->storage_id, file->filename,
+                               file->filesize, file->modificationdate, 0);
+    }
+
+    LIBMTP_destroy_file_t(file);
+  }
+
+  if(status != 0) mtp_listing_free(listing);
+
+
+  return status;
+}
+
+
+/*
+ * Returns the number of objects in folder <i>parent_id</i> (0 for the root)
+ * and sets <i>first</i> to the index of the first of them.
+ */
+
+long mtp_listing_children(mtp_listing_t *listing, uint32_t parent_id, long *first)
+{
+  long low = 0, high = listing->count, end;
+
+
+  if(!listing->sorted)
+  {
+    qsort(listing->entries, listing->count, sizeof(mtp_listing_entry_t), listing_cmp);
+
+    listing->sorted = 1;
+  }
+
+  while(low < high)
+  {
+    if(listing->entries[(low + high) / 2].parent_id < parent_id) low = (low + high) / 2 + 1; else high = (low + high) / 2;
+  }
+
+  for(end = low; (end < listing->count) && (listing->entries[end].parent_id == parent_id); end++);
+
+  *first = low;
+
+
+  return (end - low);
+}
+
+
+void mtp_listing_free(mtp_listing_t *listing)
+{
+  long i;
+
+
+  for(i=0; i < listing->count; i++)
+  {
+    free(listing->entries[i].name);
+  }
+
+  free(listing->entries);
+
+  memset(listing, 0, sizeof(mtp_listing_t));
+
+
+  return;
+}
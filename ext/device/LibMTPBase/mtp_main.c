@@ -33,10 +33,73 @@
 
 #include "mtp_proto.h"
 
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+
 
 VALUE mLibMTP;
 
 
+/*
+ * Looks up an option by symbol or string key in an optional trailing hash.
+ */
+
+VALUE mtp_option(VALUE opts, const char *name)
+{
+  VALUE value = Qnil;
+
+
+  if(!NIL_P(opts))
+  {
+    Check_Type(opts, T_HASH);
+
+    value = rb_hash_aref(opts, ID2SYM(rb_intern(name)));
+
+    if(NIL_P(value))
+    {
+      value = rb_hash_aref(opts, rb_str_new2(name));
+    }
+  }
+
+
+  return value;
+}
+
+
+/*
+ * Runs <i>func</i> with the GVL released so that other Ruby threads keep running
+ * while it blocks.  <i>func</i> must not touch Ruby objects or raise.
+ */
+
+void *mtp_without_gvl(void *(*func)(void *), void *data)
+{
+#ifdef HAVE_RUBY_THREAD_H
+  return rb_thread_call_without_gvl(func, data, NULL, NULL);
+#else
+  return func(data);
+#endif
+}
+
+
+/*
+ * Like mtp_without_gvl, but an interrupt of the thread (Thread#kill,
+ * Thread#raise, a signal) calls <i>ubf</i> with <i>data</i> to wake
+ * <i>func</i>.  The interrupt is not raised on return: <i>func</i> may have
+ * taken something that the caller must give back first, so the caller
+ * checks with rb_thread_check_ints when it is safe.
+ */
+
+void *mtp_without_gvl_interruptible(void *(*func)(void *), void (*ubf)(void *), void *data)
+{
+#ifdef HAVE_RUBY_THREAD_H
+  return rb_thread_call_without_gvl2(func, data, ubf, data);
+#else
+  return func(data);
+#endif
+}
+
+
 /*
  *  call-seq:
  *     LibMTP::filetype_desc(type) -> Filetype description string
@@ -288,12 +351,37 @@ void Init_LibMTPBase()
   Init_LibMTP_Album();
 
 
+  Init_LibMTP_Digest();
+
+  Init_LibMTP_Queue();
+
+
   Init_LibMTP_Entry();
 
   Init_LibMTP_Storage();
 
   Init_LibMTP_Device();
 
+  Init_LibMTP_Copy();
+
+  Init_LibMTP_Broadcast();
+
+  Init_LibMTP_Scheduler();
+
+  Init_LibMTP_Async();
+
+  Init_LibMTP_Sync();
+
+  Init_LibMTP_ObjectMap();
+
+  Init_LibMTP_Journal();
+
+  Init_LibMTP_Object();
+
+  Init_LibMTP_Plan();
+
+  Init_LibMTP_Events();
+
 
   return;
 }
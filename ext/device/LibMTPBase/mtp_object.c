@@ -0,0 +1,1655 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include "mtp_proto.h"
+
+
+#define OBJECT_MOVE 0
+
+#define OBJECT_COPY 1
+
+#define OBJECT_DELETE 2
+
+
+/* a property type of its own: renames go through LIBMTP_Set_File_Name */
+#define OBJECT_FILE_NAME (MTP_PROPERTY_U64 + 1)
+
+
+/*
+ * Object properties Device#properties reads, by name.
+ */
+
+static const struct { const char *name; LIBMTP_property_t property; int type; } object_properties[] =
+{
+  { "storage_id",         LIBMTP_PROPERTY_StorageID,        MTP_PROPERTY_U32 },
+  { "object_format",      LIBMTP_PROPERTY_ObjectFormat,     MTP_PROPERTY_U16 },
+  { "size",               LIBMTP_PROPERTY_ObjectSize,       MTP_PROPERTY_U64 },
+  { "file_name",          LIBMTP_PROPERTY_ObjectFileName,   MTP_PROPERTY_STRING },
+  { "date_created",       LIBMTP_PROPERTY_DateCreated,      MTP_PROPERTY_STRING },
+  { "date_modified",      LIBMTP_PROPERTY_DateModified,     MTP_PROPERTY_STRING },
+  { "parent_id",          LIBMTP_PROPERTY_ParentObject,     MTP_PROPERTY_U32 },
+  { "name",               LIBMTP_PROPERTY_Name,             MTP_PROPERTY_STRING },
+  { "artist",             LIBMTP_PROPERTY_Artist,           MTP_PROPERTY_STRING },
+  { "date_authored",      LIBMTP_PROPERTY_DateAuthored,     MTP_PROPERTY_STRING },
+  { "date_added",         LIBMTP_PROPERTY_DateAdded,        MTP_PROPERTY_STRING },
+  { "genre",              LIBMTP_PROPERTY_Genre,            MTP_PROPERTY_STRING },
+  { "composer",           LIBMTP_PROPERTY_Composer,         MTP_PROPERTY_STRING },
+  { "duration",           LIBMTP_PROPERTY_Duration,         MTP_PROPERTY_U32 },
+  { "rating",             LIBMTP_PROPERTY_Rating,           MTP_PROPERTY_U16 },
+  { "track",              LIBMTP_PROPERTY_Track,            MTP_PROPERTY_U16 },
+  { "use_count",          LIBMTP_PROPERTY_UseCount,         MTP_PROPERTY_U32 },
+  { "album_name",         LIBMTP_PROPERTY_AlbumName,        MTP_PROPERTY_STRING },
+  { "album_artist",       LIBMTP_PROPERTY_AlbumArtist,      MTP_PROPERTY_STRING },
+  { "sample_rate",        LIBMTP_PROPERTY_SampleRate,       MTP_PROPERTY_U32 },
+  { "number_of_channels", LIBMTP_PROPERTY_NumberOfChannels, MTP_PROPERTY_U16 },
+  { "audio_wave_codec",   LIBMTP_PROPERTY_AudioWAVECodec,   MTP_PROPERTY_U32 },
+  { "audio_bit_rate",     LIBMTP_PROPERTY_AudioBitRate,     MTP_PROPERTY_U32 },
+  { "bit_rate_type",      LIBMTP_PROPERTY_BitRateType,      MTP_PROPERTY_U16 },
+  { "width",              LIBMTP_PROPERTY_Width,            MTP_PROPERTY_U32 },
+  { "height",             LIBMTP_PROPERTY_Height,           MTP_PROPERTY_U32 },
+  { "hidden",             LIBMTP_PROPERTY_Hidden,           MTP_PROPERTY_U16 },
+  { "non_consumable",     LIBMTP_PROPERTY_NonConsumable,    MTP_PROPERTY_U8 },
+  { "protection_status",  LIBMTP_PROPERTY_ProtectionStatus, MTP_PROPERTY_U16 }
+};
+
+#define OBJECT_PROPERTIES (sizeof(object_properties) / sizeof(object_properties[0]))
+
+
+/*
+ * A batch of objects moved, copied or deleted in one native call.
+ */
+
+typedef struct mtp_object_batch_s
+{
+  mtp_device_t *device;
+
+  int op;
+
+  int priority;
+
+  uint32_t storage_id;
+
+  uint32_t parent_id;
+
+  uint32_t *ids;
+
+  int *status;
+
+  long count;
+
+  int ordered;                /* delete in the given order rather than children first */
+} mtp_object_batch_t;
+
+
+typedef struct mtp_object_order_s
+{
+  uint32_t id;
+
+  long depth;                 /* folders above the object, from the listing */
+
+  long index;
+
+  int listed;                 /* known to exist before the first pass */
+
+  int missing;                /* did not exist when first tried */
+} mtp_object_order_t;
+
+
+typedef struct mtp_object_parent_s
+{
+  uint32_t id;
+
+  uint32_t parent_id;
+} mtp_object_parent_t;
+
+
+static int order_cmp(const void *a, const void *b)
+{
+  const mtp_object_order_t *x = (const mtp_object_order_t *)a, *y = (const mtp_object_order_t *)b;
+
+
+  if(x->depth != y->depth) return ((x->depth > y->depth) ? -1 : 1);
+
+
+  return ((x->index > y->index) - (x->index < y->index));
+}
+
+
+static int parent_cmp(const void *a, const void *b)
+{
+  uint32_t x = ((const mtp_object_parent_t *)a)->id, y = ((const mtp_object_parent_t *)b)->id;
+
+
+  return ((x > y) - (x < y));
+}
+
+
+/*
+ * Lists the device and returns the parent of every object on it, sorted by
+ * ID, or NULL when the device could not be listed.  Takes the device.
+ */
+
+static mtp_object_parent_t *object_parents(mtp_object_batch_t *batch, long *count)
+{
+  mtp_object_parent_t *parents;
+
+  mtp_listing_t listing;
+
+  int status;
+
+  long i;
+
+
+  mtp_device_wait(batch->device, batch->priority);
+
+  status = mtp_listing_read(batch->device, 0, &listing);
+
+  mtp_device_unlock(batch->device);
+
+  if(status != 0) return NULL;
+
+  parents = (mtp_object_parent_t *)malloc(sizeof(mtp_object_parent_t) * (listing.count + 1));
+
+  if(parents != NULL)
+  {
+    for(i=0; i < listing.count; i++)
+    {
+      parents[i].id = listing.entries[i].id;
+
+      parents[i].parent_id = listing.entries[i].parent_id;
+    }
+
+    qsort(parents, listing.count, sizeof(mtp_object_parent_t), parent_cmp);
+
+    *count = listing.count;
+  }
+
+  mtp_listing_free(&listing);
+
+
+  return parents;
+}
+
+
+static mtp_object_parent_t *parent_find(mtp_object_parent_t *parents, long count, uint32_t id)
+{
+  mtp_object_parent_t key;
+
+
+  key.id = id;
+
+
+  return (mtp_object_parent_t *)bsearch(&key, parents, count, sizeof(mtp_object_parent_t), parent_cmp);
+}
+
+
+/*
+ * Returns the number of folders above object <i>id</i>, 0 for objects in the
+ * root or missing from the listing.  The walk stops after <i>count</i> steps
+ * so that a device reporting a loop cannot hold it.
+ */
+
+static long object_depth(mtp_object_parent_t *parents, long count, uint32_t id)
+{
+  mtp_object_parent_t *object;
+
+  long depth = 0;
+
+
+  while((depth < count) && ((object = parent_find(parents, count, id)) != NULL) && (object->parent_id != 0))
+  {
+    id = object->parent_id;
+
+    depth++;
+  }
+
+
+  return depth;
+}
+
+
+/*
+ * Whether the last call failed because the object does not exist.  libmtp
+ * only keeps the PTP response code in the text of its error, and 0x2009 is
+ * Invalid_ObjectHandle.
+ */
+
+static int object_gone(mtp_device_t *device)
+{
+  LIBMTP_error_t *error;
+
+
+  for(error = LIBMTP_Get_Errorstack(device->device); error != NULL; error = error->next)
+  {
+    if((error->errornumber == LIBMTP_ERROR_PTP_LAYER) && (error->error_text != NULL) &&
+       (strncmp(error->error_text, "PTP Layer error 2009", 20) == 0))
+    {
+      return 1;
+    }
+  }
+
+
+  return 0;
+}
+
+
+/*
+ * Deletes the batch without the GVL, one object per turn on the device.
+ *
+ * A folder can only be deleted once it is empty.  Unless the batch is
+ * ordered, the device is listed first and objects are deleted deepest first,
+ * so children go before their folders.  Those that fail are tried again for
+ * as long as another pass deletes something.  Some devices delete a folder
+ * with its contents, so an object that no longer exists counts as deleted
+ * when it was in the listing or existed on the first pass.
+ */
+
+static void *object_delete_blocking(void *ptr)
+{
+  mtp_object_batch_t *batch = (mtp_object_batch_t *)ptr;
+
+  mtp_object_order_t *order;
+
+  mtp_object_parent_t *parents = NULL;
+
+  long i, failed, deleted, nparents = 0;
+
+  int retry = 0, status;
+
+
+  order = (mtp_object_order_t *)malloc(sizeof(mtp_object_order_t) * (batch->count + 1));
+
+  if(order == NULL) return NULL;
+
+  /* a single object needs no order, so it does not pay for a listing */
+  if(!batch->ordered && (batch->count > 1)) parents = object_parents(batch, &nparents);
+
+  for(i=0; i < batch->count; i++)
+  {
+    order[i].id = batch->ids[i];
+
+    order[i].depth = (parents != NULL) ? object_depth(parents, nparents, batch->ids[i]) : 0;
+
+    order[i].index = i;
+
+    /* ordered batches are made from a listing */
+    order[i].listed = batch->ordered || ((parents != NULL) && (parent_find(parents, nparents, batch->ids[i]) != NULL));
+
+    order[i].missing = 0;
+  }
+
+  free(parents);
+
+  if(!batch->ordered) qsort(order, batch->count, sizeof(mtp_object_order_t), order_cmp);
+
+  do
+  {
+    failed = deleted = 0;
+
+    for(i=0; i < batch->count; i++)
+    {
+      if((batch->status[order[i].index] == 0) || order[i].missing) continue;
+
+      mtp_device_wait(batch->device, batch->priority);
+
+      LIBMTP_Clear_Errorstack(batch->device->device);
+
+      status = LIBMTP_Delete_Object(batch->device->device, order[i].id);
+
+      if((status != 0) && object_gone(batch->device))
+      {
+        /* gone after it was seen means deleted with its folder */
+        if(order[i].listed || retry) status = 0; else order[i].missing = 1;
+      }
+
+      mtp_device_unlock(batch->device);
+
+      batch->status[order[i].index] = status;
+
+      if(status == 0)
+      {
+        deleted++;
+      }
+      else
+      {
+        failed++;
+      }
+    }
+
+    retry = 1;
+  } while((failed > 0) && (deleted > 0));
+
+  free(order);
+
+
+  return NULL;
+}
+
+
+#ifdef HAVE_LIBMTP_MOVE_OBJECT
+
+static const struct { const char *name; LIBMTP_devicecap_t cap; } object_caps[] =
+{
+  { "get_partial_object",  LIBMTP_DEVICECAP_GetPartialObject },
+  { "send_partial_object", LIBMTP_DEVICECAP_SendPartialObject },
+  { "edit_objects",        LIBMTP_DEVICECAP_EditObjects },
+  { "move_object",         LIBMTP_DEVICECAP_MoveObject },
+  { "copy_object",         LIBMTP_DEVICECAP_CopyObject }
+};
+
+
+static int object_run(mtp_object_batch_t *batch, uint32_t id)
+{
+  if(batch->op == OBJECT_MOVE)
+  {
+    return LIBMTP_Move_Object(batch->device->device, id, batch->storage_id, batch->parent_id);
+  }
+
+
+  return LIBMTP_Copy_Object(batch->device->device, id, batch->storage_id, batch->parent_id);
+}
+
+
+/*
+ * Runs the batch without the GVL, one object per turn on the device so that
+ * callers of a higher priority get in between.
+ */
+
+static void *object_batch_blocking(void *ptr)
+{
+  mtp_object_batch_t *batch = (mtp_object_batch_t *)ptr;
+
+  long i;
+
+
+  for(i=0; i < batch->count; i++)
+  {
+    mtp_device_wait(batch->device, batch->priority);
+
+    batch->status[i] = object_run(batch, batch->ids[i]);
+
+    mtp_device_unlock(batch->device);
+  }
+
+
+  return NULL;
+}
+
+
+/*
+ * Raises NotImpError unless the device reports the capability for the
+ * operation of <i>batch</i>.
+ */
+
+static void object_check(mtp_object_batch_t *batch)
+{
+  int supported;
+
+
+  mtp_device_lock_as(batch->device, batch->priority);
+
+  supported = LIBMTP_Check_Capability(batch->device->device,
+                                      (batch->op == OBJECT_MOVE) ? LIBMTP_DEVICECAP_MoveObject : LIBMTP_DEVICECAP_CopyObject);
+
+  mtp_device_unlock(batch->device);
+
+  if(!supported)
+  {
+    rb_raise(rb_eNotImpError, (batch->op == OBJECT_MOVE) ? "Device does not support moving objects" :
+                                                           "Device does not support copying objects");
+  }
+
+
+  return;
+}
+
+#endif
+
+
+static void object_setup(mtp_object_batch_t *batch, VALUE self, int op, VALUE storage_id, VALUE parent_id)
+{
+  batch->device = Get_MTP_Device(self);
+
+  mtp_device_check(batch->device);
+
+  batch->op = op;
+
+  batch->storage_id = NUM2UINT(storage_id);
+
+  batch->parent_id = NUM2UINT(parent_id);
+
+#ifdef HAVE_LIBMTP_MOVE_OBJECT
+  object_check(batch);
+#else
+  rb_raise(rb_eNotImpError, "Moving and copying objects requires libmtp 1.1");
+#endif
+
+
+  return;
+}
+
+
+static VALUE object_single(VALUE self, int op, VALUE id, VALUE storage_id, VALUE parent_id)
+{
+  mtp_object_batch_t batch;
+
+  uint32_t object_id = NUM2UINT(id);
+
+  int status = -1;
+
+
+  batch.priority = mtp_priority(MTP_PRIORITY_NORMAL);
+
+  object_setup(&batch, self, op, storage_id, parent_id);
+
+  batch.ids = &object_id;
+
+  batch.status = &status;
+
+  batch.count = 1;
+
+#ifdef HAVE_LIBMTP_MOVE_OBJECT
+  mtp_without_gvl(object_batch_blocking, &batch);
+#endif
+
+  if(status != 0)
+  {
+    rb_raise(rb_eIOError, (op == OBJECT_MOVE) ? "Unable to move object" : "Unable to copy object");
+  }
+
+
+  return self;
+}
+
+
+static VALUE object_batch(VALUE self, int op, VALUE ids, VALUE storage_id, VALUE parent_id)
+{
+  mtp_object_batch_t batch;
+
+  VALUE result, ids_store, status_store;
+
+  long i;
+
+
+  ids = rb_Array(ids);
+
+  batch.priority = mtp_priority(MTP_PRIORITY_BULK);
+
+  object_setup(&batch, self, op, storage_id, parent_id);
+
+  batch.count = RARRAY_LEN(ids);
+
+  /* freed by the GC should an ID fail to convert */
+  batch.ids = ALLOCV_N(uint32_t, ids_store, batch.count + 1);
+
+  batch.status = ALLOCV_N(int, status_store, batch.count + 1);
+
+  for(i=0; i < batch.count; i++)
+  {
+    batch.ids[i] = NUM2UINT(rb_ary_entry(ids, i));
+
+    batch.status[i] = -1;
+  }
+
+#ifdef HAVE_LIBMTP_MOVE_OBJECT
+  mtp_without_gvl(object_batch_blocking, &batch);
+#endif
+
+  result = rb_ary_new2(batch.count);
+
+  for(i=0; i < batch.count; i++)
+  {
+    rb_ary_push(result, (batch.status[i] == 0) ? Qtrue : Qfalse);
+  }
+
+  ALLOCV_END(status_store);
+
+  ALLOCV_END(ids_store);
+
+
+  return result;
+}
+
+
+/*
+ *  call-seq:
+ *     device.move(id, storage_id, parent_id) -> device
+ *
+ *  Moves the object with the specified ID into the folder <i>parent_id</i> (0 for the root) of the storage
+ *  <i>storage_id</i>.  The device moves the object itself, so no data crosses the USB link.
+ *
+ *  Raises NotImpError when the device cannot move objects; see Device#capability?.
+ *
+ *  Wraps: <i>LIBMTP_Move_Object</i>
+ *
+ */
+
+static VALUE device_move(VALUE self, VALUE id, VALUE storage_id, VALUE parent_id)
+{
+  return object_single(self, OBJECT_MOVE, id, storage_id, parent_id);
+}
+
+
+/*
+ *  call-seq:
+ *     device.copy(id, storage_id, parent_id) -> device
+ *
+ *  Copies the object with the specified ID into the folder <i>parent_id</i> (0 for the root) of the storage
+ *  <i>storage_id</i>, on the device itself.
+ *
+ *  Raises NotImpError when the device cannot copy objects; see Device#capability?.
+ *
+ *  Wraps: <i>LIBMTP_Copy_Object</i>
+ *
+ */
+
+static VALUE device_copy(VALUE self, VALUE id, VALUE storage_id, VALUE parent_id)
+{
+  return object_single(self, OBJECT_COPY, id, storage_id, parent_id);
+}
+
+
+/*
+ *  call-seq:
+ *     device.move_objects(ids, storage_id, parent_id) -> Array of true or false
+ *
+ *  Moves every object in <i>ids</i> into the folder <i>parent_id</i> of the storage <i>storage_id</i>, as
+ *  Device#move does, in one call that releases the GVL.  Runs as :bulk unless a priority is set and releases
+ *  the device between objects.  A failure does not stop the batch; returns whether each object was moved.
+ *
+ *  Wraps: <i>LIBMTP_Move_Object</i>
+ *
+ */
+
+static VALUE device_move_objects(VALUE self, VALUE ids, VALUE storage_id, VALUE parent_id)
+{
+  return object_batch(self, OBJECT_MOVE, ids, storage_id, parent_id);
+}
+
+
+/*
+ *  call-seq:
+ *     device.copy_objects(ids, storage_id, parent_id) -> Array of true or false
+ *
+ *  Copies every object in <i>ids</i> into the folder <i>parent_id</i> of the storage <i>storage_id</i>, as
+ *  Device#move_objects moves them.
+ *
+ *  Wraps: <i>LIBMTP_Copy_Object</i>
+ *
+ */
+
+static VALUE device_copy_objects(VALUE self, VALUE ids, VALUE storage_id, VALUE parent_id)
+{
+  return object_batch(self, OBJECT_COPY, ids, storage_id, parent_id);
+}
+
+
+static void object_deleted_path(const char *path, uint32_t id, uint64_t size, time_t mtime, int folder, void *arg)
+{
+  st_table *deleted = (st_table *)((VALUE *)arg)[0];
+
+
+  if(st_lookup(deleted, (st_data_t)id, NULL))
+  {
+    rb_ary_push(((VALUE *)arg)[1], rb_str_new2(path));
+  }
+
+
+  return;
+}
+
+
+/*
+ * Drops the objects deleted by <i>batch</i> from an object map.
+ */
+
+static void object_forget(mtp_object_batch_t *batch, mtp_objmap_t *map)
+{
+  st_table *deleted = st_init_numtable();
+
+  VALUE arg[2];
+
+  long i;
+
+
+  for(i=0; i < batch->count; i++)
+  {
+    if(batch->status[i] == 0) st_insert(deleted, (st_data_t)batch->ids[i], 0);
+  }
+
+  arg[0] = (VALUE)deleted;
+
+  arg[1] = rb_ary_new();
+
+  if(deleted->num_entries > 0) mtp_objmap_each(map, object_deleted_path, arg);
+
+  st_free_table(deleted);
+
+  for(i=0; i < RARRAY_LEN(arg[1]); i++)
+  {
+    mtp_objmap_remove(map, StringValueCStr(RARRAY_PTR(arg[1])[i]));
+  }
+
+
+  return;
+}
+
+
+/*
+ *  call-seq:
+ *     device.delete_objects(ids) -> Array of true or false
+ *     device.delete_objects(ids, map: object_map) -> Array of true or false
+ *
+ *  Deletes every object in <i>ids</i> in one call that releases the GVL.  Runs as :bulk unless a priority is
+ *  set and releases the device between objects.
+ *
+ *  Unlike Device#delete_object, a failure does not stop the batch: returns whether each object was deleted,
+ *  in the order of <i>ids</i>.  Folders may be listed together with their contents in any order: the device is
+ *  listed once and every object deleted before the folder that holds it.  An object that went with a folder the
+ *  device deleted together with its contents counts as deleted.
+ *
+ *  With a LibMTP::ObjectMap as <i>map</i>, the paths of the deleted objects are removed from it.
+ *
+ *  Wraps: <i>LIBMTP_Get_Filelisting_With_Callback</i>, <i>LIBMTP_Get_Folder_List</i>, <i>LIBMTP_Delete_Object</i>
+ *
+ */
+
+static VALUE device_delete_objects(int argc, VALUE *argv, VALUE self)
+{
+  mtp_object_batch_t batch;
+
+  mtp_objmap_t *map = NULL;
+
+  VALUE ids, opts, value, result, ids_store, status_store;
+
+  long i;
+
+
+  rb_scan_args(argc, argv, "11", &ids, &opts);
+
+  ids = rb_Array(ids);
+
+  value = mtp_option(opts, "map");
+
+  if(!NIL_P(value)) map = Get_MTP_ObjectMap(value);
+
+  batch.device = Get_MTP_Device(self);
+
+  mtp_device_check(batch.device);
+
+  batch.op = OBJECT_DELETE;
+
+  batch.ordered = 0;
+
+  batch.priority = mtp_priority(MTP_PRIORITY_BULK);
+
+  batch.count = RARRAY_LEN(ids);
+
+  /* freed by the GC should an ID fail to convert */
+  batch.ids = ALLOCV_N(uint32_t, ids_store, batch.count + 1);
+
+  batch.status = ALLOCV_N(int, status_store, batch.count + 1);
+
+  for(i=0; i < batch.count; i++)
+  {
+    batch.ids[i] = NUM2UINT(rb_ary_entry(ids, i));
+
+    batch.status[i] = -1;
+  }
+
+  mtp_without_gvl(object_delete_blocking, &batch);
+
+  if(map != NULL) object_forget(&batch, map);
+
+  result = rb_ary_new2(batch.count);
+
+  for(i=0; i < batch.count; i++)
+  {
+    rb_ary_push(result, (batch.status[i] == 0) ? Qtrue : Qfalse);
+  }
+
+  ALLOCV_END(status_store);
+
+  ALLOCV_END(ids_store);
+
+
+  return result;
+}
+
+
+typedef struct mtp_object_format_s
+{
+  mtp_object_batch_t batch;
+
+  long capa;
+
+  int fallback;
+
+  int found;
+
+  int formatted;
+
+  int failed;                 /* the storage could not be listed, or memory ran out */
+
+  long remaining;             /* objects left on the storage after the deletes */
+} mtp_object_format_t;
+
+
+static int format_add(mtp_object_format_t *format, uint32_t id)
+{
+  uint32_t *ids;
+
+
+  if(format->batch.count == format->capa)
+  {
+    format->capa = (format->capa == 0) ? 256 : format->capa * 2;
+
+    ids = (uint32_t *)realloc(format->batch.ids, sizeof(uint32_t) * format->capa);
+
+    if(ids == NULL) return -1;
+
+    format->batch.ids = ids;
+  }
+
+  format->batch.ids[format->batch.count++] = id;
+
+
+  return 0;
+}
+
+
+/*
+ * Collects every object of the listing below <i>parent</i>, each folder
+ * before its contents.
+ */
+
+static int format_walk(mtp_object_format_t *format, mtp_listing_t *listing, uint32_t parent)
+{
+  long i, first, count;
+
+  uint32_t id;
+
+
+  count = mtp_listing_children(listing, parent, &first);
+
+  for(i=first; i < first + count; i++)
+  {
+    id = listing->entries[i].id;
+
+    if(format_add(format, id) != 0) return -1;
+
+    if(listing->entries[i].folder && (format_walk(format, listing, id) != 0)) return -1;
+  }
+
+
+  return 0;
+}
+
+
+/*
+ * Lists the storage and collects its objects.  Returns -1 when it cannot be
+ * listed.  Called with the device held.
+ */
+
+static int format_list(mtp_object_format_t *format)
+{
+  mtp_listing_t listing;
+
+  int status;
+
+
+  if(mtp_listing_read(format->batch.device, format->batch.storage_id, &listing) != 0) return -1;
+
+  status = format_walk(format, &listing, 0);
+
+  mtp_listing_free(&listing);
+
+
+  return status;
+}
+
+
+/*
+ * Formats the storage without the GVL, or when the device refuses, deletes
+ * everything on it, contents before their folders, and checks that nothing
+ * is left.
+ */
+
+static void *format_blocking(void *ptr)
+{
+  mtp_object_format_t *format = (mtp_object_format_t *)ptr;
+
+  mtp_device_t *device = format->batch.device;
+
+  LIBMTP_devicestorage_t *storage;
+
+  mtp_listing_t listing;
+
+  uint32_t id;
+
+  long i;
+
+
+  mtp_device_wait(device, format->batch.priority);
+
+  if(LIBMTP_Get_Storage(device->device, LIBMTP_STORAGE_SORTBY_NOTSORTED) == 0)
+  {
+    for(storage = device->device->storage; storage != NULL; storage = storage->next)
+    {
+      if(storage->id == format->batch.storage_id)
+      {
+        format->found = 1;
+
+        format->formatted = (LIBMTP_Format_Storage(device->device, storage) == 0);
+
+        break;
+      }
+    }
+  }
+
+  if(format->found && !format->formatted && format->fallback)
+  {
+    format->failed = (format_list(format) != 0);
+  }
+
+  mtp_device_unlock(device);
+
+  if(format->failed || (format->batch.count == 0)) return NULL;
+
+  format->batch.status = (int *)malloc(sizeof(int) * format->batch.count);
+
+  if(format->batch.status == NULL)
+  {
+    format->failed = 1;
+
+    return NULL;
+  }
+
+  /* the walk lists folders first, so deleting in reverse empties them first */
+  for(i=0; i < format->batch.count / 2; i++)
+  {
+    id = format->batch.ids[i];
+
+    format->batch.ids[i] = format->batch.ids[format->batch.count - 1 - i];
+
+    format->batch.ids[format->batch.count - 1 - i] = id;
+  }
+
+  for(i=0; i < format->batch.count; i++)
+  {
+    format->batch.status[i] = -1;
+  }
+
+  object_delete_blocking(&format->batch);
+
+  mtp_device_wait(device, format->batch.priority);
+
+  if(mtp_listing_read(device, format->batch.storage_id, &listing) == 0)
+  {
+    format->remaining = listing.count;
+
+    mtp_listing_free(&listing);
+  }
+  else
+  {
+    format->failed = 1;
+  }
+
+  mtp_device_unlock(device);
+
+
+  return NULL;
+}
+
+
+/*
+ *  call-seq:
+ *     device.format_storage(storage_id, confirm: true) -> :formatted or :deleted
+ *     device.format_storage(storage_id, confirm: true, fallback: false) -> :formatted
+ *
+ *  Erases everything on the storage with the specified ID.  Nothing is done unless <i>confirm</i> is true.
+ *
+ *  The device is asked to format the storage, which takes seconds however full it is.  Devices that refuse have
+ *  every object on the storage deleted instead, as Device#delete_objects does, unless <i>fallback</i> is false.
+ *  Returns :formatted or :deleted according to how the storage was erased.  Raises IOError when the storage
+ *  could not be formatted and, with the fallback, when the storage could not be listed, when an object could not
+ *  be deleted or when the storage is not empty afterwards.
+ *
+ *  The call releases the GVL and runs as :bulk unless a priority is set.
+ *
+ *  Wraps: <i>LIBMTP_Format_Storage</i>, <i>LIBMTP_Get_Filelisting_With_Callback</i>, <i>LIBMTP_Get_Folder_List</i>,
+ *  <i>LIBMTP_Delete_Object</i>
+ *
+ */
+
+static VALUE device_format_storage(int argc, VALUE *argv, VALUE self)
+{
+  mtp_object_format_t format;
+
+  VALUE storage_id, opts, fallback;
+
+  long i, failed = 0;
+
+
+  rb_scan_args(argc, argv, "11", &storage_id, &opts);
+
+  if(mtp_option(opts, "confirm") != Qtrue)
+  {
+    rb_raise(rb_eArgError, "format_storage requires confirm: true");
+  }
+
+  memset(&format, 0, sizeof(format));
+
+  format.batch.device = Get_MTP_Device(self);
+
+  mtp_device_check(format.batch.device);
+
+  format.batch.op = OBJECT_DELETE;
+
+  format.batch.ordered = 1;
+
+  format.batch.priority = mtp_priority(MTP_PRIORITY_BULK);
+
+  format.batch.storage_id = NUM2UINT(storage_id);
+
+  fallback = mtp_option(opts, "fallback");
+
+  format.fallback = NIL_P(fallback) || RTEST(fallback);
+
+  mtp_without_gvl(format_blocking, &format);
+
+  for(i=0; i < format.batch.count; i++)
+  {
+    if((format.batch.status == NULL) || (format.batch.status[i] != 0)) failed++;
+  }
+
+  free(format.batch.ids);
+
+  free(format.batch.status);
+
+  if(!format.found)
+  {
+    rb_raise(rb_eArgError, "Unknown storage");
+  }
+
+  if(format.formatted) return ID2SYM(rb_intern("formatted"));
+
+  if(!format.fallback)
+  {
+    rb_raise(rb_eIOError, "Unable to format storage");
+  }
+
+  if(format.failed)
+  {
+    rb_raise(rb_eIOError, "Unable to list storage");
+  }
+
+  if(failed > 0)
+  {
+    rb_raise(rb_eIOError, "Unable to delete %ld objects", failed);
+  }
+
+  if(format.remaining > 0)
+  {
+    rb_raise(rb_eIOError, "Storage still holds %ld objects", format.remaining);
+  }
+
+
+  return ID2SYM(rb_intern("deleted"));
+}
+
+
+typedef struct mtp_object_props_s
+{
+  mtp_device_t *device;
+
+  int priority;
+
+  mtp_property_t *props;
+
+  long *first;                /* props of object i are first[i] up to first[i + 1] */
+
+  int *status;
+
+  long count;
+} mtp_object_props_t;
+
+
+static int object_set(mtp_device_t *device, mtp_property_t *prop)
+{
+  LIBMTP_file_t *file;
+
+  int status;
+
+
+  if(prop->type == OBJECT_FILE_NAME)
+  {
+    /* libmtp applies the name restrictions of the object's format, so the
+       metadata is read for the real file type, folders included */
+    file = LIBMTP_Get_Filemetadata(device->device, prop->id);
+
+    if(file == NULL) return -1;
+
+    status = LIBMTP_Set_File_Name(device->device, file, prop->string);
+
+    LIBMTP_destroy_file_t(file);
+
+
+    return status;
+  }
+  else if(prop->type == MTP_PROPERTY_STRING)
+  {
+    return LIBMTP_Set_Object_String(device->device, prop->id, prop->property, prop->string);
+  }
+  else if(prop->type == MTP_PROPERTY_U16)
+  {
+    return LIBMTP_Set_Object_u16(device->device, prop->id, prop->property, (uint16_t)prop->number);
+  }
+
+
+  return LIBMTP_Set_Object_u32(device->device, prop->id, prop->property, prop->number);
+}
+
+
+/*
+ * Sets the properties without the GVL, one object per turn on the device.
+ * An object whose properties all were set gets a status of 0.
+ */
+
+static void *object_props_blocking(void *ptr)
+{
+  mtp_object_props_t *batch = (mtp_object_props_t *)ptr;
+
+  long i, j;
+
+
+  for(i=0; i < batch->count; i++)
+  {
+    batch->status[i] = 0;
+
+    if(batch->first[i] == batch->first[i + 1]) continue;
+
+    mtp_device_wait(batch->device, batch->priority);
+
+    for(j=batch->first[i]; (j < batch->first[i + 1]) && (batch->status[i] == 0); j++)
+    {
+      batch->status[i] = object_set(batch->device, &batch->props[j]);
+    }
+
+    mtp_device_unlock(batch->device);
+  }
+
+
+  return NULL;
+}
+
+
+/*
+ *  call-seq:
+ *     device.track_update_batch(tracks) -> Array of true or false
+ *
+ *  Writes the changed metadata of every LibMTP::Track in <i>tracks</i>.  Only the properties set since a track
+ *  was read or last written are sent (see Track#changed), each with a single property call, so changing the
+ *  rating of a library costs one small write per track.  Tracks without changes are skipped.
+ *
+ *  The call releases the GVL, runs as :bulk unless a priority is set and releases the device between tracks.
+ *  A failure does not stop the batch; returns whether each track was written, and clears the changes of those
+ *  that were.
+ *
+ *  Wraps: <i>LIBMTP_Set_Object_String</i>, <i>LIBMTP_Set_Object_u16</i>, <i>LIBMTP_Set_Object_u32</i>
+ *
+ */
+
+static VALUE device_track_update_batch(VALUE self, VALUE tracks)
+{
+  mtp_object_props_t batch;
+
+  unsigned int *masks;
+
+  VALUE result;
+
+  long i, j;
+
+
+  tracks = rb_ary_dup(rb_Array(tracks));
+
+  batch.device = Get_MTP_Device(self);
+
+  mtp_device_check(batch.device);
+
+  batch.priority = mtp_priority(MTP_PRIORITY_BULK);
+
+  batch.count = RARRAY_LEN(tracks);
+
+  for(i=0; i < batch.count; i++)
+  {
+    rb_ary_store(tracks, i, Get_LibMTP_Track(rb_ary_entry(tracks, i)));
+  }
+
+  batch.props = ALLOC_N(mtp_property_t, batch.count * MTP_TRACK_PROPERTIES + 1);
+
+  batch.first = ALLOC_N(long, batch.count + 1);
+
+  batch.status = ALLOC_N(int, batch.count + 1);
+
+  masks = ALLOC_N(unsigned int, batch.count + 1);
+
+  batch.first[0] = 0;
+
+  for(i=0; i < batch.count; i++)
+  {
+    batch.first[i + 1] = batch.first[i] + mtp_track_changes(rb_ary_entry(tracks, i), &batch.props[batch.first[i]], &masks[i]);
+  }
+
+  mtp_without_gvl(object_props_blocking, &batch);
+
+  result = rb_ary_new2(batch.count);
+
+  for(i=0; i < batch.count; i++)
+  {
+    if(batch.status[i] == 0) mtp_track_clean(rb_ary_entry(tracks, i), masks[i]);
+
+    rb_ary_push(result, (batch.status[i] == 0) ? Qtrue : Qfalse);
+  }
+
+  for(j=0; j < batch.first[batch.count]; j++)
+  {
+    free(batch.props[j].string);
+  }
+
+  xfree(batch.props);
+
+  xfree(batch.first);
+
+  xfree(batch.status);
+
+  xfree(masks);
+
+
+  return result;
+}
+
+
+/*
+ * Renames object ids[i] to names[i] for every i, without the GVL, and
+ * leaves a status for each in <i>batch</i>; see rename_free.  <i>names</i>
+ * is a new array, whose entries are replaced by their strings.
+ */
+
+static void rename_run(mtp_object_props_t *batch, VALUE self, VALUE ids, VALUE names, int priority)
+{
+  uint32_t *object_ids;
+
+  VALUE name, ids_store;
+
+  long i;
+
+
+  batch->device = Get_MTP_Device(self);
+
+  mtp_device_check(batch->device);
+
+  batch->priority = priority;
+
+  batch->count = RARRAY_LEN(ids);
+
+  /* freed by the GC should an ID or name fail to convert */
+  object_ids = ALLOCV_N(uint32_t, ids_store, batch->count + 1);
+
+  for(i=0; i < batch->count; i++)
+  {
+    object_ids[i] = NUM2UINT(rb_ary_entry(ids, i));
+
+    name = rb_ary_entry(names, i);
+
+    StringValueCStr(name);
+
+    rb_ary_store(names, i, name);
+  }
+
+  batch->props = ALLOC_N(mtp_property_t, batch->count + 1);
+
+  batch->first = ALLOC_N(long, batch->count + 1);
+
+  batch->status = ALLOC_N(int, batch->count + 1);
+
+  for(i=0; i < batch->count; i++)
+  {
+    batch->props[i].id = object_ids[i];
+
+    batch->props[i].property = LIBMTP_PROPERTY_ObjectFileName;
+
+    batch->props[i].type = OBJECT_FILE_NAME;
+
+    batch->props[i].string = strdup(RSTRING_PTR(rb_ary_entry(names, i)));
+
+    batch->first[i] = i;
+  }
+
+  batch->first[batch->count] = batch->count;
+
+  ALLOCV_END(ids_store);
+
+  mtp_without_gvl(object_props_blocking, batch);
+
+
+  return;
+}
+
+
+static void rename_free(mtp_object_props_t *batch)
+{
+  long i;
+
+
+  for(i=0; i < batch->count; i++)
+  {
+    free(batch->props[i].string);
+  }
+
+  xfree(batch->props);
+
+  xfree(batch->first);
+
+  xfree(batch->status);
+
+
+  return;
+}
+
+
+/*
+ *  call-seq:
+ *     device.rename(id, name) -> device
+ *
+ *  Renames the file, folder, track or other object with the specified ID in place.  Characters the device does
+ *  not accept in file names are replaced.
+ *
+ *  Wraps: <i>LIBMTP_Get_Filemetadata</i>, <i>LIBMTP_Set_File_Name</i>
+ *
+ */
+
+static VALUE device_rename(VALUE self, VALUE id, VALUE name)
+{
+  mtp_object_props_t batch;
+
+  int status;
+
+
+  rename_run(&batch, self, rb_ary_new3(1, id), rb_ary_new3(1, name), mtp_priority(MTP_PRIORITY_NORMAL));
+
+  status = batch.status[0];
+
+  rename_free(&batch);
+
+  if(status != 0)
+  {
+    rb_raise(rb_eIOError, "Unable to rename object");
+  }
+
+
+  return self;
+}
+
+
+/*
+ *  call-seq:
+ *     device.rename_batch(renames) -> Hash
+ *
+ *  Renames every object whose ID is a key of the hash <i>renames</i> to the matching value, as Device#rename
+ *  does, in one call that releases the GVL.  Runs as :bulk unless a priority is set and releases the device
+ *  between objects.
+ *
+ *  A failure does not stop the batch; returns a hash from each ID to whether the object was renamed.
+ *
+ *  Wraps: <i>LIBMTP_Get_Filemetadata</i>, <i>LIBMTP_Set_File_Name</i>
+ *
+ */
+
+static VALUE device_rename_batch(VALUE self, VALUE renames)
+{
+  mtp_object_props_t batch;
+
+  VALUE ids, result;
+
+  long i;
+
+
+  Check_Type(renames, T_HASH);
+
+  ids = rb_funcall(renames, rb_intern("keys"), 0);
+
+  rename_run(&batch, self, ids, rb_funcall(renames, rb_intern("values"), 0), mtp_priority(MTP_PRIORITY_BULK));
+
+  result = rb_hash_new();
+
+  for(i=0; i < batch.count; i++)
+  {
+    rb_hash_aset(result, rb_ary_entry(ids, i), (batch.status[i] == 0) ? Qtrue : Qfalse);
+  }
+
+  rename_free(&batch);
+
+
+  return result;
+}
+
+
+/*
+ * A read of <i>nprops</i> properties of <i>count</i> objects; value
+ * [i * nprops + j] is property j of object i.
+ */
+
+typedef struct mtp_object_read_s
+{
+  mtp_device_t *device;
+
+  int priority;
+
+  uint32_t *ids;
+
+  long count;
+
+  int *props;                 /* indices into object_properties */
+
+  long nprops;
+
+  char **strings;
+
+  uint64_t *numbers;
+} mtp_object_read_t;
+
+
+/*
+ * Reads the properties without the GVL, one object per turn on the device.
+ * On devices with GetObjPropList, libmtp fetches the whole property list of
+ * an object in one transaction and answers the rest from its cache.
+ */
+
+static void *object_read_blocking(void *ptr)
+{
+  mtp_object_read_t *read = (mtp_object_read_t *)ptr;
+
+  LIBMTP_mtpdevice_t *device = read->device->device;
+
+  LIBMTP_property_t property;
+
+  long i, j, k;
+
+
+  for(i=0; i < read->count; i++)
+  {
+    mtp_device_wait(read->device, read->priority);
+
+    for(j=0; j < read->nprops; j++)
+    {
+      k = i * read->nprops + j;
+
+      property = object_properties[read->props[j]].property;
+
+      switch(object_properties[read->props[j]].type)
+      {
+        case MTP_PROPERTY_STRING:
+          read->strings[k] = LIBMTP_Get_String_From_Object(device, read->ids[i], property);
+          break;
+
+        case MTP_PROPERTY_U8:
+          read->numbers[k] = LIBMTP_Get_u8_From_Object(device, read->ids[i], property, 0);
+          break;
+
+        case MTP_PROPERTY_U16:
+          read->numbers[k] = LIBMTP_Get_u16_From_Object(device, read->ids[i], property, 0);
+          break;
+
+        case MTP_PROPERTY_U32:
+          read->numbers[k] = LIBMTP_Get_u32_From_Object(device, read->ids[i], property, 0);
+          break;
+
+        default:
+          read->numbers[k] = LIBMTP_Get_u64_From_Object(device, read->ids[i], property, 0);
+          break;
+      }
+    }
+
+    mtp_device_unlock(read->device);
+  }
+
+
+  return NULL;
+}
+
+
+static int object_property_index(VALUE name)
+{
+  const char *name_ptr = rb_id2name(rb_to_id(name));
+
+  unsigned int i;
+
+
+  for(i=0; i < OBJECT_PROPERTIES; i++)
+  {
+    if(strcmp(name_ptr, object_properties[i].name) == 0) return i;
+  }
+
+  rb_raise(rb_eArgError, "Unknown property %s", name_ptr);
+
+
+  return -1;
+}
+
+
+/*
+ *  call-seq:
+ *     device.properties(ids, names) -> Hash of Arrays
+ *
+ *  Reads the object properties <i>names</i> of every object in <i>ids</i>, in one call that releases the GVL.
+ *  Returns a hash from each name to an array of the values of that property, in the order of <i>ids</i>.
+ *
+ *  <i>names</i> are symbols or strings among :storage_id, :object_format, :size, :file_name, :date_created,
+ *  :date_modified, :parent_id, :name, :artist, :date_authored, :date_added, :genre, :composer, :duration,
+ *  :rating, :track, :use_count, :album_name, :album_artist, :sample_rate, :number_of_channels,
+ *  :audio_wave_codec, :audio_bit_rate, :bit_rate_type, :width, :height, :hidden, :non_consumable and
+ *  :protection_status.  Text properties are strings, or nil when the object lacks them; dates are MTP date
+ *  strings such as "20070124T232300".  Numeric properties are integers, 0 when the object lacks them.
+ *
+ *  On devices that support it, libmtp reads all properties of an object with a single GetObjPropList
+ *  transaction, so the cost is one round trip per object whatever the number of names.  Runs as :bulk unless
+ *  a priority is set and releases the device between objects.
+ *
+ *  Wraps: <i>LIBMTP_Get_String_From_Object</i>, <i>LIBMTP_Get_u64_From_Object</i>,
+ *  <i>LIBMTP_Get_u32_From_Object</i>, <i>LIBMTP_Get_u16_From_Object</i>, <i>LIBMTP_Get_u8_From_Object</i>
+ *
+ */
+
+static VALUE device_properties(VALUE self, VALUE ids, VALUE names)
+{
+  mtp_object_read_t read;
+
+  VALUE result, column, ids_store, props_store;
+
+  long i, j, k;
+
+
+  ids = rb_Array(ids);
+
+  names = rb_Array(names);
+
+  read.device = Get_MTP_Device(self);
+
+  mtp_device_check(read.device);
+
+  read.priority = mtp_priority(MTP_PRIORITY_BULK);
+
+  read.count = RARRAY_LEN(ids);
+
+  read.nprops = RARRAY_LEN(names);
+
+  /* freed by the GC should an ID or name fail to convert */
+  read.ids = ALLOCV_N(uint32_t, ids_store, read.count + 1);
+
+  read.props = ALLOCV_N(int, props_store, read.nprops + 1);
+
+  for(i=0; i < read.count; i++)
+  {
+    read.ids[i] = NUM2UINT(rb_ary_entry(ids, i));
+  }
+
+  for(j=0; j < read.nprops; j++)
+  {
+    read.props[j] = object_property_index(rb_ary_entry(names, j));
+  }
+
+  read.strings = ALLOC_N(char *, read.count * read.nprops + 1);
+
+  read.numbers = ALLOC_N(uint64_t, read.count * read.nprops + 1);
+
+  memset(read.strings, 0, sizeof(char *) * (read.count * read.nprops + 1));
+
+  if(read.nprops > 0) mtp_without_gvl(object_read_blocking, &read);
+
+  result = rb_hash_new();
+
+  for(j=0; j < read.nprops; j++)
+  {
+    column = rb_ary_new2(read.count);
+
+    for(i=0; i < read.count; i++)
+    {
+      k = i * read.nprops + j;
+
+      if(object_properties[read.props[j]].type == MTP_PROPERTY_STRING)
+      {
+        rb_ary_push(column, (read.strings[k] != NULL) ? rb_str_new2(read.strings[k]) : Qnil);
+
+        free(read.strings[k]);
+      }
+      else
+      {
+        rb_ary_push(column, ULL2NUM(read.numbers[k]));
+      }
+    }
+
+    rb_hash_aset(result, rb_ary_entry(names, j), column);
+  }
+
+  xfree(read.strings);
+
+  xfree(read.numbers);
+
+  ALLOCV_END(props_store);
+
+  ALLOCV_END(ids_store);
+
+
+  return result;
+}
+
+
+/*
+ *  call-seq:
+ *     device.capability?(name) -> true or false
+ *
+ *  True when the device supports the optional operation <i>name</i>: :get_partial_object,
+ *  :send_partial_object, :edit_objects, :move_object or :copy_object.  Always false with libmtp
+ *  older than 1.1.
+ *
+ *  Wraps: <i>LIBMTP_Check_Capability</i>
+ *
+ */
+
+static VALUE device_capability(VALUE self, VALUE name)
+{
+  VALUE result = Qfalse;
+
+#ifdef HAVE_LIBMTP_MOVE_OBJECT
+  const char *name_ptr = rb_id2name(rb_to_id(name));
+
+  mtp_device_t *device = Get_MTP_Device(self);
+
+  unsigned int i;
+
+
+  for(i=0; i < sizeof(object_caps) / sizeof(object_caps[0]); i++)
+  {
+    if(strcmp(name_ptr, object_caps[i].name) == 0)
+    {
+      mtp_device_lock(device);
+
+      result = LIBMTP_Check_Capability(device->device, object_caps[i].cap) ? Qtrue : Qfalse;
+
+      mtp_device_unlock(device);
+
+
+      return result;
+    }
+  }
+
+  rb_raise(rb_eArgError, "Unknown capability %s", name_ptr);
+#endif
+
+
+  return result;
+}
+
+
+void Init_LibMTP_Object(void)
+{
+  VALUE cDevice = rb_const_get(mLibMTP, rb_intern("Device"));
+
+
+  rb_define_method(cDevice, "move", device_move, 3);
+
+  rb_define_method(cDevice, "copy", device_copy, 3);
+
+  rb_define_method(cDevice, "move_objects", device_move_objects, 3);
+
+  rb_define_method(cDevice, "copy_objects", device_copy_objects, 3);
+
+  rb_define_method(cDevice, "delete_objects", device_delete_objects, -1);
+
+  rb_define_method(cDevice, "format_storage", device_format_storage, -1);
+
+  rb_define_method(cDevice, "track_update_batch", device_track_update_batch, 1);
+
+  rb_define_method(cDevice, "rename", device_rename, 2);
+
+  rb_define_method(cDevice, "rename_batch", device_rename_batch, 1);
+
+  rb_define_method(cDevice, "properties", device_properties, 2);
+
+  rb_define_method(cDevice, "capability?", device_capability, 1);
+
+
+  return;
+}
@@ -0,0 +1,1052 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <errno.h>
+
+#include <sys/file.h>
+
+#include <sys/mman.h>
+
+#include <sys/stat.h>
+
+#include "mtp_proto.h"
+
+
+#define OBJMAP_MAGIC     "MTPOBJM1"
+
+#define OBJMAP_MIN_SLOTS 1024
+
+#define OBJMAP_MIN_HEAP  65536
+
+#define SLOT_USED        1
+
+#define SLOT_DELETED     2
+
+#define SLOT_FOLDER      4
+
+
+static VALUE cMTPObjectMap;
+
+
+/*
+ * The map file is a header, an open addressing hash table of fixed size
+ * slots and a heap holding the paths.  Removed entries leave tombstones and
+ * their paths in the heap until the table is rebuilt, which happens when the
+ * table is three quarters full or the heap runs out.  A rebuild writes a new
+ * file next to the map and renames it over the map, so a crash leaves either
+ * the old map or the new one.
+ */
+
+typedef struct mtp_objmap_header_s
+{
+  char magic[8];
+
+  uint32_t capacity;          /* slots, a power of two */
+
+  uint32_t count;             /* live entries */
+
+  uint32_t used;              /* live entries and tombstones */
+
+  uint32_t heap_size;
+
+  uint32_t heap_used;
+
+  uint32_t reserved[9];
+} mtp_objmap_header_t;
+
+
+typedef struct mtp_objmap_slot_s
+{
+  uint64_t hash;
+
+  uint64_t size;
+
+  int64_t mtime;
+
+  uint32_t id;
+
+  uint32_t path;              /* offset into the heap */
+
+  uint32_t length;
+
+  uint32_t flags;
+} mtp_objmap_slot_t;
+
+
+struct mtp_objmap_s
+{
+  int fd;
+
+  char *path;
+
+  char *base;
+
+  size_t length;
+
+  mtp_objmap_header_t *header;
+
+  mtp_objmap_slot_t *slots;
+
+  char *heap;
+};
+
+
+static uint64_t objmap_hash(const char *path, size_t length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  size_t i;
+
+
+  for(i=0; i < length; i++)
+  {
+    hash = (hash ^ (unsigned char)path[i]) * 1099511628211ULL;
+  }
+
+
+  return hash;
+}
+
+
+static size_t objmap_file_size(uint32_t capacity, uint32_t heap_size)
+{
+  return sizeof(mtp_objmap_header_t) + capacity * sizeof(mtp_objmap_slot_t) + heap_size;
+}
+
+
+static void objmap_unmap(mtp_objmap_t *map)
+{
+  if(map->base != NULL)
+  {
+    munmap(map->base, map->length);
+
+    map->base = NULL;
+  }
+
+
+  return;
+}
+
+
+static int objmap_map(mtp_objmap_t *map, size_t length)
+{
+  void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+
+
+  if(base == MAP_FAILED) return -1;
+
+  map->base = (char *)base;
+
+  map->length = length;
+
+  map->header = (mtp_objmap_header_t *)base;
+
+  map->slots = (mtp_objmap_slot_t *)(map->base + sizeof(mtp_objmap_header_t));
+
+  map->heap = (char *)(map->slots + map->header->capacity);
+
+
+  return 0;
+}
+
+
+/*
+ * True when the mapped file is a map this code can use.  Every slot is
+ * checked, as a path outside the heap would be read out of bounds and a
+ * table without an empty slot would make objmap_probe loop forever.
+ */
+
+static int objmap_valid(mtp_objmap_t *map)
+{
+  mtp_objmap_header_t *header = map->header;
+
+  mtp_objmap_slot_t *slot;
+
+  uint32_t count = 0, used = 0;
+
+  uint32_t i;
+
+
+  if(map->length < sizeof(mtp_objmap_header_t)) return 0;
+
+  if(memcmp(header->magic, OBJMAP_MAGIC, 8) != 0) return 0;
+
+  if((header->capacity == 0) || ((header->capacity & (header->capacity - 1)) != 0)) return 0;
+
+  if(objmap_file_size(header->capacity, header->heap_size) != map->length) return 0;
+
+  if((header->used >= header->capacity) || (header->count > header->used) || (header->heap_used > header->heap_size)) return 0;
+
+  for(i=0; i < header->capacity; i++)
+  {
+    slot = &map->slots[i];
+
+    if(slot->flags == 0) continue;
+
+    used++;
+
+    if(slot->flags == SLOT_DELETED) continue;
+
+    if((slot->flags & ~(uint32_t)SLOT_FOLDER) != SLOT_USED) return 0;
+
+    if((uint64_t)slot->path + slot->length > header->heap_used) return 0;
+
+    count++;
+  }
+
+
+  return ((used == header->used) && (count == header->count));
+}
+
+
+/*
+ * Finds the slot of <i>path</i>, or the slot to insert it into when it is
+ * not in the map.  Sets <i>found</i> accordingly.
+ */
+
+static uint32_t objmap_probe(mtp_objmap_t *map, const char *path, size_t length, uint64_t hash, int *found)
+{
+  uint32_t mask = map->header->capacity - 1;
+
+  uint32_t i = (uint32_t)hash & mask;
+
+  uint32_t free_slot = (uint32_t)-1;
+
+  mtp_objmap_slot_t *slot;
+
+
+  for(;;)
+  {
+    slot = &map->slots[i];
+
+    if(slot->flags == 0)
+    {
+      *found = 0;
+
+      return ((free_slot != (uint32_t)-1) ? free_slot : i);
+    }
+
+    if(slot->flags & SLOT_DELETED)
+    {
+      if(free_slot == (uint32_t)-1) free_slot = i;
+    }
+    else if((slot->hash == hash) && (slot->length == length) && (memcmp(map->heap + slot->path, path, length) == 0))
+    {
+      *found = 1;
+
+      return i;
+    }
+
+    i = (i + 1) & mask;
+  }
+}
+
+
+static int objmap_write(int fd, const char *data, size_t length)
+{
+  ssize_t written;
+
+  size_t done = 0;
+
+
+  while(done < length)
+  {
+    written = write(fd, data + done, length - done);
+
+    if(written < 0)
+    {
+      if(errno == EINTR) continue;
+
+      return -1;
+    }
+
+    done += written;
+  }
+
+
+  return 0;
+}
+
+
+/*
+ * Writes <i>length</i> bytes of a new map image to a file beside the map,
+ * locked and synced, and renames it over the map.  Returns the descriptor
+ * of the new file, or -1 with the map file left as it was.
+ */
+
+static int objmap_replace(mtp_objmap_t *map, const char *data, size_t length)
+{
+  char *temp = ALLOC_N(char, strlen(map->path) + 5);
+
+  int status = -1;
+
+  int fd;
+
+
+  strcpy(temp, map->path);
+
+  strcat(temp, ".new");
+
+  fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+  /* lock before the rename, so that no other process can take the new map */
+  if((fd >= 0) && (flock(fd, LOCK_EX | LOCK_NB) == 0) && (objmap_write(fd, data, length) == 0) &&
+     (fsync(fd) == 0))
+  {
+    status = rename(temp, map->path);
+  }
+
+  if((status != 0) && (fd >= 0))
+  {
+    close(fd);
+
+    unlink(temp);
+
+    fd = -1;
+  }
+
+  xfree(temp);
+
+
+  return fd;
+}
+
+
+/*
+ * Rewrites the map with room for <i>slots</i> slots and <i>heap</i> bytes of
+ * paths, dropping tombstones and the paths of removed entries, and the
+ * entries themselves unless <i>keep</i> is set.  The new image is built in
+ * memory and replaces the file (see objmap_replace); on failure the map is
+ * left as it was.
+ */
+
+static void objmap_rebuild(mtp_objmap_t *map, uint32_t slots, uint32_t heap, int keep)
+{
+  mtp_objmap_t image;
+
+  mtp_objmap_slot_t *slot, *target;
+
+  uint32_t i;
+
+  size_t length = objmap_file_size(slots, heap);
+
+  int found;
+
+  int fd;
+
+
+  memset(&image, 0, sizeof(image));
+
+  image.base = ALLOC_N(char, length);
+
+  memset(image.base, 0, length);
+
+  image.header = (mtp_objmap_header_t *)image.base;
+
+  memcpy(image.header->magic, OBJMAP_MAGIC, 8);
+
+  image.header->capacity = slots;
+
+  image.header->heap_size = heap;
+
+  image.slots = (mtp_objmap_slot_t *)(image.base + sizeof(mtp_objmap_header_t));
+
+  image.heap = (char *)(image.slots + slots);
+
+  for(i=0; keep && (map->base != NULL) && (i < map->header->capacity); i++)
+  {
+    slot = &map->slots[i];
+
+    if(slot->flags & SLOT_USED)
+    {
+      target = &image.slots[objmap_probe(&image, map->heap + slot->path, slot->length, slot->hash, &found)];
+
+      *target = *slot;
+
+      target->path = image.header->heap_used;
+
+      memcpy(image.heap + target->path, map->heap + slot->path, slot->length);
+
+      image.header->heap_used += slot->length;
+
+      image.header->count++;
+
+      image.header->used++;
+    }
+  }
+
+  fd = objmap_replace(map, image.base, length);
+
+  xfree(image.base);
+
+  if(fd < 0)
+  {
+    rb_raise(rb_eIOError, "Unable to write object map");
+  }
+
+  objmap_unmap(map);
+
+  close(map->fd);
+
+  map->fd = fd;
+
+  if(objmap_map(map, length) != 0)
+  {
+    rb_raise(rb_eIOError, "Unable to map object map");
+  }
+
+
+  return;
+}
+
+
+/*
+ * Makes room for one more entry with a path of <i>length</i> bytes.
+ */
+
+static void objmap_reserve(mtp_objmap_t *map, size_t length)
+{
+  mtp_objmap_header_t *header = map->header;
+
+  uint32_t slots = header->capacity;
+
+  uint32_t heap = header->heap_size;
+
+  uint64_t live = 0;
+
+  uint32_t i;
+
+
+  if(((header->used + 1) * 4 <= header->capacity * 3) && (header->heap_used + length <= header->heap_size)) return;
+
+  while((header->count + 1) * 2 > slots) slots *= 2;
+
+  for(i=0; i < header->capacity; i++)
+  {
+    if(map->slots[i].flags & SLOT_USED) live += map->slots[i].length;
+  }
+
+  while(live + length > heap / 2) heap *= 2;
+
+  objmap_rebuild(map, slots, heap, 1);
+
+
+  return;
+}
+
+
+int mtp_objmap_lookup(mtp_objmap_t *map, const char *path, uint32_t *id, uint64_t *size, time_t *mtime, int *folder)
+{
+  size_t length = strlen(path);
+
+  mtp_objmap_slot_t *slot;
+
+  int found;
+
+
+  slot = &map->slots[objmap_probe(map, path, length, objmap_hash(path, length), &found)];
+
+  if(!found) return 0;
+
+  if(id != NULL) *id = slot->id;
+
+  if(size != NULL) *size = slot->size;
+
+  if(mtime != NULL) *mtime = (time_t)slot->mtime;
+
+  if(folder != NULL) *folder = ((slot->flags & SLOT_FOLDER) != 0);
+
+
+  return 1;
+}
+
+
+void mtp_objmap_store(mtp_objmap_t *map, const char *path, uint32_t id, uint64_t size, time_t mtime, int folder)
+{
+  size_t length = strlen(path);
+
+  uint64_t hash = objmap_hash(path, length);
+
+  mtp_objmap_slot_t *slot;
+
+  int found;
+
+
+  slot = &map->slots[objmap_probe(map, path, length, hash, &found)];
+
+  if(!found)
+  {
+    objmap_reserve(map, length);
+
+    slot = &map->slots[objmap_probe(map, path, length, hash, &found)];
+
+    if(slot->flags == 0) map->header->used++;
+
+    map->header->count++;
+
+    slot->hash = hash;
+
+    slot->path = map->header->heap_used;
+
+    slot->length = length;
+
+    memcpy(map->heap + slot->path, path, length);
+
+    map->header->heap_used += length;
+  }
+
+  slot->id = id;
+
+  slot->size = size;
+
+  slot->mtime = mtime;
+
+  slot->flags = SLOT_USED | (folder ? SLOT_FOLDER : 0);
+
+
+  return;
+}
+
+
+int mtp_objmap_remove(mtp_objmap_t *map, const char *path)
+{
+  size_t length = strlen(path);
+
+  mtp_objmap_slot_t *slot;
+
+  int found;
+
+
+  slot = &map->slots[objmap_probe(map, path, length, objmap_hash(path, length), &found)];
+
+  if(!found) return 0;
+
+  slot->flags = SLOT_DELETED;
+
+  map->header->count--;
+
+
+  return 1;
+}
+
+
+long mtp_objmap_count(mtp_objmap_t *map)
+{
+  return map->header->count;
+}
+
+
+/*
+ * Calls <i>func</i> for every entry.  <i>func</i> must not change the map.
+ */
+
+void mtp_objmap_each(mtp_objmap_t *map, void (*func)(const char *, uint32_t, uint64_t, time_t, int, void *), void *arg)
+{
+  mtp_objmap_slot_t *slot;
+
+  char *path;
+
+  uint32_t i;
+
+
+  for(i=0; i < map->header->capacity; i++)
+  {
+    slot = &map->slots[i];
+
+    if(slot->flags & SLOT_USED)
+    {
+      path = strndup(map->heap + slot->path, slot->length);
+
+      func(path, slot->id, slot->size, (time_t)slot->mtime, (slot->flags & SLOT_FOLDER) != 0, arg);
+
+      free(path);
+    }
+  }
+
+
+  return;
+}
+
+
+static void objmap_close(mtp_objmap_t *map)
+{
+  if(map->base != NULL)
+  {
+    msync(map->base, map->length, MS_SYNC);
+
+    objmap_unmap(map);
+  }
+
+  if(map->fd >= 0)
+  {
+    close(map->fd);
+
+    map->fd = -1;
+  }
+
+  free(map->path);
+
+  map->path = NULL;
+
+
+  return;
+}
+
+
+static void objmap_free(void *ptr)
+{
+  objmap_close((mtp_objmap_t *)ptr);
+
+  xfree(ptr);
+
+
+  return;
+}
+
+
+static VALUE objmap_alloc(VALUE klass)
+{
+  mtp_objmap_t *map;
+
+
+  map = ALLOC(mtp_objmap_t);
+
+  memset(map, 0, sizeof(mtp_objmap_t));
+
+  map->fd = -1;
+
+
+  return Data_Wrap_Struct(klass, 0, objmap_free, map);
+}
+
+
+mtp_objmap_t *Get_MTP_ObjectMap(VALUE value)
+{
+  mtp_objmap_t *map;
+
+
+  if(!rb_obj_is_kind_of(value, cMTPObjectMap))
+  {
+    rb_raise(rb_eTypeError, "wrong argument class");
+  }
+
+  Data_Get_Struct(value, mtp_objmap_t, map);
+
+  if(map->base == NULL)
+  {
+    rb_raise(rb_eIOError, "Object map is closed");
+  }
+
+
+  return map;
+}
+
+
+/*
+ *  call-seq:
+ *     LibMTP::ObjectMap.new(path) -> New LibMTP::ObjectMap object.
+ *
+ *  Opens the object map stored in the file <i>path</i>, creating it if needed.  A file that is not a valid map,
+ *  for instance after a crash while entries were being stored, is started over empty.  The map is rebuilt
+ *  in <i>path</i>.new, which replaces <i>path</i> once it is complete.  Only one LibMTP::ObjectMap may have a
+ *  file open at a time.
+ *
+ */
+
+static VALUE objmap_init(VALUE self, VALUE path)
+{
+  mtp_objmap_t *map;
+
+  struct stat st;
+
+
+  Data_Get_Struct(self, mtp_objmap_t, map);
+
+  objmap_close(map);
+
+  map->path = strdup(StringValueCStr(path));
+
+  if(map->path == NULL)
+  {
+    rb_raise(rb_eNoMemError, "Unable to allocate object map path");
+  }
+
+  map->fd = open(map->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+  if(map->fd < 0)
+  {
+    rb_raise(rb_eIOError, "Unable to open object map");
+  }
+
+  if(flock(map->fd, LOCK_EX | LOCK_NB) != 0)
+  {
+    objmap_close(map);
+
+    rb_raise(rb_eIOError, "Object map is in use");
+  }
+
+  if((fstat(map->fd, &st) != 0) || (st.st_size < (off_t)sizeof(mtp_objmap_header_t)) ||
+     (objmap_map(map, st.st_size) != 0) || !objmap_valid(map))
+  {
+    objmap_unmap(map);
+
+    objmap_rebuild(map, OBJMAP_MIN_SLOTS, OBJMAP_MIN_HEAP, 0);
+  }
+
+
+  return self;
+}
+
+
+/*
+ *  call-seq:
+ *     map.lookup(path, size, mtime) -> object ID or nil
+ *
+ *  Returns the device object ID stored for <i>path</i> if it was stored with the same <i>size</i> and
+ *  <i>mtime</i> (a Time or seconds since the epoch), that is if the local file has not changed since.
+ *
+ */
+
+static VALUE objmap_lookup(VALUE self, VALUE path, VALUE size, VALUE mtime)
+{
+  mtp_objmap_t *map = Get_MTP_ObjectMap(self);
+
+  uint64_t stored_size;
+
+  time_t stored_mtime;
+
+  uint32_t id;
+
+
+  if(!mtp_objmap_lookup(map, StringValueCStr(path), &id, &stored_size, &stored_mtime, NULL)) return Qnil;
+
+  if(stored_size != NUM2ULL(size)) return Qnil;
+
+  if(stored_mtime != NUM2LONG(rb_Integer(mtime))) return Qnil;
+
+
+  return UINT2NUM(id);
+}
+
+
+/*
+ *  call-seq:
+ *     map[path] -> object ID or nil
+ *
+ *  Returns the device object ID stored for <i>path</i>, whatever its size and mtime.
+ *
+ */
+
+static VALUE objmap_aref(VALUE self, VALUE path)
+{
+  uint32_t id;
+
+
+  if(!mtp_objmap_lookup(Get_MTP_ObjectMap(self), StringValueCStr(path), &id, NULL, NULL, NULL)) return Qnil;
+
+
+  return UINT2NUM(id);
+}
+
+
+/*
+ *  call-seq:
+ *     map.store(path, size, mtime, id) -> id
+ *     map.store(path, size, mtime, id, folder) -> id
+ *
+ *  Records that the local file <i>path</i> of the given <i>size</i> and <i>mtime</i> is the device object
+ *  <i>id</i>.  Set <i>folder</i> for directories.
+ *
+ */
+
+static VALUE objmap_store(int argc, VALUE *argv, VALUE self)
+{
+  VALUE path, size, mtime, id, folder;
+
+
+  rb_scan_args(argc, argv, "41", &path, &size, &mtime, &id, &folder);
+
+  mtp_objmap_store(Get_MTP_ObjectMap(self), StringValueCStr(path), NUM2UINT(id), NUM2ULL(size),
+                   NUM2LONG(rb_Integer(mtime)), RTEST(folder));
+
+
+  return id;
+}
+
+
+/*
+ *  call-seq:
+ *     map.delete(path) -> object ID or nil
+ *
+ *  Removes <i>path</i> from the map and returns the object ID it had.
+ *
+ */
+
+static VALUE objmap_delete(VALUE self, VALUE path)
+{
+  mtp_objmap_t *map = Get_MTP_ObjectMap(self);
+
+  char *path_ptr = StringValueCStr(path);
+
+  uint32_t id;
+
+
+  if(!mtp_objmap_lookup(map, path_ptr, &id, NULL, NULL, NULL)) return Qnil;
+
+  mtp_objmap_remove(map, path_ptr);
+
+
+  return UINT2NUM(id);
+}
+
+
+/*
+ *  call-seq:
+ *     map.size() -> number of entries
+ *
+ */
+
+static VALUE objmap_size(VALUE self)
+{
+  return LONG2NUM(mtp_objmap_count(Get_MTP_ObjectMap(self)));
+}
+
+
+static void objmap_each_i(const char *path, uint32_t id, uint64_t size, time_t mtime, int folder, void *arg)
+{
+  rb_ary_push((VALUE)arg, rb_ary_new3(5, rb_str_new2(path), UINT2NUM(id), ULL2NUM(size), LONG2NUM(mtime),
+                                      folder ? Qtrue : Qfalse));
+
+
+  return;
+}
+
+
+/*
+ *  call-seq:
+ *     map.each { |path, id, size, mtime, folder| ... } -> map
+ *
+ *  Yields every entry, in no particular order.
+ *
+ */
+
+static VALUE objmap_each(VALUE self)
+{
+  VALUE entries = rb_ary_new();
+
+  long i;
+
+
+  rb_need_block();
+
+  mtp_objmap_each(Get_MTP_ObjectMap(self), objmap_each_i, (void *)entries);
+
+  for(i=0; i < RARRAY_LEN(entries); i++)
+  {
+    rb_yield(RARRAY_PTR(entries)[i]);
+  }
+
+
+  return self;
+}
+
+
+/*
+ *  call-seq:
+ *     map.clear() -> map
+ *
+ *  Removes every entry, so that the next Device#sync with this map lists the device.
+ *
+ */
+
+static VALUE objmap_clear(VALUE self)
+{
+  mtp_objmap_t *map = Get_MTP_ObjectMap(self);
+
+
+  objmap_rebuild(map, OBJMAP_MIN_SLOTS, OBJMAP_MIN_HEAP, 0);
+
+
+  return self;
+}
+
+
+/*
+ *  call-seq:
+ *     map.flush() -> map
+ *
+ *  Writes the map to disk.  This also happens on close and when the map is garbage collected.
+ *
+ */
+
+static VALUE objmap_flush(VALUE self)
+{
+  mtp_objmap_t *map = Get_MTP_ObjectMap(self);
+
+
+  if(msync(map->base, map->length, MS_SYNC) != 0)
+  {
+    rb_raise(rb_eIOError, "Unable to write object map");
+  }
+
+
+  return self;
+}
+
+
+/*
+ *  call-seq:
+ *     map.close() -> nil
+ *
+ */
+
+static VALUE objmap_close_m(VALUE self)
+{
+  mtp_objmap_t *map;
+
+
+  Data_Get_Struct(self, mtp_objmap_t, map);
+
+  objmap_close(map);
+
+
+  return Qnil;
+}
+
+
+/*
+ *  call-seq:
+ *     device.object_map(directory) -> LibMTP::ObjectMap
+ *
+ *  Opens the object map of this device in <i>directory</i>.  The file is named after the device serial
+ *  number, so every device keeps its own map.
+ *
+ *  Wraps: <i>LIBMTP_Get_Serialnumber</i>
+ *
+ */
+
+static VALUE device_object_map(VALUE self, VALUE directory)
+{
+  mtp_device_t *device = Get_MTP_Device(self);
+
+  char *serial, *p;
+
+  VALUE path;
+
+
+  mtp_device_lock(device);
+
+  serial = LIBMTP_Get_Serialnumber(device->device);
+
+  mtp_device_unlock(device);
+
+  if((serial == NULL) || (*serial == '\0'))
+  {
+    free(serial);
+
+    rb_raise(rb_eIOError, "Unable to read serial number");
+  }
+
+  for(p = serial; *p != '\0'; p++)
+  {
+    if(!ISALNUM(*p) && (*p != '-')) *p = '_';
+  }
+
+  path = rb_str_dup(StringValue(directory));
+
+  rb_str_cat2(path, "/");
+
+  rb_str_cat2(path, serial);
+
+  rb_str_cat2(path, ".objmap");
+
+  free(serial);
+
+
+  return rb_class_new_instance(1, &path, cMTPObjectMap);
+}
+
+
+/*
+ *  Document-class: LibMTP::ObjectMap
+ *
+ *  A LibMTP::ObjectMap is a persistent record of which device object each local file was sent as, keyed by
+ *  local path and valid while the file keeps its size and mtime.  It lives in a memory mapped hash file, so
+ *  lookups read no more of the file than they need, and a map of a hundred thousand files opens instantly.
+ *
+ *  <code>map = device.object_map(ENV['HOME'] + '/.libmtp')</code>
+ *
+ *  <code>device.sync('/srv/kiosk', map: map)</code>
+ *
+ *  Device#sync and Device#watch keep a map given to them up to date, and when it is not empty use it in place
+ *  of listing the device.
+ *
+ */
+
+void Init_LibMTP_ObjectMap(void)
+{
+  cMTPObjectMap = rb_define_class_under(mLibMTP, "ObjectMap", rb_cObject);
+
+  rb_define_alloc_func(cMTPObjectMap, objmap_alloc);
+
+
+  rb_define_method(cMTPObjectMap, "initialize", objmap_init, 1);
+
+  rb_define_method(cMTPObjectMap, "lookup", objmap_lookup, 3);
+
+  rb_define_method(cMTPObjectMap, "[]", objmap_aref, 1);
+
+  rb_define_method(cMTPObjectMap, "store", objmap_store, -1);
+
+  rb_define_method(cMTPObjectMap, "delete", objmap_delete, 1);
+
+  rb_define_method(cMTPObjectMap, "size", objmap_size, 0);
+
+  rb_define_method(cMTPObjectMap, "each", objmap_each, 0);
+
+  rb_define_method(cMTPObjectMap, "clear", objmap_clear, 0);
+
+  rb_define_method(cMTPObjectMap, "flush", objmap_flush, 0);
+
+  rb_define_method(cMTPObjectMap, "close", objmap_close_m, 0);
+
+
+  rb_define_method(rb_const_get(mLibMTP, rb_intern("Device")), "object_map", device_object_map, 1);
+
+
+  return;
+}
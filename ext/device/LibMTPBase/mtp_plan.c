@@ -0,0 +1,262 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+
+#include <stdlib.h>
+
+#include <float.h>
+
+#include "mtp_proto.h"
+
+
+typedef struct mtp_plan_item_s
+{
+  double key;                 /* priority per byte, or the size without priorities */
+
+  uint64_t size;
+
+  long index;
+} mtp_plan_item_t;
+
+
+typedef struct mtp_plan_bin_s
+{
+  VALUE id;
+
+  uint64_t bytes;             /* free bytes left */
+
+  uint64_t objects;           /* free objects left */
+} mtp_plan_bin_t;
+
+
+static int item_cmp(const void *a, const void *b)
+{
+  const mtp_plan_item_t *x = (const mtp_plan_item_t *)a;
+
+  const mtp_plan_item_t *y = (const mtp_plan_item_t *)b;
+
+
+  if(x->key != y->key) return ((x->key > y->key) ? -1 : 1);
+
+  if(x->size != y->size) return ((x->size > y->size) ? -1 : 1);
+
+
+  return ((x->index < y->index) ? -1 : (x->index > y->index));
+}
+
+
+static VALUE plan_field(VALUE object, const char *name)
+{
+  return rb_funcall(object, rb_intern("[]"), 1, rb_str_new2(name));
+}
+
+
+/*
+ * The size of a candidate.  Files and tracks are read from their struct,
+ * as File#[] builds the whole hash on every call.
+ */
+
+static uint64_t plan_size(VALUE candidate)
+{
+  uint64_t size;
+
+
+  if(FIXNUM_P(candidate) || (TYPE(candidate) == T_BIGNUM))
+  {
+    return NUM2ULL(candidate);
+  }
+
+  if(mtp_file_size(candidate, &size) || mtp_track_size(candidate, &size))
+  {
+    return size;
+  }
+
+
+  return NUM2ULL(plan_field(candidate, "file_size"));
+}
+
+
+/*
+ *  call-seq:
+ *     LibMTP::plan_fill(candidates, storages) -> Array of storage IDs or nil
+ *     LibMTP::plan_fill(candidates, storages, priority: priorities, reserve: 0) -> Array of storage IDs or nil
+ *
+ *  Plans which of <i>candidates</i> to put on which of <i>storages</i> so that as much as possible fits, before
+ *  anything is sent.  Candidates are sizes in bytes, or LibMTP::File, LibMTP::Track or hash objects with a
+ *  "file_size".  Storages are LibMTP::Storage objects as returned by Device#storage, or hashes with the same
+ *  keys; read-only storages are skipped, and <i>reserve</i> bytes are kept free on each.  A storage that
+ *  reports no free object count is taken to have no limit on the number of objects.
+ *
+ *  Without <i>priorities</i> the plan fills the storages with as many bytes as possible, taking the largest
+ *  candidates first.  With <i>priorities</i>, an array of numbers parallel to <i>candidates</i>, it favours the
+ *  highest total priority, taking candidates by priority per byte.  Each candidate goes to the storage where it
+ *  leaves the least space over, so that large candidates still find room later.
+ *
+ *  Returns an array parallel to <i>candidates</i> with the storage ID each one is planned for, or nil for those
+ *  left out.  The plan is greedy rather than optimal, and takes milliseconds for hundreds of thousands of
+ *  candidates.
+ *
+ *  <code>  storages = device.storage(0)</code>
+ *  <code>  plan = LibMTP::plan_fill(tracks, storages, priority: tracks.map { |t| t['rating'] })</code>
+ *
+ */
+
+static VALUE mtp_plan_fill(int argc, VALUE *argv, VALUE self)
+{
+  VALUE candidates, storages, opts, priorities, value, result, bins_store, items_store;
+
+  mtp_plan_item_t *items;
+
+  mtp_plan_bin_t *bins;
+
+  mtp_plan_bin_t *best;
+
+  uint64_t reserve = 0;
+
+  long count, nstorages, nbins = 0;
+
+  long i, j;
+
+
+  rb_scan_args(argc, argv, "21", &candidates, &storages, &opts);
+
+  candidates = rb_Array(candidates);
+
+  storages = rb_Array(storages);
+
+  priorities = mtp_option(opts, "priority");
+
+  value = mtp_option(opts, "reserve");
+
+  if(!NIL_P(value)) reserve = NUM2ULL(value);
+
+  count = RARRAY_LEN(candidates);
+
+  if(!NIL_P(priorities))
+  {
+    priorities = rb_Array(priorities);
+
+    if(RARRAY_LEN(priorities) != count)
+    {
+      rb_raise(rb_eArgError, "priority must have one entry per candidate");
+    }
+  }
+
+  /* freed by the GC should a storage field fail to convert */
+  nstorages = RARRAY_LEN(storages);
+
+  bins = ALLOCV_N(mtp_plan_bin_t, bins_store, nstorages + 1);
+
+  for(i=0; i < nstorages; i++)
+  {
+    value = rb_ary_entry(storages, i);
+
+    if(NUM2INT(plan_field(value, "access_capability")) != 0) continue;
+
+    bins[nbins].id = plan_field(value, "storage_id");
+
+    bins[nbins].bytes = NUM2ULL(plan_field(value, "free_space_in_bytes"));
+
+    bins[nbins].bytes = (bins[nbins].bytes > reserve) ? bins[nbins].bytes - reserve : 0;
+
+    bins[nbins].objects = NUM2ULL(plan_field(value, "free_space_in_objects"));
+
+    if(bins[nbins].objects == 0) bins[nbins].objects = UINT64_MAX;
+
+    nbins++;
+  }
+
+  /* freed by the GC should a candidate or priority fail to convert */
+  items = ALLOCV_N(mtp_plan_item_t, items_store, count + 1);
+
+  for(i=0; i < count; i++)
+  {
+    items[i].size = plan_size(rb_ary_entry(candidates, i));
+
+    items[i].index = i;
+
+    if(NIL_P(priorities))
+    {
+      items[i].key = (double)items[i].size;
+    }
+    else if(items[i].size == 0)
+    {
+      items[i].key = DBL_MAX;
+    }
+    else
+    {
+      items[i].key = NUM2DBL(rb_ary_entry(priorities, i)) / (double)items[i].size;
+    }
+  }
+
+  qsort(items, count, sizeof(mtp_plan_item_t), item_cmp);
+
+  result = rb_ary_new2(count);
+
+  for(i=0; i < count; i++)
+  {
+    rb_ary_store(result, i, Qnil);
+  }
+
+  for(i=0; i < count; i++)
+  {
+    best = NULL;
+
+    for(j=0; j < nbins; j++)
+    {
+      if((bins[j].objects == 0) || (bins[j].bytes < items[i].size)) continue;
+
+      if((best == NULL) || (bins[j].bytes < best->bytes)) best = &bins[j];
+    }
+
+    if(best == NULL) continue;
+
+    best->bytes -= items[i].size;
+
+    best->objects--;
+
+    rb_ary_store(result, items[i].index, best->id);
+  }
+
+  ALLOCV_END(items_store);
+
+  ALLOCV_END(bins_store);
+
+
+  return result;
+}
+
+
+void Init_LibMTP_Plan(void)
+{
+  rb_define_module_function(mLibMTP, "plan_fill", mtp_plan_fill, -1);
+
+
+  return;
+}
@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "libmtp.h"
 
 #include "ruby.h"
@@ -26,6 +28,30 @@ void Init_LibMTP_Playlist(void);
 
 void Init_LibMTP_Album(void);
 
+void Init_LibMTP_Digest(void);
+
+void Init_LibMTP_Copy(void);
+
+void Init_LibMTP_Broadcast(void);
+
+void Init_LibMTP_Scheduler(void);
+
+void Init_LibMTP_Queue(void);
+
+void Init_LibMTP_Async(void);
+
+void Init_LibMTP_Sync(void);
+
+void Init_LibMTP_ObjectMap(void);
+
+void Init_LibMTP_Journal(void);
+
+void Init_LibMTP_Object(void);
+
+void Init_LibMTP_Plan(void);
+
+void Init_LibMTP_Events(void);
+
 
 VALUE mtp_storage_create_with_copy(void *);
 
@@ -45,10 +71,258 @@ VALUE Get_LibMTP_File(VALUE);
 
 VALUE Wrap_LibMTP_File(LIBMTP_file_t *);
 
+int mtp_file_size(VALUE, uint64_t *);
+
 
 VALUE Get_LibMTP_Track(VALUE);
 
 VALUE Wrap_LibMTP_Track(LIBMTP_track_t *);
 
+int mtp_track_size(VALUE, uint64_t *);
+
+
+#define MTP_PROPERTY_STRING 0
+
+#define MTP_PROPERTY_U16    1
+
+#define MTP_PROPERTY_U32    2
+
+#define MTP_PROPERTY_U8     3
+
+#define MTP_PROPERTY_U64    4
+
+#define MTP_TRACK_PROPERTIES 15
+
+
+/*
+ * One property of one object, to be set with LIBMTP_Set_Object_*.
+ */
+
+typedef struct mtp_property_s
+{
+  uint32_t id;
+
+  LIBMTP_property_t property;
+
+  int type;
+
+  char *string;
+
+  uint32_t number;
+} mtp_property_t;
+
+int mtp_track_changes(VALUE, mtp_property_t *, unsigned int *);
+
+void mtp_track_clean(VALUE, unsigned int);
+
+
+VALUE mtp_option(VALUE, const char *);
+
+LIBMTP_filetype_t mtp_filetype_guess(const char *);
+
+void *mtp_without_gvl(void *(*)(void *), void *);
+
+void *mtp_without_gvl_interruptible(void *(*)(void *), void (*)(void *), void *);
+
+
+#define MTP_PRIORITY_HIGH    0
+
+#define MTP_PRIORITY_NORMAL  1
+
+#define MTP_PRIORITY_BULK    2
+
+#define MTP_PRIORITY_CLASSES 3
+
+typedef struct mtp_worker_s mtp_worker_t;
+
+typedef struct mtp_events_s mtp_events_t;
+
+typedef struct mtp_ticket_s
+{
+  int priority;
+
+  unsigned long ticket;
+} mtp_ticket_t;
+
+typedef struct mtp_device_s
+{
+  LIBMTP_mtpdevice_t *device;
+
+  pthread_mutex_t lock;
+
+  pthread_cond_t turn;
+
+  pthread_t owner;
+
+  int depth;
+
+  int streaming;              /* the owner is running a block inside a transfer */
+
+  int priority;
+
+  unsigned long ticket[MTP_PRIORITY_CLASSES];
+
+  unsigned long serving[MTP_PRIORITY_CLASSES];
+
+  mtp_ticket_t *cancelled;    /* tickets of interrupted waiters, skipped when their turn comes */
+
+  long ncancelled;
+
+  mtp_worker_t *worker;       /* runs Device#async operations, started on first use */
+
+  mtp_events_t *events;       /* running Device#events readers, stopped with the device */
+
+  uint32_t placed;            /* storage of the last placed upload, for round robin */
+} mtp_device_t;
+
+mtp_device_t *Get_MTP_Device(VALUE);
+
+void mtp_device_init(mtp_device_t *, LIBMTP_mtpdevice_t *);
+
+void mtp_device_destroy(mtp_device_t *);
+
+void mtp_device_wait(mtp_device_t *, int);
+
+void mtp_device_lock_as(mtp_device_t *, int);
+
+void mtp_device_lock(mtp_device_t *);
+
+int mtp_device_lock_protect(mtp_device_t *, int);
+
+void mtp_device_lock_all(mtp_device_t **, long);
+
+void mtp_device_unlock(mtp_device_t *);
+
+void mtp_device_check(mtp_device_t *);
+
+int mtp_device_contended(mtp_device_t *);
+
+int mtp_priority(int);
+
+VALUE mtp_async_create(VALUE);
+
+void mtp_async_stop(mtp_device_t *);
+
+void mtp_events_stop(mtp_device_t *);
+
+int mtp_async_nonblocking(void);
+
+VALUE mtp_async_call(VALUE, const char *, int, VALUE *);
+
+
+/*
+ * A snapshot of the objects on a device (see mtp_listing.c).
+ */
+
+typedef struct mtp_listing_entry_s
+{
+  uint32_t id;
+
+  uint32_t parent_id;         /* 0 for the root */
+
+  uint32_t storage_id;
+
+  char *name;
+
+  uint64_t size;
+
+  time_t mtime;
+
+  int folder;
+} mtp_listing_entry_t;
+
+
+typedef struct mtp_listing_s
+{
+  mtp_listing_entry_t *entries;
+
+  long count;
+
+  long capa;
+
+  int sorted;
+} mtp_listing_t;
+
+int mtp_listing_read(mtp_device_t *, uint32_t, mtp_listing_t *);
+
+int mtp_listing_add(mtp_listing_t *, uint32_t, uint32_t, uint32_t, const char *, uint64_t, time_t, int);
+
+long mtp_listing_children(mtp_listing_t *, uint32_t, long *);
+
+void mtp_listing_free(mtp_listing_t *);
+
+
+#define MTP_PLACE_MOST_FREE   0
+
+#define MTP_PLACE_ROUND_ROBIN 1
+
+#define MTP_PLACE_FILL_FIRST  2
+
+uint32_t mtp_storage_place(mtp_device_t *, int, uint64_t);
+
+void mtp_storage_unplace(mtp_device_t *, uint32_t, uint64_t);
+
+int mtp_placement_option(VALUE);
+
+
+typedef struct mtp_digest_s mtp_digest_t;
+
+mtp_digest_t *mtp_digest_new(VALUE);
+
+void mtp_digest_update(mtp_digest_t *, const unsigned char *, size_t);
+
+VALUE mtp_digest_finish(mtp_digest_t *);
+
+void mtp_digest_free(mtp_digest_t *);
+
+
+#define MTP_TRANSFER_FILE  0
+
+#define MTP_TRANSFER_TRACK 1
+
+VALUE mtp_transfer_to_file(mtp_device_t *, uint32_t, const char *, VALUE, int);
+
+VALUE mtp_transfer_from_file(mtp_device_t *, const char *, void *, VALUE, int);
+
+VALUE mtp_transfer_stream(mtp_device_t *, uint32_t, VALUE);
+
+
+typedef struct mtp_objmap_s mtp_objmap_t;
+
+mtp_objmap_t *Get_MTP_ObjectMap(VALUE);
+
+int mtp_objmap_lookup(mtp_objmap_t *, const char *, uint32_t *, uint64_t *, time_t *, int *);
+
+void mtp_objmap_store(mtp_objmap_t *, const char *, uint32_t, uint64_t, time_t, int);
+
+int mtp_objmap_remove(mtp_objmap_t *, const char *);
+
+long mtp_objmap_count(mtp_objmap_t *);
+
+void mtp_objmap_each(mtp_objmap_t *, void (*)(const char *, uint32_t, uint64_t, time_t, int, void *), void *);
+
+
+#define MTP_WRITER_AUTO   0
+
+#define MTP_WRITER_PWRITE 1
+
+#define MTP_WRITER_URING  2
+
+#define MTP_WRITER_THREADS 3
+
+typedef struct mtp_writer_s mtp_writer_t;
+
+mtp_writer_t *mtp_writer_new(int);
+
+int mtp_writer_backend(mtp_writer_t *);
+
+int mtp_writer_option(VALUE);
+
+int mtp_writer_get_file(mtp_writer_t *, mtp_device_t *, uint32_t, const char *, int *);
+
+void mtp_writer_finish(mtp_writer_t *);
+
+void mtp_writer_free(mtp_writer_t *);
+
 
 #endif
@@ -0,0 +1,634 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include "mtp_proto.h"
+
+
+static ID id_priority;
+
+
+/*
+ * Every device has a queue of callers waiting to use it.  libmtp is not
+ * safe to call concurrently on one device, so one caller at a time owns the
+ * device.  Waiters queue in priority classes, first come first served
+ * within a class, and the device always goes to the oldest waiter of the
+ * highest class.  Bulk work releases the device between objects (and between
+ * partial chunks where the device supports them), so a high priority call
+ * waits for at most one object or chunk.
+ *
+ * A Ruby thread waiting for the device can be interrupted; it gives up its
+ * ticket, which is skipped when its turn comes, and the interrupt is raised.
+ * Callers that hold memory, files or other devices while they wait use
+ * mtp_device_lock_protect or mtp_device_lock_all to let go of them first.
+ *
+ * Ownership is recursive so that code holding the device may call helpers
+ * that take it again.  A block yielded to from inside a transfer may not:
+ * libmtp is in the middle of that transfer, so mtp_device_check raises.
+ */
+
+void mtp_device_init(mtp_device_t *device, LIBMTP_mtpdevice_t *device_ptr)
+{
+  memset(device, 0, sizeof(mtp_device_t));
+
+  device->device = device_ptr;
+
+  pthread_mutex_init(&device->lock, NULL);
+
+  pthread_cond_init(&device->turn, NULL);
+
+
+  return;
+}
+
+
+void mtp_device_destroy(mtp_device_t *device)
+{
+  free(device->cancelled);
+
+  pthread_cond_destroy(&device->turn);
+
+  pthread_mutex_destroy(&device->lock);
+
+
+  return;
+}
+
+
+/*
+ * True when callers of the given class or higher are queued.  Called with
+ * the queue lock held.
+ */
+
+static int queue_waiting(mtp_device_t *device, int priority)
+{
+  int i;
+
+
+  for(i=0; i <= priority; i++)
+  {
+    if(device->ticket[i] != device->serving[i])
+    {
+      return 1;
+    }
+  }
+
+
+  return 0;
+}
+
+
+static int queue_owned(mtp_device_t *device)
+{
+  return ((device->depth > 0) && pthread_equal(device->owner, pthread_self()));
+}
+
+
+static void queue_enter(mtp_device_t *device, int priority)
+{
+  device->owner = pthread_self();
+
+  device->depth = 1;
+
+  device->priority = priority;
+
+
+  return;
+}
+
+
+static int queue_trylock(mtp_device_t *device, int priority)
+{
+  int status = 0;
+
+
+  pthread_mutex_lock(&device->lock);
+
+  if(queue_owned(device))
+  {
+    device->depth++;
+
+    status = 1;
+  }
+  else if((device->depth == 0) && !queue_waiting(device, priority))
+  {
+    queue_enter(device, priority);
+
+    status = 1;
+  }
+
+  pthread_mutex_unlock(&device->lock);
+
+
+  return status;
+}
+
+
+/*
+ * Moves the turn of a class past the tickets given up at its head.  Called
+ * with the queue lock held.
+ */
+
+static void queue_skip(mtp_device_t *device, int priority)
+{
+  long i = 0;
+
+
+  while(i < device->ncancelled)
+  {
+    if((device->cancelled[i].priority == priority) && (device->cancelled[i].ticket == device->serving[priority]))
+    {
+      device->cancelled[i] = device->cancelled[--device->ncancelled];
+
+      device->serving[priority]++;
+
+      i = 0;
+    }
+    else
+    {
+      i++;
+    }
+  }
+
+
+  return;
+}
+
+
+/*
+ * Gives up a ticket that is not served yet.  Returns -1 when it cannot be
+ * recorded, in which case the waiter keeps it.  Called with the queue lock
+ * held.
+ */
+
+static int queue_cancel(mtp_device_t *device, int priority, unsigned long ticket)
+{
+  mtp_ticket_t *cancelled;
+
+
+  if(device->serving[priority] != ticket)
+  {
+    cancelled = (mtp_ticket_t *)realloc(device->cancelled, (device->ncancelled + 1) * sizeof(mtp_ticket_t));
+
+    if(cancelled == NULL) return -1;
+
+    device->cancelled = cancelled;
+
+    device->cancelled[device->ncancelled].priority = priority;
+
+    device->cancelled[device->ncancelled++].ticket = ticket;
+  }
+  else
+  {
+    device->serving[priority]++;
+
+    queue_skip(device, priority);
+
+    pthread_cond_broadcast(&device->turn);
+  }
+
+
+  return 0;
+}
+
+
+/*
+ * Waits for the device in the given class until it is taken or, when
+ * <i>cancel</i> is given, until *<i>cancel</i> is set.  Returns 0 once the
+ * device is taken and -1 when the wait was cancelled.
+ */
+
+static int queue_wait(mtp_device_t *device, int priority, volatile int *cancel)
+{
+  unsigned long ticket;
+
+
+  pthread_mutex_lock(&device->lock);
+
+  if(queue_owned(device))
+  {
+    device->depth++;
+  }
+  else
+  {
+    ticket = device->ticket[priority]++;
+
+    while((device->depth > 0) || (device->serving[priority] != ticket) || queue_waiting(device, priority - 1))
+    {
+      if((cancel != NULL) && *cancel && (queue_cancel(device, priority, ticket) == 0))
+      {
+        pthread_mutex_unlock(&device->lock);
+
+        return -1;
+      }
+
+      pthread_cond_wait(&device->turn, &device->lock);
+    }
+
+    device->serving[priority]++;
+
+    queue_skip(device, priority);
+
+    queue_enter(device, priority);
+  }
+
+  pthread_mutex_unlock(&device->lock);
+
+
+  return 0;
+}
+
+
+/*
+ * Waits for the device in the given class.  Blocks the calling thread, so
+ * Ruby threads must call it without the GVL (see mtp_device_lock); native
+ * threads may call it directly.
+ */
+
+void mtp_device_wait(mtp_device_t *device, int priority)
+{
+  queue_wait(device, priority, NULL);
+
+
+  return;
+}
+
+
+typedef struct mtp_queue_wait_s
+{
+  mtp_device_t *device;
+
+  int priority;
+
+  volatile int cancel;
+
+  int status;
+} mtp_queue_wait_t;
+
+
+static void *queue_wait_blocking(void *ptr)
+{
+  mtp_queue_wait_t *wait = (mtp_queue_wait_t *)ptr;
+
+
+  wait->status = queue_wait(wait->device, wait->priority, &wait->cancel);
+
+
+  return NULL;
+}
+
+
+/*
+ * Unblocking function of a waiting Ruby thread: wakes the waiter, which
+ * gives up its ticket.
+ */
+
+static void queue_wait_unblock(void *ptr)
+{
+  mtp_queue_wait_t *wait = (mtp_queue_wait_t *)ptr;
+
+
+  pthread_mutex_lock(&wait->device->lock);
+
+  wait->cancel = 1;
+
+  pthread_cond_broadcast(&wait->device->turn);
+
+  pthread_mutex_unlock(&wait->device->lock);
+
+
+  return;
+}
+
+
+/*
+ * Raises when the calling thread is inside the block of a transfer on the
+ * device.  Called with the GVL, before the caller allocates anything.
+ */
+
+void mtp_device_check(mtp_device_t *device)
+{
+  int streaming;
+
+
+  pthread_mutex_lock(&device->lock);
+
+  streaming = (device->streaming && queue_owned(device));
+
+  pthread_mutex_unlock(&device->lock);
+
+  if(streaming)
+  {
+    rb_raise(rb_eRuntimeError, "Device cannot be used from inside a transfer block");
+  }
+
+
+  return;
+}
+
+
+/*
+ * Takes a device for the calling Ruby thread in the given class, waiting
+ * with the GVL released when the device is busy.  An interrupted wait gives
+ * up its place and handles the interrupt, which raises for Thread#kill,
+ * Thread#raise and Ctrl-C; otherwise the thread queues again.
+ */
+
+void mtp_device_lock_as(mtp_device_t *device, int priority)
+{
+  mtp_queue_wait_t wait;
+
+
+  mtp_device_check(device);
+
+  while(!queue_trylock(device, priority))
+  {
+    wait.device = device;
+
+    wait.priority = priority;
+
+    wait.cancel = 0;
+
+    wait.status = -1;
+
+    mtp_without_gvl_interruptible(queue_wait_blocking, queue_wait_unblock, &wait);
+
+    if(wait.status == 0) break;
+
+    rb_thread_check_ints();
+  }
+
+
+  return;
+}
+
+
+static VALUE queue_lock_protected(VALUE ptr)
+{
+  mtp_queue_wait_t *wait = (mtp_queue_wait_t *)ptr;
+
+
+  mtp_device_lock_as(wait->device, wait->priority);
+
+
+  return Qnil;
+}
+
+
+/*
+ * Like mtp_device_lock_as, but returns the tag of an exception raised while
+ * waiting instead of raising it, and 0 once the device is taken, so that a
+ * caller holding resources can let go of them before rb_jump_tag.
+ */
+
+int mtp_device_lock_protect(mtp_device_t *device, int priority)
+{
+  mtp_queue_wait_t wait;
+
+  int state = 0;
+
+
+  wait.device = device;
+
+  wait.priority = priority;
+
+  rb_protect(queue_lock_protected, (VALUE)&wait, &state);
+
+
+  return state;
+}
+
+
+/*
+ * Takes several devices at the thread's priority, in the order given.  When
+ * a wait is interrupted, the devices already taken are released before the
+ * exception is raised.
+ */
+
+void mtp_device_lock_all(mtp_device_t **devices, long count)
+{
+  long i;
+
+  int state;
+
+
+  for(i=0; i < count; i++)
+  {
+    state = mtp_device_lock_protect(devices[i], mtp_priority(MTP_PRIORITY_NORMAL));
+
+    if(state != 0)
+    {
+      while(i-- > 0)
+      {
+        mtp_device_unlock(devices[i]);
+      }
+
+      rb_jump_tag(state);
+    }
+  }
+
+
+  return;
+}
+
+
+/*
+ * Takes a device for the calling Ruby thread at the thread's priority.
+ */
+
+void mtp_device_lock(mtp_device_t *device)
+{
+  mtp_device_lock_as(device, mtp_priority(MTP_PRIORITY_NORMAL));
+
+
+  return;
+}
+
+
+void mtp_device_unlock(mtp_device_t *device)
+{
+  pthread_mutex_lock(&device->lock);
+
+  if(--device->depth == 0)
+  {
+    pthread_cond_broadcast(&device->turn);
+  }
+
+  pthread_mutex_unlock(&device->lock);
+
+
+  return;
+}
+
+
+/*
+ * True when a caller of a higher class than the owner is waiting, i.e.
+ * when bulk work should release the device at its next yield point.
+ */
+
+int mtp_device_contended(mtp_device_t *device)
+{
+  int status;
+
+
+  pthread_mutex_lock(&device->lock);
+
+  status = (device->depth == 1) && queue_waiting(device, device->priority - 1);
+
+  pthread_mutex_unlock(&device->lock);
+
+
+  return status;
+}
+
+
+static int priority_from_value(VALUE level)
+{
+  ID id;
+
+
+  if(FIXNUM_P(level) && (FIX2INT(level) >= 0) && (FIX2INT(level) < MTP_PRIORITY_CLASSES))
+  {
+    return FIX2INT(level);
+  }
+
+  if(!SYMBOL_P(level))
+  {
+    rb_raise(rb_eArgError, "Unknown priority");
+  }
+
+  id = SYM2ID(level);
+
+  if(id == rb_intern("high"))
+  {
+    return MTP_PRIORITY_HIGH;
+  }
+  else if(id == rb_intern("normal"))
+  {
+    return MTP_PRIORITY_NORMAL;
+  }
+  else if(id == rb_intern("bulk"))
+  {
+    return MTP_PRIORITY_BULK;
+  }
+
+  rb_raise(rb_eArgError, "Unknown priority");
+
+
+  return MTP_PRIORITY_NORMAL;
+}
+
+
+/*
+ * Returns the priority class set for the current Ruby thread with
+ * LibMTP::with_priority, or <i>fallback</i> when none was set.  Bulk
+ * operations pass MTP_PRIORITY_BULK so that they yield by default.
+ */
+
+int mtp_priority(int fallback)
+{
+  VALUE level = rb_thread_local_aref(rb_thread_current(), id_priority);
+
+
+  return (NIL_P(level) ? fallback : FIX2INT(level));
+}
+
+
+static VALUE priority_restore(VALUE previous)
+{
+  rb_thread_local_aset(rb_thread_current(), id_priority, previous);
+
+
+  return Qnil;
+}
+
+
+/*
+ *  call-seq:
+ *     LibMTP::with_priority(level) { ... } -> result of the block
+ *
+ *  Runs the block with device operations of the current thread queued in the priority class
+ *  <i>level</i>, one of :high, :normal or :bulk.
+ *
+ *  Operations on a busy device wait in a queue, and the device goes to the longest waiting caller of the
+ *  highest class.  Batch operations such as Device#file_get_batch and LibMTP::Scheduler run as :bulk
+ *  unless a priority is set, and release the device between objects; a :bulk Device#file_get reads large
+ *  files in partial chunks where the device supports it and releases the device between chunks.  An
+ *  interactive :high call therefore waits for at most one object or chunk.
+ *
+ */
+
+static VALUE mtp_with_priority(VALUE self, VALUE level)
+{
+  VALUE previous;
+
+
+  rb_need_block();
+
+  previous = rb_thread_local_aref(rb_thread_current(), id_priority);
+
+  rb_thread_local_aset(rb_thread_current(), id_priority, INT2FIX(priority_from_value(level)));
+
+
+  return rb_ensure(rb_yield, Qnil, priority_restore, previous);
+}
+
+
+/*
+ *  call-seq:
+ *     LibMTP::priority() -> :high, :normal or :bulk
+ *
+ *  Returns the priority class of device operations on the current thread.
+ *
+ */
+
+static VALUE mtp_priority_get(VALUE self)
+{
+  static const char *names[MTP_PRIORITY_CLASSES] = { "high", "normal", "bulk" };
+
+
+  return ID2SYM(rb_intern(names[mtp_priority(MTP_PRIORITY_NORMAL)]));
+}
+
+
+void Init_LibMTP_Queue(void)
+{
+  id_priority = rb_intern("__libmtp_priority");
+
+
+  rb_define_module_function(mLibMTP, "with_priority", mtp_with_priority, 1);
+
+  rb_define_module_function(mLibMTP, "priority", mtp_priority_get, 0);
+
+
+  return;
+}
@@ -0,0 +1,1061 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include "mtp_proto.h"
+
+
+#define JOB_GET  0
+
+#define JOB_SEND 1
+
+/* assumed rate of a device that has not transferred anything yet */
+#define SCHEDULER_DEFAULT_RATE (4.0 * 1024 * 1024)
+
+/* weight of the newest sample in a device's throughput estimate */
+#define SCHEDULER_RATE_WEIGHT  0.3
+
+
+static VALUE cMTPScheduler;
+
+
+typedef struct mtp_job_s
+{
+  int kind;
+
+  int device;
+
+  int floating;
+
+  uint32_t id;
+
+  char *path;
+
+  LIBMTP_file_t *file;
+
+  uint64_t size;
+
+  int status;
+} mtp_job_t;
+
+
+/*
+ * Each device has a deque of job indices.  Its worker takes jobs from the
+ * front; an idle worker steals floating jobs from the back of the deque
+ * that is furthest from done.
+ */
+
+typedef struct mtp_deque_s
+{
+  long *jobs;
+
+  long head;
+
+  long tail;
+
+  uint64_t bytes;
+} mtp_deque_t;
+
+
+typedef struct mtp_scheduler_s
+{
+  VALUE devices;
+
+  long ndevices;
+
+  mtp_job_t *jobs;
+
+  long njobs;
+
+  long capa;
+
+  double *rate;
+
+  /* only valid during run */
+  mtp_device_t **handles;
+
+  mtp_deque_t *deques;
+
+  uint64_t *free_space;
+
+  int priority;
+
+  pthread_mutex_t lock;
+
+  int running;
+} mtp_scheduler_t;
+
+
+typedef struct mtp_order_s
+{
+  uint64_t size;
+
+  long job;
+} mtp_order_t;
+
+
+typedef struct mtp_worker_s
+{
+  mtp_scheduler_t *scheduler;
+
+  int index;
+
+  pthread_t thread;
+
+  int started;
+} mtp_worker_t;
+
+
+static void scheduler_clear(mtp_scheduler_t *scheduler)
+{
+  long i;
+
+
+  for(i=0; i < scheduler->njobs; i++)
+  {
+    free(scheduler->jobs[i].path);
+
+    if(scheduler->jobs[i].file != NULL)
+    {
+      LIBMTP_destroy_file_t(scheduler->jobs[i].file);
+    }
+  }
+
+  scheduler->njobs = 0;
+
+
+  return;
+}
+
+
+static void scheduler_mark(void *ptr)
+{
+  rb_gc_mark(((mtp_scheduler_t *)ptr)->devices);
+
+
+  return;
+}
+
+
+static void scheduler_free(void *ptr)
+{
+  mtp_scheduler_t *scheduler = (mtp_scheduler_t *)ptr;
+
+
+  scheduler_clear(scheduler);
+
+  xfree(scheduler->jobs);
+
+  xfree(scheduler->rate);
+
+  xfree(scheduler);
+
+
+  return;
+}
+
+
+static VALUE scheduler_alloc(VALUE klass)
+{
+  mtp_scheduler_t *scheduler;
+
+
+  scheduler = ALLOC(mtp_scheduler_t);
+
+  memset(scheduler, 0, sizeof(mtp_scheduler_t));
+
+  scheduler->devices = Qnil;
+
+
+  return Data_Wrap_Struct(klass, scheduler_mark, scheduler_free, scheduler);
+}
+
+
+/*
+ *  call-seq:
+ *     LibMTP::Scheduler.new(devices) -> New LibMTP::Scheduler object.
+ *
+ *  Creates a scheduler for the LibMTP::Device objects in the array <i>devices</i>.
+ *
+ */
+
+static VALUE scheduler_init(VALUE self, VALUE devices)
+{
+  mtp_scheduler_t *scheduler;
+
+  long i;
+
+
+  Check_Type(devices, T_ARRAY);
+
+  Data_Get_Struct(self, mtp_scheduler_t, scheduler);
+
+  scheduler->devices = rb_ary_dup(devices);
+
+  scheduler->ndevices = RARRAY_LEN(devices);
+
+  xfree(scheduler->rate);
+
+  scheduler->rate = ALLOC_N(double, scheduler->ndevices + 1);
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    Get_MTP_Device(rb_ary_entry(devices, i));
+
+    scheduler->rate[i] = 0;
+  }
+
+
+  return self;
+}
+
+
+static int scheduler_device_index(mtp_scheduler_t *scheduler, VALUE device)
+{
+  long i;
+
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    if(rb_ary_entry(scheduler->devices, i) == device)
+    {
+      return i;
+    }
+  }
+
+  rb_raise(rb_eArgError, "Device is not managed by this scheduler");
+
+
+  return -1;
+}
+
+
+static void scheduler_check_idle(mtp_scheduler_t *scheduler)
+{
+  if(scheduler->running)
+  {
+    rb_raise(rb_eRuntimeError, "Scheduler is running");
+  }
+
+
+  return;
+}
+
+
+static mtp_job_t *scheduler_add_job(mtp_scheduler_t *scheduler)
+{
+  mtp_job_t *job;
+
+
+  scheduler_check_idle(scheduler);
+
+  if(scheduler->njobs == scheduler->capa)
+  {
+    scheduler->capa = (scheduler->capa == 0) ? 16 : scheduler->capa * 2;
+
+    REALLOC_N(scheduler->jobs, mtp_job_t, scheduler->capa);
+  }
+
+  job = &scheduler->jobs[scheduler->njobs];
+
+  memset(job, 0, sizeof(mtp_job_t));
+
+
+  return job;
+}
+
+
+/*
+ *  call-seq:
+ *     scheduler.add_get(device, id, pathname) -> job index
+ *
+ *  Queues a download of the file with the specified ID from <i>device</i> to <i>pathname</i>.
+ *  Downloads always run on the device that holds the file.
+ *
+ */
+
+static VALUE scheduler_add_get(VALUE self, VALUE device, VALUE id, VALUE pathname)
+{
+  mtp_scheduler_t *scheduler;
+
+  mtp_job_t *job;
+
+  VALUE path;
+
+  int index;
+
+
+  Data_Get_Struct(self, mtp_scheduler_t, scheduler);
+
+  index = scheduler_device_index(scheduler, device);
+
+  path = StringValue(pathname);
+
+  job = scheduler_add_job(scheduler);
+
+  job->kind = JOB_GET;
+
+  job->device = index;
+
+  job->id = NUM2UINT(id);
+
+  job->path = strdup(StringValueCStr(path));
+
+
+  return LONG2NUM(scheduler->njobs++);
+}
+
+
+/*
+ *  call-seq:
+ *     scheduler.add_send(pathname, file) -> job index
+ *     scheduler.add_send(pathname, file, device) -> job index
+ *
+ *  Queues an upload of <i>pathname</i> with the metadata in the LibMTP::File object <i>file</i>.
+ *  Without a <i>device</i> the upload may go to any device and is placed by the scheduler;
+ *  its <i>parent_id</i> and <i>storage_id</i> should then be 0 or IDs that are valid on every device.
+ *  An upload to the root with no <i>storage_id</i> goes to the writable storage with the most free
+ *  space.
+ *
+ *  If <i>file</i> contains a hash, a LibMTP::File object will be created from the hash data.
+ *
+ */
+
+static VALUE scheduler_add_send(int argc, VALUE *argv, VALUE self)
+{
+  mtp_scheduler_t *scheduler;
+
+  LIBMTP_file_t *file_ptr;
+
+  mtp_job_t *job;
+
+  struct stat st;
+
+  VALUE pathname, file, device, path;
+
+  int index = -1;
+
+
+  rb_scan_args(argc, argv, "21", &pathname, &file, &device);
+
+  Data_Get_Struct(self, mtp_scheduler_t, scheduler);
+
+  if(!NIL_P(device))
+  {
+    index = scheduler_device_index(scheduler, device);
+  }
+
+  path = StringValue(pathname);
+
+  if(stat(StringValueCStr(path), &st) != 0)
+  {
+    rb_raise(rb_eIOError, "Unable to open file");
+  }
+
+  /* a hash becomes a new LibMTP::File, which must outlive file_ptr */
+  file = Get_LibMTP_File(file);
+
+  Data_Get_Struct(file, LIBMTP_file_t, file_ptr);
+
+  job = scheduler_add_job(scheduler);
+
+  job->kind = JOB_SEND;
+
+  job->device = index;
+
+  job->floating = (index < 0);
+
+  job->path = strdup(StringValueCStr(path));
+
+  job->size = st.st_size;
+
+  job->file = LIBMTP_new_file_t();
+
+  if(file_ptr->filename != NULL)
+  {
+    job->file->filename = strdup(file_ptr->filename);
+  }
+
+  job->file->filetype = file_ptr->filetype;
+
+  job->file->parent_id = file_ptr->parent_id;
+
+  job->file->storage_id = file_ptr->storage_id;
+
+  RB_GC_GUARD(file);
+
+
+  return LONG2NUM(scheduler->njobs++);
+}
+
+
+static double scheduler_rate(mtp_scheduler_t *scheduler, int device)
+{
+  return ((scheduler->rate[device] > 0) ? scheduler->rate[device] : SCHEDULER_DEFAULT_RATE);
+}
+
+
+/*
+ * Estimated seconds until a device has worked through its deque.
+ */
+
+static double scheduler_backlog(mtp_scheduler_t *scheduler, int device)
+{
+  return (scheduler->deques[device].bytes / scheduler_rate(scheduler, device));
+}
+
+
+static void deque_push(mtp_scheduler_t *scheduler, int device, long job)
+{
+  mtp_deque_t *deque = &scheduler->deques[device];
+
+
+  deque->jobs[deque->tail++] = job;
+
+  deque->bytes += scheduler->jobs[job].size;
+
+  scheduler->jobs[job].device = device;
+
+
+  return;
+}
+
+
+/*
+ * Places a floating job on the device that would finish it soonest among
+ * those with room for it.  Returns -1 when no device has enough free space.
+ */
+
+static int scheduler_place(mtp_scheduler_t *scheduler, long job)
+{
+  uint64_t size = scheduler->jobs[job].size;
+
+  double best_time = 0, t;
+
+  int best = -1;
+
+  long i;
+
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    if(scheduler->free_space[i] < size) continue;
+
+    t = (scheduler->deques[i].bytes + size) / scheduler_rate(scheduler, i);
+
+    if((best < 0) || (t < best_time))
+    {
+      best = i;
+
+      best_time = t;
+    }
+  }
+
+  if(best >= 0)
+  {
+    scheduler->free_space[best] -= size;
+
+    deque_push(scheduler, best, job);
+  }
+
+
+  return best;
+}
+
+
+/*
+ * Takes a floating job from the back of the busiest deque that the thief
+ * has room for.  Called with the scheduler lock held.
+ */
+
+static long scheduler_steal(mtp_scheduler_t *scheduler, int thief)
+{
+  mtp_deque_t *deque;
+
+  mtp_job_t *job;
+
+  double best_time = 0, t;
+
+  int victim = -1;
+
+  long i, j, k, found = -1;
+
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    if((i == thief) || (scheduler->deques[i].head == scheduler->deques[i].tail)) continue;
+
+    t = scheduler_backlog(scheduler, i);
+
+    if((victim < 0) || (t > best_time))
+    {
+      victim = i;
+
+      best_time = t;
+    }
+  }
+
+  if(victim < 0) return -1;
+
+
+  deque = &scheduler->deques[victim];
+
+  for(j=deque->tail - 1; j >= deque->head; j--)
+  {
+    job = &scheduler->jobs[deque->jobs[j]];
+
+    if(job->floating && (job->size <= scheduler->free_space[thief]))
+    {
+      found = deque->jobs[j];
+
+      for(k=j; k < deque->tail - 1; k++)
+      {
+        deque->jobs[k] = deque->jobs[k + 1];
+      }
+
+      deque->tail--;
+
+      deque->bytes -= job->size;
+
+      scheduler->free_space[victim] += job->size;
+
+      scheduler->free_space[thief] -= job->size;
+
+      job->device = thief;
+
+      break;
+    }
+  }
+
+
+  return found;
+}
+
+
+static double scheduler_now(void)
+{
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+
+/*
+ * Runs one job, holding the device only for that job so that callers of a
+ * higher priority get the device between jobs.  An upload to the root goes
+ * to the storage with the most free space, the one its room was judged by.
+ * <i>elapsed</i> receives the time the transfer took, without the wait for
+ * the device.
+ */
+
+static int scheduler_execute(mtp_scheduler_t *scheduler, mtp_job_t *job, double *elapsed)
+{
+  mtp_device_t *handle = scheduler->handles[job->device];
+
+  LIBMTP_mtpdevice_t *device = handle->device;
+
+  struct stat st;
+
+  uint32_t storage_id = 0;
+
+  double started;
+
+  int status;
+
+
+  mtp_device_wait(handle, scheduler->priority);
+
+  started = scheduler_now();
+
+  if(job->kind == JOB_GET)
+  {
+    status = LIBMTP_Get_File_To_File(device, job->id, job->path, NULL, NULL);
+
+    if((status == 0) && (stat(job->path, &st) == 0))
+    {
+      job->size = st.st_size;
+    }
+  }
+  else
+  {
+    job->file->filesize = job->size;
+
+    if((job->file->parent_id == 0) && (job->file->storage_id == 0))
+    {
+      storage_id = mtp_storage_place(handle, MTP_PLACE_MOST_FREE, job->size);
+
+      job->file->storage_id = storage_id;
+    }
+
+    status = LIBMTP_Send_File_From_File(device, job->path, job->file, NULL, NULL);
+
+    if((status != 0) && (storage_id != 0)) mtp_storage_unplace(handle, storage_id, job->size);
+  }
+
+  *elapsed = scheduler_now() - started;
+
+  mtp_device_unlock(handle);
+
+
+  return status;
+}
+
+
+static void *scheduler_work(void *ptr)
+{
+  mtp_worker_t *worker = (mtp_worker_t *)ptr;
+
+  mtp_scheduler_t *scheduler = worker->scheduler;
+
+  mtp_deque_t *deque = &scheduler->deques[worker->index];
+
+  mtp_job_t *job;
+
+  double elapsed;
+
+  long index;
+
+
+  pthread_mutex_lock(&scheduler->lock);
+
+  while(1)
+  {
+    if(deque->head < deque->tail)
+    {
+      index = deque->jobs[deque->head++];
+
+      deque->bytes -= scheduler->jobs[index].size;
+    }
+    else
+    {
+      index = scheduler_steal(scheduler, worker->index);
+
+      if(index < 0) break;
+    }
+
+    job = &scheduler->jobs[index];
+
+    pthread_mutex_unlock(&scheduler->lock);
+
+
+    job->status = scheduler_execute(scheduler, job, &elapsed);
+
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    if((job->status == 0) && (job->size > 0) && (elapsed > 0))
+    {
+      if(scheduler->rate[worker->index] > 0)
+      {
+        scheduler->rate[worker->index] = (1 - SCHEDULER_RATE_WEIGHT) * scheduler->rate[worker->index] +
+                                         SCHEDULER_RATE_WEIGHT * (job->size / elapsed);
+      }
+      else
+      {
+        scheduler->rate[worker->index] = job->size / elapsed;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&scheduler->lock);
+
+
+  return NULL;
+}
+
+
+static void *scheduler_run_workers(void *ptr)
+{
+  mtp_scheduler_t *scheduler = (mtp_scheduler_t *)ptr;
+
+  mtp_worker_t *workers;
+
+  long i;
+
+
+  workers = (mtp_worker_t *)calloc(scheduler->ndevices + 1, sizeof(mtp_worker_t));
+
+  if(workers == NULL) return NULL;
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    workers[i].scheduler = scheduler;
+
+    workers[i].index = i;
+
+    workers[i].started = (pthread_create(&workers[i].thread, NULL, scheduler_work, &workers[i]) == 0);
+  }
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    if(workers[i].started)
+    {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+
+  free(workers);
+
+
+  return NULL;
+}
+
+
+static int scheduler_size_cmp(const void *a, const void *b)
+{
+  uint64_t sa = ((const mtp_order_t *)a)->size;
+
+  uint64_t sb = ((const mtp_order_t *)b)->size;
+
+
+  return ((sa < sb) ? 1 : ((sa > sb) ? -1 : 0));
+}
+
+
+/*
+ * Runs the jobs with the tables of the run allocated.  scheduler_run_ensure
+ * frees them, also when the body raises or a wait for a device is
+ * interrupted.
+ */
+
+static VALUE scheduler_run_body(VALUE ptr)
+{
+  mtp_scheduler_t *scheduler = (mtp_scheduler_t *)ptr;
+
+  LIBMTP_devicestorage_t *storage;
+
+  mtp_device_t **sorted;
+
+  mtp_device_t *swap;
+
+  mtp_order_t *floating;
+
+  long nfloating = 0;
+
+  VALUE array, sorted_store;
+
+  mtp_job_t *job;
+
+  long i, j;
+
+
+  sorted = ALLOCV_N(mtp_device_t *, sorted_store, scheduler->ndevices);
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    scheduler->handles[i] = sorted[i] = Get_MTP_Device(rb_ary_entry(scheduler->devices, i));
+  }
+
+  for(i=1; i < scheduler->ndevices; i++)
+  {
+    for(j=i; (j > 0) && (sorted[j - 1] > sorted[j]); j--)
+    {
+      swap = sorted[j];
+
+      sorted[j] = sorted[j - 1];
+
+      sorted[j - 1] = swap;
+    }
+  }
+
+  for(i=1; i < scheduler->ndevices; i++)
+  {
+    if(sorted[i] == sorted[i - 1])
+    {
+      rb_raise(rb_eArgError, "Each device may only appear once");
+    }
+  }
+
+  ALLOCV_END(sorted_store);
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    scheduler->deques[i].jobs = ALLOC_N(long, scheduler->njobs + 1);
+  }
+
+  scheduler->priority = mtp_priority(MTP_PRIORITY_BULK);
+
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    scheduler->deques[i].head = scheduler->deques[i].tail = 0;
+
+    scheduler->deques[i].bytes = 0;
+
+    scheduler->free_space[i] = 0;
+
+    mtp_device_lock(scheduler->handles[i]);
+
+    if(LIBMTP_Get_Storage(scheduler->handles[i]->device, LIBMTP_STORAGE_SORTBY_NOTSORTED) == 0)
+    {
+      for(storage = scheduler->handles[i]->device->storage; storage != NULL; storage = storage->next)
+      {
+        if((storage->AccessCapability == 0) && (storage->FreeSpaceInBytes > scheduler->free_space[i]))
+        {
+          scheduler->free_space[i] = storage->FreeSpaceInBytes;
+        }
+      }
+    }
+
+    mtp_device_unlock(scheduler->handles[i]);
+  }
+
+  floating = ALLOC_N(mtp_order_t, scheduler->njobs + 1);
+
+  for(i=0; i < scheduler->njobs; i++)
+  {
+    job = &scheduler->jobs[i];
+
+    job->status = -1;
+
+    if(job->floating)
+    {
+      floating[nfloating].size = job->size;
+
+      floating[nfloating++].job = i;
+    }
+    else
+    {
+      if(job->size > scheduler->free_space[job->device])
+      {
+        scheduler->free_space[job->device] = 0;
+      }
+      else
+      {
+        scheduler->free_space[job->device] -= job->size;
+      }
+
+      deque_push(scheduler, job->device, i);
+    }
+  }
+
+  qsort(floating, nfloating, sizeof(mtp_order_t), scheduler_size_cmp);
+
+  /* a job no device has room for is not run and keeps its failed status */
+  for(i=0; i < nfloating; i++)
+  {
+    scheduler_place(scheduler, floating[i].job);
+  }
+
+  xfree(floating);
+
+
+  pthread_mutex_init(&scheduler->lock, NULL);
+
+  mtp_without_gvl(scheduler_run_workers, scheduler);
+
+  pthread_mutex_destroy(&scheduler->lock);
+
+
+  array = rb_ary_new2(scheduler->njobs);
+
+  for(i=0; i < scheduler->njobs; i++)
+  {
+    job = &scheduler->jobs[i];
+
+    if(job->kind == JOB_GET)
+    {
+      rb_ary_push(array, (job->status == 0) ? Qtrue : Qfalse);
+    }
+    else
+    {
+      rb_ary_push(array, (job->status == 0) ? UINT2NUM(job->file->item_id) : Qnil);
+    }
+  }
+
+  scheduler_clear(scheduler);
+
+
+  return array;
+}
+
+
+static VALUE scheduler_run_ensure(VALUE ptr)
+{
+  mtp_scheduler_t *scheduler = (mtp_scheduler_t *)ptr;
+
+  long i;
+
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    xfree(scheduler->deques[i].jobs);
+  }
+
+  xfree(scheduler->handles);
+
+  xfree(scheduler->deques);
+
+  xfree(scheduler->free_space);
+
+  scheduler->handles = NULL;
+
+  scheduler->deques = NULL;
+
+  scheduler->free_space = NULL;
+
+  scheduler->running = 0;
+
+
+  return Qnil;
+}
+
+
+/*
+ *  call-seq:
+ *     scheduler.run() -> Array of results
+ *
+ *  Runs all queued jobs, one native worker thread per device, and empties the queue.
+ *
+ *  Downloads and uploads to a given device run on that device's worker.  Uploads without a device
+ *  are spread over the devices, largest first, by the time each device would need to reach them,
+ *  using the throughput observed in earlier jobs and runs; a device only receives an upload that fits
+ *  in the free space of its largest writable storage, and uploads to the root with no storage set go
+ *  to that storage.  An upload that fits on no device is not run and fails.  A worker that runs out of
+ *  jobs steals such uploads from the device that is furthest behind.  The throughput counts only the time a transfer
+ *  holds the device, not the time spent waiting for it.
+ *
+ *  Workers hold a device for one job at a time and queue for it at the priority of the calling thread,
+ *  :bulk unless set with LibMTP::with_priority, so other callers get the device between jobs.
+ *
+ *  Returns an array with one entry per job in the order the jobs were added: true or false for a download,
+ *  and the new object ID or nil for an upload.
+ *
+ *  Wraps: <i>LIBMTP_Get_Storage</i>, <i>LIBMTP_Get_File_To_File</i>, <i>LIBMTP_Send_File_From_File</i>
+ *
+ */
+
+static VALUE scheduler_run(VALUE self)
+{
+  mtp_scheduler_t *scheduler;
+
+
+  Data_Get_Struct(self, mtp_scheduler_t, scheduler);
+
+  scheduler_check_idle(scheduler);
+
+  if(scheduler->ndevices == 0)
+  {
+    rb_raise(rb_eArgError, "Scheduler has no devices");
+  }
+
+  scheduler->handles = ALLOC_N(mtp_device_t *, scheduler->ndevices);
+
+  scheduler->deques = ALLOC_N(mtp_deque_t, scheduler->ndevices);
+
+  scheduler->free_space = ALLOC_N(uint64_t, scheduler->ndevices);
+
+  memset(scheduler->deques, 0, sizeof(mtp_deque_t) * scheduler->ndevices);
+
+  scheduler->running = 1;
+
+
+  return rb_ensure(scheduler_run_body, (VALUE)scheduler, scheduler_run_ensure, (VALUE)scheduler);
+}
+
+
+/*
+ *  call-seq:
+ *     scheduler.throughput() -> Array of bytes per second
+ *
+ *  Returns the observed throughput of each device in bytes per second, or nil for a device
+ *  that has not completed a job yet.
+ *
+ */
+
+static VALUE scheduler_throughput(VALUE self)
+{
+  mtp_scheduler_t *scheduler;
+
+  VALUE array;
+
+  long i;
+
+
+  Data_Get_Struct(self, mtp_scheduler_t, scheduler);
+
+  array = rb_ary_new2(scheduler->ndevices);
+
+  for(i=0; i < scheduler->ndevices; i++)
+  {
+    rb_ary_push(array, (scheduler->rate[i] > 0) ? rb_float_new(scheduler->rate[i]) : Qnil);
+  }
+
+
+  return array;
+}
+
+
+/*
+ *  Document-class: LibMTP::Scheduler
+ *
+ *  A LibMTP::Scheduler runs a list of transfers across several devices at once.  Jobs are queued
+ *  with <code>add_get</code> and <code>add_send</code> and run with <code>run</code>:
+ *
+ *  <code>scheduler = LibMTP::Scheduler.new(LibMTP::Device.list)</code>
+ *
+ *  <code>files.each { |path| scheduler.add_send(path, 'file_name' => File.basename(path)) }</code>
+ *
+ *  <code>results = scheduler.run</code>
+ *
+ *  The throughput seen on each device is kept between runs and used to place later uploads.
+ *
+ */
+
+void Init_LibMTP_Scheduler(void)
+{
+  cMTPScheduler = rb_define_class_under(mLibMTP, "Scheduler", rb_cObject);
+
+  rb_define_alloc_func(cMTPScheduler, scheduler_alloc);
+
+
+  rb_define_method(cMTPScheduler, "initialize", scheduler_init, 1);
+
+  rb_define_method(cMTPScheduler, "add_get", scheduler_add_get, 3);
+
+  rb_define_method(cMTPScheduler, "add_send", scheduler_add_send, -1);
+
+  rb_define_method(cMTPScheduler, "run", scheduler_run, 0);
+
+  rb_define_method(cMTPScheduler, "throughput", scheduler_throughput, 0);
+
+
+  return;
+}
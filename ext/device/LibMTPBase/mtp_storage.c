@@ -537,3 +537,122 @@ VALUE mtp_storage_create_with_copy(void *storage_ptr)
 
   return storage;
 }
+
+
+/*
+ * Picks the storage for an upload of <i>size</i> bytes by <i>policy</i>
+ * (MTP_PLACE_*) from the free space libmtp cached with the storage list,
+ * and reserves the space in that cache so that a batch of uploads needs no
+ * new storage query.  Only writable storages with room are considered.
+ * Returns the storage ID, or 0 when no storage has room.  Called with the
+ * device held.
+ */
+
+uint32_t mtp_storage_place(mtp_device_t *device, int policy, uint64_t size)
+{
+  LIBMTP_devicestorage_t *storage, *chosen = NULL;
+
+  long count = 0, start = 0;
+
+  long i, k;
+
+
+  if(device->device->storage == NULL)
+  {
+    LIBMTP_Get_Storage(device->device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+  }
+
+  for(storage = device->device->storage; storage != NULL; storage = storage->next)
+  {
+    count++;
+
+    /* round robin starts after the storage used last */
+    if((policy == MTP_PLACE_ROUND_ROBIN) && (storage->id == device->placed)) start = count;
+  }
+
+  for(i=0; i < count; i++)
+  {
+    storage = device->device->storage;
+
+    for(k=(start + i) % count; k > 0; k--) storage = storage->next;
+
+    if((storage->AccessCapability != 0) || (storage->FreeSpaceInBytes < size)) continue;
+
+    if(policy != MTP_PLACE_MOST_FREE)
+    {
+      chosen = storage;
+
+      break;
+    }
+
+    if((chosen == NULL) || (storage->FreeSpaceInBytes > chosen->FreeSpaceInBytes)) chosen = storage;
+  }
+
+  if(chosen == NULL) return 0;
+
+  chosen->FreeSpaceInBytes -= size;
+
+  device->placed = chosen->id;
+
+
+  return chosen->id;
+}
+
+
+/*
+ * Gives back space reserved by mtp_storage_place for an upload that
+ * failed.  Called with the device held.
+ */
+
+void mtp_storage_unplace(mtp_device_t *device, uint32_t storage_id, uint64_t size)
+{
+  LIBMTP_devicestorage_t *storage;
+
+
+  for(storage = device->device->storage; storage != NULL; storage = storage->next)
+  {
+    if(storage->id == storage_id)
+    {
+      storage->FreeSpaceInBytes += size;
+    }
+  }
+
+
+  return;
+}
+
+
+/*
+ * The MTP_PLACE_* policy of a <i>placement</i> option, or -1 when none is
+ * given.
+ */
+
+int mtp_placement_option(VALUE opts)
+{
+  VALUE placement = mtp_option(opts, "placement");
+
+  ID id;
+
+
+  if(NIL_P(placement)) return -1;
+
+  id = rb_to_id(placement);
+
+  if(id == rb_intern("most_free"))
+  {
+    return MTP_PLACE_MOST_FREE;
+  }
+  else if(id == rb_intern("round_robin"))
+  {
+    return MTP_PLACE_ROUND_ROBIN;
+  }
+  else if(id == rb_intern("fill_first"))
+  {
+    return MTP_PLACE_FILL_FIRST;
+  }
+
+  rb_raise(rb_eArgError, "placement must be :most_free, :round_robin or :fill_first");
+
+
+  return -1;
+}
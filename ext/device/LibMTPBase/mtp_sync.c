@@ -0,0 +1,2452 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include <strings.h>
+
+#include <errno.h>
+
+#include <dirent.h>
+
+#include <utime.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <sys/time.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "mtp_proto.h"
+
+#include "ruby/io.h"
+
+
+#define SYNC_PUSH   0
+
+#define SYNC_PULL   1
+
+#define SYNC_MIRROR 2
+
+
+#define SYNC_CREATE_FOLDER    0
+
+#define SYNC_SEND             1
+
+#define SYNC_REPLACE          2
+
+#define SYNC_DELETE           3
+
+#define SYNC_CREATE_DIRECTORY 4
+
+#define SYNC_GET              5
+
+
+/* larger objects are written by libmtp straight to the file, not held in memory */
+#define SYNC_DIRECT_SIZE (32 * 1024 * 1024)
+
+
+static const char *sync_action_names[] = { "create_folder", "send", "replace", "delete", "create_directory", "get" };
+
+
+/*
+ * One side of a sync: every file and folder below the sync root, keyed by
+ * its '/' separated path relative to the root.
+ */
+
+typedef struct mtp_sync_entry_s
+{
+  char *path;
+
+  uint32_t id;
+
+  uint64_t size;
+
+  time_t mtime;
+
+  int folder;
+} mtp_sync_entry_t;
+
+
+typedef struct mtp_sync_list_s
+{
+  mtp_sync_entry_t *entries;
+
+  long count;
+
+  long capa;
+} mtp_sync_list_t;
+
+
+typedef struct mtp_sync_op_s
+{
+  int action;
+
+  long local;                 /* index into the local list, or -1 */
+
+  long remote;                /* index into the device list, or -1 */
+
+  int status;
+} mtp_sync_op_t;
+
+
+typedef struct mtp_sync_s
+{
+  mtp_device_t *device;
+
+  const char *root;
+
+  uint32_t parent_id;
+
+  uint32_t storage_id;
+
+  int priority;
+
+  mtp_objmap_t *map;          /* stands in for the device listing when not empty */
+
+  int refresh;
+
+  int exact;                  /* device side from the map: compare mtimes for equality */
+
+  int writer;                 /* MTP_WRITER_* backend for retrieved files */
+
+  int prune;                  /* skip device folders with no local counterpart */
+
+  mtp_sync_list_t local;
+
+  mtp_sync_list_t remote;
+
+  mtp_sync_op_t *ops;
+
+  long nops;
+} mtp_sync_t;
+
+
+static void list_add(mtp_sync_list_t *list, char *path, uint32_t id, uint64_t size, time_t mtime, int folder)
+{
+  mtp_sync_entry_t *entry;
+
+
+  if(list->count == list->capa)
+  {
+    list->capa = (list->capa > 0) ? list->capa * 2 : 64;
+
+    REALLOC_N(list->entries, mtp_sync_entry_t, list->capa);
+  }
+
+  entry = &list->entries[list->count++];
+
+  entry->path = path;
+
+  entry->id = id;
+
+  entry->size = size;
+
+  entry->mtime = mtime;
+
+  entry->folder = folder;
+
+
+  return;
+}
+
+
+static void list_free(mtp_sync_list_t *list)
+{
+  long i;
+
+
+  for(i=0; i < list->count; i++)
+  {
+    free(list->entries[i].path);
+  }
+
+  xfree(list->entries);
+
+  list->entries = NULL;
+
+  list->count = list->capa = 0;
+
+
+  return;
+}
+
+
+static int entry_cmp(const void *a, const void *b)
+{
+  return strcmp(((const mtp_sync_entry_t *)a)->path, ((const mtp_sync_entry_t *)b)->path);
+}
+
+
+static mtp_sync_entry_t *list_find(mtp_sync_list_t *list, const char *path)
+{
+  mtp_sync_entry_t key;
+
+
+  key.path = (char *)path;
+
+
+  return (mtp_sync_entry_t *)bsearch(&key, list->entries, list->count, sizeof(mtp_sync_entry_t), entry_cmp);
+}
+
+
+static char *sync_join(const char *prefix, const char *name)
+{
+  size_t length = strlen(prefix);
+
+  char *path = (char *)malloc(length + strlen(name) + 2);
+
+
+  if(length > 0)
+  {
+    memcpy(path, prefix, length);
+
+    path[length++] = '/';
+  }
+
+  strcpy(path + length, name);
+
+
+  return path;
+}
+
+
+static int sync_local_folder(mtp_sync_t *sync, const char *path)
+{
+  mtp_sync_entry_t *entry = list_find(&sync->local, path);
+
+
+  return ((entry != NULL) && entry->folder);
+}
+
+
+static void sync_walk_listing(mtp_sync_t *sync, mtp_listing_t *listing, uint32_t parent, const char *prefix)
+{
+  mtp_listing_entry_t *object;
+
+  long first = sync->remote.count;
+
+  long i, start, count, last;
+
+
+  count = mtp_listing_children(listing, parent, &start);
+
+  for(i=start; i < start + count; i++)
+  {
+    object = &listing->entries[i];
+
+    list_add(&sync->remote, sync_join(prefix, object->name), object->id, object->size, object->mtime, object->folder);
+  }
+
+  last = sync->remote.count;
+
+  for(i=first; i < last; i++)
+  {
+    if(sync->remote.entries[i].folder)
+    {
+      if(sync->prune && !sync_local_folder(sync, sync->remote.entries[i].path)) continue;
+
+      sync_walk_listing(sync, listing, sync->remote.entries[i].id, sync->remote.entries[i].path);
+    }
+  }
+
+
+  return;
+}
+
+
+/*
+ * Lists the device below the sync root.  When pruning, folders with no
+ * local counterpart are not descended into; the local list must be sorted
+ * by then.  Raises IOError when the device cannot be listed, so that a sync
+ * never mistakes a failed listing for an empty device.
+ */
+
+static void sync_walk_device(mtp_sync_t *sync)
+{
+  mtp_listing_t listing;
+
+  int status;
+
+
+  mtp_device_lock_as(sync->device, sync->priority);
+
+  status = mtp_listing_read(sync->device, sync->storage_id, &listing);
+
+  mtp_device_unlock(sync->device);
+
+  if(status != 0)
+  {
+    rb_raise(rb_eIOError, "Unable to list device");
+  }
+
+  sync_walk_listing(sync, &listing, sync->parent_id, "");
+
+  mtp_listing_free(&listing);
+
+
+  return;
+}
+
+
+/*
+ * Lists the local tree below <i>root</i>.  Symbolic links and special files
+ * are skipped.
+ */
+
+static void sync_walk_local(mtp_sync_t *sync, const char *prefix)
+{
+  struct dirent *dirent;
+
+  struct stat st;
+
+  char *relative, *absolute;
+
+  long first = sync->local.count;
+
+  long i, last;
+
+  DIR *dir;
+
+
+  absolute = sync_join(sync->root, prefix);
+
+  dir = opendir(absolute);
+
+  free(absolute);
+
+  if(dir == NULL) return;
+
+  while((dirent = readdir(dir)) != NULL)
+  {
+    if((strcmp(dirent->d_name, ".") == 0) || (strcmp(dirent->d_name, "..") == 0)) continue;
+
+    relative = sync_join(prefix, dirent->d_name);
+
+    absolute = sync_join(sync->root, relative);
+
+    if((lstat(absolute, &st) == 0) && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+    {
+      list_add(&sync->local, relative, 0, S_ISREG(st.st_mode) ? st.st_size : 0, st.st_mtime, S_ISDIR(st.st_mode));
+    }
+    else
+    {
+      free(relative);
+    }
+
+    free(absolute);
+  }
+
+  closedir(dir);
+
+  last = sync->local.count;
+
+  for(i=first; i < last; i++)
+  {
+    if(sync->local.entries[i].folder)
+    {
+      sync_walk_local(sync, sync->local.entries[i].path);
+    }
+  }
+
+
+  return;
+}
+
+
+static void sync_add_op(mtp_sync_t *sync, int action, long local, long remote)
+{
+  mtp_sync_op_t *op = &sync->ops[sync->nops++];
+
+
+  op->action = action;
+
+  op->local = local;
+
+  op->remote = remote;
+
+  op->status = -1;
+
+
+  return;
+}
+
+
+/*
+ * True when the copy on the source side differs from the one on the
+ * destination.  Devices that do not keep modification dates report 0, and
+ * then only the size is compared.  An object map records the local mtime of
+ * what was sent, so any other mtime is a change.
+ */
+
+static int sync_changed(mtp_sync_t *sync, mtp_sync_entry_t *source, mtp_sync_entry_t *target)
+{
+  if(source->size != target->size) return 1;
+
+  if(sync->exact) return (source->mtime != target->mtime);
+
+  if((source->mtime == 0) || (target->mtime == 0)) return 0;
+
+
+  return (source->mtime > target->mtime);
+}
+
+
+/*
+ * Merges the sorted local and device listings into the list of operations.
+ * Creations and transfers come in path order, so a folder is always created
+ * before its contents; deletions come last, deepest first.
+ */
+
+static void sync_plan(mtp_sync_t *sync, int mode)
+{
+  mtp_sync_entry_t *local, *remote;
+
+  long i = 0, j = 0, k, ndelete = 0;
+
+  long *deletes;
+
+  int cmp;
+
+
+  sync->ops = ALLOC_N(mtp_sync_op_t, sync->local.count + sync->remote.count + 1);
+
+  deletes = ALLOC_N(long, sync->remote.count + 1);
+
+  while((i < sync->local.count) || (j < sync->remote.count))
+  {
+    local = (i < sync->local.count) ? &sync->local.entries[i] : NULL;
+
+    remote = (j < sync->remote.count) ? &sync->remote.entries[j] : NULL;
+
+    if(local == NULL)
+    {
+      cmp = 1;
+    }
+    else if(remote == NULL)
+    {
+      cmp = -1;
+    }
+    else
+    {
+      cmp = strcmp(local->path, remote->path);
+    }
+
+
+    if(cmp < 0)
+    {
+      if(mode != SYNC_PULL)
+      {
+        sync_add_op(sync, local->folder ? SYNC_CREATE_FOLDER : SYNC_SEND, i, -1);
+      }
+
+      i++;
+    }
+    else if(cmp > 0)
+    {
+      if(mode == SYNC_PULL)
+      {
+        sync_add_op(sync, remote->folder ? SYNC_CREATE_DIRECTORY : SYNC_GET, -1, j);
+      }
+      else if(mode == SYNC_MIRROR)
+      {
+        deletes[ndelete++] = j;
+      }
+
+      j++;
+    }
+    else
+    {
+      local->id = remote->id;
+
+      if(local->folder != remote->folder)
+      {
+        /* a file became a folder or the other way round; pull never deletes locally */
+        if(mode != SYNC_PULL)
+        {
+          sync_add_op(sync, SYNC_DELETE, i, j);
+
+          sync_add_op(sync, local->folder ? SYNC_CREATE_FOLDER : SYNC_SEND, i, -1);
+        }
+      }
+      else if(!local->folder)
+      {
+        if(mode == SYNC_PULL)
+        {
+          if(sync_changed(sync, remote, local)) sync_add_op(sync, SYNC_GET, i, j);
+        }
+        else
+        {
+          if(sync_changed(sync, local, remote)) sync_add_op(sync, SYNC_REPLACE, i, j);
+        }
+      }
+
+      i++;
+
+      j++;
+    }
+  }
+
+  for(k=ndelete - 1; k >= 0; k--)
+  {
+    sync_add_op(sync, SYNC_DELETE, -1, deletes[k]);
+  }
+
+  xfree(deletes);
+
+
+  return;
+}
+
+
+/*
+ * Device ID of the folder that holds <i>path</i>, or 0 when that folder
+ * does not exist on the device (for instance because creating it failed).
+ */
+
+static uint32_t sync_parent(mtp_sync_t *sync, const char *path)
+{
+  mtp_sync_entry_t *entry;
+
+  const char *slash = strrchr(path, '/');
+
+  char *dir;
+
+
+  if(slash == NULL) return sync->parent_id;
+
+  dir = strndup(path, slash - path);
+
+  entry = list_find(&sync->local, dir);
+
+  free(dir);
+
+
+  return ((entry != NULL) ? entry->id : 0);
+}
+
+
+static const char *sync_basename(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+
+
+  return ((slash != NULL) ? slash + 1 : path);
+}
+
+
+/*
+ * A filetype for uploads from the file name extension.
+ */
+
+LIBMTP_filetype_t mtp_filetype_guess(const char *name)
+{
+  static const struct { const char *ext; LIBMTP_filetype_t type; } types[] =
+  {
+    { "mp3", LIBMTP_FILETYPE_MP3 },   { "wma", LIBMTP_FILETYPE_WMA },   { "ogg", LIBMTP_FILETYPE_OGG },
+    { "wav", LIBMTP_FILETYPE_WAV },   { "flac", LIBMTP_FILETYPE_FLAC }, { "aac", LIBMTP_FILETYPE_AAC },
+    { "m4a", LIBMTP_FILETYPE_M4A },   { "mp4", LIBMTP_FILETYPE_MP4 },   { "wmv", LIBMTP_FILETYPE_WMV },
+    { "avi", LIBMTP_FILETYPE_AVI },   { "mpg", LIBMTP_FILETYPE_MPEG },  { "mpeg", LIBMTP_FILETYPE_MPEG },
+    { "jpg", LIBMTP_FILETYPE_JPEG },  { "jpeg", LIBMTP_FILETYPE_JPEG }, { "png", LIBMTP_FILETYPE_PNG },
+    { "gif", LIBMTP_FILETYPE_GIF },   { "bmp", LIBMTP_FILETYPE_BMP },   { "tif", LIBMTP_FILETYPE_TIFF },
+    { "txt", LIBMTP_FILETYPE_TEXT },  { "htm", LIBMTP_FILETYPE_HTML },  { "html", LIBMTP_FILETYPE_HTML },
+    { "xml", LIBMTP_FILETYPE_XML },   { "doc", LIBMTP_FILETYPE_DOC },   { "xls", LIBMTP_FILETYPE_XLS },
+    { "ppt", LIBMTP_FILETYPE_PPT },   { NULL, LIBMTP_FILETYPE_UNKNOWN }
+  };
+
+  const char *dot = strrchr(name, '.');
+
+  int i;
+
+
+  if(dot != NULL)
+  {
+    for(i=0; types[i].ext != NULL; i++)
+    {
+      if(strcasecmp(dot + 1, types[i].ext) == 0) return types[i].type;
+    }
+  }
+
+
+  return LIBMTP_FILETYPE_UNKNOWN;
+}
+
+
+typedef struct mtp_sync_send_s
+{
+  mtp_device_t *device;
+
+  const char *path;
+
+  LIBMTP_file_t *file;
+
+  int status;
+} mtp_sync_send_t;
+
+
+static void *sync_send_blocking(void *ptr)
+{
+  mtp_sync_send_t *send = (mtp_sync_send_t *)ptr;
+
+
+  send->status = LIBMTP_Send_File_From_File(send->device->device, send->path, send->file, NULL, NULL);
+
+
+  return NULL;
+}
+
+
+static void *sync_get_blocking(void *ptr)
+{
+  mtp_sync_send_t *get = (mtp_sync_send_t *)ptr;
+
+
+  get->status = LIBMTP_Get_File_To_File(get->device->device, get->file->item_id, get->path, NULL, NULL);
+
+
+  return NULL;
+}
+
+
+static int sync_execute(mtp_sync_t *sync, mtp_sync_op_t *op)
+{
+  mtp_sync_entry_t *local = (op->local >= 0) ? &sync->local.entries[op->local] : NULL;
+
+  mtp_sync_entry_t *remote = (op->remote >= 0) ? &sync->remote.entries[op->remote] : NULL;
+
+  LIBMTP_mtpdevice_t *device_ptr = sync->device->device;
+
+  mtp_sync_send_t transfer;
+
+  struct utimbuf times;
+
+  struct stat st;
+
+  uint32_t parent;
+
+  char *path;
+
+  int status = -1;
+
+
+  switch(op->action)
+  {
+    case SYNC_CREATE_FOLDER:
+      parent = sync_parent(sync, local->path);
+
+      if((parent != 0) || (strchr(local->path, '/') == NULL))
+      {
+        path = strdup(sync_basename(local->path));
+
+        local->id = LIBMTP_Create_Folder(device_ptr, path, parent, sync->storage_id);
+
+        free(path);
+
+        status = (local->id != 0) ? 0 : -1;
+      }
+      break;
+
+    case SYNC_REPLACE:
+    case SYNC_SEND:
+      local->id = 0;
+
+      parent = sync_parent(sync, local->path);
+
+      if((parent == 0) && (strchr(local->path, '/') != NULL))
+      {
+        break;
+      }
+
+      transfer.device = sync->device;
+
+      transfer.file = LIBMTP_new_file_t();
+
+      transfer.file->filename = strdup(sync_basename(local->path));
+
+      transfer.file->filesize = local->size;
+
+      transfer.file->modificationdate = local->mtime;
+
+      transfer.file->filetype = mtp_filetype_guess(local->path);
+
+      transfer.file->parent_id = parent;
+
+      transfer.file->storage_id = sync->storage_id;
+
+      path = sync_join(sync->root, local->path);
+
+      transfer.path = path;
+
+      mtp_without_gvl(sync_send_blocking, &transfer);
+
+      status = transfer.status;
+
+      if(status == 0)
+      {
+        local->id = transfer.file->item_id;
+
+        /* the old object goes only once the new one is on the device */
+        if(op->action == SYNC_REPLACE) status = LIBMTP_Delete_Object(device_ptr, remote->id);
+      }
+
+      LIBMTP_destroy_file_t(transfer.file);
+
+      free(path);
+      break;
+
+    case SYNC_DELETE:
+      status = LIBMTP_Delete_Object(device_ptr, remote->id);
+      break;
+
+    case SYNC_CREATE_DIRECTORY:
+      path = sync_join(sync->root, remote->path);
+
+      status = mkdir(path, 0755);
+
+      if((status != 0) && (errno == EEXIST) && (stat(path, &st) == 0) && S_ISDIR(st.st_mode)) status = 0;
+
+      free(path);
+      break;
+
+    case SYNC_GET:
+      path = sync_join(sync->root, remote->path);
+
+      transfer.device = sync->device;
+
+      transfer.file = LIBMTP_new_file_t();
+
+      transfer.file->item_id = remote->id;
+
+      transfer.path = path;
+
+      mtp_without_gvl(sync_get_blocking, &transfer);
+
+      status = transfer.status;
+
+      LIBMTP_destroy_file_t(transfer.file);
+
+      if((status == 0) && (remote->mtime != 0))
+      {
+        /* so that the next pull sees the file as unchanged */
+        times.actime = times.modtime = remote->mtime;
+
+        utime(path, &times);
+      }
+
+      free(path);
+      break;
+  }
+
+
+  return status;
+}
+
+
+static VALUE sync_op_hash(mtp_sync_t *sync, mtp_sync_op_t *op, int executed)
+{
+  mtp_sync_entry_t *local = (op->local >= 0) ? &sync->local.entries[op->local] : NULL;
+
+  mtp_sync_entry_t *remote = (op->remote >= 0) ? &sync->remote.entries[op->remote] : NULL;
+
+  mtp_sync_entry_t *entry = (local != NULL) ? local : remote;
+
+  VALUE hash = rb_hash_new();
+
+
+  rb_hash_aset(hash, rb_str_new2("action"), ID2SYM(rb_intern(sync_action_names[op->action])));
+
+  rb_hash_aset(hash, rb_str_new2("path"), rb_str_new2(entry->path));
+
+  if(!entry->folder && (op->action != SYNC_DELETE))
+  {
+    rb_hash_aset(hash, rb_str_new2("size"), ULL2NUM((op->action == SYNC_GET) ? remote->size : local->size));
+  }
+
+  if(op->action == SYNC_DELETE)
+  {
+    rb_hash_aset(hash, rb_str_new2("object_id"), UINT2NUM(remote->id));
+  }
+  else if((local != NULL) && (local->id != 0) && (op->action != SYNC_GET))
+  {
+    rb_hash_aset(hash, rb_str_new2("object_id"), UINT2NUM(local->id));
+  }
+  else if(remote != NULL)
+  {
+    rb_hash_aset(hash, rb_str_new2("object_id"), UINT2NUM(remote->id));
+  }
+
+  if(executed)
+  {
+    rb_hash_aset(hash, rb_str_new2("status"), (op->status == 0) ? Qtrue : Qfalse);
+  }
+
+
+  return hash;
+}
+
+
+static VALUE sync_cleanup(VALUE ptr)
+{
+  mtp_sync_t *sync = (mtp_sync_t *)ptr;
+
+
+  list_free(&sync->local);
+
+  list_free(&sync->remote);
+
+  xfree(sync->ops);
+
+  sync->ops = NULL;
+
+
+  return Qnil;
+}
+
+
+typedef struct mtp_sync_args_s
+{
+  mtp_sync_t *sync;
+
+  int mode;
+
+  int dry_run;
+} mtp_sync_args_t;
+
+
+static void sync_map_entry(const char *path, uint32_t id, uint64_t size, time_t mtime, int folder, void *arg)
+{
+  list_add(&((mtp_sync_t *)arg)->remote, strdup(path), id, size, mtime, folder);
+
+
+  return;
+}
+
+
+/*
+ * Lists both sides and plans the operations for <i>mode</i>.  A pushing sync
+ * with a non-empty object map takes the device side from the map.
+ */
+
+static void sync_prepare(mtp_sync_t *sync, int mode)
+{
+  if((sync->map != NULL) && !sync->refresh && (mode != SYNC_PULL) && (mtp_objmap_count(sync->map) > 0))
+  {
+    mtp_objmap_each(sync->map, sync_map_entry, sync);
+
+    sync->exact = 1;
+  }
+
+  sync_walk_local(sync, "");
+
+  qsort(sync->local.entries, sync->local.count, sizeof(mtp_sync_entry_t), entry_cmp);
+
+  if(!sync->exact)
+  {
+    /* a push never looks at what exists only on the device */
+    sync->prune = (mode == SYNC_PUSH);
+
+    sync_walk_device(sync);
+  }
+
+  qsort(sync->remote.entries, sync->remote.count, sizeof(mtp_sync_entry_t), entry_cmp);
+
+  sync_plan(sync, mode);
+
+
+  return;
+}
+
+
+/*
+ * Records the outcome of a pushing sync in its object map: what was deleted
+ * or failed to send is dropped, and every local path now on the device is
+ * stored with its ID.
+ */
+
+static void sync_update_map(mtp_sync_t *sync)
+{
+  mtp_sync_entry_t *entry;
+
+  mtp_sync_op_t *op;
+
+  long i;
+
+
+  for(i=0; i < sync->nops; i++)
+  {
+    op = &sync->ops[i];
+
+    if((op->action == SYNC_DELETE) && (op->status == 0))
+    {
+      mtp_objmap_remove(sync->map, sync->remote.entries[op->remote].path);
+    }
+    else if(((op->action == SYNC_SEND) || (op->action == SYNC_REPLACE)) && (op->status != 0))
+    {
+      mtp_objmap_remove(sync->map, sync->local.entries[op->local].path);
+    }
+  }
+
+  for(i=0; i < sync->local.count; i++)
+  {
+    entry = &sync->local.entries[i];
+
+    if(entry->id != 0)
+    {
+      mtp_objmap_store(sync->map, entry->path, entry->id, entry->size, entry->mtime, entry->folder);
+    }
+  }
+
+
+  return;
+}
+
+
+typedef struct mtp_sync_fetch_s
+{
+  uint32_t id;
+
+  long op;
+} mtp_sync_fetch_t;
+
+
+static int fetch_cmp(const void *a, const void *b)
+{
+  uint32_t x = ((const mtp_sync_fetch_t *)a)->id, y = ((const mtp_sync_fetch_t *)b)->id;
+
+
+  return ((x < y) ? -1 : (x > y));
+}
+
+
+/*
+ * Runs the planned retrievals through a batch writer, so that local files
+ * are written while the next object is read.  Objects are read in order of
+ * their IDs, which is usually the order the device stored them in, so the
+ * device reads sequentially and the USB pipe stays full.  The files are
+ * given the device's modification dates once written.  An interrupted wait
+ * for the device stops the retrievals and is raised once the writes in
+ * flight are done.
+ */
+
+static void sync_fetch(mtp_sync_t *sync)
+{
+  mtp_sync_fetch_t *fetch;
+
+  mtp_sync_entry_t *remote;
+
+  mtp_writer_t *writer;
+
+  struct utimbuf times;
+
+  long i, count = 0;
+
+  char *path;
+
+  int state = 0;
+
+
+  fetch = ALLOC_N(mtp_sync_fetch_t, sync->nops + 1);
+
+  for(i=0; i < sync->nops; i++)
+  {
+    if(sync->ops[i].action == SYNC_GET)
+    {
+      fetch[count].id = sync->remote.entries[sync->ops[i].remote].id;
+
+      fetch[count++].op = i;
+    }
+  }
+
+  qsort(fetch, count, sizeof(mtp_sync_fetch_t), fetch_cmp);
+
+  writer = mtp_writer_new(sync->writer);
+
+  for(i=0; (i < count) && (state == 0); i++)
+  {
+    remote = &sync->remote.entries[sync->ops[fetch[i].op].remote];
+
+    if((writer == NULL) || (remote->size > SYNC_DIRECT_SIZE))
+    {
+      state = mtp_device_lock_protect(sync->device, sync->priority);
+
+      if(state != 0) break;
+
+      sync->ops[fetch[i].op].status = sync_execute(sync, &sync->ops[fetch[i].op]);
+
+      mtp_device_unlock(sync->device);
+    }
+    else
+    {
+      path = sync_join(sync->root, remote->path);
+
+      state = mtp_writer_get_file(writer, sync->device, remote->id, path, &sync->ops[fetch[i].op].status);
+
+      free(path);
+    }
+  }
+
+  if(writer != NULL) mtp_writer_free(writer);
+
+  if(state != 0)
+  {
+    xfree(fetch);
+
+    rb_jump_tag(state);
+  }
+
+  for(i=0; i < count; i++)
+  {
+    remote = &sync->remote.entries[sync->ops[fetch[i].op].remote];
+
+    if((sync->ops[fetch[i].op].status == 0) && (remote->mtime != 0))
+    {
+      path = sync_join(sync->root, remote->path);
+
+      times.actime = times.modtime = remote->mtime;
+
+      utime(path, &times);
+
+      free(path);
+    }
+  }
+
+  xfree(fetch);
+
+
+  return;
+}
+
+
+/*
+ * The pass of sync_apply an operation runs in: the folder tree first, with
+ * the deletions that make room for it, then the transfers and the remaining
+ * deletions.  Retrievals are batched separately by sync_fetch.
+ */
+
+static int sync_pass(mtp_sync_op_t *op)
+{
+  if((op->action == SYNC_CREATE_FOLDER) || (op->action == SYNC_CREATE_DIRECTORY)) return 0;
+
+  if((op->action == SYNC_DELETE) && (op->local >= 0)) return 0;
+
+
+  return 1;
+}
+
+
+/*
+ * Runs the planned operations, releasing the device between them, and
+ * returns the plan with the status of each.  Every folder is created before
+ * the first file is sent, so that the sends run back to back.
+ */
+
+static VALUE sync_apply(mtp_sync_t *sync, int dry_run)
+{
+  VALUE plan;
+
+  long i;
+
+  int pass;
+
+
+  if(!dry_run)
+  {
+    for(pass=0; pass < 2; pass++)
+    {
+      for(i=0; i < sync->nops; i++)
+      {
+        if((sync->ops[i].action == SYNC_GET) || (sync_pass(&sync->ops[i]) != pass)) continue;
+
+        mtp_device_lock_as(sync->device, sync->priority);
+
+        sync->ops[i].status = sync_execute(sync, &sync->ops[i]);
+
+        mtp_device_unlock(sync->device);
+      }
+    }
+
+    sync_fetch(sync);
+
+    if(sync->map != NULL) sync_update_map(sync);
+  }
+
+  plan = rb_ary_new2(sync->nops);
+
+  for(i=0; i < sync->nops; i++)
+  {
+    rb_ary_push(plan, sync_op_hash(sync, &sync->ops[i], !dry_run));
+  }
+
+
+  return plan;
+}
+
+
+static VALUE sync_body(VALUE ptr)
+{
+  mtp_sync_args_t *args = (mtp_sync_args_t *)ptr;
+
+
+  sync_prepare(args->sync, args->mode);
+
+
+  return sync_apply(args->sync, args->dry_run);
+}
+
+
+/*
+ * Fills in <i>sync</i> from the arguments common to Device#sync and
+ * Device#watch and returns the mode.
+ */
+
+static int sync_setup(mtp_sync_t *sync, VALUE self, VALUE local_dir, VALUE opts)
+{
+  VALUE mode, value;
+
+  struct stat st;
+
+  ID id;
+
+
+  memset(sync, 0, sizeof(mtp_sync_t));
+
+  sync->device = Get_MTP_Device(self);
+
+  sync->root = StringValueCStr(local_dir);
+
+  sync->priority = mtp_priority(MTP_PRIORITY_BULK);
+
+  value = mtp_option(opts, "storage_id");
+
+  if(!NIL_P(value)) sync->storage_id = NUM2UINT(value);
+
+  value = mtp_option(opts, "parent_id");
+
+  if(!NIL_P(value)) sync->parent_id = NUM2UINT(value);
+
+  value = mtp_option(opts, "map");
+
+  if(!NIL_P(value)) sync->map = Get_MTP_ObjectMap(value);
+
+  sync->refresh = RTEST(mtp_option(opts, "refresh"));
+
+  sync->writer = mtp_writer_option(opts);
+
+  if((stat(sync->root, &st) != 0) || !S_ISDIR(st.st_mode))
+  {
+    rb_raise(rb_eIOError, "Unable to open local directory");
+  }
+
+  mode = mtp_option(opts, "mode");
+
+  if(NIL_P(mode)) return -1;
+
+  id = rb_to_id(mode);
+
+  if(id == rb_intern("push"))
+  {
+    return SYNC_PUSH;
+  }
+  else if(id == rb_intern("pull"))
+  {
+    return SYNC_PULL;
+  }
+  else if(id == rb_intern("mirror"))
+  {
+    return SYNC_MIRROR;
+  }
+
+
+  return -2;
+}
+
+
+/*
+ *  call-seq:
+ *     device.sync(local_dir) -> Array of Hashes
+ *     device.sync(local_dir, storage_id: 0, parent_id: 0, mode: :push, dry_run: false) -> Array of Hashes
+ *     device.sync(local_dir, map: object_map, refresh: false) -> Array of Hashes
+ *
+ *  Brings the folder <i>parent_id</i> (0 for the root) of the storage <i>storage_id</i> in line with the local
+ *  directory <i>local_dir</i>, transferring only what changed.
+ *
+ *  Both trees are listed and compared by path, size and modification date.  The device is listed once per call,
+ *  its whole folder list and file listing, and the tree below <i>parent_id</i> is picked from that; a :push skips
+ *  the device folders that do not exist locally.  All folders are created before the first file is sent.
+ *  With <i>mode</i> :push, new local folders are created on the device and new or changed files are sent.  A
+ *  changed file is one of a different size or, where the device keeps modification dates, a newer local one; it
+ *  replaces the object on the device, which is deleted once the new one was sent, so a failed send leaves the old
+ *  object in place.  :mirror does the same and also deletes what exists only on the device.
+ *  :pull is the reverse of :push: new or changed device files are retrieved and given the device's modification
+ *  date.  Nothing is ever deleted locally.
+ *
+ *  Returns the plan: one hash per operation, in path order with deletions last, with "action" (:create_folder,
+ *  :send, :replace, :delete, :create_directory or :get), "path" relative to the roots, "size" for transfers and the
+ *  "object_id" of the object on the device.  With <i>dry_run</i> nothing is done; otherwise each hash also has a
+ *  "status" of true or false, and "object_id" is the ID of the new object for creations and sends.
+ *
+ *  With a LibMTP::ObjectMap as <i>map</i>, :push and :mirror record the ID of every local path on the device in
+ *  the map.  Later syncs with a map that is not empty take the device side from it instead of listing the device,
+ *  and count a file as changed when its size or mtime differs from those recorded.  Pass <i>refresh</i> to list
+ *  the device anyway, for instance after it was changed by something else.
+ *
+ *  Raises IOError when the device cannot be listed.
+ *
+ *  Wraps: <i>LIBMTP_Get_Filelisting_With_Callback</i>, <i>LIBMTP_Get_Folder_List</i>, <i>LIBMTP_Create_Folder</i>, <i>LIBMTP_Send_File_From_File</i>,
+ *  <i>LIBMTP_Get_File_To_File</i>, <i>LIBMTP_Delete_Object</i>
+ *
+ */
+
+static VALUE device_sync(int argc, VALUE *argv, VALUE self)
+{
+  mtp_sync_args_t args;
+
+  mtp_sync_t sync;
+
+  VALUE local_dir, opts;
+
+
+  rb_scan_args(argc, argv, "11", &local_dir, &opts);
+
+  args.sync = &sync;
+
+  args.mode = sync_setup(&sync, self, local_dir, opts);
+
+  if(args.mode == -1)
+  {
+    args.mode = SYNC_PUSH;
+  }
+  else if(args.mode < 0)
+  {
+    rb_raise(rb_eArgError, "mode must be :push, :pull or :mirror");
+  }
+
+  args.dry_run = RTEST(mtp_option(opts, "dry_run"));
+
+  if(args.mode == SYNC_PULL) sync.map = NULL;
+
+
+  return rb_ensure(sync_body, (VALUE)&args, sync_cleanup, (VALUE)&sync);
+}
+
+
+/*
+ *  call-seq:
+ *     device.upload_tree(local_dir) -> Array of Hashes
+ *     device.upload_tree(local_dir, storage_id: 0, parent_id: 0, map: object_map) -> Array of Hashes
+ *
+ *  Copies the local directory <i>local_dir</i> with everything below it into the folder <i>parent_id</i> (0 for
+ *  the root) of the storage <i>storage_id</i>, like <code>mkdir -p</code> followed by a copy.
+ *
+ *  The device is listed once, its whole folder list and file listing, and only the part below folders that also
+ *  exist locally is looked at.  The missing folders are then created, parents first, and their IDs kept, after
+ *  which the files are sent one after another without further lookups.  Files already on the device are skipped
+ *  unless changed, so an interrupted upload can simply be run again.  Nothing is deleted.  This is Device#sync with <i>mode</i> :push, and takes its <i>map</i> and <i>refresh</i> options.
+ *
+ *  Returns one hash per operation as Device#sync does.
+ *
+ *  Wraps: <i>LIBMTP_Get_Filelisting_With_Callback</i>, <i>LIBMTP_Get_Folder_List</i>, <i>LIBMTP_Create_Folder</i>, <i>LIBMTP_Send_File_From_File</i>
+ *
+ */
+
+static VALUE device_upload_tree(int argc, VALUE *argv, VALUE self)
+{
+  mtp_sync_args_t args;
+
+  mtp_sync_t sync;
+
+  VALUE local_dir, opts;
+
+
+  rb_scan_args(argc, argv, "11", &local_dir, &opts);
+
+  args.sync = &sync;
+
+  sync_setup(&sync, self, local_dir, opts);
+
+  args.mode = SYNC_PUSH;
+
+  args.dry_run = 0;
+
+
+  return rb_ensure(sync_body, (VALUE)&args, sync_cleanup, (VALUE)&sync);
+}
+
+
+static VALUE download_body(VALUE ptr)
+{
+  mtp_sync_t *sync = (mtp_sync_t *)ptr;
+
+
+  sync_walk_device(sync);
+
+  qsort(sync->remote.entries, sync->remote.count, sizeof(mtp_sync_entry_t), entry_cmp);
+
+  sync_plan(sync, SYNC_PULL);
+
+
+  return sync_apply(sync, 0);
+}
+
+
+/*
+ *  call-seq:
+ *     device.download_tree(folder_id, local_dir) -> Array of Hashes
+ *     device.download_tree(folder_id, local_dir, storage_id: 0, backend: :threads) -> Array of Hashes
+ *
+ *  Copies the folder <i>folder_id</i> (0 for the root) of the storage <i>storage_id</i> with everything below it
+ *  into the local directory <i>local_dir</i>, which is created when missing.  Existing local files of the same
+ *  name are overwritten.
+ *
+ *  The device is listed once, its whole folder list and file listing, and the tree below <i>folder_id</i> is
+ *  picked from that.  The whole local tree is created before the first file is retrieved.  Files are then retrieved in order of their object IDs and written by a batch writer while the next
+ *  one is read; <i>backend</i> selects it as for Device#file_get_batch.  Files over 32 MiB are written directly
+ *  rather than held in memory.  Each file is given the device's modification date.
+ *
+ *  Returns one hash per operation as Device#sync does, with "action" :create_directory or :get.
+ *
+ *  Wraps: <i>LIBMTP_Get_Filelisting_With_Callback</i>, <i>LIBMTP_Get_Folder_List</i>, <i>LIBMTP_Get_File_To_File</i>
+ *
+ */
+
+static VALUE device_download_tree(int argc, VALUE *argv, VALUE self)
+{
+  mtp_sync_t sync;
+
+  VALUE folder_id, local_dir, opts;
+
+
+  rb_scan_args(argc, argv, "21", &folder_id, &local_dir, &opts);
+
+  if((mkdir(StringValueCStr(local_dir), 0755) != 0) && (errno != EEXIST))
+  {
+    rb_raise(rb_eIOError, "Unable to create local directory");
+  }
+
+  sync_setup(&sync, self, local_dir, opts);
+
+  sync.parent_id = NUM2UINT(folder_id);
+
+  sync.map = NULL;
+
+
+  return rb_ensure(download_body, (VALUE)&sync, sync_cleanup, (VALUE)&sync);
+}
+
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR)
+
+
+/*
+ * What the device holds for one local path, as of the last push.
+ */
+
+typedef struct mtp_watch_entry_s
+{
+  uint32_t id;
+
+  uint64_t size;
+
+  time_t mtime;
+
+  int folder;
+
+  int wd;                     /* inotify watch of a folder, or -1 */
+} mtp_watch_entry_t;
+
+
+typedef struct mtp_watch_s
+{
+  mtp_sync_t sync;
+
+  int mirror;
+
+  int fd;
+
+  int rescan;
+
+  struct timeval delay;
+
+  st_table *objects;          /* relative path -> mtp_watch_entry_t */
+
+  st_table *watches;          /* inotify watch descriptor -> relative path */
+
+  st_table *dirty;            /* relative paths changed since the last batch */
+
+  int state;                  /* tag of an interrupted wait for the device, raised after the batch */
+
+  VALUE ops;
+} mtp_watch_t;
+
+
+static void watch_remember(mtp_watch_t *watch, const char *path, uint32_t id, uint64_t size, time_t mtime, int folder)
+{
+  mtp_watch_entry_t *entry;
+
+  st_data_t value;
+
+
+  if(st_lookup(watch->objects, (st_data_t)path, &value))
+  {
+    entry = (mtp_watch_entry_t *)value;
+  }
+  else
+  {
+    entry = ALLOC(mtp_watch_entry_t);
+
+    entry->wd = -1;
+
+    st_insert(watch->objects, (st_data_t)strdup(path), (st_data_t)entry);
+  }
+
+  entry->id = id;
+
+  entry->size = size;
+
+  entry->mtime = mtime;
+
+  entry->folder = folder;
+
+  if(watch->sync.map != NULL) mtp_objmap_store(watch->sync.map, path, id, size, mtime, folder);
+
+
+  return;
+}
+
+
+static mtp_watch_entry_t *watch_lookup(mtp_watch_t *watch, const char *path)
+{
+  st_data_t value;
+
+
+  return (st_lookup(watch->objects, (st_data_t)path, &value) ? (mtp_watch_entry_t *)value : NULL);
+}
+
+
+static void watch_forget(mtp_watch_t *watch, const char *path)
+{
+  st_data_t key = (st_data_t)path, value;
+
+
+  if(st_delete(watch->objects, &key, &value))
+  {
+    free((char *)key);
+
+    xfree((mtp_watch_entry_t *)value);
+  }
+
+  if(watch->sync.map != NULL) mtp_objmap_remove(watch->sync.map, path);
+
+
+  return;
+}
+
+
+static void watch_mark(mtp_watch_t *watch, char *path)
+{
+  if(st_lookup(watch->dirty, (st_data_t)path, NULL))
+  {
+    free(path);
+  }
+  else
+  {
+    st_insert(watch->dirty, (st_data_t)path, 0);
+  }
+
+
+  return;
+}
+
+
+static void watch_add_dir(mtp_watch_t *watch, const char *path)
+{
+  mtp_watch_entry_t *entry = watch_lookup(watch, path);
+
+  char *absolute = sync_join(watch->sync.root, path);
+
+  st_data_t key, value;
+
+  int wd;
+
+
+  wd = inotify_add_watch(watch->fd, absolute, WATCH_MASK);
+
+  free(absolute);
+
+  if(wd < 0) return;
+
+  key = (st_data_t)wd;
+
+  if(st_delete(watch->watches, &key, &value))
+  {
+    free((char *)value);
+  }
+
+  st_insert(watch->watches, (st_data_t)wd, (st_data_t)strdup(path));
+
+  if(entry != NULL) entry->wd = wd;
+
+
+  return;
+}
+
+
+static int watch_unwatch_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  mtp_watch_t *watch = (mtp_watch_t *)((void **)arg)[0];
+
+  const char *prefix = (const char *)((void **)arg)[1];
+
+  const char *path = (const char *)value;
+
+  size_t length = strlen(prefix);
+
+  mtp_watch_entry_t *entry;
+
+
+  if((strncmp(path, prefix, length) != 0) || ((path[length] != '\0') && (path[length] != '/'))) return ST_CONTINUE;
+
+  inotify_rm_watch(watch->fd, (int)key);
+
+  entry = watch_lookup(watch, path);
+
+  if(entry != NULL) entry->wd = -1;
+
+  free((char *)value);
+
+
+  return ST_DELETE;
+}
+
+
+/*
+ * Stops watching the directory <i>path</i> and everything below it.
+ */
+
+static void watch_remove_dir(mtp_watch_t *watch, const char *path)
+{
+  void *arg[2];
+
+
+  arg[0] = watch;
+
+  arg[1] = (void *)path;
+
+  st_foreach(watch->watches, watch_unwatch_i, (st_data_t)arg);
+
+
+  return;
+}
+
+
+static VALUE watch_op_hash(const char *action, const char *path, mtp_watch_entry_t *entry, uint32_t id, int status)
+{
+  VALUE hash = rb_hash_new();
+
+
+  rb_hash_aset(hash, rb_str_new2("action"), ID2SYM(rb_intern(action)));
+
+  rb_hash_aset(hash, rb_str_new2("path"), rb_str_new2(path));
+
+  if((entry != NULL) && !entry->folder)
+  {
+    rb_hash_aset(hash, rb_str_new2("size"), ULL2NUM(entry->size));
+  }
+
+  if(id != 0)
+  {
+    rb_hash_aset(hash, rb_str_new2("object_id"), UINT2NUM(id));
+  }
+
+  rb_hash_aset(hash, rb_str_new2("status"), (status == 0) ? Qtrue : Qfalse);
+
+
+  return hash;
+}
+
+
+/*
+ * Reads the pending inotify events into the dirty set.  Returns the number
+ * of events read.
+ */
+
+static int watch_read(mtp_watch_t *watch)
+{
+  char buffer[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+  struct inotify_event *event;
+
+  mtp_watch_entry_t *entry;
+
+  st_data_t key, value;
+
+  ssize_t length;
+
+  char *offset, *path;
+
+  int count = 0;
+
+
+  while((length = read(watch->fd, buffer, sizeof(buffer))) > 0)
+  {
+    for(offset = buffer; offset < buffer + length; offset += sizeof(struct inotify_event) + event->len)
+    {
+      event = (struct inotify_event *)offset;
+
+      count++;
+
+      if(event->mask & IN_Q_OVERFLOW)
+      {
+        /* events were lost; the next batch rescans the whole tree */
+        watch->rescan = 1;
+      }
+      else if(event->mask & IN_IGNORED)
+      {
+        key = (st_data_t)event->wd;
+
+        if(st_delete(watch->watches, &key, &value))
+        {
+          entry = watch_lookup(watch, (const char *)value);
+
+          if((entry != NULL) && (entry->wd == event->wd)) entry->wd = -1;
+
+          free((char *)value);
+        }
+      }
+      else if((event->len > 0) && st_lookup(watch->watches, (st_data_t)event->wd, &value))
+      {
+        path = sync_join((const char *)value, event->name);
+
+        if((event->mask & (IN_MOVED_FROM | IN_ISDIR)) == (IN_MOVED_FROM | IN_ISDIR))
+        {
+          /* the watches would follow the directory out of the tree */
+          watch_remove_dir(watch, path);
+        }
+
+        watch_mark(watch, path);
+      }
+    }
+  }
+
+
+  return count;
+}
+
+
+/*
+ * Parent folder ID on the device for <i>path</i>, or 0 when the parent
+ * folder is not on the device.
+ */
+
+static uint32_t watch_parent(mtp_watch_t *watch, const char *path)
+{
+  mtp_watch_entry_t *entry;
+
+  const char *slash = strrchr(path, '/');
+
+  char *dir;
+
+
+  if(slash == NULL) return watch->sync.parent_id;
+
+  dir = strndup(path, slash - path);
+
+  entry = watch_lookup(watch, dir);
+
+  free(dir);
+
+
+  return (((entry != NULL) && entry->folder) ? entry->id : 0);
+}
+
+
+typedef struct mtp_watch_children_s
+{
+  const char *prefix;
+
+  size_t length;
+
+  int direct;
+
+  char **paths;
+
+  long count;
+
+  long capa;
+} mtp_watch_children_t;
+
+
+static int watch_children_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  mtp_watch_children_t *children = (mtp_watch_children_t *)arg;
+
+  const char *path = (const char *)key;
+
+
+  if(children->length > 0)
+  {
+    if((strncmp(path, children->prefix, children->length) != 0) || (path[children->length] != '/')) return ST_CONTINUE;
+
+    path += children->length + 1;
+  }
+
+  if(children->direct && (strchr(path, '/') != NULL)) return ST_CONTINUE;
+
+  if(children->count == children->capa)
+  {
+    children->capa = (children->capa > 0) ? children->capa * 2 : 16;
+
+    REALLOC_N(children->paths, char *, children->capa);
+  }
+
+  children->paths[children->count++] = strdup((const char *)key);
+
+
+  return ST_CONTINUE;
+}
+
+
+static int path_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/*
+ * The known paths below <i>prefix</i>, sorted; only the direct children when
+ * <i>direct</i> is set.  Free with watch_children_free.
+ */
+
+static void watch_children(mtp_watch_t *watch, const char *prefix, int direct, mtp_watch_children_t *children)
+{
+  memset(children, 0, sizeof(mtp_watch_children_t));
+
+  children->prefix = prefix;
+
+  children->length = strlen(prefix);
+
+  children->direct = direct;
+
+  st_foreach(watch->objects, watch_children_i, (st_data_t)children);
+
+  if(children->count > 0)
+  {
+    qsort(children->paths, children->count, sizeof(char *), path_cmp);
+  }
+
+
+  return;
+}
+
+
+static void watch_children_free(mtp_watch_children_t *children)
+{
+  long i;
+
+
+  for(i=0; i < children->count; i++)
+  {
+    free(children->paths[i]);
+  }
+
+  xfree(children->paths);
+
+
+  return;
+}
+
+
+/*
+ * Takes the device for one operation of a batch.  Once a wait has been
+ * interrupted, the rest of the batch is skipped: returns -1 without the
+ * device, and watch_batch raises the interrupt when it is done.
+ */
+
+static int watch_lock(mtp_watch_t *watch)
+{
+  if(watch->state == 0)
+  {
+    watch->state = mtp_device_lock_protect(watch->sync.device, watch->sync.priority);
+  }
+
+
+  return ((watch->state == 0) ? 0 : -1);
+}
+
+
+static int watch_delete_object(mtp_watch_t *watch, const char *path, mtp_watch_entry_t *entry, int remove)
+{
+  int status = 0;
+
+
+  if(remove)
+  {
+    if(watch_lock(watch) != 0) return -1;
+
+    status = LIBMTP_Delete_Object(watch->sync.device->device, entry->id);
+
+    mtp_device_unlock(watch->sync.device);
+
+    rb_ary_push(watch->ops, watch_op_hash("delete", path, NULL, entry->id, status));
+
+    /* an object that is still on the device keeps its entry */
+    if(status == 0) watch_forget(watch, path);
+  }
+
+
+  return status;
+}
+
+
+/*
+ * Drops <i>path</i> from the device and from the map; a folder goes with
+ * everything below it, deepest first.  Without <i>remove</i> the objects
+ * stay, and so do their IDs, so that a file written again replaces its
+ * object.
+ */
+
+static int watch_delete(mtp_watch_t *watch, const char *path, mtp_watch_entry_t *entry, int remove)
+{
+  mtp_watch_children_t children;
+
+  mtp_watch_entry_t *child;
+
+  long i;
+
+
+  if(entry->folder)
+  {
+    watch_remove_dir(watch, path);
+
+    watch_children(watch, path, 0, &children);
+
+    for(i=children.count - 1; i >= 0; i--)
+    {
+      child = watch_lookup(watch, children.paths[i]);
+
+      if(child != NULL) watch_delete_object(watch, children.paths[i], child, remove);
+    }
+
+    watch_children_free(&children);
+  }
+
+
+  return watch_delete_object(watch, path, entry, remove);
+}
+
+
+static void watch_update(mtp_watch_t *watch, const char *path);
+
+
+/*
+ * Brings the contents of the local directory <i>path</i> to the device:
+ * every local entry is updated and every known entry that is gone locally is
+ * dropped.
+ */
+
+static void watch_scan(mtp_watch_t *watch, const char *path)
+{
+  mtp_watch_children_t children;
+
+  struct dirent *dirent;
+
+  char *absolute, *relative;
+
+  DIR *dir;
+
+  long i;
+
+
+  watch_add_dir(watch, path);
+
+  absolute = sync_join(watch->sync.root, path);
+
+  dir = opendir(absolute);
+
+  free(absolute);
+
+  if(dir != NULL)
+  {
+    while((dirent = readdir(dir)) != NULL)
+    {
+      if((strcmp(dirent->d_name, ".") == 0) || (strcmp(dirent->d_name, "..") == 0)) continue;
+
+      relative = sync_join(path, dirent->d_name);
+
+      watch_update(watch, relative);
+
+      free(relative);
+    }
+
+    closedir(dir);
+  }
+
+  /* what is still there locally was updated above */
+  watch_children(watch, path, 1, &children);
+
+  for(i=0; i < children.count; i++)
+  {
+    absolute = sync_join(watch->sync.root, children.paths[i]);
+
+    if(access(absolute, F_OK) != 0) watch_update(watch, children.paths[i]);
+
+    free(absolute);
+  }
+
+  watch_children_free(&children);
+
+
+  return;
+}
+
+
+static void watch_send(mtp_watch_t *watch, const char *action, const char *path, struct stat *st, uint32_t replace)
+{
+  mtp_sync_send_t transfer;
+
+  mtp_watch_entry_t sent;
+
+  uint32_t parent = watch_parent(watch, path);
+
+  char *absolute;
+
+  int status;
+
+
+  sent.id = 0;
+
+  sent.size = st->st_size;
+
+  sent.mtime = st->st_mtime;
+
+  sent.folder = 0;
+
+  if((parent == 0) && (strchr(path, '/') != NULL))
+  {
+    rb_ary_push(watch->ops, watch_op_hash(action, path, &sent, 0, -1));
+
+    return;
+  }
+
+  if(watch_lock(watch) != 0) return;
+
+  transfer.device = watch->sync.device;
+
+  transfer.file = LIBMTP_new_file_t();
+
+  transfer.file->filename = strdup(sync_basename(path));
+
+  transfer.file->filesize = sent.size;
+
+  transfer.file->modificationdate = sent.mtime;
+
+  transfer.file->filetype = mtp_filetype_guess(path);
+
+  transfer.file->parent_id = parent;
+
+  transfer.file->storage_id = watch->sync.storage_id;
+
+  absolute = sync_join(watch->sync.root, path);
+
+  transfer.path = absolute;
+
+  mtp_without_gvl(sync_send_blocking, &transfer);
+
+  status = transfer.status;
+
+  /* the object replaced goes only once the new one is on the device */
+  if((status == 0) && (replace != 0))
+  {
+    status = LIBMTP_Delete_Object(watch->sync.device->device, replace);
+  }
+
+  mtp_device_unlock(watch->sync.device);
+
+  if(transfer.status == 0)
+  {
+    sent.id = transfer.file->item_id;
+
+    watch_remember(watch, path, sent.id, sent.size, sent.mtime, 0);
+  }
+
+  rb_ary_push(watch->ops, watch_op_hash(action, path, &sent, sent.id, status));
+
+  LIBMTP_destroy_file_t(transfer.file);
+
+  free(absolute);
+
+
+  return;
+}
+
+
+static void watch_create_folder(mtp_watch_t *watch, const char *path)
+{
+  uint32_t parent = watch_parent(watch, path);
+
+  uint32_t id = 0;
+
+  char *name;
+
+
+  if((parent != 0) || (strchr(path, '/') == NULL))
+  {
+    if(watch_lock(watch) != 0) return;
+
+    name = strdup(sync_basename(path));
+
+    id = LIBMTP_Create_Folder(watch->sync.device->device, name, parent, watch->sync.storage_id);
+
+    mtp_device_unlock(watch->sync.device);
+
+    free(name);
+  }
+
+  if(id != 0)
+  {
+    watch_remember(watch, path, id, 0, 0, 1);
+  }
+
+  rb_ary_push(watch->ops, watch_op_hash("create_folder", path, NULL, id, (id != 0) ? 0 : -1));
+
+
+  return;
+}
+
+
+/*
+ * Pushes the current state of one local path: sends a new or changed file,
+ * creates and scans a new folder, or drops what is gone.
+ */
+
+static void watch_update(mtp_watch_t *watch, const char *path)
+{
+  mtp_watch_entry_t *entry = watch_lookup(watch, path);
+
+  char *absolute = sync_join(watch->sync.root, path);
+
+  struct stat st;
+
+  int exists;
+
+
+  exists = (lstat(absolute, &st) == 0) && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode));
+
+  free(absolute);
+
+  if((entry != NULL) && !exists)
+  {
+    watch_delete(watch, path, entry, watch->mirror);
+
+    return;
+  }
+
+  if(!exists) return;
+
+  if((entry != NULL) && (entry->folder != S_ISDIR(st.st_mode)))
+  {
+    /* a file became a folder or the other way round */
+    watch_delete(watch, path, entry, 1);
+
+    entry = NULL;
+  }
+
+  if(S_ISDIR(st.st_mode))
+  {
+    if(entry == NULL)
+    {
+      watch_create_folder(watch, path);
+
+      entry = watch_lookup(watch, path);
+
+      if(entry == NULL) return;
+    }
+
+    /* a known folder is only rescanned when it is back after a move */
+    if((entry->wd < 0) || watch->rescan)
+    {
+      watch_scan(watch, path);
+    }
+  }
+  else if(entry == NULL)
+  {
+    watch_send(watch, "send", path, &st, 0);
+  }
+  else if((entry->size != (uint64_t)st.st_size) || (entry->mtime != st.st_mtime))
+  {
+    watch_send(watch, "replace", path, &st, entry->id);
+  }
+
+
+  return;
+}
+
+
+static int watch_free_key_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  free((char *)key);
+
+
+  return ST_DELETE;
+}
+
+
+static int watch_free_object_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  free((char *)key);
+
+  xfree((mtp_watch_entry_t *)value);
+
+
+  return ST_DELETE;
+}
+
+
+static int watch_free_path_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  free((char *)value);
+
+
+  return ST_DELETE;
+}
+
+
+static int watch_link_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  mtp_watch_entry_t *entry = watch_lookup((mtp_watch_t *)arg, (const char *)value);
+
+
+  if(entry != NULL) entry->wd = (int)key;
+
+
+  return ST_CONTINUE;
+}
+
+
+static int watch_dirty_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  mtp_watch_children_t *dirty = (mtp_watch_children_t *)arg;
+
+
+  dirty->paths[dirty->count++] = (char *)key;
+
+
+  return ST_DELETE;
+}
+
+
+/*
+ * Pushes everything marked dirty since the last batch, parents before
+ * their contents, and returns the operations done.
+ */
+
+static VALUE watch_batch(mtp_watch_t *watch)
+{
+  mtp_watch_children_t dirty;
+
+  long i;
+
+
+  watch->ops = rb_ary_new();
+
+  if(watch->rescan)
+  {
+    st_foreach(watch->dirty, watch_free_key_i, 0);
+
+    watch_scan(watch, "");
+
+    watch->rescan = 0;
+  }
+  else
+  {
+    memset(&dirty, 0, sizeof(dirty));
+
+    dirty.paths = ALLOC_N(char *, watch->dirty->num_entries + 1);
+
+    st_foreach(watch->dirty, watch_dirty_i, (st_data_t)&dirty);
+
+    qsort(dirty.paths, dirty.count, sizeof(char *), path_cmp);
+
+    for(i=0; i < dirty.count; i++)
+    {
+      watch_update(watch, dirty.paths[i]);
+    }
+
+    watch_children_free(&dirty);
+  }
+
+  if(watch->state != 0)
+  {
+    rb_jump_tag(watch->state);
+  }
+
+
+  return watch->ops;
+}
+
+
+static double watch_now(void)
+{
+  struct timeval now;
+
+
+  gettimeofday(&now, NULL);
+
+
+  return (now.tv_sec + now.tv_usec / 1e6);
+}
+
+
+/*
+ * Waits for the first event, then keeps reading until the tree has been
+ * quiet for the delay (at most ten delays in all), so that a burst of
+ * writes becomes one batch.
+ */
+
+static void watch_wait(mtp_watch_t *watch)
+{
+  struct timeval timeout;
+
+  double deadline;
+
+
+  if((watch->dirty->num_entries == 0) && !watch->rescan)
+  {
+    rb_thread_wait_fd(watch->fd);
+  }
+
+  watch_read(watch);
+
+  deadline = watch_now() + 10 * (watch->delay.tv_sec + watch->delay.tv_usec / 1e6);
+
+  while(watch_now() < deadline)
+  {
+    timeout = watch->delay;
+
+    if(rb_wait_for_single_fd(watch->fd, RB_WAITFD_IN, &timeout) <= 0) break;
+
+    watch_read(watch);
+  }
+
+
+  return;
+}
+
+
+static VALUE watch_body(VALUE ptr)
+{
+  mtp_watch_t *watch = (mtp_watch_t *)ptr;
+
+  mtp_sync_t *sync = &watch->sync;
+
+  mtp_sync_entry_t *local;
+
+  VALUE ops;
+
+  long i;
+
+
+  sync_prepare(sync, watch->mirror ? SYNC_MIRROR : SYNC_PUSH);
+
+  /* watch before pushing, so that nothing written meanwhile is missed */
+  watch_add_dir(watch, "");
+
+  for(i=0; i < sync->local.count; i++)
+  {
+    if(sync->local.entries[i].folder) watch_add_dir(watch, sync->local.entries[i].path);
+  }
+
+  ops = sync_apply(sync, 0);
+
+  for(i=0; i < sync->local.count; i++)
+  {
+    local = &sync->local.entries[i];
+
+    if(local->id != 0)
+    {
+      watch_remember(watch, local->path, local->id, local->size, local->mtime, local->folder);
+    }
+  }
+
+  st_foreach(watch->watches, watch_link_i, (st_data_t)watch);
+
+  sync_cleanup((VALUE)sync);
+
+  if((RARRAY_LEN(ops) > 0) && rb_block_given_p()) rb_yield(ops);
+
+  for(;;)
+  {
+    watch_wait(watch);
+
+    ops = watch_batch(watch);
+
+    if((RARRAY_LEN(ops) > 0) && rb_block_given_p()) rb_yield(ops);
+  }
+
+
+  return Qnil;
+}
+
+
+static VALUE watch_cleanup(VALUE ptr)
+{
+  mtp_watch_t *watch = (mtp_watch_t *)ptr;
+
+
+  close(watch->fd);
+
+  st_foreach(watch->objects, watch_free_object_i, 0);
+
+  st_foreach(watch->watches, watch_free_path_i, 0);
+
+  st_foreach(watch->dirty, watch_free_key_i, 0);
+
+  st_free_table(watch->objects);
+
+  st_free_table(watch->watches);
+
+  st_free_table(watch->dirty);
+
+  sync_cleanup((VALUE)&watch->sync);
+
+
+  return Qnil;
+}
+
+#endif
+
+
+/*
+ *  call-seq:
+ *     device.watch(local_dir) { |operations| ... }
+ *     device.watch(local_dir, storage_id: 0, parent_id: 0, mode: :mirror, delay: 0.5) { |operations| ... }
+ *
+ *  Keeps the folder <i>parent_id</i> of the storage <i>storage_id</i> in line with the local directory
+ *  <i>local_dir</i> as it changes.  Does not return; break out of the block to stop watching.
+ *
+ *  Starts with a Device#sync in <i>mode</i> (:mirror or :push), then subscribes to inotify events on the local
+ *  tree.  Events are coalesced until the tree has been quiet for <i>delay</i> seconds, and each batch pushes only
+ *  the paths it names: new and changed files are sent, new folders are created and scanned, and with :mirror
+ *  deleted files and folders are deleted on the device.  The object IDs of everything pushed are kept in memory,
+ *  so a batch needs no device listing and costs in proportion to what changed.  If the kernel drops events, the
+ *  next batch rescans the local tree against the kept IDs.  A <i>map</i> (see Device#sync) is used for the initial
+ *  sync and kept up to date with every batch.
+ *
+ *  The operations of the initial sync and of every batch after it are yielded as an array of hashes in the
+ *  format of Device#sync: "action" (:create_folder, :send, :replace or :delete), "path", "size", "object_id" and
+ *  "status".
+ *
+ *  Wraps: <i>LIBMTP_Get_Filelisting_With_Callback</i>, <i>LIBMTP_Get_Folder_List</i>, <i>LIBMTP_Create_Folder</i>, <i>LIBMTP_Send_File_From_File</i>,
+ *  <i>LIBMTP_Delete_Object</i>
+ *
+ */
+
+static VALUE device_watch(int argc, VALUE *argv, VALUE self)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  mtp_watch_t watch;
+
+  VALUE local_dir, opts, delay;
+
+  double seconds = 0.5;
+
+  int mode;
+
+
+  rb_scan_args(argc, argv, "11", &local_dir, &opts);
+
+  memset(&watch, 0, sizeof(watch));
+
+  mode = sync_setup(&watch.sync, self, local_dir, opts);
+
+  if((mode != -1) && (mode != SYNC_MIRROR) && (mode != SYNC_PUSH))
+  {
+    rb_raise(rb_eArgError, "mode must be :push or :mirror");
+  }
+
+  watch.mirror = (mode != SYNC_PUSH);
+
+  delay = mtp_option(opts, "delay");
+
+  if(!NIL_P(delay)) seconds = NUM2DBL(delay);
+
+  if(seconds < 0) seconds = 0;
+
+  watch.delay.tv_sec = (long)seconds;
+
+  watch.delay.tv_usec = (long)((seconds - (long)seconds) * 1e6);
+
+  watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if(watch.fd < 0)
+  {
+    rb_raise(rb_eIOError, "Unable to watch local directory");
+  }
+
+  watch.objects = st_init_strtable();
+
+  watch.watches = st_init_numtable();
+
+  watch.dirty = st_init_strtable();
+
+
+  return rb_ensure(watch_body, (VALUE)&watch, watch_cleanup, (VALUE)&watch);
+#else
+  rb_raise(rb_eNotImpError, "Device#watch requires inotify");
+
+
+  return Qnil;
+#endif
+}
+
+
+void Init_LibMTP_Sync(void)
+{
+  VALUE cDevice = rb_const_get(mLibMTP, rb_intern("Device"));
+
+
+  rb_define_method(cDevice, "sync", device_sync, -1);
+
+  rb_define_method(cDevice, "watch", device_watch, -1);
+
+  rb_define_method(cDevice, "upload_tree", device_upload_tree, -1);
+
+  rb_define_method(cDevice, "download_tree", device_download_tree, -1);
+
+
+  return;
+}
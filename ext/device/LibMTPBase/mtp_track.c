@@ -31,11 +31,79 @@
 
 #include <stdlib.h>
 
+#include <stddef.h>
+
 #include "mtp_proto.h"
 
 
 static VALUE cMTPTrack;
 
+static ID id_dirty;
+
+
+/*
+ * The keys that map to a single object property on the device.  Setting one
+ * marks its bit in the track's dirty mask, so that Device#track_update_batch
+ * sends only what changed.
+ */
+
+static const struct
+{
+  const char *key;
+
+  LIBMTP_property_t property;
+
+  int type;
+
+  size_t offset;
+} track_properties[MTP_TRACK_PROPERTIES] =
+{
+  { "title",        LIBMTP_PROPERTY_Name,             MTP_PROPERTY_STRING, offsetof(LIBMTP_track_t, title) },
+  { "artist",       LIBMTP_PROPERTY_Artist,           MTP_PROPERTY_STRING, offsetof(LIBMTP_track_t, artist) },
+  { "genre",        LIBMTP_PROPERTY_Genre,            MTP_PROPERTY_STRING, offsetof(LIBMTP_track_t, genre) },
+  { "album",        LIBMTP_PROPERTY_AlbumName,        MTP_PROPERTY_STRING, offsetof(LIBMTP_track_t, album) },
+  { "date",         LIBMTP_PROPERTY_DateAuthored,     MTP_PROPERTY_STRING, offsetof(LIBMTP_track_t, date) },
+  { "number",       LIBMTP_PROPERTY_Track,            MTP_PROPERTY_U16,    offsetof(LIBMTP_track_t, tracknumber) },
+  { "duration",     LIBMTP_PROPERTY_Duration,         MTP_PROPERTY_U32,    offsetof(LIBMTP_track_t, duration) },
+  { "rate",         LIBMTP_PROPERTY_SampleRate,       MTP_PROPERTY_U32,    offsetof(LIBMTP_track_t, samplerate) },
+  { "channels",     LIBMTP_PROPERTY_NumberOfChannels, MTP_PROPERTY_U16,    offsetof(LIBMTP_track_t, nochannels) },
+  { "codec",        LIBMTP_PROPERTY_AudioWAVECodec,   MTP_PROPERTY_U32,    offsetof(LIBMTP_track_t, wavecodec) },
+  { "bitrate",      LIBMTP_PROPERTY_AudioBitRate,     MTP_PROPERTY_U32,    offsetof(LIBMTP_track_t, bitrate) },
+  { "bitrate_type", LIBMTP_PROPERTY_BitRateType,      MTP_PROPERTY_U16,    offsetof(LIBMTP_track_t, bitratetype) },
+  { "rating",       LIBMTP_PROPERTY_Rating,           MTP_PROPERTY_U16,    offsetof(LIBMTP_track_t, rating) },
+  { "use_count",    LIBMTP_PROPERTY_UseCount,         MTP_PROPERTY_U32,    offsetof(LIBMTP_track_t, usecount) },
+  { "file_name",    LIBMTP_PROPERTY_ObjectFileName,   MTP_PROPERTY_STRING, offsetof(LIBMTP_track_t, filename) }
+};
+
+
+static unsigned int track_dirty(VALUE self)
+{
+  VALUE mask = rb_attr_get(self, id_dirty);
+
+
+  return (NIL_P(mask) ? 0 : NUM2UINT(mask));
+}
+
+
+static void track_mark(VALUE self, const char *key)
+{
+  unsigned int i;
+
+
+  for(i=0; i < MTP_TRACK_PROPERTIES; i++)
+  {
+    if(strcmp(track_properties[i].key, key) == 0)
+    {
+      rb_ivar_set(self, id_dirty, UINT2NUM(track_dirty(self) | (1U << i)));
+
+      break;
+    }
+  }
+
+
+  return;
+}
+
 
 static void track_free(void *track)
 {
@@ -163,7 +231,7 @@ static VALUE track_to_hash(VALUE self)
     rb_hash_aset(hash, rb_str_new2("file_name"),  Qnil);
   }
 
-  rb_hash_aset(hash, rb_str_new2("file_size"),    INT2NUM(track->filesize));
+  rb_hash_aset(hash, rb_str_new2("file_size"),    ULL2NUM(track->filesize));
 
   rb_hash_aset(hash, rb_str_new2("file_type"),    INT2NUM(track->filetype));
 
@@ -385,7 +453,7 @@ static VALUE track_aset(VALUE self, VALUE name, VALUE value)
   }
   else if(strcmp("file_size", ptr) == 0)
   {
-    track->filesize = NUM2UINT(value);
+    track->filesize = NUM2ULL(value);
   }
   else if(strcmp("file_type", ptr) == 0)
   {
@@ -396,11 +464,44 @@ static VALUE track_aset(VALUE self, VALUE name, VALUE value)
     rb_raise(rb_eIndexError, "Unable to store data");
   }
 
+  track_mark(self, ptr);
+
 
   return value;
 }
 
 
+/*
+ *  call-seq:
+ *     track.changed() -> Array of keys
+ *
+ *  Returns the keys set since the track was read from the device or last written to it.  These are the
+ *  properties Device#track_update_batch sends.
+ *
+ */
+
+static VALUE track_changed(VALUE self)
+{
+  VALUE keys = rb_ary_new();
+
+  unsigned int mask = track_dirty(self);
+
+  unsigned int i;
+
+
+  for(i=0; i < MTP_TRACK_PROPERTIES; i++)
+  {
+    if(mask & (1U << i))
+    {
+      rb_ary_push(keys, rb_str_new2(track_properties[i].key));
+    }
+  }
+
+
+  return keys;
+}
+
+
 static VALUE track_populate(VALUE array, VALUE self)
 {
   VALUE key, value;
@@ -659,6 +760,11 @@ void Init_LibMTP_Track(void)
 
   rb_define_method(cMTPTrack, "<=>",            track_cmp_by_id, 1);
 
+  rb_define_method(cMTPTrack, "changed",        track_changed, 0);
+
+
+  id_dirty = rb_intern("__dirty__");
+
 
   return;
 }
@@ -671,9 +777,9 @@ VALUE Get_LibMTP_Track(VALUE value)
   VALUE hash;
 
 
-  if(rb_obj_is_instance_of(cMTPTrack, rb_obj_class(value)))
+  if(rb_obj_is_instance_of(value, cMTPTrack))
   {
-    track = cMTPTrack;
+    track = value;
   }
   else
   {
@@ -699,6 +805,99 @@ VALUE Get_LibMTP_Track(VALUE value)
 }
 
 
+/*
+ * Copies the changed properties of <i>track</i> into <i>props</i>, which has
+ * room for MTP_TRACK_PROPERTIES entries, and returns how many there are.
+ * <i>mask</i> receives the bits to pass to mtp_track_clean once they were
+ * written.  String values are copies for the caller to free.
+ */
+
+int mtp_track_changes(VALUE track, mtp_property_t *props, unsigned int *mask)
+{
+  LIBMTP_track_t *track_ptr;
+
+  char *field;
+
+  unsigned int i;
+
+  int count = 0;
+
+
+  Data_Get_Struct(track, LIBMTP_track_t, track_ptr);
+
+  *mask = track_dirty(track);
+
+  for(i=0; i < MTP_TRACK_PROPERTIES; i++)
+  {
+    if(!(*mask & (1U << i))) continue;
+
+    field = (char *)track_ptr + track_properties[i].offset;
+
+    props[count].id = track_ptr->item_id;
+
+    props[count].property = track_properties[i].property;
+
+    props[count].type = track_properties[i].type;
+
+    props[count].string = NULL;
+
+    props[count].number = 0;
+
+    if(track_properties[i].type == MTP_PROPERTY_STRING)
+    {
+      props[count].string = strdup((*(char **)field != NULL) ? *(char **)field : "");
+    }
+    else if(track_properties[i].type == MTP_PROPERTY_U16)
+    {
+      props[count].number = *(uint16_t *)field;
+    }
+    else
+    {
+      props[count].number = *(uint32_t *)field;
+    }
+
+    count++;
+  }
+
+
+  return count;
+}
+
+
+/*
+ * Clears the dirty bits in <i>mask</i>, keeping any set since.
+ */
+
+void mtp_track_clean(VALUE track, unsigned int mask)
+{
+  rb_ivar_set(track, id_dirty, UINT2NUM(track_dirty(track) & ~mask));
+
+
+  return;
+}
+
+
+/*
+ * Stores the size of a LibMTP::Track in <i>size</i>.  Returns 0 when
+ * <i>value</i> is not one.
+ */
+
+int mtp_track_size(VALUE value, uint64_t *size)
+{
+  LIBMTP_track_t *track;
+
+
+  if(!RTEST(rb_obj_is_kind_of(value, cMTPTrack))) return 0;
+
+  Data_Get_Struct(value, LIBMTP_track_t, track);
+
+  *size = track->filesize;
+
+
+  return 1;
+}
+
+
 VALUE Wrap_LibMTP_Track(LIBMTP_track_t *track)
 {
   return Data_Wrap_Struct(cMTPTrack, 0, track_free, track);
@@ -0,0 +1,960 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1   /* O_DIRECT, sync_file_range */
+#endif
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "mtp_proto.h"
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include "ruby/io/buffer.h"
+#endif
+
+
+#define SINK_ALIGN       4096
+
+#define SINK_BUFFER_SIZE (1024 * 1024)
+
+#define PARTIAL_CHUNK_SIZE (1024 * 1024)
+
+
+typedef struct mtp_transfer_s
+{
+  int fd;
+
+  mtp_digest_t *digest;
+
+  unsigned char *buffer;      /* aligned coalescing buffer, NULL for plain writes */
+
+  size_t used;
+
+  off_t offset;
+
+  off_t advised;              /* everything below this has been dropped from the page cache */
+
+  int direct;
+
+  int dontneed;
+
+  int state;                  /* tag of an interrupted wait for the device */
+} mtp_transfer_t;
+
+
+static int sink_write(mtp_transfer_t *transfer, const unsigned char *data, size_t len)
+{
+  ssize_t written;
+
+  size_t done = 0;
+
+
+  while(done < len)
+  {
+    written = pwrite(transfer->fd, data + done, len - done, transfer->offset + done);
+
+    if(written < 0)
+    {
+      if(errno == EINTR) continue;
+
+      return -1;
+    }
+
+    done += written;
+  }
+
+  transfer->offset += len;
+
+
+  if(transfer->dontneed && !transfer->direct)
+  {
+#ifdef SYNC_FILE_RANGE_WRITE
+    /* start writeback of this block; wait for the previous one so it can be dropped */
+    sync_file_range(transfer->fd, transfer->offset - len, len, SYNC_FILE_RANGE_WRITE);
+
+    if(transfer->offset - len > transfer->advised)
+    {
+      sync_file_range(transfer->fd, transfer->advised, transfer->offset - len - transfer->advised,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+
+      posix_fadvise(transfer->fd, transfer->advised, transfer->offset - len - transfer->advised, POSIX_FADV_DONTNEED);
+
+      transfer->advised = transfer->offset - len;
+    }
+#else
+    posix_fadvise(transfer->fd, transfer->offset - len, len, POSIX_FADV_DONTNEED);
+#endif
+  }
+
+
+  return 0;
+}
+
+
+/*
+ * Writes out what is left in the coalescing buffer.  O_DIRECT needs block
+ * sized writes, so an unaligned tail is written with O_DIRECT switched off.
+ */
+
+static int sink_finish(mtp_transfer_t *transfer)
+{
+  int status = 0;
+
+
+  if(transfer->used > 0)
+  {
+    if(transfer->direct && ((transfer->used % SINK_ALIGN) != 0))
+    {
+      fcntl(transfer->fd, F_SETFL, fcntl(transfer->fd, F_GETFL) & ~O_DIRECT);
+
+      transfer->direct = 0;
+    }
+
+    status = sink_write(transfer, transfer->buffer, transfer->used);
+
+    transfer->used = 0;
+  }
+
+  if(status == 0)
+  {
+    /* a preallocated file may be longer than what the device sent */
+    status = ftruncate(transfer->fd, transfer->offset);
+  }
+
+  if((status == 0) && transfer->dontneed)
+  {
+    status = fdatasync(transfer->fd);
+
+    posix_fadvise(transfer->fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+
+
+  return status;
+}
+
+
+/*
+ * MTPDataPutFunc: libmtp hands over each chunk read from the USB pipe.
+ */
+
+static uint16_t transfer_put(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen)
+{
+  mtp_transfer_t *transfer = (mtp_transfer_t *)priv;
+
+  uint32_t done = 0;
+
+  ssize_t written;
+
+  size_t take;
+
+
+  if(transfer->buffer != NULL)
+  {
+    while(done < sendlen)
+    {
+      take = SINK_BUFFER_SIZE - transfer->used;
+
+      if(take > sendlen - done) take = sendlen - done;
+
+      memcpy(transfer->buffer + transfer->used, data + done, take);
+
+      transfer->used += take;
+
+      done += take;
+
+      if(transfer->used == SINK_BUFFER_SIZE)
+      {
+        if(sink_write(transfer, transfer->buffer, SINK_BUFFER_SIZE) != 0)
+        {
+          return LIBMTP_HANDLER_RETURN_ERROR;
+        }
+
+        transfer->used = 0;
+      }
+    }
+  }
+  else
+  {
+    while(done < sendlen)
+    {
+      written = write(transfer->fd, data + done, sendlen - done);
+
+      if(written < 0)
+      {
+        if(errno == EINTR) continue;
+
+        return LIBMTP_HANDLER_RETURN_ERROR;
+      }
+
+      done += written;
+    }
+  }
+
+  if(transfer->digest != NULL)
+  {
+    mtp_digest_update(transfer->digest, data, sendlen);
+  }
+
+  *putlen = sendlen;
+
+
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+
+#ifdef HAVE_LIBMTP_GETPARTIALOBJECT
+
+typedef struct mtp_partial_s
+{
+  mtp_device_t *device;
+
+  uint32_t id;
+
+  uint64_t offset;
+
+  mtp_transfer_t *transfer;
+
+  int status;
+} mtp_partial_t;
+
+
+/*
+ * Reads the next chunk of an object into the sink; runs without the GVL.
+ */
+
+static void *partial_read(void *ptr)
+{
+  mtp_partial_t *partial = (mtp_partial_t *)ptr;
+
+  unsigned char *data = NULL;
+
+  unsigned int len = 0;
+
+  uint32_t putlen;
+
+
+  partial->status = LIBMTP_GetPartialObject(partial->device->device, partial->id, partial->offset, PARTIAL_CHUNK_SIZE, &data, &len);
+
+  if((partial->status == 0) && (len == 0))
+  {
+    partial->status = -1;
+  }
+
+  if(partial->status == 0)
+  {
+    if(transfer_put(NULL, partial->transfer, len, data, &putlen) != LIBMTP_HANDLER_RETURN_OK)
+    {
+      partial->status = -1;
+    }
+
+    partial->offset += len;
+  }
+
+  free(data);
+
+
+  return NULL;
+}
+
+
+/*
+ * Downloads an object of <i>size</i> bytes chunk by chunk, handing the
+ * device over whenever a caller of a higher priority is waiting.  Called
+ * with the device held; it is still held on return unless the wait to take
+ * it back was interrupted, which sets the state of the transfer.
+ */
+
+static int partial_get(mtp_device_t *device, uint32_t id, uint64_t size, mtp_transfer_t *transfer, int priority)
+{
+  mtp_partial_t partial;
+
+
+  memset(&partial, 0, sizeof(partial));
+
+  partial.device = device;
+
+  partial.id = id;
+
+  partial.transfer = transfer;
+
+  while((partial.status == 0) && (partial.offset < size))
+  {
+    mtp_without_gvl(partial_read, &partial);
+
+    if((partial.status == 0) && (partial.offset < size) && mtp_device_contended(device))
+    {
+      mtp_device_unlock(device);
+
+      transfer->state = mtp_device_lock_protect(device, priority);
+
+      if(transfer->state != 0) return -1;
+    }
+  }
+
+
+  return partial.status;
+}
+
+#endif
+
+
+/*
+ * Reads object <i>id</i> into the sink.  At bulk priority, objects larger
+ * than a chunk are read with GetPartialObject where the device supports it,
+ * so that the transfer can be preempted between chunks.  An interrupted wait
+ * for the device fails the transfer and sets its state.
+ */
+
+static int transfer_get_object(mtp_device_t *device, uint32_t id, mtp_transfer_t *transfer, int kind)
+{
+  int priority = mtp_priority(MTP_PRIORITY_NORMAL);
+
+  int status = -1;
+
+  int done = 0;
+
+#ifdef HAVE_LIBMTP_GETPARTIALOBJECT
+  LIBMTP_file_t *file_ptr;
+#endif
+
+
+  transfer->state = mtp_device_lock_protect(device, priority);
+
+  if(transfer->state != 0) return -1;
+
+#ifdef HAVE_LIBMTP_GETPARTIALOBJECT
+  if((priority == MTP_PRIORITY_BULK) && LIBMTP_Check_Capability(device->device, LIBMTP_DEVICECAP_GetPartialObject))
+  {
+    file_ptr = LIBMTP_Get_Filemetadata(device->device, id);
+
+    if((file_ptr != NULL) && (file_ptr->filesize > PARTIAL_CHUNK_SIZE))
+    {
+      status = partial_get(device, id, file_ptr->filesize, transfer, priority);
+
+      done = 1;
+    }
+
+    if(file_ptr != NULL)
+    {
+      LIBMTP_destroy_file_t(file_ptr);
+    }
+
+    if(transfer->state != 0) return -1;
+  }
+#endif
+
+  if(!done)
+  {
+    if(kind == MTP_TRANSFER_TRACK)
+    {
+      status = LIBMTP_Get_Track_To_Handler(device->device, id, transfer_put, transfer, NULL, NULL);
+    }
+    else
+    {
+      status = LIBMTP_Get_File_To_Handler(device->device, id, transfer_put, transfer, NULL, NULL);
+    }
+  }
+
+  mtp_device_unlock(device);
+
+
+  return status;
+}
+
+
+/*
+ * MTPDataGetFunc: fill the next chunk that libmtp pushes to the device.
+ */
+
+static uint16_t transfer_get(void *params, void *priv, uint32_t wantlen, unsigned char *data, uint32_t *gotlen)
+{
+  mtp_transfer_t *transfer = (mtp_transfer_t *)priv;
+
+  uint32_t done = 0;
+
+  ssize_t got;
+
+
+  while(done < wantlen)
+  {
+    got = read(transfer->fd, data + done, wantlen - done);
+
+    if(got < 0)
+    {
+      if(errno == EINTR) continue;
+
+      return LIBMTP_HANDLER_RETURN_ERROR;
+    }
+
+    if(got == 0) break;
+
+    done += got;
+  }
+
+  if(transfer->digest != NULL)
+  {
+    mtp_digest_update(transfer->digest, data, done);
+  }
+
+  *gotlen = done;
+
+
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+
+/*
+ * Downloads an object to <i>path</i> through the data handler so that the
+ * digest requested in <i>opts</i> is computed while the chunks pass through.
+ * Returns the hex digest, or nil when no digest was requested.
+ *
+ * The sink options in <i>opts</i> are:
+ *
+ *   preallocate => true to posix_fallocate the object's filesize, or a size in bytes
+ *   direct      => write with O_DIRECT from an aligned buffer where the filesystem allows it
+ *   dontneed    => drop written pages from the page cache as the download proceeds
+ */
+
+VALUE mtp_transfer_to_file(mtp_device_t *device, uint32_t id, const char *path, VALUE opts, int kind)
+{
+  mtp_transfer_t transfer;
+
+  LIBMTP_file_t *file_ptr;
+
+  VALUE digest, preallocate;
+
+  uint64_t size = 0;
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+  int status;
+
+
+  memset(&transfer, 0, sizeof(transfer));
+
+  preallocate = mtp_option(opts, "preallocate");
+
+  transfer.direct = RTEST(mtp_option(opts, "direct"));
+
+  transfer.dontneed = RTEST(mtp_option(opts, "dontneed"));
+
+  if(FIXNUM_P(preallocate) || (TYPE(preallocate) == T_BIGNUM))
+  {
+    size = NUM2ULL(preallocate);
+  }
+  else if(RTEST(preallocate))
+  {
+    mtp_device_lock(device);
+
+    file_ptr = LIBMTP_Get_Filemetadata(device->device, id);
+
+    mtp_device_unlock(device);
+
+    if(file_ptr == NULL)
+    {
+      rb_raise(rb_eIOError, "Unable to get file metadata");
+    }
+
+    size = file_ptr->filesize;
+
+    LIBMTP_destroy_file_t(file_ptr);
+  }
+
+  /* an unknown digest raises, so it is set up before the buffer */
+  digest = mtp_option(opts, "digest");
+
+  if(!NIL_P(digest))
+  {
+    transfer.digest = mtp_digest_new(digest);
+  }
+
+  if(transfer.direct || transfer.dontneed || (size > 0))
+  {
+    if(posix_memalign((void **)&transfer.buffer, SINK_ALIGN, SINK_BUFFER_SIZE) != 0)
+    {
+      mtp_digest_free(transfer.digest);
+
+      rb_raise(rb_eNoMemError, "Unable to allocate transfer buffer");
+    }
+  }
+
+
+#ifdef O_DIRECT
+  if(transfer.direct)
+  {
+    transfer.fd = open(path, flags | O_DIRECT, 0644);
+
+    /* filesystems such as tmpfs refuse O_DIRECT; fall back to buffered writes */
+    if((transfer.fd < 0) && (errno == EINVAL))
+    {
+      transfer.direct = 0;
+
+      transfer.fd = open(path, flags, 0644);
+    }
+  }
+  else
+#endif
+  {
+    transfer.direct = 0;
+
+    transfer.fd = open(path, flags, 0644);
+  }
+
+  if(transfer.fd < 0)
+  {
+    free(transfer.buffer);
+
+    mtp_digest_free(transfer.digest);
+
+    rb_raise(rb_eIOError, "Unable to open file");
+  }
+
+  if((size > 0) && (posix_fallocate(transfer.fd, 0, size) == ENOSPC))
+  {
+    close(transfer.fd);
+
+    unlink(path);
+
+    free(transfer.buffer);
+
+    mtp_digest_free(transfer.digest);
+
+    rb_raise(rb_eIOError, "Unable to preallocate file");
+  }
+
+  status = transfer_get_object(device, id, &transfer, kind);
+
+  if((status == 0) && (transfer.buffer != NULL))
+  {
+    status = sink_finish(&transfer);
+  }
+
+  if((close(transfer.fd) != 0) && (status == 0))
+  {
+    status = -1;
+  }
+
+  free(transfer.buffer);
+
+
+  if(status != 0)
+  {
+    unlink(path);
+
+    mtp_digest_free(transfer.digest);
+
+    if(transfer.state != 0)
+    {
+      rb_jump_tag(transfer.state);
+    }
+
+    rb_raise(rb_eIOError, "Unable to retrieve file");
+  }
+
+
+  return ((transfer.digest != NULL) ? mtp_digest_finish(transfer.digest) : Qnil);
+}
+
+
+/*
+ * Uploads <i>path</i> with the LIBMTP_file_t or LIBMTP_track_t metadata in
+ * <i>object</i>, hashing the data as it is read.  The object's filesize is
+ * taken from the file itself, and with a <i>placement</i> option its
+ * storage is picked by mtp_storage_place; the object must then go to the
+ * root, as a parent folder would tie it to its own storage.  Returns the hex
+ * digest or nil.
+ */
+
+VALUE mtp_transfer_from_file(mtp_device_t *device, const char *path, void *object, VALUE opts, int kind)
+{
+  mtp_transfer_t transfer;
+
+  struct stat st;
+
+  VALUE digest;
+
+  uint32_t storage_id = 0;
+
+  int status, placement;
+
+  uint32_t parent_id;
+
+
+  memset(&transfer, 0, sizeof(transfer));
+
+  placement = mtp_placement_option(opts);
+
+  parent_id = (kind == MTP_TRANSFER_TRACK) ? ((LIBMTP_track_t *)object)->parent_id : ((LIBMTP_file_t *)object)->parent_id;
+
+  if((placement >= 0) && (parent_id != 0))
+  {
+    rb_raise(rb_eArgError, "placement requires parent 0, as a folder belongs to one storage");
+  }
+
+  digest = mtp_option(opts, "digest");
+
+  if(!NIL_P(digest))
+  {
+    transfer.digest = mtp_digest_new(digest);
+  }
+
+
+  transfer.fd = open(path, O_RDONLY);
+
+  if((transfer.fd < 0) || (fstat(transfer.fd, &st) != 0))
+  {
+    if(transfer.fd >= 0) close(transfer.fd);
+
+    mtp_digest_free(transfer.digest);
+
+    rb_raise(rb_eIOError, "Unable to open file");
+  }
+
+  transfer.state = mtp_device_lock_protect(device, mtp_priority(MTP_PRIORITY_NORMAL));
+
+  if(transfer.state != 0)
+  {
+    close(transfer.fd);
+
+    mtp_digest_free(transfer.digest);
+
+    rb_jump_tag(transfer.state);
+  }
+
+  if(placement >= 0)
+  {
+    storage_id = mtp_storage_place(device, placement, st.st_size);
+
+    if(storage_id == 0)
+    {
+      mtp_device_unlock(device);
+
+      close(transfer.fd);
+
+      mtp_digest_free(transfer.digest);
+
+      rb_raise(rb_eIOError, "No storage has room for the file");
+    }
+
+    if(kind == MTP_TRANSFER_TRACK)
+    {
+      ((LIBMTP_track_t *)object)->storage_id = storage_id;
+    }
+    else
+    {
+      ((LIBMTP_file_t *)object)->storage_id = storage_id;
+    }
+  }
+
+  if(kind == MTP_TRANSFER_TRACK)
+  {
+    ((LIBMTP_track_t *)object)->filesize = st.st_size;
+
+    status = LIBMTP_Send_Track_From_Handler(device->device, transfer_get, &transfer, (LIBMTP_track_t *)object, NULL, NULL);
+  }
+  else
+  {
+    ((LIBMTP_file_t *)object)->filesize = st.st_size;
+
+    status = LIBMTP_Send_File_From_Handler(device->device, transfer_get, &transfer, (LIBMTP_file_t *)object, NULL, NULL);
+  }
+
+  if((status != 0) && (storage_id != 0)) mtp_storage_unplace(device, storage_id, st.st_size);
+
+  mtp_device_unlock(device);
+
+  close(transfer.fd);
+
+
+  if(status != 0)
+  {
+    mtp_digest_free(transfer.digest);
+
+    rb_raise(rb_eIOError, (kind == MTP_TRANSFER_TRACK) ? "Unable to send track" : "Unable to send file");
+  }
+
+
+  return ((transfer.digest != NULL) ? mtp_digest_finish(transfer.digest) : Qnil);
+}
+
+
+typedef struct mtp_stream_s
+{
+  unsigned char *pool;        /* reusable chunk buffer handed to the block */
+
+  size_t chunk;
+
+  size_t used;
+
+  int buffer;
+
+  int state;                  /* tag of a pending non-local exit from the block */
+
+  VALUE view;                 /* IO::Buffer over the whole pool, reused for every full chunk */
+
+  mtp_digest_t *digest;
+} mtp_stream_t;
+
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+
+static VALUE stream_yield(VALUE chunk)
+{
+  return rb_yield(chunk);
+}
+
+
+static VALUE stream_release(VALUE chunk)
+{
+  return rb_io_buffer_free(chunk);
+}
+
+
+static VALUE stream_yield_buffer(VALUE chunk)
+{
+  return rb_ensure(stream_yield, chunk, stream_release, chunk);
+}
+
+#endif
+
+
+/*
+ * Yields one chunk.  The block runs under rb_protect because unwinding
+ * through libmtp would leave the device mid-transaction; the tag is
+ * re-raised once libmtp has returned.
+ */
+
+static int stream_emit(mtp_stream_t *stream, unsigned char *data, size_t len)
+{
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  if(stream->buffer)
+  {
+    if((data == stream->pool) && (len == stream->chunk))
+    {
+      if(NIL_P(stream->view))
+      {
+        stream->view = rb_io_buffer_new(stream->pool, stream->chunk, RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+      }
+
+      rb_protect(rb_yield, stream->view, &stream->state);
+    }
+    else
+    {
+      rb_protect(stream_yield_buffer,
+                 rb_io_buffer_new(data, len, RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY),
+                 &stream->state);
+    }
+  }
+  else
+#endif
+  {
+    rb_protect(rb_yield, rb_str_new((const char *)data, len), &stream->state);
+  }
+
+
+  return stream->state;
+}
+
+
+static uint16_t stream_put(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen)
+{
+  mtp_stream_t *stream = (mtp_stream_t *)priv;
+
+  uint32_t done = 0;
+
+  size_t take;
+
+
+  if(stream->digest != NULL)
+  {
+    mtp_digest_update(stream->digest, data, sendlen);
+  }
+
+  while(done < sendlen)
+  {
+    if(!stream->buffer && (stream->used == 0) && (sendlen - done >= stream->chunk))
+    {
+      /* strings copy anyway, so build them straight from libmtp's buffer */
+      if(stream_emit(stream, data + done, stream->chunk) != 0)
+      {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+      }
+
+      done += stream->chunk;
+
+      continue;
+    }
+
+    take = stream->chunk - stream->used;
+
+    if(take > sendlen - done) take = sendlen - done;
+
+    memcpy(stream->pool + stream->used, data + done, take);
+
+    stream->used += take;
+
+    done += take;
+
+    if(stream->used == stream->chunk)
+    {
+      stream->used = 0;
+
+      if(stream_emit(stream, stream->pool, stream->chunk) != 0)
+      {
+        return LIBMTP_HANDLER_RETURN_CANCEL;
+      }
+    }
+  }
+
+  *putlen = sendlen;
+
+
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+
+/*
+ * Downloads object <i>id</i> and yields its data in chunks of
+ * <i>chunk_size</i> bytes (the last one may be shorter).  Chunks are
+ * Strings, or with <i>buffer</i> read-only IO::Buffer views of one reused
+ * native buffer; a view is only valid inside the block and is freed when
+ * the download ends.  Returns the hex digest when one was requested.
+ */
+
+VALUE mtp_transfer_stream(mtp_device_t *device, uint32_t id, VALUE opts)
+{
+  mtp_stream_t stream;
+
+  VALUE chunk_size, digest;
+
+  int status;
+
+
+  memset(&stream, 0, sizeof(stream));
+
+  stream.view = Qnil;
+
+  stream.buffer = RTEST(mtp_option(opts, "buffer"));
+
+#ifndef HAVE_RUBY_IO_BUFFER_H
+  if(stream.buffer)
+  {
+    rb_raise(rb_eNotImpError, "IO::Buffer is not available");
+  }
+#endif
+
+  chunk_size = mtp_option(opts, "chunk_size");
+
+  stream.chunk = NIL_P(chunk_size) ? SINK_BUFFER_SIZE : NUM2SIZET(chunk_size);
+
+  if(stream.chunk == 0)
+  {
+    rb_raise(rb_eArgError, "chunk_size must be positive");
+  }
+
+  /* an unknown digest raises, so it is set up before the pool */
+  digest = mtp_option(opts, "digest");
+
+  if(!NIL_P(digest))
+  {
+    stream.digest = mtp_digest_new(digest);
+  }
+
+  stream.pool = (unsigned char *)malloc(stream.chunk);
+
+  if(stream.pool == NULL)
+  {
+    mtp_digest_free(stream.digest);
+
+    rb_raise(rb_eNoMemError, "Unable to allocate stream buffer");
+  }
+
+
+  stream.state = mtp_device_lock_protect(device, mtp_priority(MTP_PRIORITY_NORMAL));
+
+  if(stream.state != 0)
+  {
+    free(stream.pool);
+
+    mtp_digest_free(stream.digest);
+
+    rb_jump_tag(stream.state);
+  }
+
+  device->streaming = 1;
+
+  status = LIBMTP_Get_File_To_Handler(device->device, id, stream_put, &stream, NULL, NULL);
+
+  device->streaming = 0;
+
+  mtp_device_unlock(device);
+
+  if((status == 0) && (stream.used > 0))
+  {
+    stream_emit(&stream, stream.pool, stream.used);
+  }
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  if(!NIL_P(stream.view))
+  {
+    rb_io_buffer_free(stream.view);
+  }
+#endif
+
+  free(stream.pool);
+
+  RB_GC_GUARD(stream.view);
+
+
+  if((status != 0) || (stream.state != 0))
+  {
+    mtp_digest_free(stream.digest);
+
+    if(stream.state != 0)
+    {
+      rb_jump_tag(stream.state);
+    }
+
+    rb_raise(rb_eIOError, "Unable to retrieve file");
+  }
+
+
+  return ((stream.digest != NULL) ? mtp_digest_finish(stream.digest) : Qnil);
+}
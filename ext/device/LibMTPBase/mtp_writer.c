@@ -0,0 +1,916 @@
+/**********************************************************************
+
+ libMTP ruby extension
+
+ Copyright (c) 2007 Todd Olivas (todd@topstorm.org)
+
+ This program is free software; you can redistribute it and/or modify it
+ under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or (at your
+ option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY  or
+ FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ License for more details.
+
+ You should have received a copy of the GNU Lesser General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ See LibMTP for detailed documentation.
+
+ Download: http://rubyforge.org/projects/libmtp/
+
+ History:
+ v0.0.1        alpha code      Wed Jan 24 23:23:00 EST 2007
+
+**********************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <string.h>
+
+#include <stdlib.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+
+#include <unistd.h>
+
+#include "mtp_proto.h"
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+#include <sys/uio.h>
+
+#include <liburing.h>
+#endif
+
+
+/*
+ * A batch writer keeps downloaded objects in memory slots and writes them
+ * to local files.  With io_uring each slot gets an open/write/close chain
+ * that runs asynchronously while the next object is read from the device;
+ * slots use registered buffers and direct (fixed) file descriptors.  The
+ * threads backend hands full slots to a small pool of native threads that
+ * write them out, which overlaps in the same way without io_uring.  The
+ * plain backend writes each slot out with pwrite before it is reused.
+ * An object that outgrows WRITER_MEMORY_LIMIT is written straight to its
+ * file as it arrives instead, so memory stays bounded however large the
+ * objects are.
+ */
+
+#define WRITER_SLOTS     16
+
+#define WRITER_THREADS   4
+
+#define WRITER_SLOT_SIZE (1024 * 1024)
+
+#define WRITER_MEMORY_LIMIT (32 * 1024 * 1024)
+
+#define WRITER_OP_OPEN   0
+
+#define WRITER_OP_WRITE  1
+
+#define WRITER_OP_CLOSE  2
+
+
+typedef struct mtp_writer_slot_s
+{
+  unsigned char *buffer;    /* slot buffer, registered with the ring when possible */
+
+  unsigned char *data;      /* buffer, or a heap copy once an object outgrows it */
+
+  size_t size;
+
+  size_t used;
+
+  char *path;
+
+  int fd;                   /* open once the object outgrew memory, or -1 */
+
+  int *status;
+
+  int busy;
+
+  int pending;
+
+  int failed;
+} mtp_writer_slot_t;
+
+
+struct mtp_writer_s
+{
+  int backend;
+
+  int nslots;
+
+  int inflight;
+
+  mtp_writer_slot_t slots[WRITER_SLOTS];
+
+  pthread_mutex_t lock;       /* threads backend: guards the queue, busy flags and inflight */
+
+  pthread_cond_t queued;
+
+  pthread_cond_t written;
+
+  pthread_t threads[WRITER_THREADS];
+
+  int nthreads;
+
+  int queue[WRITER_SLOTS];
+
+  int head;
+
+  int count;
+
+  int stop;
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+  struct io_uring ring;
+
+  int registered;
+#endif
+};
+
+
+static int write_at(int fd, const unsigned char *data, size_t len, off_t offset)
+{
+  ssize_t written;
+
+  size_t done = 0;
+
+
+  while(done < len)
+  {
+    written = pwrite(fd, data + done, len - done, offset + done);
+
+    if(written < 0)
+    {
+      if(errno == EINTR) continue;
+
+      return -1;
+    }
+
+    done += written;
+  }
+
+
+  return 0;
+}
+
+
+static int write_file(const char *path, const unsigned char *data, size_t len)
+{
+  int fd;
+
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if(fd < 0) return -1;
+
+  if(write_at(fd, data, len, 0) != 0)
+  {
+    close(fd);
+
+    return -1;
+  }
+
+
+  return close(fd);
+}
+
+
+static void slot_release(mtp_writer_slot_t *slot)
+{
+  if(slot->fd >= 0)
+  {
+    close(slot->fd);
+
+    slot->fd = -1;
+  }
+
+  if(slot->data != slot->buffer)
+  {
+    free(slot->data);
+
+    slot->data = slot->buffer;
+
+    slot->size = WRITER_SLOT_SIZE;
+  }
+
+  free(slot->path);
+
+  slot->path = NULL;
+
+  slot->used = 0;
+
+  slot->busy = 0;
+
+
+  return;
+}
+
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+
+static void writer_reap(mtp_writer_t *writer)
+{
+  struct io_uring_cqe *cqe;
+
+  mtp_writer_slot_t *slot;
+
+  uint64_t data;
+
+  int status;
+
+  int i;
+
+
+  do
+  {
+    status = io_uring_wait_cqe(&writer->ring, &cqe);
+  }
+  while(status == -EINTR);
+
+  /* the ring is broken, so fail what it holds and write the rest with pwrite */
+  if(status != 0)
+  {
+    for(i=0; i < writer->nslots; i++)
+    {
+      slot = &writer->slots[i];
+
+      if(slot->pending == 0) continue;
+
+      unlink(slot->path);
+
+      *slot->status = -1;
+
+      slot->pending = 0;
+
+      slot_release(slot);
+    }
+
+    writer->inflight = 0;
+
+    io_uring_queue_exit(&writer->ring);
+
+    writer->backend = MTP_WRITER_PWRITE;
+
+    return;
+  }
+
+
+  data = io_uring_cqe_get_data64(cqe);
+
+  slot = &writer->slots[data >> 2];
+
+  if((data & 3) == WRITER_OP_WRITE)
+  {
+    if((cqe->res < 0) || ((size_t)cqe->res != slot->used)) slot->failed = 1;
+  }
+  else if(cqe->res < 0)
+  {
+    slot->failed = 1;
+  }
+
+  io_uring_cqe_seen(&writer->ring, cqe);
+
+
+  if(--slot->pending == 0)
+  {
+    if(slot->failed) unlink(slot->path);
+
+    *slot->status = (slot->failed ? -1 : 0);
+
+    writer->inflight--;
+
+    slot_release(slot);
+  }
+
+
+  return;
+}
+
+
+static void writer_submit(mtp_writer_t *writer, mtp_writer_slot_t *slot)
+{
+  struct io_uring_sqe *sqe;
+
+  unsigned index = slot - writer->slots;
+
+
+  sqe = io_uring_get_sqe(&writer->ring);
+
+  io_uring_prep_openat_direct(sqe, AT_FDCWD, slot->path, O_WRONLY | O_CREAT | O_TRUNC, 0644, index);
+
+  io_uring_sqe_set_data64(sqe, (index << 2) | WRITER_OP_OPEN);
+
+  sqe->flags |= IOSQE_IO_LINK;
+
+
+  sqe = io_uring_get_sqe(&writer->ring);
+
+  if(writer->registered && (slot->data == slot->buffer))
+  {
+    io_uring_prep_write_fixed(sqe, index, slot->data, slot->used, 0, index);
+  }
+  else
+  {
+    io_uring_prep_write(sqe, index, slot->data, slot->used, 0);
+  }
+
+  io_uring_sqe_set_data64(sqe, (index << 2) | WRITER_OP_WRITE);
+
+  sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+
+  sqe = io_uring_get_sqe(&writer->ring);
+
+  io_uring_prep_close_direct(sqe, index);
+
+  io_uring_sqe_set_data64(sqe, (index << 2) | WRITER_OP_CLOSE);
+
+
+  slot->pending = 3;
+
+  slot->failed = 0;
+
+  writer->inflight++;
+
+  io_uring_submit(&writer->ring);
+
+
+  return;
+}
+
+#endif
+
+
+static void *writer_thread(void *ptr)
+{
+  mtp_writer_t *writer = (mtp_writer_t *)ptr;
+
+  mtp_writer_slot_t *slot;
+
+  int status;
+
+
+  pthread_mutex_lock(&writer->lock);
+
+  for(;;)
+  {
+    while((writer->count == 0) && !writer->stop)
+    {
+      pthread_cond_wait(&writer->queued, &writer->lock);
+    }
+
+    if(writer->count == 0) break;
+
+    slot = &writer->slots[writer->queue[writer->head]];
+
+    writer->head = (writer->head + 1) % WRITER_SLOTS;
+
+    writer->count--;
+
+    pthread_mutex_unlock(&writer->lock);
+
+    status = write_file(slot->path, slot->data, slot->used);
+
+    if(status != 0) unlink(slot->path);
+
+    pthread_mutex_lock(&writer->lock);
+
+    *slot->status = status;
+
+    writer->inflight--;
+
+    slot_release(slot);
+
+    pthread_cond_broadcast(&writer->written);
+  }
+
+  pthread_mutex_unlock(&writer->lock);
+
+
+  return NULL;
+}
+
+
+static void writer_start_threads(mtp_writer_t *writer)
+{
+  pthread_mutex_init(&writer->lock, NULL);
+
+  pthread_cond_init(&writer->queued, NULL);
+
+  pthread_cond_init(&writer->written, NULL);
+
+  for(writer->nthreads = 0; writer->nthreads < WRITER_THREADS; writer->nthreads++)
+  {
+    if(pthread_create(&writer->threads[writer->nthreads], NULL, writer_thread, writer) != 0) break;
+  }
+
+  if(writer->nthreads > 0)
+  {
+    writer->backend = MTP_WRITER_THREADS;
+
+    writer->nslots = WRITER_SLOTS;
+  }
+
+
+  return;
+}
+
+
+/*
+ * Creates a batch writer.  MTP_WRITER_AUTO and MTP_WRITER_URING use
+ * io_uring when it was compiled in and the kernel accepts the ring;
+ * otherwise, and for MTP_WRITER_THREADS, the writer uses a thread pool,
+ * and it quietly falls back to MTP_WRITER_PWRITE when no thread starts.
+ */
+
+mtp_writer_t *mtp_writer_new(int backend)
+{
+  mtp_writer_t *writer;
+
+  int i;
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+  struct iovec iov[WRITER_SLOTS];
+#endif
+
+
+  writer = (mtp_writer_t *)calloc(1, sizeof(mtp_writer_t));
+
+  if(writer == NULL) return NULL;
+
+  writer->backend = MTP_WRITER_PWRITE;
+
+  writer->nslots = 1;
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+  if(backend != MTP_WRITER_PWRITE)
+  {
+    if(io_uring_queue_init(WRITER_SLOTS * 3, &writer->ring, 0) == 0)
+    {
+      if(io_uring_register_files_sparse(&writer->ring, WRITER_SLOTS) == 0)
+      {
+        writer->backend = MTP_WRITER_URING;
+
+        writer->nslots = WRITER_SLOTS;
+      }
+      else
+      {
+        io_uring_queue_exit(&writer->ring);
+      }
+    }
+  }
+#endif
+
+  if((writer->backend == MTP_WRITER_PWRITE) && (backend != MTP_WRITER_PWRITE))
+  {
+    writer_start_threads(writer);
+  }
+
+
+  for(i=0; i < writer->nslots; i++)
+  {
+    if(posix_memalign((void **)&writer->slots[i].buffer, 4096, WRITER_SLOT_SIZE) != 0)
+    {
+      writer->nslots = i;
+
+      mtp_writer_free(writer);
+
+      return NULL;
+    }
+
+    writer->slots[i].data = writer->slots[i].buffer;
+
+    writer->slots[i].size = WRITER_SLOT_SIZE;
+
+    writer->slots[i].fd = -1;
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+    iov[i].iov_base = writer->slots[i].buffer;
+
+    iov[i].iov_len  = WRITER_SLOT_SIZE;
+#endif
+  }
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+  /* registration can fail under a low RLIMIT_MEMLOCK; plain writes still work */
+  if(writer->backend == MTP_WRITER_URING)
+  {
+    writer->registered = (io_uring_register_buffers(&writer->ring, iov, writer->nslots) == 0);
+  }
+#endif
+
+
+  return writer;
+}
+
+
+int mtp_writer_backend(mtp_writer_t *writer)
+{
+  return writer->backend;
+}
+
+
+/*
+ * The writer backend asked for by the <i>backend</i> option in <i>opts</i>:
+ * :io_uring, :threads or :pwrite.
+ */
+
+int mtp_writer_option(VALUE opts)
+{
+  VALUE backend = mtp_option(opts, "backend");
+
+  ID id;
+
+
+  if(NIL_P(backend)) return MTP_WRITER_AUTO;
+
+  id = rb_to_id(backend);
+
+  if(id == rb_intern("pwrite"))
+  {
+    return MTP_WRITER_PWRITE;
+  }
+  else if(id == rb_intern("io_uring"))
+  {
+    return MTP_WRITER_URING;
+  }
+  else if(id == rb_intern("threads"))
+  {
+    return MTP_WRITER_THREADS;
+  }
+
+
+  return MTP_WRITER_AUTO;
+}
+
+
+/*
+ * MTPDataPutFunc that collects an object into a writer slot, or once it
+ * outgrows WRITER_MEMORY_LIMIT, writes it to its file; <i>used</i> then
+ * counts the bytes written.
+ */
+
+static uint16_t writer_put(void *params, void *priv, uint32_t sendlen, unsigned char *data, uint32_t *putlen)
+{
+  mtp_writer_slot_t *slot = (mtp_writer_slot_t *)priv;
+
+  unsigned char *grown;
+
+  size_t size;
+
+
+  if((slot->fd < 0) && (slot->used + sendlen > WRITER_MEMORY_LIMIT))
+  {
+    slot->fd = open(slot->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if((slot->fd < 0) || (write_at(slot->fd, slot->data, slot->used, 0) != 0)) return LIBMTP_HANDLER_RETURN_ERROR;
+  }
+
+  if(slot->fd >= 0)
+  {
+    if(write_at(slot->fd, data, sendlen, slot->used) != 0) return LIBMTP_HANDLER_RETURN_ERROR;
+
+    slot->used += sendlen;
+
+    *putlen = sendlen;
+
+    return LIBMTP_HANDLER_RETURN_OK;
+  }
+
+  if(slot->used + sendlen > slot->size)
+  {
+    size = slot->size * 2;
+
+    while(size < slot->used + sendlen) size *= 2;
+
+    if(slot->data == slot->buffer)
+    {
+      grown = (unsigned char *)malloc(size);
+
+      if(grown != NULL) memcpy(grown, slot->buffer, slot->used);
+    }
+    else
+    {
+      grown = (unsigned char *)realloc(slot->data, size);
+    }
+
+    if(grown == NULL) return LIBMTP_HANDLER_RETURN_ERROR;
+
+    slot->data = grown;
+
+    slot->size = size;
+  }
+
+  memcpy(slot->data + slot->used, data, sendlen);
+
+  slot->used += sendlen;
+
+  *putlen = sendlen;
+
+
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+
+typedef struct mtp_writer_get_s
+{
+  mtp_device_t *device;
+
+  uint32_t id;
+
+  mtp_writer_slot_t *slot;
+
+  int result;
+} mtp_writer_get_t;
+
+
+static void *writer_get_blocking(void *ptr)
+{
+  mtp_writer_get_t *get = (mtp_writer_get_t *)ptr;
+
+
+  get->result = LIBMTP_Get_File_To_Handler(get->device->device, get->id, writer_put, get->slot, NULL, NULL);
+
+
+  return NULL;
+}
+
+
+/*
+ * Gives a slot back without writing it, and sets the status of its object.
+ */
+
+static void writer_drop(mtp_writer_t *writer, mtp_writer_slot_t *slot, int status)
+{
+  if(writer->backend == MTP_WRITER_THREADS) pthread_mutex_lock(&writer->lock);
+
+  *slot->status = status;
+
+  slot_release(slot);
+
+  if(writer->backend == MTP_WRITER_THREADS) pthread_mutex_unlock(&writer->lock);
+
+
+  return;
+}
+
+
+/*
+ * Waits for a free slot and claims it; runs without the GVL, as it may
+ * wait on the writes still in flight.
+ */
+
+static void *writer_claim_blocking(void *ptr)
+{
+  mtp_writer_t *writer = (mtp_writer_t *)ptr;
+
+  mtp_writer_slot_t *slot = NULL;
+
+  int i;
+
+
+  if(writer->backend == MTP_WRITER_THREADS) pthread_mutex_lock(&writer->lock);
+
+  while(slot == NULL)
+  {
+    for(i=0; i < writer->nslots; i++)
+    {
+      if(!writer->slots[i].busy)
+      {
+        slot = &writer->slots[i];
+
+        break;
+      }
+    }
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+    if((slot == NULL) && (writer->backend == MTP_WRITER_URING)) writer_reap(writer);
+#endif
+
+    if((slot == NULL) && (writer->backend == MTP_WRITER_THREADS))
+    {
+      pthread_cond_wait(&writer->written, &writer->lock);
+    }
+  }
+
+  slot->busy = 1;
+
+  if(writer->backend == MTP_WRITER_THREADS) pthread_mutex_unlock(&writer->lock);
+
+
+  return slot;
+}
+
+
+/*
+ * Downloads object <i>id</i> into a free slot and queues it for writing
+ * to <i>path</i>.  <i>status</i> receives 0 or -1 once the write completes,
+ * which may be after this call returns; see mtp_writer_finish.  Returns 0,
+ * or the tag of an interrupted wait for the device, in which case the
+ * object is not downloaded and the caller raises it once it is safe to.
+ */
+
+int mtp_writer_get_file(mtp_writer_t *writer, mtp_device_t *device, uint32_t id, const char *path, int *status)
+{
+  mtp_writer_slot_t *slot;
+
+  mtp_writer_get_t get;
+
+  int state;
+
+
+  slot = (mtp_writer_slot_t *)mtp_without_gvl(writer_claim_blocking, writer);
+
+  slot->path = strdup(path);
+
+  slot->status = status;
+
+  if(slot->path == NULL)
+  {
+    writer_drop(writer, slot, -1);
+
+    return 0;
+  }
+
+  /* one object per turn, so callers of a higher priority get in between */
+  state = mtp_device_lock_protect(device, mtp_priority(MTP_PRIORITY_BULK));
+
+  if(state != 0)
+  {
+    writer_drop(writer, slot, -1);
+
+    return state;
+  }
+
+  get.device = device;
+
+  get.id = id;
+
+  get.slot = slot;
+
+  mtp_without_gvl(writer_get_blocking, &get);
+
+  mtp_device_unlock(device);
+
+  /* a large object was written to its file as it came in, so it is done */
+  if((get.result != 0) || (slot->fd >= 0))
+  {
+    if(slot->fd >= 0)
+    {
+      if(close(slot->fd) != 0) get.result = -1;
+
+      slot->fd = -1;
+
+      if(get.result != 0) unlink(slot->path);
+    }
+
+    writer_drop(writer, slot, (get.result == 0) ? 0 : -1);
+
+    return 0;
+  }
+
+  if(writer->backend == MTP_WRITER_THREADS)
+  {
+    pthread_mutex_lock(&writer->lock);
+
+    writer->queue[(writer->head + writer->count) % WRITER_SLOTS] = slot - writer->slots;
+
+    writer->count++;
+
+    writer->inflight++;
+
+    pthread_cond_signal(&writer->queued);
+
+    pthread_mutex_unlock(&writer->lock);
+
+    return 0;
+  }
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+  if(writer->backend == MTP_WRITER_URING)
+  {
+    writer_submit(writer, slot);
+
+    return 0;
+  }
+#endif
+
+  *status = write_file(path, slot->data, slot->used);
+
+  if(*status != 0) unlink(path);
+
+  slot_release(slot);
+
+
+  return 0;
+}
+
+
+/*
+ * Waits for the writes in flight; runs without the GVL.
+ */
+
+static void *writer_finish_blocking(void *ptr)
+{
+  mtp_writer_t *writer = (mtp_writer_t *)ptr;
+
+
+  if(writer->backend == MTP_WRITER_THREADS)
+  {
+    pthread_mutex_lock(&writer->lock);
+
+    while(writer->inflight > 0)
+    {
+      pthread_cond_wait(&writer->written, &writer->lock);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+  }
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+  while(writer->inflight > 0)
+  {
+    writer_reap(writer);
+  }
+#endif
+
+
+  return NULL;
+}
+
+
+/*
+ * Waits for all queued writes; every status handed to the writer is final afterwards.
+ */
+
+void mtp_writer_finish(mtp_writer_t *writer)
+{
+  mtp_without_gvl(writer_finish_blocking, writer);
+
+
+  return;
+}
+
+
+void mtp_writer_free(mtp_writer_t *writer)
+{
+  int i;
+
+
+  if(writer == NULL) return;
+
+  mtp_writer_finish(writer);
+
+  if(writer->backend == MTP_WRITER_THREADS)
+  {
+    pthread_mutex_lock(&writer->lock);
+
+    writer->stop = 1;
+
+    pthread_cond_broadcast(&writer->queued);
+
+    pthread_mutex_unlock(&writer->lock);
+
+    for(i=0; i < writer->nthreads; i++)
+    {
+      pthread_join(writer->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&writer->written);
+
+    pthread_cond_destroy(&writer->queued);
+
+    pthread_mutex_destroy(&writer->lock);
+  }
+
+#ifdef HAVE_IO_URING_PREP_OPENAT_DIRECT
+  if(writer->backend == MTP_WRITER_URING)
+  {
+    io_uring_queue_exit(&writer->ring);
+  }
+#endif
+
+  for(i=0; i < writer->nslots; i++)
+  {
+    slot_release(&writer->slots[i]);
+
+    free(writer->slots[i].buffer);
+  }
+
+  free(writer);
+
+
+  return;
+}